@@ -75,6 +75,10 @@ static void usage(void)
 	     "These commands work on offline, unmounted filesystems\n"
 	     "  dump                 Dump filesystem metadata to a qcow2 image\n"
 	     "  list                 List filesystem metadata in textual form\n"
+	     "  trace                Decode a trace recorded with BCACHEFS_TRACE\n"
+	     "  bench                Run btree performance tests\n"
+	     "  bench-bset           Benchmark bset search and btree node iteration\n"
+	     "  bench-data           Benchmark checksums, compression, encryption and erasure coding\n"
 	     "\n"
 	     "Miscellaneous:\n"
 	     "  version              Display the version of the invoked bcachefs tool\n");
@@ -199,6 +203,14 @@ int main(int argc, char *argv[])
 		return cmd_dump(argc, argv);
 	if (!strcmp(cmd, "list"))
 		return cmd_list(argc, argv);
+	if (!strcmp(cmd, "trace"))
+		return cmd_trace(argc, argv);
+	if (!strcmp(cmd, "bench"))
+		return cmd_bench(argc, argv);
+	if (!strcmp(cmd, "bench-bset"))
+		return cmd_bench_bset(argc, argv);
+	if (!strcmp(cmd, "bench-data"))
+		return cmd_bench_data(argc, argv);
 
 	if (!strcmp(cmd, "setattr"))
 		return cmd_setattr(argc, argv);
@@ -0,0 +1,824 @@
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/random.h>
+#include <linux/sched/clock.h>
+#include <raid/raid.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/checksum.h"
+#include "libbcachefs/compress.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/tests.h"
+#include "tools-util.h"
+
+static void bench_usage(void)
+{
+	puts("bcachefs bench - run btree performance tests\n"
+	     "Usage: bcachefs bench [OPTION]... <test> <nr>\n"
+	     "\n"
+	     "Runs <test> for <nr> iterations against a file backed filesystem.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -t, --threads=nr            Number of threads to run the test with (default 1)\n"
+	     "  -i, --image=file            Filesystem image to use; formatted if new or empty.\n"
+	     "                              Default is a temporary image, deleted afterwards\n"
+	     "  -s, --size=size             Size of newly created images (default 4G)\n"
+	     "  -f, --format                Reformat the image even if it already exists\n"
+	     "  -j, --json                  Print results as JSON\n"
+	     "  -l, --list                  List tests\n"
+	     "      --stats[=json]          Print time stats on exit, and to stderr on SIGUSR1\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Results are printed to standard output, filesystem messages to standard\n"
+	     "error.\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+/* bch2_format() closes the fd it's given, so it gets a dup of @fd: */
+static void bench_format(const char *path, int fd, struct format_opts opts)
+{
+	struct dev_opts dev = dev_opts_default();
+	struct bch_opt_strs fs_opt_strs;
+	struct bch_sb *sb;
+
+	memset(&fs_opt_strs, 0, sizeof(fs_opt_strs));
+
+	dev.path	= (char *) path;
+	dev.fd		= dup(fd);
+	if (dev.fd < 0)
+		die("error duplicating fd for %s: %m", path);
+
+	sb = bch2_format(fs_opt_strs, bch2_opts_empty(), opts, &dev, 1);
+	free(sb);
+}
+
+/* Returns the path of a new image in $TMPDIR, to be unlinked by the caller: */
+static char *bench_tmp_image(u64 size, struct format_opts opts)
+{
+	const char *tmpdir = getenv("TMPDIR") ?: "/tmp";
+	char *image = mprintf("%s/bcachefs-bench.XXXXXX", tmpdir);
+	int fd = mkstemp(image);
+
+	if (fd < 0)
+		die("error creating %s: %m", image);
+
+	if (ftruncate(fd, size))
+		die("error resizing %s: %m", image);
+
+	bench_format(image, fd, opts);
+	close(fd);
+	return image;
+}
+
+/*
+ * Filesystem messages go to stdout; send them to stderr so that results can be
+ * parsed. Returns the original stdout:
+ */
+static FILE *bench_redirect_stdout(void)
+{
+	FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+
+	if (!out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+		die("error redirecting stdout: %m");
+	return out;
+}
+
+static void bench_print_text(FILE *out, const char *test,
+			     struct btree_perf_test_result *r)
+{
+	char buf[200];
+	unsigned i;
+
+	bch2_btree_perf_test_to_text(&PBUF(buf), test, r);
+	fputs(buf, out);
+
+	if (r->lat_nr)
+		fprintf(out, "latency (ns):  min %llu mean %llu p50 %llu p90 %llu "
+			"p99 %llu p99.9 %llu max %llu\n",
+			r->lat_min, r->lat_mean, r->lat_p50, r->lat_p90,
+			r->lat_p99, r->lat_p999, r->lat_max);
+
+	fprintf(out, "restarts:      %llu", r->nr_restarts);
+	for (i = 0; i < BCH_TRANS_RESTART_NR; i++)
+		if (r->restarts[i])
+			fprintf(out, " %s %llu",
+				bch2_trans_restart_reasons[i], r->restarts[i]);
+	fputc('\n', out);
+}
+
+static void bench_print_json(FILE *out, const char *test,
+			     struct btree_perf_test_result *r)
+{
+	unsigned i;
+
+	fprintf(out, "{\"test\": \"%s\", \"nr\": %llu, \"threads\": %u, "
+		"\"time_ns\": %llu, \"ops_per_sec\": %llu",
+		test, r->nr, r->nr_threads, r->time,
+		r->time ? r->nr * NSEC_PER_SEC / r->time : 0);
+
+	if (r->lat_nr)
+		fprintf(out, ", \"latency_ns\": {\"min\": %llu, \"mean\": %llu, "
+			"\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+			"\"p99.9\": %llu, \"max\": %llu}",
+			r->lat_min, r->lat_mean, r->lat_p50, r->lat_p90,
+			r->lat_p99, r->lat_p999, r->lat_max);
+
+	fprintf(out, ", \"restarts\": {\"total\": %llu", r->nr_restarts);
+	for (i = 0; i < BCH_TRANS_RESTART_NR; i++)
+		fprintf(out, ", \"%s\": %llu",
+			bch2_trans_restart_reasons[i], r->restarts[i]);
+	fputs("}}\n", out);
+}
+
+int cmd_bench(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "threads",		required_argument,	NULL, 't' },
+		{ "image",		required_argument,	NULL, 'i' },
+		{ "size",		required_argument,	NULL, 's' },
+		{ "format",		no_argument,		NULL, 'f' },
+		{ "json",		no_argument,		NULL, 'j' },
+		{ "list",		no_argument,		NULL, 'l' },
+		{ "help",		no_argument,		NULL, 'h' },
+		FS_STATS_LONGOPT,
+		{ NULL }
+	};
+	struct btree_perf_test_result r;
+	enum fs_stats_format stats = FS_STATS_NONE;
+	const char * const *t;
+	char *image = NULL, *test;
+	bool format = false, json = false, tmp_image = false;
+	unsigned nr_threads = 1;
+	u64 nr, size = 4ULL << 30;
+	struct bch_fs *c;
+	struct stat st;
+	FILE *out;
+	int opt, fd, ret;
+
+	while ((opt = getopt_long(argc, argv, "t:i:s:fjlh",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 't':
+			if (kstrtouint(optarg, 10, &nr_threads) || !nr_threads)
+				die("invalid number of threads %s", optarg);
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 's':
+			if (bch2_strtoull_h(optarg, &size))
+				die("invalid size %s", optarg);
+			break;
+		case 'f':
+			format = true;
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'S':
+			stats = fs_stats_format_parse(optarg);
+			break;
+		case 'l':
+			for (t = bch2_btree_perf_tests; *t; t++)
+				puts(*t);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			bench_usage();
+			exit(EXIT_SUCCESS);
+		case '?':
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (argc != 2) {
+		bench_usage();
+		exit(EXIT_FAILURE);
+	}
+
+	test = argv[0];
+	if (bch2_strtoull_h(argv[1], &nr))
+		die("invalid number of iterations %s", argv[1]);
+
+	for (t = bch2_btree_perf_tests; *t; t++)
+		if (!strcmp(*t, test))
+			break;
+	if (!*t)
+		die("unknown test %s (see bcachefs bench --list)", test);
+
+	out = bench_redirect_stdout();
+
+	if (!image) {
+		image = bench_tmp_image(size, format_opts_default());
+		tmp_image = true;
+	} else {
+		fd = xopen(image, O_RDWR|O_CREAT, 0644);
+
+		st = xfstat(fd);
+		if (!st.st_size) {
+			if (ftruncate(fd, size))
+				die("error resizing %s: %m", image);
+			format = true;
+		}
+
+		if (format)
+			bench_format(image, fd, format_opts_default());
+		close(fd);
+	}
+
+	fs_stats_start(stats);
+
+	c = bch2_fs_open(&image, 1, bch2_opts_empty());
+	if (IS_ERR(c))
+		die("error opening %s: %s", image, strerror(-PTR_ERR(c)));
+
+	ret = bch2_btree_perf_test(c, test, nr, nr_threads, &r);
+	if (!ret) {
+		if (json)
+			bench_print_json(out, test, &r);
+		else
+			bench_print_text(out, test, &r);
+
+		fs_stats_print(c, stats, out);
+	}
+
+	bch2_fs_stop(c);
+
+	if (tmp_image) {
+		unlink(image);
+		free(image);
+	}
+
+	if (ret)
+		die("error running %s: %s", test, strerror(-ret));
+
+	fclose(out);
+	return 0;
+}
+
+/* bcachefs bench-data: */
+
+static void bench_data_usage(void)
+{
+	puts("bcachefs bench-data - benchmark checksums, compression, encryption and erasure coding\n"
+	     "Usage: bcachefs bench-data [OPTION]...\n"
+	     "\n"
+	     "Runs the data path's checksum, compression, encryption and erasure coding code\n"
+	     "on in memory buffers, and reports throughput in GB/s.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -b, --sizes=list            Buffer sizes, comma separated (default 4k,64k)\n"
+	     "  -t, --threads=nr            Number of threads to run each test with (default 1)\n"
+	     "  -d, --duration=seconds      How long to run each test for (default 1)\n"
+	     "  -e, --tests=list            Only run tests matching list (see --list)\n"
+	     "  -c, --compressible=percent  How compressible the data is (default 50)\n"
+	     "      --raid_data=nr          Number of data blocks in erasure coding tests,\n"
+	     "                              each one buffer size (1-251, default 8)\n"
+	     "  -j, --json                  Print results as JSON\n"
+	     "  -l, --list                  List tests\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+enum data_bench_type {
+	DATA_BENCH_CHECKSUM,
+	DATA_BENCH_CHECKSUM_BIO,
+	DATA_BENCH_COMPRESS,
+	DATA_BENCH_UNCOMPRESS,
+	DATA_BENCH_ENCRYPT_BIO,
+	DATA_BENCH_RAID_GEN,
+	DATA_BENCH_RAID_REC,
+};
+
+struct data_bench_test {
+	char			name[32];
+	enum data_bench_type	type;
+	/* checksum type, compression option, or number of parity blocks: */
+	unsigned		arg;
+};
+
+/* bch2_csum_types[] only has the checksum options, not every type: */
+static const char * const data_bench_csum_types[] = {
+	[BCH_CSUM_CRC32C_NONZERO]		= "crc32c_nonzero",
+	[BCH_CSUM_CRC64_NONZERO]		= "crc64_nonzero",
+	[BCH_CSUM_CHACHA20_POLY1305_80]		= "chacha20_poly1305_80",
+	[BCH_CSUM_CHACHA20_POLY1305_128]	= "chacha20_poly1305_128",
+	[BCH_CSUM_CRC32C]			= "crc32c",
+	[BCH_CSUM_CRC64]			= "crc64",
+};
+
+typedef darray(struct data_bench_test) data_bench_test_list;
+
+static data_bench_test_list data_bench_tests(void)
+{
+	data_bench_test_list tests;
+	struct data_bench_test t;
+	unsigned i;
+
+	darray_init(tests);
+
+#define add_test(_type, _arg, _fmt, ...)				\
+do {									\
+	memset(&t, 0, sizeof(t));					\
+	t.type	= _type;						\
+	t.arg	= _arg;							\
+	snprintf(t.name, sizeof(t.name), _fmt, ##__VA_ARGS__);		\
+	darray_append(tests, t);					\
+} while (0)
+
+	for (i = BCH_CSUM_NONE + 1; i < BCH_CSUM_NR; i++)
+		add_test(DATA_BENCH_CHECKSUM, i, "checksum/%s",
+			 data_bench_csum_types[i]);
+	for (i = BCH_CSUM_NONE + 1; i < BCH_CSUM_NR; i++)
+		add_test(DATA_BENCH_CHECKSUM_BIO, i, "checksum_bio/%s",
+			 data_bench_csum_types[i]);
+	for (i = BCH_COMPRESSION_OPT_NONE + 1; i < BCH_COMPRESSION_OPT_NR; i++)
+		add_test(DATA_BENCH_COMPRESS, i, "compress/%s",
+			 bch2_compression_types[i]);
+	for (i = BCH_COMPRESSION_OPT_NONE + 1; i < BCH_COMPRESSION_OPT_NR; i++)
+		add_test(DATA_BENCH_UNCOMPRESS, i, "uncompress/%s",
+			 bch2_compression_types[i]);
+	add_test(DATA_BENCH_ENCRYPT_BIO, BCH_CSUM_CHACHA20_POLY1305_128,
+		 "encrypt_bio/chacha20");
+	for (i = 1; i <= RAID_PARITY_MAX; i++)
+		add_test(DATA_BENCH_RAID_GEN, i, "raid_gen/%u", i);
+	for (i = 1; i <= RAID_PARITY_MAX; i++)
+		add_test(DATA_BENCH_RAID_REC, i, "raid_rec/%u", i);
+#undef add_test
+
+	return tests;
+}
+
+struct data_bench {
+	struct bch_fs		*c;
+	struct data_bench_test	*test;
+	size_t			size;
+	unsigned		compressible;
+	unsigned		raid_data;
+
+	pthread_barrier_t	start;
+	bool			stop;
+};
+
+struct data_bench_thread {
+	struct data_bench	*d;
+	pthread_t		thread;
+
+	void			*src;
+	void			*dst;
+	struct bio		*src_bio;
+	struct bio		*dst_bio;
+
+	/* compress output, for uncompress: */
+	struct bch_extent_crc_unpacked crc;
+
+	/* raid_data data blocks, then RAID_PARITY_MAX parity blocks: */
+	void			*raid[RAID_DATA_MAX + RAID_PARITY_MAX];
+
+	u64			bytes;
+	/* compressed bytes, for the compression ratio: */
+	u64			compressed_bytes;
+};
+
+static void *data_bench_buf(size_t size)
+{
+	void *p = vmalloc(round_up(size, PAGE_SIZE));
+
+	if (!p)
+		die("error allocating buffer");
+	return p;
+}
+
+static struct bio *data_bench_bio(void *buf, size_t size)
+{
+	struct bio *bio = bio_kmalloc(GFP_KERNEL, DIV_ROUND_UP(size, PAGE_SIZE));
+
+	bch2_bio_map(bio, buf, size);
+	return bio;
+}
+
+/*
+ * Random data, with @compressible percent of each 64 byte chunk's chance of
+ * just being a repeat of the one before it:
+ */
+static void data_bench_fill(void *buf, size_t size, unsigned compressible)
+{
+	size_t i;
+
+	get_random_bytes(buf, size);
+
+	for (i = 64; i + 64 <= size; i += 64)
+		if (random() % 100 < compressible)
+			memcpy(buf + i, buf + i - 64, 64);
+}
+
+static void data_bench_thread_init(struct data_bench_thread *t)
+{
+	struct data_bench *d = t->d;
+	struct bch_fs *c = d->c;
+	unsigned i;
+
+	switch (d->test->type) {
+	case DATA_BENCH_RAID_GEN:
+	case DATA_BENCH_RAID_REC:
+		for (i = 0; i < d->raid_data + d->test->arg; i++) {
+			t->raid[i] = data_bench_buf(d->size);
+			data_bench_fill(t->raid[i], d->size, d->compressible);
+		}
+
+		raid_gen(d->raid_data, d->test->arg, d->size, t->raid);
+		break;
+	default:
+		t->src = data_bench_buf(d->size);
+		t->dst = data_bench_buf(d->size);
+		data_bench_fill(t->src, d->size, d->compressible);
+
+		t->src_bio = data_bench_bio(t->src, d->size);
+		t->dst_bio = data_bench_bio(t->dst, d->size);
+		break;
+	}
+
+	if (d->test->type == DATA_BENCH_UNCOMPRESS) {
+		size_t src_len, dst_len;
+
+		t->crc.compression_type =
+			bch2_bio_compress(c, t->dst_bio, &dst_len,
+					  t->src_bio, &src_len,
+					  bch2_compression_opt_to_type[d->test->arg]);
+		if (t->crc.compression_type) {
+			t->crc.compressed_size	 = dst_len >> 9;
+			t->crc.uncompressed_size = src_len >> 9;
+			t->crc.live_size	 = src_len >> 9;
+
+			/* uncompress from dst, into src: */
+			swap(t->src_bio, t->dst_bio);
+		}
+	}
+}
+
+static void data_bench_thread_exit(struct data_bench_thread *t)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(t->raid); i++)
+		vfree(t->raid[i]);
+	if (t->src_bio)
+		bio_put(t->src_bio);
+	if (t->dst_bio)
+		bio_put(t->dst_bio);
+	vfree(t->src);
+	vfree(t->dst);
+}
+
+/* Returns the number of (uncompressed) bytes processed: */
+static u64 data_bench_iter(struct data_bench_thread *t)
+{
+	struct data_bench *d = t->d;
+	struct bch_fs *c = d->c;
+	unsigned arg = d->test->arg;
+	int failed[RAID_PARITY_MAX], i;
+	size_t src_len, dst_len;
+
+	switch (d->test->type) {
+	case DATA_BENCH_CHECKSUM:
+		bch2_checksum(c, arg, null_nonce(), t->src, d->size);
+		return d->size;
+	case DATA_BENCH_CHECKSUM_BIO:
+		bch2_checksum_bio(c, arg, null_nonce(), t->src_bio);
+		return d->size;
+	case DATA_BENCH_COMPRESS:
+		if (bch2_bio_compress(c, t->dst_bio, &dst_len,
+				      t->src_bio, &src_len,
+				      bch2_compression_opt_to_type[arg])) {
+			t->compressed_bytes += dst_len;
+			return src_len;
+		}
+
+		/* didn't compress: */
+		t->compressed_bytes += d->size;
+		return d->size;
+	case DATA_BENCH_UNCOMPRESS:
+		if (bch2_bio_uncompress(c, t->src_bio, t->dst_bio,
+					t->dst_bio->bi_iter, t->crc))
+			die("error uncompressing");
+		t->compressed_bytes += t->crc.compressed_size << 9;
+		return t->crc.uncompressed_size << 9;
+	case DATA_BENCH_ENCRYPT_BIO:
+		bch2_encrypt_bio(c, arg, null_nonce(), t->src_bio);
+		return d->size;
+	case DATA_BENCH_RAID_GEN:
+		raid_gen(d->raid_data, arg, d->size, t->raid);
+		return d->size * d->raid_data;
+	case DATA_BENCH_RAID_REC:
+		/* recover the first @arg data blocks: */
+		for (i = 0; i < arg; i++)
+			failed[i] = i;
+		raid_rec(arg, failed, d->raid_data, arg, d->size, t->raid);
+		return d->size * d->raid_data;
+	}
+
+	BUG();
+}
+
+static void *data_bench_thread_fn(void *arg)
+{
+	struct data_bench_thread *t = arg;
+
+	pthread_barrier_wait(&t->d->start);
+
+	while (!READ_ONCE(t->d->stop))
+		t->bytes += data_bench_iter(t);
+
+	return NULL;
+}
+
+struct data_bench_result {
+	u64		bytes;
+	u64		compressed_bytes;
+	u64		time;
+};
+
+static int data_bench_run(struct data_bench *d, unsigned nr_threads,
+			  unsigned duration, struct data_bench_result *r)
+{
+	struct data_bench_thread *threads;
+	unsigned i;
+	u64 start;
+
+	/* the compression code won't try to compress a single block: */
+	if ((d->test->type == DATA_BENCH_COMPRESS ||
+	     d->test->type == DATA_BENCH_UNCOMPRESS) &&
+	    d->size <= block_bytes(d->c))
+		return -1;
+
+	threads = xcalloc(nr_threads, sizeof(*threads));
+
+	d->stop = false;
+	pthread_barrier_init(&d->start, NULL, nr_threads + 1);
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].d = d;
+		data_bench_thread_init(&threads[i]);
+	}
+
+	if (d->test->type == DATA_BENCH_UNCOMPRESS &&
+	    !threads[0].crc.compression_type) {
+		/* data didn't compress, nothing to uncompress */
+		for (i = 0; i < nr_threads; i++)
+			data_bench_thread_exit(&threads[i]);
+		free(threads);
+		pthread_barrier_destroy(&d->start);
+		return -1;
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i].thread, NULL,
+				   data_bench_thread_fn, &threads[i]))
+			die("error creating thread: %m");
+
+	pthread_barrier_wait(&d->start);
+	start = local_clock();
+
+	sleep(duration);
+	WRITE_ONCE(d->stop, true);
+
+	memset(r, 0, sizeof(*r));
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		r->bytes		+= threads[i].bytes;
+		r->compressed_bytes	+= threads[i].compressed_bytes;
+	}
+
+	r->time = local_clock() - start;
+
+	for (i = 0; i < nr_threads; i++)
+		data_bench_thread_exit(&threads[i]);
+	free(threads);
+	pthread_barrier_destroy(&d->start);
+	return 0;
+}
+
+static bool data_bench_test_selected(const char *name, const char *list)
+{
+	char *buf, *p, *pattern;
+	bool ret = false;
+
+	if (!list)
+		return true;
+
+	buf = p = strdup(list);
+	while ((pattern = strsep(&p, ",")))
+		if (!fnmatch(pattern, name, 0)) {
+			ret = true;
+			break;
+		}
+	free(buf);
+	return ret;
+}
+
+int cmd_bench_data(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "sizes",		required_argument,	NULL, 'b' },
+		{ "threads",		required_argument,	NULL, 't' },
+		{ "duration",		required_argument,	NULL, 'd' },
+		{ "tests",		required_argument,	NULL, 'e' },
+		{ "compressible",	required_argument,	NULL, 'c' },
+		{ "raid_data",		required_argument,	NULL, 'R' },
+		{ "json",		no_argument,		NULL, 'j' },
+		{ "list",		no_argument,		NULL, 'l' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	data_bench_test_list tests = data_bench_tests();
+	darray(u64) sizes;
+	struct data_bench d = {
+		.compressible	= 50,
+		.raid_data	= 8,
+	};
+	struct data_bench_result r;
+	struct data_bench_test *test;
+	struct format_opts format_opts = format_opts_default();
+	const char *size_list = "4k,64k", *filter = NULL;
+	char *buf, *p, *s, *image;
+	void *zero;
+	unsigned nr_threads = 1, duration = 1, opt_arg;
+	bool json = false, first = true;
+	u64 *size, max_size = 0;
+	FILE *out;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "b:t:d:e:c:jlh",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'b':
+			size_list = optarg;
+			break;
+		case 't':
+			if (kstrtouint(optarg, 10, &nr_threads) || !nr_threads)
+				die("invalid number of threads %s", optarg);
+			break;
+		case 'd':
+			if (kstrtouint(optarg, 10, &duration) || !duration)
+				die("invalid duration %s", optarg);
+			break;
+		case 'e':
+			filter = optarg;
+			break;
+		case 'c':
+			if (kstrtouint(optarg, 10, &d.compressible) ||
+			    d.compressible > 100)
+				die("invalid compressible percentage %s", optarg);
+			break;
+		case 'R':
+			if (kstrtouint(optarg, 10, &opt_arg) ||
+			    !opt_arg || opt_arg > RAID_DATA_MAX)
+				die("invalid number of data blocks %s (1-%u)",
+				    optarg, RAID_DATA_MAX);
+			d.raid_data = opt_arg;
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'l':
+			darray_foreach(test, tests)
+				puts(test->name);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			bench_data_usage();
+			exit(EXIT_SUCCESS);
+		case '?':
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (argc) {
+		bench_data_usage();
+		exit(EXIT_FAILURE);
+	}
+
+	darray_init(sizes);
+	buf = p = strdup(size_list);
+	while ((s = strsep(&p, ","))) {
+		u64 v;
+
+		/* erasure coding works in 64 byte units: */
+		if (bch2_strtoull_h(s, &v) || !v || v & 63)
+			die("invalid buffer size %s (must be a multiple of 64)", s);
+		darray_append(sizes, v);
+		max_size = max(max_size, v);
+	}
+	free(buf);
+
+	/*
+	 * The filesystem is only needed for the checksum, crypto and
+	 * compression state: make it encrypted if we're testing anything that
+	 * needs the key, and allow compressing the biggest buffer in one go:
+	 */
+	darray_foreach(test, tests)
+		if (data_bench_test_selected(test->name, filter) &&
+		    (test->type == DATA_BENCH_ENCRYPT_BIO ||
+		     ((test->type == DATA_BENCH_CHECKSUM ||
+		       test->type == DATA_BENCH_CHECKSUM_BIO) &&
+		      bch2_csum_type_is_encryption(test->arg))))
+			format_opts.encrypted = true;
+
+	format_opts.encoded_extent_max	=
+		roundup_pow_of_two(max_t(u64, format_opts.encoded_extent_max,
+					 DIV_ROUND_UP(max_size, 512)));
+	format_opts.encoded_extent_max	= min(format_opts.encoded_extent_max,
+					      1U << 15);
+
+	/* raid_rec() reads a zeroed block in place of the blocks it recovers: */
+	zero = data_bench_buf(max_size);
+	memset(zero, 0, max_size);
+	raid_zero(zero);
+
+	out = bench_redirect_stdout();
+	image = bench_tmp_image(1ULL << 30, format_opts);
+
+	d.c = bch2_fs_open(&image, 1, bch2_opts_empty());
+	if (IS_ERR(d.c))
+		die("error opening %s: %s", image, strerror(-PTR_ERR(d.c)));
+
+	if (json)
+		fprintf(out, "{\"threads\": %u, \"compressible\": %u, "
+			"\"raid_data\": %u, \"results\": [",
+			nr_threads, d.compressible, d.raid_data);
+	else
+		fprintf(out, "%-32s %8s %10s %8s\n",
+			"test", "size", "GB/s", "ratio");
+
+	darray_foreach(test, tests) {
+		if (!data_bench_test_selected(test->name, filter))
+			continue;
+
+		if ((test->type == DATA_BENCH_COMPRESS ||
+		     test->type == DATA_BENCH_UNCOMPRESS) &&
+		    bch2_check_set_has_compressed_data(d.c, test->arg))
+			die("error initializing %s", test->name);
+
+		darray_foreach(size, sizes) {
+			char size_str[16];
+			double gbs, ratio;
+
+			d.test	= test;
+			d.size	= *size;
+
+			if (data_bench_run(&d, nr_threads, duration, &r))
+				continue;
+
+			/* bytes/ns is GB/s: */
+			gbs	= r.time ? (double) r.bytes / r.time : 0;
+			ratio	= r.compressed_bytes
+				? (double) r.bytes / r.compressed_bytes : 0;
+
+			bch2_hprint(&PBUF(size_str), *size);
+
+			if (json) {
+				fprintf(out, "%s{\"test\": \"%s\", \"size\": %llu, "
+					"\"bytes\": %llu, \"time_ns\": %llu, "
+					"\"gb_per_sec\": %.3f",
+					first ? "" : ", ", test->name, *size,
+					r.bytes, r.time, gbs);
+				if (ratio)
+					fprintf(out, ", \"ratio\": %.2f", ratio);
+				fputc('}', out);
+			} else {
+				fprintf(out, "%-32s %8s %10.3f", test->name,
+					size_str, gbs);
+				if (ratio)
+					fprintf(out, " %8.2f", ratio);
+				fputc('\n', out);
+			}
+			fflush(out);
+			first = false;
+		}
+	}
+
+	if (json)
+		fputs("]}\n", out);
+
+	bch2_fs_stop(d.c);
+	unlink(image);
+	free(image);
+	vfree(zero);
+
+	darray_free(sizes);
+	darray_free(tests);
+	fclose(out);
+	return 0;
+}
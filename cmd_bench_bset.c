@@ -0,0 +1,621 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/sched/clock.h>
+#include <linux/sort.h>
+
+#include "cmds.h"
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/bkey.h"
+#include "libbcachefs/bset.h"
+#include "libbcachefs/btree_cache.h"
+#include "tools-util.h"
+
+/*
+ * Microbenchmarks for bset lookup and btree node iteration, on synthetic btree
+ * nodes built in memory - no filesystem involved, so that changes to bset.c can
+ * be measured in isolation.
+ */
+
+static void bench_bset_usage(void)
+{
+	puts("bcachefs bench-bset - benchmark bset search and btree node iteration\n"
+	     "Usage: bcachefs bench-bset [OPTION]...\n"
+	     "\n"
+	     "Builds a synthetic btree node in memory and times bset search, btree node\n"
+	     "iterator init, advance and prev, and key unpacking and packed key comparisons\n"
+	     "on it.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -n, --nr=nr                 Operations per benchmark (default 1M)\n"
+	     "      --node_size=size        Btree node size (default 256k)\n"
+	     "  -k, --keys=nr               Number of keys (default: fill 3/4 of the node)\n"
+	     "  -s, --bsets=nr              Number of bsets, 1-3 (default 3)\n"
+	     "  -w, --whiteouts=percent     Percentage of keys that are whiteouts (default 0)\n"
+	     "  -f, --format=(packed|unpacked)\n"
+	     "                              Key format (default packed)\n"
+	     "  -d, --distribution=(seq|random)\n"
+	     "                              Key positions: sequential offsets in one inode,\n"
+	     "                              or random inodes and offsets (default seq)\n"
+	     "      --rw                    Give the last bset a read-write aux tree, as\n"
+	     "                              if it was still being inserted into\n"
+	     "      --no_compile            Don't compile unpack and compare functions for\n"
+	     "                              the node's key format, as when executable\n"
+	     "                              memory isn't available\n"
+	     "      --seed=nr               Random seed (default 0)\n"
+	     "  -j, --json                  Print results as JSON\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+struct bench_bset_opts {
+	u64		nr;
+	u64		node_size;
+	u64		nr_keys;
+	unsigned	nsets;
+	unsigned	whiteouts;
+	bool		unpacked;
+	bool		random;
+	bool		rw;
+	bool		no_compile;
+	u64		seed;
+	bool		json;
+};
+
+/* deterministic, so that runs are comparable: */
+static u64 bench_rand_state;
+
+static u64 bench_rand(void)
+{
+	u64 x = bench_rand_state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return bench_rand_state = x;
+}
+
+static int bpos_cmp_p(const void *l, const void *r)
+{
+	return bkey_cmp(*((struct bpos *) l), *((struct bpos *) r));
+}
+
+static struct bkey_format bench_format(struct bench_bset_opts *opts,
+				       struct bpos *pos, size_t nr)
+{
+	struct bkey_format_state s;
+	struct bkey k;
+	size_t i;
+
+	if (opts->unpacked)
+		return bch2_bkey_format_current;
+
+	bch2_bkey_format_init(&s);
+
+	for (i = 0; i < nr; i++) {
+		bkey_init(&k);
+		k.p = pos[i];
+		bch2_bkey_format_add_key(&s, &k);
+	}
+
+	return bch2_bkey_format_done(&s);
+}
+
+static struct bpos *bench_positions(struct bench_bset_opts *opts, size_t *nr)
+{
+	size_t i, j, max = opts->nr_keys ?: opts->node_size / sizeof(u64);
+	struct bpos *pos = xcalloc(max, sizeof(*pos));
+
+	for (i = 0; i < max; i++)
+		pos[i] = opts->random
+			? POS(bench_rand() % 256, bench_rand())
+			: POS(1, i + 1);
+
+	if (!opts->nr_keys) {
+		/*
+		 * Fill 3/4 of the node, with keys that have a u64 of value
+		 * (whiteouts don't, but close enough) - a subset of these
+		 * positions won't need a bigger format:
+		 */
+		struct bkey_format f = bench_format(opts, pos, max);
+
+		opts->nr_keys = min_t(u64, max, (opts->node_size * 3 / 4) /
+				      ((f.key_u64s + 1) * sizeof(u64)));
+	}
+
+	sort(pos, opts->nr_keys, sizeof(pos[0]), bpos_cmp_p, NULL);
+
+	for (i = j = 0; i < opts->nr_keys; i++)
+		if (!j || bkey_cmp(pos[i], pos[j - 1]))
+			pos[j++] = pos[i];
+	*nr = j;
+	return pos;
+}
+
+/*
+ * Later bsets are smaller, as in a real node: each gets a quarter of the keys
+ * of the one before it
+ */
+static unsigned bench_key_bset(unsigned nsets)
+{
+	unsigned total = ((1 << (2 * nsets)) - 1) / 3;
+	unsigned r = bench_rand() % total, i, w = 1 << (2 * (nsets - 1));
+
+	for (i = 0; i < nsets - 1; i++) {
+		if (r < w)
+			return i;
+		r -= w;
+		w >>= 2;
+	}
+
+	return nsets - 1;
+}
+
+static bool bench_expensive_debug_checks;
+
+static struct btree *bench_node_build(struct bch_fs *c,
+				      struct bench_bset_opts *opts,
+				      struct bpos *pos, size_t nr)
+{
+	struct btree *b = xcalloc(1, sizeof(*b));
+	u8 *key_bset = xmalloc(nr);
+	struct bset_tree *t;
+	size_t j;
+	unsigned s;
+
+	b->data = kvpmalloc(opts->node_size, GFP_KERNEL|__GFP_ZERO);
+	if (!b->data ||
+	    bch2_btree_keys_alloc(b, ilog2(opts->node_size / PAGE_SIZE),
+				  GFP_KERNEL))
+		die("error allocating btree node");
+
+	bch2_btree_keys_init(b, &bench_expensive_debug_checks);
+	if (opts->no_compile)
+		b->aux_data_exec = false;
+
+	b->data->min_key	= POS_MIN;
+	b->data->max_key	= POS_MAX;
+	b->data->format		= bench_format(opts, pos, nr);
+	btree_node_set_format(b, b->data->format);
+
+	for (j = 0; j < nr; j++)
+		key_bset[j] = bench_key_bset(opts->nsets);
+
+	for (s = 0; s < opts->nsets; s++) {
+		struct bset *i;
+
+		if (!s) {
+			bch2_bset_init_first(b, &b->data->keys);
+		} else {
+			void *end = vstruct_end(btree_bset_last(b));
+			size_t offset = round_up(bset_byte_offset(b, end),
+						 block_bytes(c));
+
+			if (offset + sizeof(struct btree_node_entry) >
+			    opts->node_size)
+				die("too many keys for node size");
+
+			bch2_bset_init_next(c, b, (void *) b->data + offset);
+		}
+
+		t = bset_tree_last(b);
+		i = bset(b, t);
+
+		for (j = 0; j < nr; j++) {
+			struct bkey_i_cookie k;
+			struct bkey_packed *dst = vstruct_last(i);
+
+			if (key_bset[j] != s)
+				continue;
+
+			bkey_cookie_init(&k.k_i);
+			k.k.p = pos[j];
+			k.v.cookie = j;
+
+			if (bench_rand() % 100 < opts->whiteouts) {
+				k.k.type = KEY_TYPE_deleted;
+				set_bkey_val_u64s(&k.k, 0);
+			}
+
+			if ((void *) dst + bkey_bytes(&k.k) >
+			    (void *) b->data + opts->node_size)
+				die("too many keys for node size");
+
+			if (!bch2_bkey_pack(dst, &k.k_i, &b->format))
+				bkey_copy((struct bkey_i *) dst, &k.k_i);
+
+			le16_add_cpu(&i->u64s, dst->u64s);
+			btree_keys_account_key_add(&b->nr, t - b->set, dst);
+		}
+
+		set_btree_bset_end(b, t);
+	}
+
+	for_each_bset(b, t)
+		bch2_bset_build_aux_tree(b, t,
+				opts->rw && t == bset_tree_last(b));
+
+	free(key_bset);
+	return b;
+}
+
+static void bench_node_free(struct btree *b, struct bench_bset_opts *opts)
+{
+	bch2_btree_keys_free(b);
+	kvpfree(b->data, opts->node_size);
+	free(b);
+}
+
+/* Benchmarks: */
+
+struct bench_search {
+	struct bpos		pos;
+	struct bkey_packed	p;
+	bool			exact;
+};
+
+#define NR_SEARCHES		(1U << 16)
+
+static struct bench_search *bench_searches(struct btree *b,
+					   struct bpos *pos, size_t nr)
+{
+	struct bench_search *searches = xcalloc(NR_SEARCHES, sizeof(*searches));
+	unsigned i;
+
+	for (i = 0; i < NR_SEARCHES; i++) {
+		struct bench_search *s = &searches[i];
+
+		s->pos	 = pos[bench_rand() % nr];
+		s->exact = bch2_bkey_pack_pos_lossy(&s->p, s->pos, b) ==
+			BKEY_PACK_POS_EXACT;
+	}
+
+	return searches;
+}
+
+/* keeps the compiler from throwing away the results we're timing: */
+static volatile unsigned long bench_sink;
+
+static u64 bench_bset_search(struct btree *b, struct bset_tree *t,
+			     struct bench_search *searches, u64 nr)
+{
+	unsigned long sink = 0;
+	u64 i, start = local_clock();
+
+	for (i = 0; i < nr; i++) {
+		struct bench_search *s = &searches[i & (NR_SEARCHES - 1)];
+
+		sink += (unsigned long)
+			__bch2_bset_search(b, t, &s->pos,
+					   s->exact ? &s->p : NULL, &s->p);
+	}
+
+	bench_sink = sink;
+	return local_clock() - start;
+}
+
+static u64 bench_node_iter_init(struct btree *b,
+				struct bench_search *searches, u64 nr)
+{
+	struct btree_node_iter iter;
+	unsigned long sink = 0;
+	u64 i, start = local_clock();
+
+	for (i = 0; i < nr; i++) {
+		bch2_btree_node_iter_init(&iter, b,
+				&searches[i & (NR_SEARCHES - 1)].pos);
+		sink += iter.data[0].k;
+	}
+
+	bench_sink = sink;
+	return local_clock() - start;
+}
+
+static u64 bench_node_iter_advance(struct btree *b, u64 nr)
+{
+	struct btree_node_iter iter;
+	u64 i = 0, time = 0, start;
+
+	while (i < nr) {
+		bch2_btree_node_iter_init_from_start(&iter, b);
+
+		start = local_clock();
+		for (; i < nr && !bch2_btree_node_iter_end(&iter); i++)
+			bch2_btree_node_iter_advance(&iter, b);
+		time += local_clock() - start;
+	}
+
+	return time;
+}
+
+static u64 bench_node_iter_prev_filter(struct btree *b, u64 nr)
+{
+	struct btree_node_iter iter;
+	struct bset_tree *t;
+	u64 i = 0, pass_start, time = 0, start;
+
+	while (i < nr) {
+		pass_start = i;
+
+		/* an iterator pointing at the end of every bset: */
+		memset(&iter, 0, sizeof(iter));
+		for_each_bset(b, t)
+			bch2_btree_node_iter_push(&iter, b,
+						  btree_bkey_last(b, t),
+						  btree_bkey_last(b, t));
+
+		start = local_clock();
+		for (; i < nr; i++)
+			if (!bch2_btree_node_iter_prev_filter(&iter, b,
+						KEY_TYPE_discard + 1))
+				break;
+		time += local_clock() - start;
+
+		/* no keys that aren't whiteouts: */
+		if (i == pass_start)
+			break;
+	}
+
+	return time;
+}
+
+static u64 bench_key_unpack(struct btree *b,
+			    struct bench_search *searches, u64 nr)
+{
+	long sink = 0;
+	u64 i, start = local_clock();
+
+	for (i = 0; i < nr; i++)
+		sink += bkey_unpack_key(b,
+				&searches[i & (NR_SEARCHES - 1)].p).p.offset;
+
+	bench_sink = sink;
+	return local_clock() - start;
+}
+
+static u64 bench_key_cmp_packed(struct btree *b,
+				struct bench_search *searches, u64 nr)
+{
+	long sink = 0;
+	u64 i, start = local_clock();
+
+	for (i = 0; i < nr; i++)
+		sink += bkey_cmp_packed(b,
+				&searches[i & (NR_SEARCHES - 1)].p,
+				&searches[(i + 1) & (NR_SEARCHES - 1)].p);
+
+	bench_sink = sink;
+	return local_clock() - start;
+}
+
+static u64 bench_key_cmp_left_packed(struct btree *b,
+				     struct bench_search *searches, u64 nr)
+{
+	long sink = 0;
+	u64 i, start = local_clock();
+
+	for (i = 0; i < nr; i++)
+		sink += bkey_cmp_left_packed(b,
+				&searches[i & (NR_SEARCHES - 1)].p,
+				&searches[(i + 1) & (NR_SEARCHES - 1)].pos);
+
+	bench_sink = sink;
+	return local_clock() - start;
+}
+
+/* Output: */
+
+static const char * const aux_tree_types[] = {
+	[BSET_NO_AUX_TREE]	= "none",
+	[BSET_RO_AUX_TREE]	= "ro",
+	[BSET_RW_AUX_TREE]	= "rw",
+};
+
+static double ns_per_op(u64 time, u64 nr)
+{
+	return nr ? (double) time / nr : 0;
+}
+
+static double percent(size_t n, size_t d)
+{
+	return d ? 100.0 * n / d : 0;
+}
+
+int cmd_bench_bset(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "nr",			required_argument,	NULL, 'n' },
+		{ "node_size",		required_argument,	NULL, 'N' },
+		{ "keys",		required_argument,	NULL, 'k' },
+		{ "bsets",		required_argument,	NULL, 's' },
+		{ "whiteouts",		required_argument,	NULL, 'w' },
+		{ "format",		required_argument,	NULL, 'f' },
+		{ "distribution",	required_argument,	NULL, 'd' },
+		{ "rw",			no_argument,		NULL, 'r' },
+		{ "no_compile",		no_argument,		NULL, 'C' },
+		{ "seed",		required_argument,	NULL, 'S' },
+		{ "json",		no_argument,		NULL, 'j' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bench_bset_opts opts = {
+		.nr		= 1 << 20,
+		.node_size	= 256 << 10,
+		.nsets		= 3,
+	};
+	struct bench_search *searches;
+	struct bset_stats stats;
+	struct bset_tree *t;
+	struct bpos *pos;
+	struct bch_fs *c;
+	struct btree *b;
+	size_t nr;
+	u64 time;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "n:k:s:w:f:d:jh",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'n':
+			if (bch2_strtoull_h(optarg, &opts.nr) || !opts.nr)
+				die("invalid number of operations %s", optarg);
+			break;
+		case 'N':
+			if (bch2_strtoull_h(optarg, &opts.node_size) ||
+			    !is_power_of_2(opts.node_size) ||
+			    opts.node_size < PAGE_SIZE ||
+			    opts.node_size > (256 << 10))
+				die("invalid node size %s (power of two, 4k-256k)",
+				    optarg);
+			break;
+		case 'k':
+			if (bch2_strtoull_h(optarg, &opts.nr_keys) ||
+			    !opts.nr_keys)
+				die("invalid number of keys %s", optarg);
+			break;
+		case 's':
+			if (kstrtouint(optarg, 10, &opts.nsets) ||
+			    !opts.nsets || opts.nsets > MAX_BSETS)
+				die("invalid number of bsets %s (1-%u)",
+				    optarg, MAX_BSETS);
+			break;
+		case 'w':
+			if (kstrtouint(optarg, 10, &opts.whiteouts) ||
+			    opts.whiteouts > 100)
+				die("invalid whiteout percentage %s", optarg);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "unpacked"))
+				opts.unpacked = true;
+			else if (strcmp(optarg, "packed"))
+				die("invalid key format %s", optarg);
+			break;
+		case 'd':
+			if (!strcmp(optarg, "random"))
+				opts.random = true;
+			else if (strcmp(optarg, "seq"))
+				die("invalid key distribution %s", optarg);
+			break;
+		case 'r':
+			opts.rw = true;
+			break;
+		case 'C':
+			opts.no_compile = true;
+			break;
+		case 'S':
+			if (kstrtoull(optarg, 10, &opts.seed))
+				die("invalid seed %s", optarg);
+			break;
+		case 'j':
+			opts.json = true;
+			break;
+		case 'h':
+			bench_bset_usage();
+			exit(EXIT_SUCCESS);
+		case '?':
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (argc) {
+		bench_bset_usage();
+		exit(EXIT_FAILURE);
+	}
+
+	/* xorshift state must be nonzero: */
+	bench_rand_state = opts.seed * 0x9e3779b97f4a7c15ULL + 1;
+
+	/* only needed for the superblock options bset.c looks at: */
+	c = xcalloc(1, sizeof(*c));
+	c->opts = bch2_opts_default;
+	c->opts.btree_node_size = opts.node_size >> 9;
+
+	pos = bench_positions(&opts, &nr);
+	b = bench_node_build(c, &opts, pos, nr);
+	searches = bench_searches(b, pos, nr);
+
+	memset(&stats, 0, sizeof(stats));
+	bch2_btree_keys_stats(b, &stats);
+
+	if (opts.json)
+		printf("{\"node_size\": %llu, \"keys\": %zu, \"whiteouts\": %u, "
+		       "\"format\": \"%s\", \"key_u64s\": %u, \"key_bits\": %u, "
+		       "\"distribution\": \"%s\", \"nr\": %llu, "
+		       "\"bkey_floats\": {\"nr\": %zu, \"failed_unpacked\": %zu, "
+		       "\"failed_prev\": %zu, \"failed_overflow\": %zu}, "
+		       "\"bset_search\": [",
+		       opts.node_size, nr, opts.whiteouts,
+		       opts.unpacked ? "unpacked" : "packed",
+		       b->format.key_u64s, b->nr_key_bits,
+		       opts.random ? "random" : "seq", opts.nr,
+		       stats.floats, stats.failed_unpacked,
+		       stats.failed_prev, stats.failed_overflow);
+	else
+		printf("node:                   %llu bytes, %zu keys, %u%% whiteouts\n"
+		       "format:                 %s, %u u64s, %u key bits, %s positions\n"
+		       "bkey_float:             %zu floats, failed: unpacked %zu (%.2f%%) "
+		       "prev %zu (%.2f%%) overflow %zu (%.2f%%)\n",
+		       opts.node_size, nr, opts.whiteouts,
+		       opts.unpacked ? "unpacked" : "packed",
+		       b->format.key_u64s, b->nr_key_bits,
+		       opts.random ? "random" : "seq",
+		       stats.floats,
+		       stats.failed_unpacked,
+		       percent(stats.failed_unpacked, stats.floats),
+		       stats.failed_prev,
+		       percent(stats.failed_prev, stats.floats),
+		       stats.failed_overflow,
+		       percent(stats.failed_overflow, stats.floats));
+
+	for_each_bset(b, t) {
+		unsigned idx = t - b->set;
+
+		time = bench_bset_search(b, t, searches, opts.nr);
+
+		if (opts.json)
+			printf("%s{\"aux_tree\": \"%s\", \"u64s\": %u, "
+			       "\"ns_per_op\": %.1f}", idx ? ", " : "",
+			       aux_tree_types[bset_aux_tree_type(t)],
+			       b->nr.bset_u64s[idx],
+			       ns_per_op(time, opts.nr));
+		else {
+			char name[32];
+
+			snprintf(name, sizeof(name), "bset_search %u (%s):",
+				 idx, aux_tree_types[bset_aux_tree_type(t)]);
+			printf("%-24s%10.1f ns/op, %u u64s\n", name,
+			       ns_per_op(time, opts.nr), b->nr.bset_u64s[idx]);
+		}
+	}
+
+	if (opts.json)
+		printf("]");
+
+#define bench_print(_name, _time)					\
+	if (opts.json)							\
+		printf(", \"%s\": {\"ns_per_op\": %.1f}", _name,	\
+		       ns_per_op(_time, opts.nr));			\
+	else								\
+		printf("%-24s%10.1f ns/op\n", _name ":",		\
+		       ns_per_op(_time, opts.nr))
+
+	bench_print("node_iter_init",	bench_node_iter_init(b, searches, opts.nr));
+	bench_print("node_iter_advance", bench_node_iter_advance(b, opts.nr));
+	bench_print("node_iter_prev_filter", bench_node_iter_prev_filter(b, opts.nr));
+	bench_print("key_unpack",	bench_key_unpack(b, searches, opts.nr));
+	bench_print("key_cmp_packed",	bench_key_cmp_packed(b, searches, opts.nr));
+	bench_print("key_cmp_left_packed", bench_key_cmp_left_packed(b, searches, opts.nr));
+#undef bench_print
+
+	if (opts.json)
+		printf("}\n");
+
+	free(searches);
+	bench_node_free(b, &opts);
+	free(pos);
+	free(c);
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <getopt.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -25,6 +26,8 @@ static void dump_usage(void)
 	     "Options:\n"
 	     "  -o output     Output qcow2 image(s)\n"
 	     "  -f            Force; overwrite when needed\n"
+	     "  --stats[=json]\n"
+	     "                Print time stats on exit, and to stderr on SIGUSR1\n"
 	     "  -h            Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
@@ -83,7 +86,12 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd)
 
 int cmd_dump(int argc, char *argv[])
 {
+	static const struct option longopts[] = {
+		FS_STATS_LONGOPT,
+		{ NULL }
+	};
 	struct bch_opts opts = bch2_opts_empty();
+	enum fs_stats_format stats = FS_STATS_NONE;
 	struct bch_dev *ca;
 	char *out = NULL;
 	unsigned i, nr_devices = 0;
@@ -95,7 +103,7 @@ int cmd_dump(int argc, char *argv[])
 	opt_set(opts, degraded,		true);
 	opt_set(opts, errors,		BCH_ON_ERROR_CONTINUE);
 
-	while ((opt = getopt(argc, argv, "o:fh")) != -1)
+	while ((opt = getopt_long(argc, argv, "o:fh", longopts, NULL)) != -1)
 		switch (opt) {
 		case 'o':
 			out = optarg;
@@ -103,6 +111,9 @@ int cmd_dump(int argc, char *argv[])
 		case 'f':
 			force = true;
 			break;
+		case 'S':
+			stats = fs_stats_format_parse(optarg);
+			break;
 		case 'h':
 			dump_usage();
 			exit(EXIT_SUCCESS);
@@ -115,6 +126,8 @@ int cmd_dump(int argc, char *argv[])
 	if (!argc)
 		die("Please supply device(s) to check");
 
+	fs_stats_start(stats);
+
 	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
@@ -147,6 +160,7 @@ int cmd_dump(int argc, char *argv[])
 
 	up_read(&c->gc_lock);
 
+	fs_stats_print(c, stats, stdout);
 	bch2_fs_stop(c);
 	return 0;
 }
@@ -254,6 +268,7 @@ static void list_keys_usage(void)
 	     "  -m (keys|formats)                     List mode\n"
 	     "  -f                                    Check (fsck) the filesystem first\n"
 	     "  -v                                    Verbose mode\n"
+	     "      --stats[=json]                    Print time stats on exit, and to stderr on SIGUSR1\n"
 	     "  -h                                    Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
@@ -267,7 +282,12 @@ static const char * const list_modes[] = {
 
 int cmd_list(int argc, char *argv[])
 {
+	static const struct option longopts[] = {
+		FS_STATS_LONGOPT,
+		{ NULL }
+	};
 	struct bch_opts opts = bch2_opts_empty();
+	enum fs_stats_format stats = FS_STATS_NONE;
 	enum btree_id btree_id = BTREE_ID_EXTENTS;
 	struct bpos start = POS_MIN, end = POS_MAX;
 	u64 inum;
@@ -278,7 +298,8 @@ int cmd_list(int argc, char *argv[])
 	opt_set(opts, degraded,		true);
 	opt_set(opts, errors,		BCH_ON_ERROR_CONTINUE);
 
-	while ((opt = getopt(argc, argv, "b:s:e:i:m:fvh")) != -1)
+	while ((opt = getopt_long(argc, argv, "b:s:e:i:m:fvh",
+				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'b':
 			btree_id = read_string_list_or_die(optarg,
@@ -307,6 +328,9 @@ int cmd_list(int argc, char *argv[])
 		case 'v':
 			opt_set(opts, verbose, true);
 			break;
+		case 'S':
+			stats = fs_stats_format_parse(optarg);
+			break;
 		case 'h':
 			list_keys_usage();
 			exit(EXIT_SUCCESS);
@@ -316,6 +340,8 @@ int cmd_list(int argc, char *argv[])
 	if (!argc)
 		die("Please supply device(s)");
 
+	fs_stats_start(stats);
+
 	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
@@ -334,6 +360,7 @@ int cmd_list(int argc, char *argv[])
 		die("Invalid mode");
 	}
 
+	fs_stats_print(c, stats, stdout);
 	bch2_fs_stop(c);
 	return 0;
 }
@@ -1,4 +1,6 @@
 
+#include <getopt.h>
+
 #include "cmds.h"
 #include "libbcachefs/error.h"
 #include "libbcachefs.h"
@@ -16,13 +18,20 @@ static void usage(void)
 	     "  -y     Assume \"yes\" to all questions\n"
 	     "  -f     Force checking even if filesystem is marked clean\n"
 	     "  -v     Be verbose\n"
+	     "  --stats[=json]\n"
+	     "         Print time stats on exit, and to stderr on SIGUSR1\n"
 	     " --h     Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
 
 int cmd_fsck(int argc, char *argv[])
 {
+	static const struct option longopts[] = {
+		FS_STATS_LONGOPT,
+		{ NULL }
+	};
 	struct bch_opts opts = bch2_opts_empty();
+	enum fs_stats_format stats = FS_STATS_NONE;
 	unsigned i;
 	int opt, ret = 0;
 
@@ -30,7 +39,8 @@ int cmd_fsck(int argc, char *argv[])
 	opt_set(opts, fsck, true);
 	opt_set(opts, fix_errors, FSCK_OPT_ASK);
 
-	while ((opt = getopt(argc, argv, "apynfvh")) != -1)
+	while ((opt = getopt_long(argc, argv, "apynfvh",
+				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'a': /* outdated alias for -p */
 		case 'p':
@@ -49,6 +59,9 @@ int cmd_fsck(int argc, char *argv[])
 		case 'v':
 			opt_set(opts, verbose, true);
 			break;
+		case 'S':
+			stats = fs_stats_format_parse(optarg);
+			break;
 		case 'h':
 			usage();
 			exit(EXIT_SUCCESS);
@@ -62,6 +75,8 @@ int cmd_fsck(int argc, char *argv[])
 		if (dev_mounted_rw(argv[i]))
 			die("%s is mounted read-write - aborting", argv[i]);
 
+	fs_stats_start(stats);
+
 	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
@@ -71,6 +86,7 @@ int cmd_fsck(int argc, char *argv[])
 	if (test_bit(BCH_FS_ERROR, &c->flags))
 		ret = 4;
 
+	fs_stats_print(c, stats, stdout);
 	bch2_fs_stop(c);
 	return ret;
 }
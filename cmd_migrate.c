@@ -648,6 +648,7 @@ static void migrate_usage(void)
 	     "      --encrypted        Enable whole filesystem encryption (chacha20/poly1305)\n"
 	     "      --no_passphrase    Don't encrypt master encryption key\n"
 	     "  -F                     Force, even if metadata file already exists\n"
+	     "      --stats[=json]     Print time stats on exit, and to stderr on SIGUSR1\n"
 	     "  -h                     Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
@@ -655,6 +656,7 @@ static void migrate_usage(void)
 static const struct option migrate_opts[] = {
 	{ "encrypted",		no_argument, NULL, 'e' },
 	{ "no_passphrase",	no_argument, NULL, 'p' },
+	FS_STATS_LONGOPT,
 	{ NULL }
 };
 
@@ -662,6 +664,7 @@ static int migrate_fs(const char		*fs_path,
 		      struct bch_opt_strs	fs_opt_strs,
 		      struct bch_opts		fs_opts,
 		      struct format_opts	format_opts,
+		      enum fs_stats_format	stats,
 		      bool force)
 {
 	if (!path_is_fs_root(fs_path))
@@ -723,6 +726,7 @@ static int migrate_fs(const char		*fs_path,
 
 	copy_fs(c, fs_fd, fs_path, bcachefs_inum, &extents);
 
+	fs_stats_print(c, stats, stdout);
 	bch2_fs_stop(c);
 
 	printf("Migrate complete, running fsck:\n");
@@ -733,6 +737,7 @@ static int migrate_fs(const char		*fs_path,
 	if (IS_ERR(c))
 		die("Error opening new filesystem: %s", strerror(-PTR_ERR(c)));
 
+	fs_stats_print(c, stats, stdout);
 	bch2_fs_stop(c);
 	printf("fsck complete\n");
 
@@ -755,6 +760,7 @@ static int migrate_fs(const char		*fs_path,
 int cmd_migrate(int argc, char *argv[])
 {
 	struct format_opts format_opts = format_opts_default();
+	enum fs_stats_format stats = FS_STATS_NONE;
 	char *fs_path = NULL;
 	bool no_passphrase = false, force = false;
 	int opt;
@@ -778,6 +784,9 @@ int cmd_migrate(int argc, char *argv[])
 		case 'F':
 			force = true;
 			break;
+		case 'S':
+			stats = fs_stats_format_parse(optarg);
+			break;
 		case 'h':
 			migrate_usage();
 			exit(EXIT_SUCCESS);
@@ -789,10 +798,12 @@ int cmd_migrate(int argc, char *argv[])
 	if (format_opts.encrypted && !no_passphrase)
 		format_opts.passphrase = read_passphrase_twice("Enter passphrase: ");
 
+	fs_stats_start(stats);
+
 	return migrate_fs(fs_path,
 			  fs_opt_strs,
 			  fs_opts,
-			  format_opts, force);
+			  format_opts, stats, force);
 }
 
 static void migrate_superblock_usage(void)
@@ -0,0 +1,236 @@
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/jiffies.h>
+#include <linux/tracepoint.h>
+
+#include "cmds.h"
+#include "tools-util.h"
+
+static void trace_usage(void)
+{
+	puts("bcachefs trace - decode a trace recorded with BCACHEFS_TRACE\n"
+	     "Usage: bcachefs trace [OPTION]... <file>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -e, --events=list           Only print events matching list\n"
+	     "  -s, --stats                 Print the number of each event, not the events\n"
+	     "  -l, --list                  List events that can be traced\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+struct trace_decode_event {
+	const char		*name;
+	/* NULL if this build doesn't have the event, or its format changed: */
+	struct tracepoint	*tp;
+	bool			selected;
+	u64			nr;
+};
+
+struct trace_decode_entry {
+	struct trace_entry	*e;
+	u32			tid;
+	u32			seq;
+};
+
+static int trace_entry_cmp(const void *_l, const void *_r)
+{
+	const struct trace_decode_entry *l = _l, *r = _r;
+
+	if (l->e->time != r->e->time)
+		return l->e->time < r->e->time ? -1 : 1;
+	return l->seq < r->seq ? -1 : l->seq > r->seq;
+}
+
+static bool trace_event_selected(const char *name, const char *list)
+{
+	char *buf, *p, *pattern;
+	bool ret = false;
+
+	if (!list)
+		return true;
+
+	buf = p = strdup(list);
+	while ((pattern = strsep(&p, ",")))
+		if (!fnmatch(pattern, name, 0)) {
+			ret = true;
+			break;
+		}
+	free(buf);
+	return ret;
+}
+
+static void trace_list_events(void)
+{
+	struct tracepoint * const *i, *tp;
+
+	for_each_tracepoint(tp, i)
+		printf("%s\n", tp->name);
+}
+
+int cmd_trace(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "events",		required_argument,	NULL, 'e' },
+		{ "stats",		no_argument,		NULL, 's' },
+		{ "list",		no_argument,		NULL, 'l' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct trace_decode_event *events;
+	darray(struct trace_decode_entry) entries;
+	struct trace_decode_entry *d;
+	struct trace_file_header *h;
+	struct trace_file_event *fe;
+	const char *filter = NULL;
+	bool stats = false;
+	void *p, *end;
+	u64 lost = 0;
+	u32 seq = 0;
+	unsigned i;
+	int opt, fd;
+	struct stat st;
+
+	while ((opt = getopt_long(argc, argv, "e:slh",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'e':
+			filter = optarg;
+			break;
+		case 's':
+			stats = true;
+			break;
+		case 'l':
+			trace_list_events();
+			exit(EXIT_SUCCESS);
+		case 'h':
+			trace_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (argc != 1)
+		die("Please supply a trace file");
+
+	fd = xopen(argv[0], O_RDONLY);
+	st = xfstat(fd);
+
+	if (st.st_size < sizeof(*h))
+		die("%s: not a bcachefs trace file", argv[0]);
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		die("error mapping %s: %m", argv[0]);
+	end = p + st.st_size;
+
+	h = p;
+	if (memcmp(h->magic, TRACE_FILE_MAGIC, sizeof(h->magic)))
+		die("%s: not a bcachefs trace file", argv[0]);
+	if (h->version != TRACE_FILE_VERSION)
+		die("%s: unknown trace file version %u", argv[0], h->version);
+
+	trace_print_text_base = h->text_base;
+
+	fe = (void *) (h + 1);
+	if ((void *) (fe + h->nr_events) > end)
+		die("%s: truncated", argv[0]);
+
+	events = xcalloc(h->nr_events, sizeof(*events));
+	for (i = 0; i < h->nr_events; i++) {
+		struct trace_decode_event *ev;
+
+		if (fe[i].id >= h->nr_events)
+			die("%s: bad event id %u", argv[0], fe[i].id);
+
+		ev = &events[fe[i].id];
+		ev->name	= fe[i].name;
+		ev->tp		= trace_event_find(fe[i].name);
+		ev->selected	= trace_event_selected(fe[i].name, filter);
+
+		if (ev->tp && ev->tp->entry_size != fe[i].entry_size)
+			ev->tp = NULL;
+	}
+
+	darray_init(entries);
+
+	p = fe + h->nr_events;
+	while (p + sizeof(struct trace_file_chunk) <= end) {
+		struct trace_file_chunk *c = p;
+		void *c_end = p + sizeof(*c) + c->bytes;
+
+		if (c_end > end) {
+			fprintf(stderr, "%s: truncated\n", argv[0]);
+			break;
+		}
+
+		lost += c->lost;
+
+		for (p = c + 1; p < c_end;) {
+			struct trace_entry *e = p;
+
+			if (e->bytes < sizeof(*e) || p + e->bytes > c_end ||
+			    e->id >= h->nr_events)
+				die("%s: corrupt entry", argv[0]);
+
+			p += e->bytes;
+
+			if (!events[e->id].selected)
+				continue;
+
+			darray_append(entries, ((struct trace_decode_entry) {
+				.e	= e,
+				.tid	= c->tid,
+				.seq	= seq++,
+			}));
+		}
+	}
+
+	if (stats) {
+		darray_foreach(d, entries)
+			events[d->e->id].nr++;
+
+		for (i = 0; i < h->nr_events; i++)
+			if (events[i].nr)
+				printf("%-40s %llu\n", events[i].name,
+				       events[i].nr);
+		goto out;
+	}
+
+	qsort(entries.item, entries.size, sizeof(entries.item[0]),
+	      trace_entry_cmp);
+
+	darray_foreach(d, entries) {
+		struct trace_decode_event *ev = &events[d->e->id];
+		u64 t = d->e->time - entries.item[0].e->time;
+
+		printf("%7u [%03u] %6llu.%06llu: %s: ",
+		       d->tid, d->e->cpu,
+		       t / NSEC_PER_SEC, (t % NSEC_PER_SEC) / NSEC_PER_USEC,
+		       ev->name);
+
+		if (ev->tp)
+			ev->tp->print(stdout, d->e->data);
+		else
+			printf("(unknown format, %zu bytes)",
+			       d->e->bytes - sizeof(*d->e));
+		putchar('\n');
+	}
+out:
+	if (lost)
+		fprintf(stderr, "%llu events lost (ring buffer full)\n", lost);
+
+	darray_free(entries);
+	free(events);
+	munmap(h, st.st_size);
+	close(fd);
+	return 0;
+}
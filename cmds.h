@@ -39,6 +39,10 @@ int cmd_fsck(int argc, char *argv[]);
 
 int cmd_dump(int argc, char *argv[]);
 int cmd_list(int argc, char *argv[]);
+int cmd_trace(int argc, char *argv[]);
+int cmd_bench(int argc, char *argv[]);
+int cmd_bench_bset(int argc, char *argv[]);
+int cmd_bench_data(int argc, char *argv[]);
 
 int cmd_migrate(int argc, char *argv[]);
 int cmd_migrate_superblock(int argc, char *argv[]);
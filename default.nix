@@ -11,7 +11,7 @@ stdenv.mkDerivation rec {
 
   nativeBuildInputs = [ git pkgconfig ];
   buildInputs =
-    [ liburcu libuuid libaio zlib attr keyutils
+    [ liburcu libuuid libaio liburing zlib attr keyutils
       libsodium libscrypt
     ];
 
@@ -207,25 +207,20 @@ static inline struct bio *bio_next_split(struct bio *bio, int sectors,
 }
 
 struct bio_set {
-	unsigned int front_pad;
+	unsigned int		front_pad;
+	/* one per bvec pool size, for bios with inline bvecs: */
+	struct kmem_cache	*bio_slabs[BVEC_POOL_NR];
 };
 
-static inline void bioset_exit(struct bio_set *bs) {}
+extern void bioset_exit(struct bio_set *);
+extern int bioset_init(struct bio_set *, unsigned, unsigned, int);
 
 static inline void bioset_free(struct bio_set *bs)
 {
+	bioset_exit(bs);
 	kfree(bs);
 }
 
-static inline int bioset_init(struct bio_set *bs,
-			      unsigned pool_size,
-			      unsigned front_pad,
-			      int flags)
-{
-	bs->front_pad = front_pad;
-	return 0;
-}
-
 extern struct bio_set *bioset_create(unsigned int, unsigned int);
 extern struct bio_set *bioset_create_nobvec(unsigned int, unsigned int);
 enum {
@@ -276,13 +271,17 @@ static inline void zero_fill_bio(struct bio *bio)
 #define bio_set_dev(bio, bdev)			\
 do {						\
 	(bio)->bi_bdev = (bdev);		\
+	(bio)->bi_disk = (bdev)->bd_disk;	\
 } while (0)
 
 #define bio_copy_dev(dst, src)			\
 do {						\
 	(dst)->bi_bdev = (src)->bi_bdev;	\
+	(dst)->bi_disk = (src)->bi_disk;	\
 } while (0)
 
+#define bio_dev(bio)	((bio)->bi_bdev->bd_dev)
+
 static inline char *bvec_kmap_irq(struct bio_vec *bvec, unsigned long *flags)
 {
 	return page_address(bvec->bv_page) + bvec->bv_offset;
@@ -42,6 +42,7 @@ typedef u8 __bitwise blk_status_t;
 struct bio {
 	struct bio		*bi_next;	/* request queue link */
 	struct block_device	*bi_bdev;
+	struct gendisk		*bi_disk;	/* bi_bdev->bd_disk */
 	blk_status_t		bi_status;
 	unsigned int		bi_opf;		/* bottom bits req flags,
 						 * top bits REQ_OP. Use
@@ -2,8 +2,10 @@
 #define __TOOLS_LINUX_BLKDEV_H
 
 #include <linux/backing-dev.h>
+#include <linux/bitops.h>
 #include <linux/blk_types.h>
 #include <linux/kobject.h>
+#include <linux/mutex.h>
 #include <linux/types.h>
 
 #define BIO_MAX_PAGES	256
@@ -11,6 +13,8 @@
 typedef unsigned fmode_t;
 
 struct bio;
+struct blk_ioq;
+struct task_struct;
 struct user_namespace;
 
 #define MINORBITS	20
@@ -61,8 +65,11 @@ static inline struct inode *file_inode(const struct file *f)
 
 #define BDEVNAME_SIZE	32
 
+#define QUEUE_FLAG_DISCARD	14	/* supports DISCARD */
+
 struct request_queue {
 	struct backing_dev_info *backing_dev_info;
+	unsigned long		queue_flags;
 };
 
 struct gendisk {
@@ -82,8 +89,15 @@ struct block_device {
 	struct hd_struct	*bd_part;
 	struct gendisk		*bd_disk;
 	struct gendisk		__bd_disk;
+	dev_t			bd_dev;
 	int			bd_fd;
-	int			bd_sync_fd;
+	/* O_DIRECT alignment, 0 if opened buffered: */
+	unsigned		bd_dio_align;
+	/* serializes partial block writes, see blk_req_rmw(): */
+	struct mutex		bd_rmw_lock;
+	/* submission/completion queue, and registered file slot in it or -1: */
+	struct blk_ioq		*bd_ioq;
+	int			bd_fd_idx;
 
 	struct backing_dev_info	*bd_bdi;
 	struct backing_dev_info	__bd_bdi;
@@ -97,12 +111,31 @@ static inline void submit_bio(struct bio *bio)
 	generic_make_request(bio);
 }
 
+/*
+ * Bios submitted while plugged are queued on the plug, and submitted together
+ * (with bios to adjacent sectors merged) when it's flushed - on
+ * blk_finish_plug(), when the plug fills up, or when the task sleeps:
+ */
+#define BLK_MAX_REQUEST_COUNT	32
+
+struct blk_plug {
+	struct bio		*head;
+	struct bio		*tail;
+	unsigned		nr;
+};
+
+void blk_start_plug(struct blk_plug *);
+void blk_finish_plug(struct blk_plug *);
+void blk_flush_plug(struct task_struct *);
+
+int __blkdev_issue_discard(struct block_device *, sector_t,
+			   sector_t, gfp_t, int, struct bio **);
 int blkdev_issue_discard(struct block_device *, sector_t,
 			 sector_t, gfp_t, unsigned long);
 
 #define bdev_get_queue(bdev)		(&((bdev)->queue))
 
-#define blk_queue_discard(q)		((void) (q), 0)
+#define blk_queue_discard(q)		test_bit(QUEUE_FLAG_DISCARD, &(q)->queue_flags)
 #define blk_queue_nonrot(q)		((void) (q), 0)
 
 unsigned bdev_logical_block_size(struct block_device *bdev);
@@ -6,82 +6,92 @@
 
 #include <linux/compiler.h>
 #include <linux/bug.h>
+#include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/wait.h>
 
 struct kmem_cache;
+struct mempool_pcpu;
 
 typedef void * (mempool_alloc_t)(gfp_t gfp_mask, void *pool_data);
 typedef void (mempool_free_t)(void *element, void *pool_data);
 
 typedef struct mempool_s {
-	size_t			elem_size;
+	spinlock_t		lock;
+	int			min_nr;		/* nr of elements at *elements */
+	int			curr_nr;	/* Current nr of elements at *elements */
+	void			**elements;
+
 	void			*pool_data;
 	mempool_alloc_t		*alloc;
 	mempool_free_t		*free;
+	wait_queue_head_t	wait;
+
+	/* see linux/mempool.c: */
+	const char		*name;
+	struct list_head	list;
+	struct mempool_pcpu __percpu *pcpu;
+	bool			cache_owned;
 } mempool_t;
 
 static inline bool mempool_initialized(mempool_t *pool)
 {
-	return true;
+	return pool->elements != NULL;
 }
 
-extern int mempool_resize(mempool_t *pool, int new_min_nr);
+void mempool_exit(mempool_t *pool);
+int __mempool_init(mempool_t *pool, int min_nr, mempool_alloc_t *alloc_fn,
+		   mempool_free_t *free_fn, void *pool_data, const char *name);
+mempool_t *__mempool_create(int min_nr, mempool_alloc_t *alloc_fn,
+			    mempool_free_t *free_fn, void *pool_data,
+			    const char *name);
 
-static inline void mempool_free(void *element, mempool_t *pool)
-{
-	free(element);
-}
+/* Pools are named after the expression they were initialized with: */
+#define mempool_init(pool, min_nr, alloc_fn, free_fn, pool_data)	\
+	__mempool_init(pool, min_nr, alloc_fn, free_fn, pool_data, #pool)
+#define mempool_create(min_nr, alloc_fn, free_fn, pool_data)		\
+	__mempool_create(min_nr, alloc_fn, free_fn, pool_data, #alloc_fn)
 
-static inline void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask) __malloc
-{
-	BUG_ON(!pool->elem_size);
-	return kmalloc(pool->elem_size, gfp_mask);
-}
+extern int mempool_resize(mempool_t *pool, int new_min_nr);
+extern void mempool_destroy(mempool_t *pool);
+extern void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask) __malloc;
+extern void mempool_free(void *element, mempool_t *pool);
 
-static inline void mempool_exit(mempool_t *pool) {}
+void mempools_print_stats(FILE *);
 
-static inline void mempool_destroy(mempool_t *pool)
-{
-	free(pool);
-}
+/*
+ * A mempool_alloc_t and mempool_free_t that get the memory from
+ * a slab cache that is passed in through pool_data.
+ * Note: the slab cache may not have a ctor function.
+ */
+void *mempool_alloc_slab(gfp_t gfp_mask, void *pool_data);
+void mempool_free_slab(void *element, void *pool_data);
 
-static inline int
-mempool_init_slab_pool(mempool_t *pool, int min_nr, struct kmem_cache *kc)
-{
-	pool->elem_size = 0;
-	return 0;
-}
+#define mempool_init_slab_pool(pool, min_nr, kc)			\
+	mempool_init(pool, min_nr, mempool_alloc_slab, mempool_free_slab, \
+		     (void *) (kc))
+#define mempool_create_slab_pool(min_nr, kc)				\
+	mempool_create(min_nr, mempool_alloc_slab, mempool_free_slab,	\
+		       (void *) (kc))
 
-static inline mempool_t *
-mempool_create_slab_pool(int min_nr, struct kmem_cache *kc)
-{
-	mempool_t *pool = malloc(sizeof(*pool));
-	pool->elem_size = 0;
-	return pool;
-}
+/*
+ * kmalloc pools get their own slab cache, which the pool owns:
+ */
+int __mempool_init_kmalloc_pool(mempool_t *pool, int min_nr, size_t size,
+				const char *name);
 
-static inline int mempool_init_kmalloc_pool(mempool_t *pool, int min_nr, size_t size)
-{
-	pool->elem_size = size;
-	return 0;
-}
+#define mempool_init_kmalloc_pool(pool, min_nr, size)			\
+	__mempool_init_kmalloc_pool(pool, min_nr, size, #pool)
 
-static inline int mempool_init_page_pool(mempool_t *pool, int min_nr, int order)
-{
-	pool->elem_size = PAGE_SIZE << order;
-	return 0;
-}
+/*
+ * A mempool_alloc_t and mempool_free_t for a simple page allocator that
+ * allocates pages of the order specified by pool_data
+ */
+void *mempool_alloc_pages(gfp_t gfp_mask, void *pool_data);
+void mempool_free_pages(void *element, void *pool_data);
 
-static inline int mempool_init(mempool_t *pool, int min_nr,
-			       mempool_alloc_t *alloc_fn,
-			       mempool_free_t *free_fn,
-			       void *pool_data)
-{
-	pool->elem_size = (size_t) pool_data;
-	pool->pool_data	= pool_data;
-	pool->alloc	= alloc_fn;
-	pool->free	= free_fn;
-	return 0;
-}
+#define mempool_init_page_pool(pool, min_nr, order)			\
+	mempool_init(pool, min_nr, mempool_alloc_pages,			\
+		     mempool_free_pages, (void *) (long) (order))
 
 #endif /* _LINUX_MEMPOOL_H */
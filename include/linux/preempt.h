@@ -1,15 +1,37 @@
 #ifndef __LINUX_PREEMPT_H
 #define __LINUX_PREEMPT_H
 
-#define preempt_disable()			barrier()
-#define sched_preempt_enable_no_resched()	barrier()
-#define preempt_enable_no_resched()		barrier()
-#define preempt_enable()			barrier()
+#include <linux/compiler.h>
+
+/*
+ * We can't actually disable preemption - but percpu data is per thread (see
+ * linux/percpu.c), so code that disables preemption still has its "cpu's"
+ * percpu data to itself, and preempt_disable() needn't do anything else:
+ */
+
+extern __thread unsigned __preempt_count;
+
+static inline void preempt_disable(void)
+{
+	__preempt_count++;
+	barrier();
+}
+
+static inline void preempt_enable(void)
+{
+	barrier();
+	__preempt_count--;
+}
+
+#define preempt_count()				__preempt_count
+
+#define sched_preempt_enable_no_resched()	preempt_enable()
+#define preempt_enable_no_resched()		preempt_enable()
 #define preempt_check_resched()			do { } while (0)
 
-#define preempt_disable_notrace()		barrier()
-#define preempt_enable_no_resched_notrace()	barrier()
-#define preempt_enable_notrace()		barrier()
+#define preempt_disable_notrace()		preempt_disable()
+#define preempt_enable_no_resched_notrace()	preempt_enable()
+#define preempt_enable_notrace()		preempt_enable()
 #define preemptible()				0
 
 #endif /* __LINUX_PREEMPT_H */
@@ -0,0 +1,21 @@
+#ifndef _LINUX_SET_MEMORY_H
+#define _LINUX_SET_MEMORY_H
+
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <linux/page.h>
+
+static inline int set_memory_x(unsigned long addr, int numpages)
+{
+	return mprotect((void *) addr, (size_t) numpages << PAGE_SHIFT,
+			PROT_READ|PROT_WRITE|PROT_EXEC) ? -errno : 0;
+}
+
+static inline int set_memory_nx(unsigned long addr, int numpages)
+{
+	return mprotect((void *) addr, (size_t) numpages << PAGE_SHIFT,
+			PROT_READ|PROT_WRITE) ? -errno : 0;
+}
+
+#endif /* _LINUX_SET_MEMORY_H */
@@ -1,6 +1,7 @@
 #ifndef __TOOLS_LINUX_SHRINKER_H
 #define __TOOLS_LINUX_SHRINKER_H
 
+#include <linux/compiler.h>
 #include <linux/list.h>
 #include <linux/types.h>
 
@@ -25,6 +26,25 @@ struct shrinker {
 int register_shrinker(struct shrinker *);
 void unregister_shrinker(struct shrinker *);
 
-void run_shrinkers(void);
+enum memory_pressure {
+	MEMORY_PRESSURE_NONE,
+	MEMORY_PRESSURE_SOME,
+	MEMORY_PRESSURE_CRITICAL,
+};
+
+/* Updated by the shrinker thread, see linux/shrinker.c: */
+extern int memory_pressure;
+
+void __run_shrinkers(void);
+
+/*
+ * Called on every allocation: normally the shrinker thread does all the work,
+ * allocations only shrink directly when memory is critically low.
+ */
+static inline void run_shrinkers(void)
+{
+	if (unlikely(READ_ONCE(memory_pressure) == MEMORY_PRESSURE_CRITICAL))
+		__run_shrinkers();
+}
 
 #endif /* __TOOLS_LINUX_SHRINKER_H */
@@ -56,10 +56,21 @@
  * lock held, and for the correct type, six_lock_increment() may be used to
  * bump up the counter for that type - the only effect is that one more call to
  * unlock will be required before the lock is unlocked.
+ *
+ * Userspace: waiters park on futexes in the lock itself (one per lock type)
+ * rather than on a waitlist, after spinning for a while - how long is adapted
+ * to how long the lock has been taking to acquire.
+ *
+ * Heavily read locks can be switched to per cpu reader counts with
+ * six_lock_pcpu_readers(), while held for write: readers then only touch their
+ * own cpu's counter, and write locks have to sum the counters. The state word
+ * records which mode the lock is in, and since the mode only changes when there
+ * are no readers, unlock always agrees with lock about where the read count is.
  */
 
+#include <linux/atomic.h>
 #include <linux/lockdep.h>
-#include <linux/osq_lock.h>
+#include <linux/percpu.h>
 #include <linux/sched.h>
 #include <linux/types.h>
 
@@ -80,9 +91,12 @@ union six_lock_state {
 	};
 
 	struct {
-		unsigned	read_lock:26;
+		unsigned	read_lock:24;
 		unsigned	intent_lock:3;
 		unsigned	waiters:3;
+		/* set by a writer waiting on per cpu readers: */
+		unsigned	write_locking:1;
+		unsigned	pcpu_readers:1;
 		/*
 		 * seq works much like in seqlocks: it's incremented every time
 		 * we lock and unlock for write.
@@ -107,10 +121,12 @@ enum six_lock_type {
 struct six_lock {
 	union six_lock_state	state;
 	struct task_struct	*owner;
-	struct optimistic_spin_queue osq;
+	unsigned __percpu	*readers;
 
-	raw_spinlock_t		wait_lock;
-	struct list_head	wait_list[2];
+	/* futexes, bumped on every wakeup, indexed by lock type: */
+	u32			wait_seq[3];
+	atomic_t		intent_waiters;
+	unsigned		spin_avg;
 #ifdef CONFIG_DEBUG_LOCK_ALLOC
 	struct lockdep_map	dep_map;
 #endif
@@ -121,9 +137,12 @@ static __always_inline void __six_lock_init(struct six_lock *lock,
 					    struct lock_class_key *key)
 {
 	atomic64_set(&lock->state.counter, 0);
-	raw_spin_lock_init(&lock->wait_lock);
-	INIT_LIST_HEAD(&lock->wait_list[SIX_LOCK_read]);
-	INIT_LIST_HEAD(&lock->wait_list[SIX_LOCK_intent]);
+	lock->owner	= NULL;
+	lock->readers	= NULL;
+	lock->wait_seq[SIX_LOCK_read] = lock->wait_seq[SIX_LOCK_intent] =
+		lock->wait_seq[SIX_LOCK_write] = 0;
+	atomic_set(&lock->intent_waiters, 0);
+	lock->spin_avg	= 0;
 #ifdef CONFIG_DEBUG_LOCK_ALLOC
 	debug_check_no_locks_freed((void *) lock, sizeof(*lock));
 	lockdep_init_map(&lock->dep_map, name, key, 0);
@@ -226,5 +245,9 @@ bool six_trylock_convert(struct six_lock *, enum six_lock_type,
 			 enum six_lock_type);
 
 void six_lock_increment(struct six_lock *, enum six_lock_type);
+void six_lock_readers_add(struct six_lock *, int);
+
+void six_lock_pcpu_readers(struct six_lock *, bool);
+void six_lock_exit(struct six_lock *);
 
 #endif /* _LINUX_SIX_H */
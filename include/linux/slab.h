@@ -2,9 +2,11 @@
 #define __TOOLS_LINUX_SLAB_H
 
 #include <malloc.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <linux/huge_mm.h>
 #include <linux/kernel.h>
 #include <linux/log2.h>
 #include <linux/page.h>
@@ -64,39 +66,117 @@ static inline void *krealloc(void *old, size_t size, gfp_t flags)
 #define kvmalloc(size, flags)		kmalloc(size, flags)
 #define kvfree(p)			kfree(p)
 
-static inline struct page *alloc_pages(gfp_t flags, unsigned int order)
+/*
+ * Compound allocations of huge page size come from the huge page arena (see
+ * linux/vmalloc.c), and are backed by huge pages where possible:
+ */
+extern void *huge_arena_start, *huge_arena_end;
+
+void *huge_page_alloc(void);
+void huge_page_free(void *);
+
+static inline bool huge_arena_contains(const void *p)
+{
+	return p >= huge_arena_start && p < huge_arena_end;
+}
+
+static inline unsigned long __get_free_pages(gfp_t flags, unsigned int order)
 {
 	size_t size = PAGE_SIZE << order;
 	void *p;
 
 	run_shrinkers();
 
+	/* fresh huge pages are always zeroed: */
+	if ((flags & __GFP_COMP) &&
+	    order == HPAGE_PMD_ORDER &&
+	    (p = huge_page_alloc()))
+		return (unsigned long) p;
+
 	p = aligned_alloc(PAGE_SIZE, size);
 	if (p && (flags & __GFP_ZERO))
 		memset(p, 0, size);
 
+	return (unsigned long) p;
+}
+
+#define __get_free_page(gfp)		__get_free_pages(gfp, 0)
+
+/*
+ * Single struct pages - i.e. bio pages - come from the page arena, so they can
+ * be vmap()ed:
+ */
+extern void *page_arena_start, *page_arena_end;
+
+void *page_arena_alloc(void);
+void page_arena_free(void *);
+
+static inline bool page_arena_contains(const void *p)
+{
+	return p >= page_arena_start && p < page_arena_end;
+}
+
+static inline struct page *alloc_pages(gfp_t flags, unsigned int order)
+{
+	void *p;
+
+	if (order)
+		return (void *) __get_free_pages(flags, order);
+
+	run_shrinkers();
+
+	p = page_arena_alloc();
+	if (!p)
+		return (void *) __get_free_pages(flags, 0);
+
+	if (flags & __GFP_ZERO)
+		memset(p, 0, PAGE_SIZE);
 	return p;
 }
 
 #define alloc_page(gfp)			alloc_pages(gfp, 0)
 
-#define __get_free_pages(gfp, order)	((unsigned long) alloc_pages(gfp, order))
-#define __get_free_page(gfp)		__get_free_pages(gfp, 0)
+static inline void free_pages(unsigned long addr, unsigned int order)
+{
+	void *p = (void *) addr;
+
+	if (page_arena_contains(p))
+		page_arena_free(p);
+	else if (huge_arena_contains(p))
+		huge_page_free(p);
+	else
+		free(p);
+}
 
-#define __free_pages(page, order)			\
-do {							\
-	(void) order;					\
-	free(page);					\
-} while (0)
+#define __free_pages(page, order)	free_pages((unsigned long) (page), order)
+#define __free_page(page)		__free_pages((page), 0)
+#define free_page(addr)			free_pages((addr), 0)
 
-#define free_pages(addr, order)				\
-do {							\
-	(void) order;					\
-	free((void *) (addr));				\
-} while (0)
+/* kmem_caches - see linux/slab.c: */
 
-#define __free_page(page) __free_pages((page), 0)
-#define free_page(addr) free_pages((addr), 0)
+#define SLAB_HWCACHE_ALIGN	0x00002000UL	/* Align objs on cache lines */
+#define SLAB_PANIC		0x00040000UL	/* Panic if kmem_cache_create() fails */
+#define SLAB_RECLAIM_ACCOUNT	0x00020000UL	/* Objects are reclaimable */
+#define SLAB_ACCOUNT		0x04000000UL	/* Account to memcg */
+
+struct kmem_cache *kmem_cache_create(const char *, size_t, size_t,
+				     unsigned long, void (*)(void *));
+void kmem_cache_destroy(struct kmem_cache *);
+void *kmem_cache_alloc(struct kmem_cache *, gfp_t) __malloc;
+void kmem_cache_free(struct kmem_cache *, void *);
+void kmem_caches_print_stats(FILE *);
+
+/* BCACHEFS_SLAB_STATS: print statistics as caches and mempools are freed */
+extern bool kmem_print_stats;
+
+#define KMEM_CACHE(__struct, __flags)					\
+	kmem_cache_create(#__struct, sizeof(struct __struct),		\
+			  __alignof__(struct __struct), (__flags), NULL)
+
+static inline void *kmem_cache_zalloc(struct kmem_cache *c, gfp_t flags)
+{
+	return kmem_cache_alloc(c, flags|__GFP_ZERO);
+}
 
 #define VM_IOREMAP		0x00000001	/* ioremap() and friends */
 #define VM_ALLOC		0x00000002	/* vmalloc() */
@@ -106,13 +186,9 @@ do {							\
 #define VM_NO_GUARD		0x00000040      /* don't add guard page */
 #define VM_KASAN		0x00000080      /* has allocated kasan shadow memory */
 
-static inline void vunmap(const void *addr) {}
-
-static inline void *vmap(struct page **pages, unsigned int count,
-			 unsigned long flags, unsigned prot)
-{
-	return NULL;
-}
+void vunmap(const void *addr);
+void *vmap(struct page **pages, unsigned int count,
+	   unsigned long flags, unsigned prot);
 
 #define is_vmalloc_addr(page)		0
 
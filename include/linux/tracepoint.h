@@ -1,6 +1,87 @@
 #ifndef __TOOLS_LINUX_TRACEPOINT_H
 #define __TOOLS_LINUX_TRACEPOINT_H
 
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <linux/compiler.h>
+#include <linux/types.h>
+
+/*
+ * Tracepoints: each event in include/trace/events/ gets a struct tracepoint,
+ * defined (along with the code to record and print the event) by the .c file
+ * that includes the events header with CREATE_TRACE_POINTS - see
+ * include/trace/define_trace.h.
+ *
+ * Enabled events are recorded into per thread ring buffers, which a background
+ * thread writes out to a trace file - decoded by `bcachefs trace`. See
+ * linux/tracepoint.c.
+ */
+
+struct tracepoint {
+	const char	*name;
+	int		enabled;
+	unsigned	id;
+	unsigned	entry_size;
+	void		(*print)(FILE *, const void *);
+};
+
+void trace_event_write(struct tracepoint *, const void *, unsigned);
+void trace_event_printf(FILE *, const char *, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+/* set by the decoder, to the recording binary's load address: */
+extern u64 trace_print_text_base;
+
+int trace_events_enable(const char *, bool);
+struct tracepoint *trace_event_find(const char *);
+
+/* all events, in no particular order: */
+extern struct tracepoint * const __start___tracepoints_ptrs[];
+extern struct tracepoint * const __stop___tracepoints_ptrs[];
+
+#define for_each_tracepoint(_tp, _i)					\
+	for (_i = __start___tracepoints_ptrs;				\
+	     _i < __stop___tracepoints_ptrs && ((_tp) = *(_i), 1);	\
+	     _i++)
+
+/*
+ * Trace file format: a header, then the events the file was written with,
+ * then chunks of entries - each chunk being a run of entries from one thread.
+ */
+
+#define TRACE_FILE_MAGIC	"BCHTRACE"
+#define TRACE_FILE_VERSION	1
+
+struct trace_file_header {
+	char		magic[8];
+	u32		version;
+	u32		nr_events;
+	/* for making sense of %pf: */
+	u64		text_base;
+};
+
+struct trace_file_event {
+	u16		id;
+	u16		entry_size;
+	char		name[60];
+};
+
+struct trace_file_chunk {
+	u32		tid;
+	u32		bytes;
+	/* entries dropped because the thread's ring buffer was full: */
+	u64		lost;
+};
+
+struct trace_entry {
+	u64		time;		/* ns, CLOCK_MONOTONIC */
+	u16		id;
+	u16		cpu;
+	u32		bytes;		/* including this header, padded to 8 */
+	u8		data[];
+};
+
 #define PARAMS(args...) args
 
 #define TP_PROTO(args...)	args
@@ -8,10 +89,17 @@
 #define TP_CONDITION(args...)	args
 
 #define __DECLARE_TRACE(name, proto, args, cond, data_proto, data_args) \
+	extern struct tracepoint __tracepoint_##name;			\
+	void __trace_##name(proto);					\
 	static inline void trace_##name(proto)				\
-	{ }								\
+	{								\
+		if (unlikely(READ_ONCE(__tracepoint_##name.enabled)))	\
+			__trace_##name(args);				\
+	}								\
 	static inline void trace_##name##_rcuidle(proto)		\
-	{ }								\
+	{								\
+		trace_##name(args);					\
+	}								\
 	static inline int						\
 	register_trace_##name(void (*probe)(data_proto),		\
 			      void *data)				\
@@ -30,7 +118,7 @@
 	static inline bool						\
 	trace_##name##_enabled(void)					\
 	{								\
-		return false;						\
+		return READ_ONCE(__tracepoint_##name.enabled);		\
 	}
 
 #define DEFINE_TRACE_FN(name, reg, unreg)
@@ -10,6 +10,7 @@
 
 #define __SANE_USERSPACE_TYPES__	/* For PPC64, to get LL64 types */
 #include <asm/types.h>
+#include <linux/posix_types.h>
 
 #define BITS_PER_LONG	__BITS_PER_LONG
 
@@ -22,15 +23,19 @@ typedef unsigned short		umode_t;
 
 typedef unsigned gfp_t;
 
-#define GFP_KERNEL	0
+#define __GFP_IO		0
+#define __GFP_NOWARN		0
+#define __GFP_NORETRY		0
+#define __GFP_ZERO		1
+#define __GFP_DIRECT_RECLAIM	2
+#define __GFP_RECLAIM		__GFP_DIRECT_RECLAIM
+#define __GFP_COMP		4
+
+#define GFP_KERNEL	__GFP_RECLAIM
 #define GFP_ATOMIC	0
-#define GFP_NOFS	0
-#define GFP_NOIO	0
+#define GFP_NOFS	__GFP_RECLAIM
+#define GFP_NOIO	__GFP_RECLAIM
 #define GFP_NOWAIT	0
-#define __GFP_IO	0
-#define __GFP_NOWARN	0
-#define __GFP_NORETRY	0
-#define __GFP_ZERO	1
 
 #define PAGE_ALLOC_COSTLY_ORDER	6
 
@@ -0,0 +1,36 @@
+/*
+ * Included at the end of every events header: when the includer defined
+ * CREATE_TRACE_POINTS, read the events header again to generate the event
+ * definitions - see trace_events.h.
+ */
+
+#ifdef CREATE_TRACE_POINTS
+
+/* Prevent recursion */
+#undef CREATE_TRACE_POINTS
+
+#include <linux/stringify.h>
+
+#ifndef TRACE_INCLUDE_FILE
+# define TRACE_INCLUDE_FILE TRACE_SYSTEM
+# define UNDEF_TRACE_INCLUDE_FILE
+#endif
+
+#define TRACE_INCLUDE(system) __stringify(trace/events/system.h)
+
+#define TRACE_HEADER_MULTI_READ
+
+#include <trace/trace_events.h>
+
+#undef TRACE_HEADER_MULTI_READ
+#undef TRACE_INCLUDE
+
+#ifdef UNDEF_TRACE_INCLUDE_FILE
+# undef TRACE_INCLUDE_FILE
+# undef UNDEF_TRACE_INCLUDE_FILE
+#endif
+
+/* We may be processing more files */
+#define CREATE_TRACE_POINTS
+
+#endif /* CREATE_TRACE_POINTS */
@@ -0,0 +1,125 @@
+/*
+ * Stage 1: for each event class, the struct an event is recorded as:
+ *
+ *	struct trace_event_raw_<class> {
+ *		<TP_STRUCT__entry fields>
+ *	};
+ *
+ * Stage 2: for each event class, functions to fill in the struct from the
+ * event's arguments, and to print it:
+ *
+ *	static inline void trace_event_assign_<class>(struct trace_event_raw_<class> *__entry, proto)
+ *	static void trace_event_print_<class>(FILE *out, const void *p)
+ *
+ * Stage 3: for each event, its struct tracepoint and the function trace_<event>()
+ * calls when the event is enabled:
+ *
+ *	struct tracepoint __tracepoint_<event>;
+ *	void __trace_<event>(proto)
+ *
+ * If we were built with <sys/sdt.h>, enabled events also fire a USDT probe,
+ * bcachefs:<event>, with a pointer to the struct as its argument.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define trace_event_usdt(name, entry)	DTRACE_PROBE1(bcachefs, name, entry)
+#else
+#define trace_event_usdt(name, entry)	do {} while (0)
+#endif
+
+#undef TRACE_EVENT
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)		\
+	DECLARE_EVENT_CLASS(name,					\
+			    PARAMS(proto),				\
+			    PARAMS(args),				\
+			    PARAMS(tstruct),				\
+			    PARAMS(assign),				\
+			    PARAMS(print))				\
+	DEFINE_EVENT(name, name, PARAMS(proto), PARAMS(args))
+
+#undef DEFINE_EVENT_FN
+#define DEFINE_EVENT_FN(template, name, proto, args, reg, unreg)	\
+	DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args))
+
+#undef DEFINE_EVENT_PRINT
+#define DEFINE_EVENT_PRINT(template, name, proto, args, print)		\
+	DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args))
+
+/* Stage 1: */
+
+#undef __field
+#define __field(type, item)		type	item;
+
+#undef __field_ext
+#define __field_ext(type, item, filter_type)	type	item;
+
+#undef __array
+#define __array(type, item, len)	type	item[len];
+
+#undef TP_STRUCT__entry
+#define TP_STRUCT__entry(args...)	args
+
+#undef DECLARE_EVENT_CLASS
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)	\
+	struct trace_event_raw_##name {					\
+		tstruct							\
+	};
+
+#undef DEFINE_EVENT
+#define DEFINE_EVENT(template, name, proto, args)
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
+
+/* Stage 2: */
+
+#undef TP_fast_assign
+#define TP_fast_assign(args...)		args
+
+#undef TP_printk
+#define TP_printk(fmt, args...)		fmt, ##args
+
+#undef DECLARE_EVENT_CLASS
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)	\
+static inline void							\
+trace_event_assign_##name(struct trace_event_raw_##name *__entry, proto)\
+{									\
+	assign								\
+}									\
+									\
+static void trace_event_print_##name(FILE *out, const void *p)		\
+{									\
+	const struct trace_event_raw_##name *__entry __maybe_unused = p;\
+									\
+	trace_event_printf(out, print);					\
+}
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
+
+/* Stage 3: */
+
+#undef DECLARE_EVENT_CLASS
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+
+#undef DEFINE_EVENT
+#define DEFINE_EVENT(template, call, proto, args)			\
+struct tracepoint __tracepoint_##call = {				\
+	.name		= #call,					\
+	.entry_size	= sizeof(struct trace_event_raw_##template),	\
+	.print		= trace_event_print_##template,			\
+};									\
+static struct tracepoint * const __tracepoint_ptr_##call __used	\
+	__attribute__((section("__tracepoints_ptrs"))) =		\
+	&__tracepoint_##call;						\
+									\
+void __trace_##call(proto)						\
+{									\
+	struct trace_event_raw_##template __entry;			\
+									\
+	trace_event_assign_##template(&__entry, args);			\
+	trace_event_usdt(call, &__entry);				\
+	trace_event_write(&__tracepoint_##call,				\
+			  &__entry, sizeof(__entry));			\
+}
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
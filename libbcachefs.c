@@ -1,6 +1,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,15 +15,21 @@
 
 #include <uuid/uuid.h>
 
+#include <linux/kthread.h>
+
 #include "libbcachefs.h"
 #include "crypto.h"
 #include "libbcachefs/bcachefs_format.h"
 #include "libbcachefs/btree_cache.h"
+#include "libbcachefs/btree_iter.h"
 #include "libbcachefs/checksum.h"
 #include "libbcachefs/disk_groups.h"
+#include "libbcachefs/eytzinger.h"
 #include "libbcachefs/opts.h"
 #include "libbcachefs/replicas.h"
+#include "libbcachefs/super.h"
 #include "libbcachefs/super-io.h"
+#include "libbcachefs/trans_profile.h"
 #include "tools-util.h"
 
 #define NSEC_PER_SEC	1000000000L
@@ -1101,3 +1108,362 @@ void bch2_opts_usage(unsigned opt_types)
 		}
 	}
 }
+
+/* --stats: */
+
+static const char * const bch2_time_stat_names[] = {
+#define x(name) #name,
+	BCH_TIME_STATS()
+#undef x
+	NULL
+};
+
+enum fs_stats_format fs_stats_format_parse(const char *arg)
+{
+	if (!arg || !strcmp(arg, "text"))
+		return FS_STATS_TEXT;
+	if (strcmp(arg, "json"))
+		die("invalid stats format %s (text or json)", arg);
+
+	return FS_STATS_JSON;
+}
+
+/* stats are updated concurrently - print from a consistent copy: */
+static void time_stats_copy(struct time_stats *dst, struct time_stats *src)
+{
+	spin_lock_irq(&src->lock);
+	*dst = *src;
+	spin_unlock_irq(&src->lock);
+}
+
+static void time_stats_print_text(FILE *out, const char *name,
+				  struct time_stats *stats)
+{
+	/* may be called from fs_stats_thread(), which has a small stack: */
+	char *buf = xmalloc(4096), *p, *n;
+
+	bch2_time_stats_print(stats, buf, 4096);
+
+	fprintf(out, "%s:\n", name);
+	for (p = buf; *p; p = n) {
+		n = strchrnul(p, '\n');
+		fprintf(out, "  %.*s\n", (int) (n - p), p);
+		if (*n)
+			n++;
+	}
+
+	free(buf);
+}
+
+static void time_stats_print_json(FILE *out, const char *name,
+				  struct time_stats *stats, bool first)
+{
+	u64 q, last_q = 0;
+	int i;
+
+	fprintf(out, "%s\"%s\": {\"count\": %llu, "
+		"\"frequency_ns\": %llu, \"avg_duration_ns\": %llu, "
+		"\"max_duration_ns\": %llu, \"quantiles_ns\": [",
+		first ? "" : ", ", name,
+		stats->count, stats->average_frequency,
+		stats->average_duration, stats->max_duration);
+
+	eytzinger0_for_each(i, NR_QUANTILES) {
+		q = max(stats->quantiles.entries[i].m, last_q);
+		fprintf(out, "%s%llu", i == eytzinger0_first(NR_QUANTILES)
+			? "" : ", ", q);
+		last_q = q;
+	}
+
+	fputs("]}", out);
+}
+
+static const char * const six_lock_type_names[] = {
+	"read", "intent", "write",
+};
+
+#define FS_STATS_CALLSITES	20
+
+/* callsites are printed as offsets into the binary, for addr2line: */
+static void callsite_print(FILE *out, unsigned long ip)
+{
+	extern char __executable_start[];
+
+	if (!ip)
+		fputs("other", out);
+	else if (ip >= (unsigned long) __executable_start)
+		fprintf(out, "%s+0x%lx", program_invocation_short_name,
+			ip - (unsigned long) __executable_start);
+	else
+		fprintf(out, "0x%lx", ip);
+}
+
+static void trans_profile_print_text(struct bch_fs *c, FILE *out)
+{
+	struct lock_wait_hist (*h)[SIX_LOCK_write + 1];
+	struct trans_profile_site *sites;
+	u64 restarts[BCH_TRANS_RESTART_NR];
+	u64 relock_fail[BTREE_MAX_DEPTH], upgrade_fail[BTREE_MAX_DEPTH];
+	unsigned i, l, t, nr;
+
+	bch2_trans_restarts_read(c, restarts);
+	fputs("transaction restarts:\n", out);
+	for (i = 0; i < BCH_TRANS_RESTART_NR; i++)
+		if (restarts[i])
+			fprintf(out, "  %-24s %llu\n",
+				bch2_trans_restart_reasons[i], restarts[i]);
+
+	bch2_lock_fails_read(c, relock_fail, upgrade_fail);
+	fputs("btree node lock failures:\n", out);
+	for (l = 0; l < BTREE_MAX_DEPTH; l++)
+		if (relock_fail[l] || upgrade_fail[l])
+			fprintf(out, "  level %u: relock_fail %llu upgrade_fail %llu\n",
+				l, relock_fail[l], upgrade_fail[l]);
+
+	h = xmalloc(sizeof(*h) * BTREE_MAX_DEPTH);
+	bch2_lock_wait_read(c, h);
+	fputs("btree node lock waits (ns):\n", out);
+	for (l = 0; l < BTREE_MAX_DEPTH; l++)
+		for (t = 0; t <= SIX_LOCK_write; t++)
+			if (h[l][t].nr)
+				fprintf(out, "  level %u %-6s nr %llu mean %llu "
+					"p50 <%llu p90 <%llu p99 <%llu max <%llu\n",
+					l, six_lock_type_names[t], h[l][t].nr,
+					div64_u64(h[l][t].ns, h[l][t].nr),
+					lock_wait_hist_quantile(&h[l][t], 500),
+					lock_wait_hist_quantile(&h[l][t], 900),
+					lock_wait_hist_quantile(&h[l][t], 990),
+					lock_wait_hist_quantile(&h[l][t], 1000));
+	free(h);
+
+	sites = xmalloc(sizeof(*sites) * FS_STATS_CALLSITES);
+	nr = bch2_trans_profile_sites_read(c, sites, FS_STATS_CALLSITES);
+	fputs("transaction callsites:\n", out);
+	for (i = 0; i < nr; i++) {
+		struct trans_profile_site *s = &sites[i];
+
+		fputs("  ", out);
+		callsite_print(out, s->ip);
+		fputc(':', out);
+
+		for (t = 0; t < BCH_TRANS_RESTART_NR; t++)
+			if (s->restarts[t])
+				fprintf(out, " %s %llu",
+					bch2_trans_restart_reasons[t], s->restarts[t]);
+		if (s->relock_fail)
+			fprintf(out, " relock_fail %llu", s->relock_fail);
+		if (s->upgrade_fail)
+			fprintf(out, " upgrade_fail %llu", s->upgrade_fail);
+		if (s->lock_waits)
+			fprintf(out, " lock_waits %llu (mean %llu ns, max %llu ns)",
+				s->lock_waits,
+				div64_u64(s->lock_wait_ns, s->lock_waits),
+				s->lock_wait_max_ns);
+		fputc('\n', out);
+	}
+	free(sites);
+}
+
+static void trans_profile_print_json(struct bch_fs *c, FILE *out)
+{
+	struct lock_wait_hist (*h)[SIX_LOCK_write + 1];
+	struct trans_profile_site *sites;
+	u64 restarts[BCH_TRANS_RESTART_NR];
+	u64 relock_fail[BTREE_MAX_DEPTH], upgrade_fail[BTREE_MAX_DEPTH];
+	unsigned i, l, t, b, nr;
+
+	bch2_trans_restarts_read(c, restarts);
+	fputs(", \"restarts\": {", out);
+	for (i = 0; i < BCH_TRANS_RESTART_NR; i++)
+		fprintf(out, "%s\"%s\": %llu", i ? ", " : "",
+			bch2_trans_restart_reasons[i], restarts[i]);
+
+	bch2_lock_fails_read(c, relock_fail, upgrade_fail);
+	fputs("}, \"lock_fails\": [", out);
+	for (l = 0; l < BTREE_MAX_DEPTH; l++)
+		fprintf(out, "%s{\"relock_fail\": %llu, \"upgrade_fail\": %llu}",
+			l ? ", " : "", relock_fail[l], upgrade_fail[l]);
+
+	/* per level, per lock type; buckets[i] counts waits < 2^i ns */
+	h = xmalloc(sizeof(*h) * BTREE_MAX_DEPTH);
+	bch2_lock_wait_read(c, h);
+	fputs("], \"lock_waits\": [", out);
+	for (l = 0; l < BTREE_MAX_DEPTH; l++) {
+		fprintf(out, "%s{", l ? ", " : "");
+		for (t = 0; t <= SIX_LOCK_write; t++) {
+			unsigned nr_buckets = LOCK_WAIT_BUCKETS;
+
+			while (nr_buckets && !h[l][t].buckets[nr_buckets - 1])
+				--nr_buckets;
+
+			fprintf(out, "%s\"%s\": {\"nr\": %llu, \"ns\": %llu, "
+				"\"buckets\": [", t ? ", " : "",
+				six_lock_type_names[t], h[l][t].nr, h[l][t].ns);
+			for (b = 0; b < nr_buckets; b++)
+				fprintf(out, "%s%llu", b ? ", " : "",
+					h[l][t].buckets[b]);
+			fputs("]}", out);
+		}
+		fputc('}', out);
+	}
+	free(h);
+
+	sites = xmalloc(sizeof(*sites) * FS_STATS_CALLSITES);
+	nr = bch2_trans_profile_sites_read(c, sites, FS_STATS_CALLSITES);
+	fputs("], \"callsites\": [", out);
+	for (i = 0; i < nr; i++) {
+		struct trans_profile_site *s = &sites[i];
+
+		fprintf(out, "%s{\"ip\": \"", i ? ", " : "");
+		callsite_print(out, s->ip);
+		fputs("\", \"restarts\": {", out);
+		for (t = 0; t < BCH_TRANS_RESTART_NR; t++)
+			fprintf(out, "%s\"%s\": %llu", t ? ", " : "",
+				bch2_trans_restart_reasons[t], s->restarts[t]);
+		fprintf(out, "}, \"relock_fail\": %llu, \"upgrade_fail\": %llu, "
+			"\"lock_waits\": %llu, \"lock_wait_ns\": %llu, "
+			"\"lock_wait_max_ns\": %llu}",
+			s->relock_fail, s->upgrade_fail, s->lock_waits,
+			s->lock_wait_ns, s->lock_wait_max_ns);
+	}
+	fputc(']', out);
+	free(sites);
+}
+
+void fs_stats_print(struct bch_fs *c, enum fs_stats_format fmt, FILE *out)
+{
+	struct time_stats stats;
+	struct bch_dev *ca;
+	char uuid[40];
+	unsigned i, rw;
+	bool first = true;
+
+	if (fmt == FS_STATS_NONE)
+		return;
+
+	uuid_unparse_lower(c->sb.user_uuid.b, uuid);
+
+	if (fmt == FS_STATS_JSON)
+		fprintf(out, "{\"fs\": \"%s\", \"time_stats\": {", uuid);
+	else
+		fprintf(out, "time stats for %s:\n", uuid);
+
+	for (i = 0; i < BCH_TIME_STAT_NR; i++) {
+		time_stats_copy(&stats, &c->times[i]);
+		if (!stats.count)
+			continue;
+
+		if (fmt == FS_STATS_JSON)
+			time_stats_print_json(out, bch2_time_stat_names[i],
+					      &stats, first);
+		else
+			time_stats_print_text(out, bch2_time_stat_names[i],
+					      &stats);
+		first = false;
+	}
+
+	if (fmt == FS_STATS_JSON)
+		fputs("}, \"devices\": {", out);
+	first = true;
+
+	for_each_member_device(ca, c, i) {
+		bool dev_first = true;
+
+		for (rw = 0; rw < 2; rw++) {
+			char *name = mprintf("%s io_latency_%s", ca->name,
+					     rw == READ ? "read" : "write");
+
+			time_stats_copy(&stats, &ca->io_latency[rw]);
+			if (!stats.count)
+				goto next;
+
+			if (fmt == FS_STATS_JSON) {
+				if (dev_first)
+					fprintf(out, "%s\"%s\": {",
+						first ? "" : ", ", ca->name);
+				time_stats_print_json(out, name + strlen(ca->name) + 1,
+						      &stats, dev_first);
+			} else {
+				time_stats_print_text(out, name, &stats);
+			}
+			dev_first = first = false;
+next:
+			free(name);
+		}
+
+		if (fmt == FS_STATS_JSON && !dev_first)
+			fputc('}', out);
+	}
+
+	if (fmt == FS_STATS_JSON) {
+		fputc('}', out);
+		trans_profile_print_json(c, out);
+		fputs("}\n", out);
+	} else {
+		trans_profile_print_text(c, out);
+	}
+	fflush(out);
+}
+
+static enum fs_stats_format fs_stats_signal_fmt;
+static int fs_stats_signal_pipe[2];
+
+static void fs_stats_signal_handler(int sig)
+{
+	int saved_errno = errno;
+	char c = 0;
+
+	/* printing isn't async signal safe - kick fs_stats_thread(): */
+	if (write(fs_stats_signal_pipe[1], &c, 1) < 0)
+		;
+	errno = saved_errno;
+}
+
+static void fs_stats_print_stderr(struct bch_fs *c, void *arg)
+{
+	fs_stats_print(c, fs_stats_signal_fmt, stderr);
+}
+
+static int fs_stats_thread(void *arg)
+{
+	char c;
+
+	while (1) {
+		if (read(fs_stats_signal_pipe[0], &c, 1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("error reading stats signal pipe: %m");
+		}
+
+		bch2_for_each_fs(fs_stats_print_stderr, NULL);
+	}
+
+	return 0;
+}
+
+/*
+ * For long running commands: print stats of all open filesystems to stderr
+ * whenever we get SIGUSR1:
+ */
+void fs_stats_start(enum fs_stats_format fmt)
+{
+	struct sigaction sa = { .sa_handler = fs_stats_signal_handler };
+	struct task_struct *p;
+
+	if (fmt == FS_STATS_NONE)
+		return;
+
+	fs_stats_signal_fmt = fmt;
+
+	if (pipe(fs_stats_signal_pipe))
+		die("error creating pipe: %m");
+
+	p = kthread_run(fs_stats_thread, NULL, "bcachefs stats");
+	if (IS_ERR(p))
+		die("error starting stats thread: %li", PTR_ERR(p));
+
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sa, NULL))
+		die("error installing SIGUSR1 handler: %m");
+}
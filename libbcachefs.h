@@ -205,4 +205,20 @@ static inline void bchu_disk_resize(struct bchfs_handle fs,
 
 int bchu_data(struct bchfs_handle, struct bch_ioctl_data);
 
+/* --stats: time stats (latency quantiles etc.) of open filesystems */
+
+enum fs_stats_format {
+	FS_STATS_NONE,
+	FS_STATS_TEXT,
+	FS_STATS_JSON,
+};
+
+#define FS_STATS_LONGOPT	{ "stats", optional_argument, NULL, 'S' }
+
+struct bch_fs;
+
+enum fs_stats_format fs_stats_format_parse(const char *);
+void fs_stats_print(struct bch_fs *, enum fs_stats_format, FILE *);
+void fs_stats_start(enum fs_stats_format);
+
 #endif /* _LIBBCACHE_H */
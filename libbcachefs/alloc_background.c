@@ -12,6 +12,7 @@
 #include "debug.h"
 #include "ec.h"
 #include "error.h"
+#include "keylist.h"
 #include "recovery.h"
 
 #include <linux/kthread.h>
@@ -314,28 +315,77 @@ err:
 	return ret;
 }
 
+/* Alloc keys written per bch2_btree_insert_list() call: */
+#define ALLOC_WRITE_BATCH	64
+
+struct alloc_write_batch {
+	struct keylist		keys;
+	unsigned		nr;
+	size_t			b[ALLOC_WRITE_BATCH];
+	struct bucket_mark	m[ALLOC_WRITE_BATCH];
+	/* hack: */
+	u64			inline_keys[ALLOC_WRITE_BATCH * (BKEY_U64s + 8)];
+};
+
+static int bch2_alloc_write_batch(struct bch_fs *c, struct bch_dev *ca,
+				  struct alloc_write_batch *w,
+				  unsigned flags, bool *wrote)
+{
+	struct bucket_mark new;
+	unsigned i;
+	int ret;
+
+	if (!w->nr)
+		return 0;
+
+	ret = bch2_btree_insert_list(c, BTREE_ID_ALLOC, &w->keys, NULL, NULL,
+				     BTREE_INSERT_NOFAIL|
+				     BTREE_INSERT_NOMARK|
+				     flags);
+	if (ret) {
+		if (!test_bit(BCH_FS_EMERGENCY_RO, &c->flags))
+			bch_err(c, "error %i writing alloc info for dev %u buckets %zu-%zu",
+				ret, ca->dev_idx, w->b[0], w->b[w->nr - 1]);
+		return ret;
+	}
+
+	for (i = 0; i < w->nr; i++) {
+		struct bucket *g = bucket(ca, w->b[i]);
+
+		new = w->m[i];
+		new.dirty = false;
+		atomic64_cmpxchg(&g->_mark.v, w->m[i].v.counter, new.v.counter);
+
+		if (ca->buckets_written)
+			set_bit(w->b[i], ca->buckets_written);
+	}
+
+	w->nr = 0;
+	w->keys.top = w->keys.keys;
+	*wrote = true;
+	return 0;
+}
+
 int bch2_alloc_write(struct bch_fs *c, unsigned flags, bool *wrote)
 {
-	struct btree_trans trans;
-	struct btree_iter *iter;
+	struct alloc_write_batch *w;
 	struct bucket_array *buckets;
 	struct bch_dev *ca;
 	struct bucket *g;
-	struct bucket_mark m, new;
-	struct bkey_alloc_unpacked old_u, new_u;
-	__BKEY_PADDED(k, 8) alloc_key; /* hack: */
+	struct bucket_mark m;
 	struct bkey_i_alloc *a;
-	struct bkey_s_c k;
 	unsigned i;
 	size_t b;
 	int ret = 0;
 
 	BUG_ON(BKEY_ALLOC_VAL_U64s_MAX > 8);
 
-	bch2_trans_init(&trans, c, 0, 0);
+	w = kmalloc(sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
 
-	iter = bch2_trans_get_iter(&trans, BTREE_ID_ALLOC, POS_MIN,
-				   BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
+	bch2_keylist_init(&w->keys, w->inline_keys);
+	w->nr = 0;
 
 	for_each_rw_member(ca, c, i) {
 		down_read(&ca->bucket_lock);
@@ -348,68 +398,44 @@ restart:
 			if (!buckets->b[b].mark.dirty)
 				continue;
 
-			bch2_btree_iter_set_pos(iter, POS(i, b));
-			k = bch2_btree_iter_peek_slot(iter);
-			ret = bkey_err(k);
-			if (ret)
-				goto err;
-
-			old_u = bch2_alloc_unpack(k);
-
-			percpu_down_read(&c->mark_lock);
-			g	= bucket(ca, b);
-			m	= READ_ONCE(g->mark);
-			new_u	= alloc_mem_to_key(g, m);
-			percpu_up_read(&c->mark_lock);
-
-			if (!m.dirty)
-				continue;
-
 			if ((flags & BTREE_INSERT_LAZY_RW) &&
 			    percpu_ref_is_zero(&c->writes)) {
 				up_read(&ca->bucket_lock);
-				bch2_trans_unlock(&trans);
 
 				ret = bch2_fs_read_write_early(c);
 				down_read(&ca->bucket_lock);
 
 				if (ret)
-					goto err;
+					break;
 				goto restart;
 			}
 
-			a = bkey_alloc_init(&alloc_key.k);
-			a->k.p = iter->pos;
-			bch2_alloc_pack(a, new_u);
-
-			bch2_trans_update(&trans, BTREE_INSERT_ENTRY(iter, &a->k_i));
-			ret = bch2_trans_commit(&trans, NULL, NULL,
-						BTREE_INSERT_NOFAIL|
-						BTREE_INSERT_NOMARK|
-						flags);
-err:
-			if (ret && !test_bit(BCH_FS_EMERGENCY_RO, &c->flags)) {
-				bch_err(c, "error %i writing alloc info", ret);
-				printk(KERN_CONT "dev %llu bucket %llu\n",
-				       iter->pos.inode, iter->pos.offset);
-				printk(KERN_CONT "gen %u -> %u\n", old_u.gen, new_u.gen);
-#define x(_name, _bits)		printk(KERN_CONT #_name " %u -> %u\n", old_u._name, new_u._name);
-				BCH_ALLOC_FIELDS()
-#undef  x
-			}
-			if (ret)
-				break;
+			percpu_down_read(&c->mark_lock);
+			g	= bucket(ca, b);
+			m	= READ_ONCE(g->mark);
 
-			new = m;
-			new.dirty = false;
-			atomic64_cmpxchg(&g->_mark.v, m.v.counter, new.v.counter);
+			if (m.dirty) {
+				a = bkey_alloc_init(w->keys.top);
+				a->k.p = POS(ca->dev_idx, b);
+				bch2_alloc_pack(a, alloc_mem_to_key(g, m));
+				bch2_keylist_push(&w->keys);
 
-			if (ca->buckets_written)
-				set_bit(b, ca->buckets_written);
+				w->b[w->nr] = b;
+				w->m[w->nr] = m;
+				w->nr++;
+			}
+			percpu_up_read(&c->mark_lock);
 
-			bch2_trans_cond_resched(&trans);
-			*wrote = true;
+			if (w->nr == ALLOC_WRITE_BATCH) {
+				ret = bch2_alloc_write_batch(c, ca, w,
+							     flags, wrote);
+				if (ret)
+					break;
+			}
 		}
+
+		if (!ret)
+			ret = bch2_alloc_write_batch(c, ca, w, flags, wrote);
 		up_read(&ca->bucket_lock);
 
 		if (ret) {
@@ -418,8 +444,7 @@ err:
 		}
 	}
 
-	bch2_trans_exit(&trans);
-
+	kfree(w);
 	return ret;
 }
 
@@ -1108,21 +1133,46 @@ out:
 	return ret;
 }
 
+/*
+ * Discards everything on free_inc: issued together so that discards of
+ * adjacent buckets get merged, and waited on before any are reused:
+ */
+static void discard_free_inc(struct bch_dev *ca)
+{
+	struct block_device *bdev = ca->disk_sb.bdev;
+	struct bio *bio = NULL;
+	struct blk_plug plug;
+	size_t i, bucket;
+
+	if (!blk_queue_discard(bdev_get_queue(bdev)))
+		return;
+
+	blk_start_plug(&plug);
+	fifo_for_each_entry(bucket, &ca->free_inc, i)
+		if (__blkdev_issue_discard(bdev, bucket_to_sector(ca, bucket),
+					   ca->mi.bucket_size, GFP_NOIO, 0,
+					   &bio))
+			break;
+
+	if (bio) {
+		submit_bio_wait(bio);
+		bio_put(bio);
+	}
+	blk_finish_plug(&plug);
+}
+
 /*
  * Pulls buckets off free_inc, discards them (if enabled), then adds them to
  * freelists, waiting until there's room if necessary:
  */
 static int discard_invalidated_buckets(struct bch_fs *c, struct bch_dev *ca)
 {
+	if (ca->mi.discard)
+		discard_free_inc(ca);
+
 	while (!fifo_empty(&ca->free_inc)) {
 		size_t bucket = fifo_peek(&ca->free_inc);
 
-		if (ca->mi.discard &&
-		    blk_queue_discard(bdev_get_queue(ca->disk_sb.bdev)))
-			blkdev_issue_discard(ca->disk_sb.bdev,
-					     bucket_to_sector(ca, bucket),
-					     ca->mi.bucket_size, GFP_NOIO, 0);
-
 		if (push_invalidated_bucket(c, ca, bucket))
 			return 1;
 	}
@@ -1508,11 +1558,12 @@ static void allocator_start_issue_discards(struct bch_fs *c)
 	unsigned dev_iter;
 	size_t bu;
 
-	for_each_rw_member(ca, c, dev_iter)
+	for_each_rw_member(ca, c, dev_iter) {
+		discard_free_inc(ca);
+
 		while (fifo_pop(&ca->free_inc, bu))
-			blkdev_issue_discard(ca->disk_sb.bdev,
-					     bucket_to_sector(ca, bu),
-					     ca->mi.bucket_size, GFP_NOIO, 0);
+			;
+	}
 }
 
 static int resize_free_inc(struct bch_dev *ca)
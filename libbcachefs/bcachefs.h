@@ -322,6 +322,29 @@ enum bch_time_stats {
 	BCH_TIME_STAT_NR
 };
 
+#define BCH_TRANS_RESTARTS()			\
+	x(btree_node_reused)			\
+	x(would_deadlock)			\
+	x(iters_realloced)			\
+	x(mem_realloced)			\
+	x(journal_res_get)			\
+	x(journal_preres_get)			\
+	x(mark_replicas)			\
+	x(fault_inject)				\
+	x(btree_node_split)			\
+	x(mark)					\
+	x(upgrade)				\
+	x(iter_upgrade)				\
+	x(traverse)				\
+	x(atomic)
+
+enum bch_trans_restart {
+#define x(name) BCH_TRANS_RESTART_##name,
+	BCH_TRANS_RESTARTS()
+#undef x
+	BCH_TRANS_RESTART_NR
+};
+
 #include "alloc_types.h"
 #include "btree_types.h"
 #include "buckets_types.h"
@@ -511,8 +534,21 @@ struct btree_debug {
 	struct dentry		*failed;
 };
 
+/* log2 histogram of time spent blocked on btree node locks, in ns: */
+#define LOCK_WAIT_BUCKETS	40
+
+struct lock_wait_hist {
+	u64			nr;
+	u64			ns;
+	u64			buckets[LOCK_WAIT_BUCKETS];
+};
+
 struct bch_fs_pcpu {
 	u64			sectors_available;
+	u64			trans_restarts[BCH_TRANS_RESTART_NR];
+	u64			node_relock_fail[BTREE_MAX_DEPTH];
+	u64			node_upgrade_fail[BTREE_MAX_DEPTH];
+	struct lock_wait_hist	lock_wait[BTREE_MAX_DEPTH][SIX_LOCK_write + 1];
 };
 
 struct journal_seq_blacklist_table {
@@ -640,6 +676,7 @@ struct bch_fs {
 	atomic64_t		sectors_available;
 
 	struct bch_fs_pcpu __percpu	*pcpu;
+	struct trans_profile	*trans_profile;
 
 	struct percpu_rw_semaphore	mark_lock;
 
@@ -6,6 +6,8 @@
 #include "bset.h"
 #include "util.h"
 
+#include <linux/random.h>
+
 #undef EBUG_ON
 
 #ifdef DEBUG_BKEYS
@@ -266,7 +268,6 @@ struct bkey __bch2_bkey_unpack_key(const struct bkey_format *format,
 	return out;
 }
 
-#ifndef HAVE_BCACHEFS_COMPILED_UNPACK
 struct bpos __bkey_unpack_pos(const struct bkey_format *format,
 				     const struct bkey_packed *in)
 {
@@ -283,7 +284,187 @@ struct bpos __bkey_unpack_pos(const struct bkey_format *format,
 
 	return out;
 }
-#endif
+
+/* Unpacking, specialized by format shape: */
+
+enum bkey_format_shape bch2_bkey_format_shape(const struct bkey_format *f)
+{
+	unsigned i, fields = 0;
+
+	for (i = 0; i < BKEY_NR_FIELDS; i++)
+		if (f->bits_per_field[i])
+			fields |= 1U << i;
+
+#define x(name, _fields)						\
+	if (!(fields & ~(_fields)))					\
+		return f->key_u64s == 1					\
+			? BKEY_FORMAT_SHAPE_##name##_1w			\
+			: BKEY_FORMAT_SHAPE_##name;
+	bkey_format_shapes()
+#undef x
+
+	return BKEY_FORMAT_SHAPE_generic;
+}
+
+/*
+ * Like get_inc_field(), for fields that are known to be present - and if
+ * @one_word, known not to cross a word boundary:
+ */
+__always_inline
+static u64 get_inc_field_shaped(struct unpack_state *state, unsigned field,
+				bool one_word)
+{
+	unsigned bits = state->format->bits_per_field[field];
+	u64 v = 0, offset = le64_to_cpu(state->format->field_offset[field]);
+
+	if (!one_word && bits >= state->bits) {
+		v = state->w >> (64 - bits);
+		bits -= state->bits;
+
+		state->p = next_word(state->p);
+		state->w = *state->p;
+		state->bits = 64;
+	}
+
+	v |= (state->w >> 1) >> (63 - bits);
+	state->w <<= bits;
+	state->bits -= bits;
+
+	return v + offset;
+}
+
+#define shaped_field(_state, _id, _fields, _one_word)			\
+	((_fields) & (1U << (_id))					\
+	 ? get_inc_field_shaped(_state, _id, _one_word)			\
+	 : le64_to_cpu((_state)->format->field_offset[_id]))
+
+__always_inline
+static struct bkey __bkey_unpack_key_shaped(const struct bkey_format *format,
+					    const struct bkey_packed *in,
+					    unsigned fields, bool one_word)
+{
+	struct unpack_state state = unpack_state_init(format, in);
+	struct bkey out;
+
+	EBUG_ON(format->nr_fields != BKEY_NR_FIELDS);
+	EBUG_ON(in->u64s < format->key_u64s);
+	EBUG_ON(in->format != KEY_FORMAT_LOCAL_BTREE);
+	EBUG_ON(in->u64s - format->key_u64s + BKEY_U64s > U8_MAX);
+
+	out.u64s	= BKEY_U64s + in->u64s - format->key_u64s;
+	out.format	= KEY_FORMAT_CURRENT;
+	out.needs_whiteout = in->needs_whiteout;
+	out.type	= in->type;
+	out.pad[0]	= 0;
+
+#define x(id, field)	out.field = shaped_field(&state, id, fields, one_word);
+	bkey_fields()
+#undef x
+
+	return out;
+}
+
+__always_inline
+static struct bpos __bkey_unpack_pos_shaped(const struct bkey_format *format,
+					    const struct bkey_packed *in,
+					    unsigned fields, bool one_word)
+{
+	struct unpack_state state = unpack_state_init(format, in);
+	struct bpos out;
+
+	EBUG_ON(format->nr_fields != BKEY_NR_FIELDS);
+	EBUG_ON(in->u64s < format->key_u64s);
+	EBUG_ON(in->format != KEY_FORMAT_LOCAL_BTREE);
+
+	out.inode	= shaped_field(&state, BKEY_FIELD_INODE, fields, one_word);
+	out.offset	= shaped_field(&state, BKEY_FIELD_OFFSET, fields, one_word);
+	out.snapshot	= shaped_field(&state, BKEY_FIELD_SNAPSHOT, fields, one_word);
+
+	return out;
+}
+
+__always_inline
+static int __bkey_cmp_left_shaped(const struct bkey_format *format,
+				  const struct bkey_packed *l,
+				  const struct bpos *r,
+				  unsigned fields, bool one_word)
+{
+	struct unpack_state state = unpack_state_init(format, l);
+	u64 v;
+
+	/* stop unpacking at the first field that differs: */
+	v = shaped_field(&state, BKEY_FIELD_INODE, fields, one_word);
+	if (v != r->inode)
+		return cmp_int(v, r->inode);
+
+	v = shaped_field(&state, BKEY_FIELD_OFFSET, fields, one_word);
+	if (v != r->offset)
+		return cmp_int(v, r->offset);
+
+	v = shaped_field(&state, BKEY_FIELD_SNAPSHOT, fields, one_word);
+	return cmp_int(v, r->snapshot);
+}
+
+/*
+ * We call these through a function pointer, like the compiled ones - with a
+ * switch on the shape instead, the dispatch costs more than the unpacking:
+ */
+#define bkey_shape_fns(_name, _fields, _one_word)			\
+static void unpack_key_##_name(const struct bkey_format *f,		\
+			       struct bkey *out,			\
+			       const struct bkey_packed *in)		\
+{									\
+	*out = __bkey_unpack_key_shaped(f, in, _fields, _one_word);	\
+}									\
+									\
+static struct bpos unpack_pos_##_name(const struct bkey_format *f,	\
+				      const struct bkey_packed *in)	\
+{									\
+	return __bkey_unpack_pos_shaped(f, in, _fields, _one_word);	\
+}									\
+									\
+static int cmp_left_##_name(const struct bkey_format *f,		\
+			    const struct bkey_packed *l,		\
+			    const struct bpos *r)			\
+{									\
+	return __bkey_cmp_left_shaped(f, l, r, _fields, _one_word);	\
+}
+
+#define x(name, fields)							\
+	bkey_shape_fns(name, fields, false)				\
+	bkey_shape_fns(name##_1w, fields, true)
+	bkey_format_shapes()
+#undef x
+
+static void unpack_key_generic(const struct bkey_format *f,
+			       struct bkey *out,
+			       const struct bkey_packed *in)
+{
+	*out = __bch2_bkey_unpack_key(f, in);
+}
+
+static int cmp_left_generic(const struct bkey_format *f,
+			    const struct bkey_packed *l,
+			    const struct bpos *r)
+{
+	return bkey_cmp(__bkey_unpack_pos(f, l), *r);
+}
+
+const struct bkey_shape_fns bch2_bkey_shape_fns[] = {
+	[BKEY_FORMAT_SHAPE_generic] = {
+		unpack_key_generic, __bkey_unpack_pos, cmp_left_generic,
+	},
+#define x(name, fields)							\
+	[BKEY_FORMAT_SHAPE_##name] = {					\
+		unpack_key_##name, unpack_pos_##name, cmp_left_##name,	\
+	},								\
+	[BKEY_FORMAT_SHAPE_##name##_1w] = {				\
+		unpack_key_##name##_1w, unpack_pos_##name##_1w,		\
+		cmp_left_##name##_1w,					\
+	},
+	bkey_format_shapes()
+#undef x
+};
 
 /**
  * bch2_bkey_pack_key -- pack just the key, not the value
@@ -766,60 +947,17 @@ static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
 #define I4(i0, i1, i2, i3)	(I3(i0, i1, i2),	I(i3))
 #define I5(i0, i1, i2, i3, i4)	(I4(i0, i1, i2, i3),	I(i4))
 
-static u8 *compile_bkey_field(const struct bkey_format *format, u8 *out,
-			      enum bch_bkey_fields field,
-			      unsigned dst_offset, unsigned dst_size,
-			      bool *eax_zeroed)
+/*
+ * Emit code to extract @field from the packed key pointed to by rsi into rax -
+ * clobbers rdx; the field must have a nonzero number of bits:
+ */
+static u8 *compile_bkey_field_load(const struct bkey_format *format, u8 *out,
+				   enum bch_bkey_fields field)
 {
 	unsigned bits = format->bits_per_field[field];
 	u64 offset = le64_to_cpu(format->field_offset[field]);
 	unsigned i, byte, bit_offset, align, shl, shr;
 
-	if (!bits && !offset) {
-		if (!*eax_zeroed) {
-			/* xor eax, eax */
-			I2(0x31, 0xc0);
-		}
-
-		*eax_zeroed = true;
-		goto set_field;
-	}
-
-	if (!bits) {
-		/* just return offset: */
-
-		switch (dst_size) {
-		case 8:
-			if (offset > S32_MAX) {
-				/* mov [rdi + dst_offset], offset */
-				I3(0xc7, 0x47, dst_offset);
-				memcpy(out, &offset, 4);
-				out += 4;
-
-				I3(0xc7, 0x47, dst_offset + 4);
-				memcpy(out, (void *) &offset + 4, 4);
-				out += 4;
-			} else {
-				/* mov [rdi + dst_offset], offset */
-				/* sign extended */
-				I4(0x48, 0xc7, 0x47, dst_offset);
-				memcpy(out, &offset, 4);
-				out += 4;
-			}
-			break;
-		case 4:
-			/* mov [rdi + dst_offset], offset */
-			I3(0xc7, 0x47, dst_offset);
-			memcpy(out, &offset, 4);
-			out += 4;
-			break;
-		default:
-			BUG();
-		}
-
-		return out;
-	}
-
 	bit_offset = format->key_u64s * 64;
 	for (i = 0; i <= field; i++)
 		bit_offset -= format->bits_per_field[i];
@@ -827,8 +965,6 @@ static u8 *compile_bkey_field(const struct bkey_format *format, u8 *out,
 	byte = bit_offset / 8;
 	bit_offset -= byte * 8;
 
-	*eax_zeroed = false;
-
 	if (bit_offset == 0 && bits == 8) {
 		/* movzx eax, BYTE PTR [rsi + imm8] */
 		I4(0x0f, 0xb6, 0x46, byte);
@@ -933,6 +1069,65 @@ static u8 *compile_bkey_field(const struct bkey_format *format, u8 *out,
 		memcpy(out, &offset, 4);
 		out += 4;
 	}
+
+	return out;
+}
+
+static u8 *compile_bkey_field(const struct bkey_format *format, u8 *out,
+			      enum bch_bkey_fields field,
+			      unsigned dst_offset, unsigned dst_size,
+			      bool *eax_zeroed)
+{
+	unsigned bits = format->bits_per_field[field];
+	u64 offset = le64_to_cpu(format->field_offset[field]);
+
+	if (!bits && !offset) {
+		if (!*eax_zeroed) {
+			/* xor eax, eax */
+			I2(0x31, 0xc0);
+		}
+
+		*eax_zeroed = true;
+		goto set_field;
+	}
+
+	if (!bits) {
+		/* just return offset: */
+
+		switch (dst_size) {
+		case 8:
+			if (offset > S32_MAX) {
+				/* mov [rdi + dst_offset], offset */
+				I3(0xc7, 0x47, dst_offset);
+				memcpy(out, &offset, 4);
+				out += 4;
+
+				I3(0xc7, 0x47, dst_offset + 4);
+				memcpy(out, (void *) &offset + 4, 4);
+				out += 4;
+			} else {
+				/* mov [rdi + dst_offset], offset */
+				/* sign extended */
+				I4(0x48, 0xc7, 0x47, dst_offset);
+				memcpy(out, &offset, 4);
+				out += 4;
+			}
+			break;
+		case 4:
+			/* mov [rdi + dst_offset], offset */
+			I3(0xc7, 0x47, dst_offset);
+			memcpy(out, &offset, 4);
+			out += 4;
+			break;
+		default:
+			BUG();
+		}
+
+		return out;
+	}
+
+	out = compile_bkey_field_load(format, out, field);
+	*eax_zeroed = false;
 set_field:
 	switch (dst_size) {
 	case 8:
@@ -988,6 +1183,158 @@ int bch2_compile_bkey_format(const struct bkey_format *format, void *_out)
 	return (void *) out - _out;
 }
 
+/*
+ * Tail shared by the compiled comparisons: turn the flags from an unsigned
+ * compare into -1, 0 or 1:
+ */
+static u8 *compile_cmp_result(u8 *out)
+{
+	/* seta al */
+	I3(0x0f, 0x97, 0xc0);
+	/* movzx eax, al */
+	I3(0x0f, 0xb6, 0xc0);
+	/* sbb eax, 0 */
+	I3(0x83, 0xd8, 0x00);
+	/* retq */
+	I1(0xc3);
+
+	return out;
+}
+
+static void patch_jumps(u8 **jumps, unsigned nr, u8 *target)
+{
+	while (nr--) {
+		BUG_ON(target - (jumps[nr] + 1) > S8_MAX);
+		*jumps[nr] = target - (jumps[nr] + 1);
+	}
+}
+
+/*
+ * Compile a comparison of two keys packed in @format - the same thing as
+ * __bkey_cmp_bits(), but with the number of words and the final shift known
+ * in advance:
+ */
+int bch2_compile_bkey_format_cmp(const struct bkey_format *format, void *_out)
+{
+	unsigned nr_key_bits = bkey_format_key_bits(format);
+	unsigned word = format->key_u64s - 1;
+	u8 *jumps[BKEY_U64s], **jump = jumps;
+	u8 *out = _out;
+
+	/*
+	 * rdi: l
+	 * rsi: r
+	 */
+
+	if (!nr_key_bits) {
+		/* xor eax, eax; retq */
+		I3(0x31, 0xc0, 0xc3);
+		return (void *) out - _out;
+	}
+
+	while (nr_key_bits) {
+		BUG_ON(word >= format->key_u64s);
+
+		/* mov rax, [rdi + word * 8] */
+		I4(0x48, 0x8b, 0x47, word * 8);
+
+		if (nr_key_bits >= 64) {
+			/* cmp rax, [rsi + word * 8] */
+			I4(0x48, 0x3b, 0x46, word * 8);
+			nr_key_bits -= 64;
+		} else {
+			/* mov rdx, [rsi + word * 8] */
+			I4(0x48, 0x8b, 0x56, word * 8);
+			/* shr rax, 64 - nr_key_bits */
+			I4(0x48, 0xc1, 0xe8, 64 - nr_key_bits);
+			/* shr rdx, 64 - nr_key_bits */
+			I4(0x48, 0xc1, 0xea, 64 - nr_key_bits);
+			/* cmp rax, rdx */
+			I3(0x48, 0x39, 0xd0);
+			nr_key_bits = 0;
+		}
+
+		if (nr_key_bits) {
+			/* jne result */
+			I2(0x75, 0);
+			*jump++ = out - 1;
+		}
+
+		word--;
+	}
+
+	patch_jumps(jumps, jump - jumps, out);
+	out = compile_cmp_result(out);
+
+	return (void *) out - _out;
+}
+
+/*
+ * Compile a comparison of a key packed in @format against an unpacked bpos -
+ * only extracts as many fields as it needs to, instead of unpacking the whole
+ * key first:
+ */
+int bch2_compile_bkey_format_cmp_left(const struct bkey_format *format,
+				      void *_out)
+{
+	static const struct {
+		enum bch_bkey_fields	field;
+		unsigned		offset;
+		unsigned		size;
+	} fields[] = {
+		{ BKEY_FIELD_INODE,	offsetof(struct bpos, inode),	 8 },
+		{ BKEY_FIELD_OFFSET,	offsetof(struct bpos, offset),	 8 },
+		{ BKEY_FIELD_SNAPSHOT,	offsetof(struct bpos, snapshot), 4 },
+	};
+	u8 *jumps[ARRAY_SIZE(fields)], **jump = jumps;
+	u8 *out = _out;
+	unsigned i;
+
+	/*
+	 * rdi: r - unpacked bpos
+	 * rsi: l - packed key
+	 *
+	 * (the packed key is in rsi, as for the unpack function, so that
+	 * compile_bkey_field_load() can be used)
+	 */
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		enum bch_bkey_fields field = fields[i].field;
+		u64 offset = le64_to_cpu(format->field_offset[field]);
+
+		if (format->bits_per_field[field]) {
+			out = compile_bkey_field_load(format, out, field);
+		} else if (offset) {
+			/* mov rax, imm64 */
+			I2(0x48, 0xb8);
+			memcpy(out, &offset, 8);
+			out += 8;
+		} else {
+			/* xor eax, eax */
+			I2(0x31, 0xc0);
+		}
+
+		if (fields[i].size == 8) {
+			/* cmp rax, [rdi + offset] */
+			I4(0x48, 0x3b, 0x47, fields[i].offset);
+		} else {
+			/* cmp eax, [rdi + offset] */
+			I3(0x3b, 0x47, fields[i].offset);
+		}
+
+		if (i + 1 < ARRAY_SIZE(fields)) {
+			/* jne result */
+			I2(0x75, 0);
+			*jump++ = out - 1;
+		}
+	}
+
+	patch_jumps(jumps, jump - jumps, out);
+	out = compile_cmp_result(out);
+
+	return (void *) out - _out;
+}
+
 #else
 static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
 				  unsigned nr_key_bits)
@@ -1036,9 +1383,14 @@ int __bch2_bkey_cmp_packed_format_checked(const struct bkey_packed *l,
 	EBUG_ON(!bkey_packed(l) || !bkey_packed(r));
 	EBUG_ON(b->nr_key_bits != bkey_format_key_bits(f));
 
-	ret = __bkey_cmp_bits(high_word(f, l),
-			      high_word(f, r),
-			      b->nr_key_bits);
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
+	if (likely(b->cmp_fn_len))
+		ret = btree_compiled_cmp_fn(b)(l, r);
+	else
+#endif
+		ret = __bkey_cmp_bits(high_word(f, l),
+				      high_word(f, r),
+				      b->nr_key_bits);
 
 	EBUG_ON(ret != bkey_cmp(bkey_unpack_pos(b, l),
 				bkey_unpack_pos(b, r)));
@@ -1050,7 +1402,15 @@ int __bch2_bkey_cmp_left_packed_format_checked(const struct btree *b,
 					       const struct bkey_packed *l,
 					       const struct bpos *r)
 {
-	return bkey_cmp(bkey_unpack_pos_format_checked(b, l), *r);
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
+	if (likely(b->cmp_left_fn_len)) {
+		int ret = btree_compiled_cmp_left_fn(b)(r, l);
+
+		EBUG_ON(ret != bkey_cmp(bkey_unpack_pos_format_checked(b, l), *r));
+		return ret;
+	}
+#endif
+	return bch2_bkey_shape_fns[b->format_shape].cmp_left(&b->format, l, r);
 }
 
 __pure __flatten
@@ -1118,6 +1478,390 @@ void bch2_bkey_swab_key(const struct bkey_format *_f, struct bkey_packed *k)
 }
 
 #ifdef CONFIG_BCACHEFS_DEBUG
+
+/*
+ * Checks the compiled and shape specialized unpack and comparison functions
+ * against the generic ones, on random keys in random formats:
+ */
+
+#define BKEY_PACK_TEST_FORMATS		1000
+#define BKEY_PACK_TEST_KEYS		100
+
+static const unsigned bkey_pack_test_field_bits[] = {
+#define x(id, field)	[id] = sizeof(((struct bkey *) NULL)->field) * 8,
+	bkey_fields()
+#undef x
+};
+
+static const struct {
+	unsigned		fields;
+	bool			one_word;
+} bkey_pack_test_shapes[] = {
+	[BKEY_FORMAT_SHAPE_generic]	= { ~0U, false },
+#define x(name, fields)							\
+	[BKEY_FORMAT_SHAPE_##name]	= { fields, false },		\
+	[BKEY_FORMAT_SHAPE_##name##_1w]	= { fields, true },
+	bkey_format_shapes()
+#undef x
+};
+
+/* xorshift64*: much cheaper than get_random_bytes() per value: */
+static u64 bkey_pack_test_rand(u64 *seed)
+{
+	*seed ^= *seed >> 12;
+	*seed ^= *seed << 25;
+	*seed ^= *seed >> 27;
+	return *seed * 2685821657736338717ULL;
+}
+
+static u64 bkey_pack_test_mask(unsigned bits)
+{
+	return bits < 64 ? ~(~0ULL << bits) : ~0ULL;
+}
+
+static void bkey_pack_test_format_done(struct bkey_format *f)
+{
+	unsigned i, bits = KEY_PACKED_BITS_START;
+	const char *err;
+
+	f->nr_fields = BKEY_NR_FIELDS;
+
+	for (i = 0; i < BKEY_NR_FIELDS; i++)
+		bits += f->bits_per_field[i];
+	f->key_u64s = DIV_ROUND_UP(bits, 64);
+
+	err = bch2_bkey_format_validate(f);
+	if (err)
+		panic("invalid test format: %s\n", err);
+}
+
+/*
+ * Random fields present, of random sizes and with random offsets - sometimes
+ * restricted to a shape, and sometimes small enough to fit in one word:
+ */
+static void bkey_pack_test_format_rand(struct bkey_format *f, u64 *seed)
+{
+	unsigned i, bits, budget = 64 - KEY_PACKED_BITS_START;
+	unsigned r = bkey_pack_test_rand(seed);
+	unsigned fields =
+		bkey_pack_test_shapes[r % ARRAY_SIZE(bkey_pack_test_shapes)].fields;
+	bool one_word = (r >> 8) % 3 == 0;
+	u64 offset, max_offset;
+
+	memset(f, 0, sizeof(*f));
+
+	for (i = 0; i < BKEY_NR_FIELDS; i++) {
+		unsigned field_bits = bkey_pack_test_field_bits[i];
+
+		r = bkey_pack_test_rand(seed);
+
+		bits = (fields & (1U << i)) && r % 4
+			? (r >> 8) % (field_bits + 1)
+			: 0;
+		if (one_word) {
+			bits = min(bits, budget);
+			budget -= bits;
+		}
+
+		max_offset = bkey_pack_test_mask(field_bits) -
+			bkey_pack_test_mask(bits);
+
+		offset = bkey_pack_test_rand(seed);
+		switch ((r >> 16) % 4) {
+		case 0:
+			offset = 0;
+			break;
+		case 1:
+			offset = min(offset >> (offset & 63), max_offset);
+			break;
+		case 2:
+			offset = max_offset;
+			break;
+		case 3:
+			offset = min((u64) S32_MAX + 1 + (offset & 0xffff),
+				     max_offset);
+			break;
+		}
+
+		set_format_field(f, i, bits, offset);
+	}
+
+	bkey_pack_test_format_done(f);
+}
+
+static void bkey_pack_test_set_field(struct bkey *k, unsigned nr, u64 v)
+{
+	switch (nr) {
+#define x(id, field)	case id: k->field = v; break;
+	bkey_fields()
+#undef x
+	default:
+		BUG();
+	}
+}
+
+/* a random value for field @nr that fits in @f, biased towards the ends: */
+static u64 bkey_pack_test_field_rand(const struct bkey_format *f,
+				     unsigned nr, u64 *seed)
+{
+	u64 mask = bkey_pack_test_mask(f->bits_per_field[nr]);
+	u64 r = bkey_pack_test_rand(seed);
+
+	switch (r & 3) {
+	case 0:
+		r = 0;
+		break;
+	case 1:
+		r = mask;
+		break;
+	default:
+		r = bkey_pack_test_rand(seed) & mask;
+		break;
+	}
+
+	return le64_to_cpu(f->field_offset[nr]) + r;
+}
+
+static void bkey_pack_test_key_rand(struct bkey *k,
+				    const struct bkey_format *f, u64 *seed)
+{
+	unsigned i;
+
+	memset(k, 0, sizeof(*k));
+	k->u64s		= BKEY_U64s;
+	k->format	= KEY_FORMAT_CURRENT;
+	k->needs_whiteout = bkey_pack_test_rand(seed) & 1;
+	k->type		= bkey_pack_test_rand(seed);
+
+	for (i = 0; i < BKEY_NR_FIELDS; i++)
+		bkey_pack_test_set_field(k, i,
+				bkey_pack_test_field_rand(f, i, seed));
+}
+
+/*
+ * Not bch2_bkey_pack_key(), which also refuses extents whose start doesn't
+ * pack - that doesn't matter here:
+ */
+static void bkey_pack_test_pack(struct bkey_packed *out, const struct bkey *in,
+				const struct bkey_format *f)
+{
+	struct pack_state state = pack_state_init(f, out);
+
+	out->_data[0] = 0;
+
+#define x(id, field)	BUG_ON(!set_inc_field(&state, id, in->field));
+	bkey_fields()
+#undef x
+
+	pack_state_finish(&state, out);
+	out->u64s	= f->key_u64s;
+	out->format	= KEY_FORMAT_LOCAL_BTREE;
+	out->needs_whiteout = in->needs_whiteout;
+	out->type	= in->type;
+}
+
+static void bkey_pack_test_fail(const struct bkey_format *f,
+				const struct bkey *l, const struct bkey *r,
+				const char *msg)
+{
+	unsigned i;
+
+	pr_err("bkey pack test: %s", msg);
+	pr_err("format: key_u64s %u", f->key_u64s);
+	for (i = 0; i < BKEY_NR_FIELDS; i++)
+		pr_err("  field %u: bits %u offset %llu", i,
+		       f->bits_per_field[i],
+		       le64_to_cpu(f->field_offset[i]));
+	pr_err("l: %llu:%llu:%u", l->p.inode, l->p.offset, l->p.snapshot);
+	pr_err("r: %llu:%llu:%u", r->p.inode, r->p.offset, r->p.snapshot);
+	panic("bkey pack test failed\n");
+}
+
+struct bkey_pack_test_compiled {
+	compiled_unpack_fn	unpack;
+	compiled_cmp_fn		cmp;
+	compiled_cmp_left_fn	cmp_left;
+};
+
+static void bkey_pack_test_keys(const struct bkey_format *f,
+				const struct bkey_packed *lp,
+				const struct bkey *l,
+				const struct bkey_packed *rp,
+				const struct bkey *r,
+				const struct bkey_pack_test_compiled *compiled,
+				u64 *seed)
+{
+	struct bkey u;
+	struct bpos q = l->p;
+	unsigned i, j, fields = 0;
+	u64 v = bkey_pack_test_rand(seed);
+	int cmp = bkey_cmp(l->p, r->p), q_cmp;
+
+	u = __bch2_bkey_unpack_key(f, lp);
+	if (memcmp(&u, l, sizeof(u)))
+		bkey_pack_test_fail(f, l, r, "__bch2_bkey_unpack_key()");
+
+	/* a position next to @l, that might not be representable in @f: */
+	switch (v % 3) {
+	case 0:
+		q.inode		+= v & 8 ? 1 : -1;
+		break;
+	case 1:
+		q.offset	+= v & 8 ? 1 : -1;
+		break;
+	case 2:
+		q.snapshot	+= v & 8 ? 1 : -1;
+		break;
+	}
+	q_cmp = bkey_cmp(l->p, q);
+
+	for (j = 0; j < BKEY_NR_FIELDS; j++)
+		if (f->bits_per_field[j])
+			fields |= 1U << j;
+
+	/* every shape specialized version that can handle @f: */
+	for (i = 0; i < ARRAY_SIZE(bkey_pack_test_shapes); i++) {
+		const struct bkey_shape_fns *fns = &bch2_bkey_shape_fns[i];
+
+		if ((fields & ~bkey_pack_test_shapes[i].fields) ||
+		    (bkey_pack_test_shapes[i].one_word && f->key_u64s != 1))
+			continue;
+
+		memset(&u, 0x55, sizeof(u));
+		fns->unpack_key(f, &u, lp);
+		if (memcmp(&u, l, sizeof(u)))
+			bkey_pack_test_fail(f, l, r, "shaped unpack_key()");
+
+		if (bkey_cmp(fns->unpack_pos(f, lp), l->p))
+			bkey_pack_test_fail(f, l, r, "shaped unpack_pos()");
+
+		if (fns->cmp_left(f, lp, &r->p) != cmp ||
+		    fns->cmp_left(f, lp, &l->p) ||
+		    fns->cmp_left(f, lp, &q) != q_cmp)
+			bkey_pack_test_fail(f, l, r, "shaped cmp_left()");
+	}
+
+	if (!compiled)
+		return;
+
+	memset(&u, 0x55, sizeof(u));
+	compiled->unpack(&u, lp);
+	if (memcmp(&u, l, sizeof(u)))
+		bkey_pack_test_fail(f, l, r, "compiled unpack");
+
+	if (compiled->cmp(lp, rp) != cmp ||
+	    compiled->cmp(rp, lp) != -cmp ||
+	    compiled->cmp(lp, lp))
+		bkey_pack_test_fail(f, l, r, "compiled cmp");
+
+	if (compiled->cmp_left(&r->p, lp) != cmp ||
+	    compiled->cmp_left(&l->p, lp) ||
+	    compiled->cmp_left(&q, lp) != q_cmp)
+		bkey_pack_test_fail(f, l, r, "compiled cmp_left");
+}
+
+static void bkey_pack_test_format(const struct bkey_format *f,
+				  void *exec, u64 *seed)
+{
+	/*
+	 * Unpacking may read the word past the end of a key (before it, on
+	 * little endian), as it may in a bset:
+	 */
+	u64 l_buf[2 + BKEY_U64s] = { 0 }, r_buf[2 + BKEY_U64s] = { 0 };
+	struct bkey_packed *lp = (void *) (l_buf + 1);
+	struct bkey_packed *rp = (void *) (r_buf + 1);
+	struct bkey_pack_test_compiled __maybe_unused _compiled;
+	struct bkey_pack_test_compiled *compiled = NULL;
+	struct bkey l, r;
+	unsigned i, field;
+
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
+	if (exec) {
+		int len = 0;
+
+		_compiled.unpack	= exec + len;
+		len += bch2_compile_bkey_format(f, exec + len);
+		_compiled.cmp		= exec + len;
+		len += bch2_compile_bkey_format_cmp(f, exec + len);
+		_compiled.cmp_left	= exec + len;
+		len += bch2_compile_bkey_format_cmp_left(f, exec + len);
+		BUG_ON(len > PAGE_SIZE);
+
+		compiled = &_compiled;
+	}
+#endif
+
+	for (i = 0; i < BKEY_PACK_TEST_KEYS; i++) {
+		bkey_pack_test_key_rand(&l, f, seed);
+		bkey_pack_test_key_rand(&r, f, seed);
+
+		/* keys that differ in only one pos field, or not at all: */
+		field = bkey_pack_test_rand(seed) % 5;
+		if (field <= BKEY_FIELD_SNAPSHOT) {
+			r.p = l.p;
+			bkey_pack_test_set_field(&r, field,
+				bkey_pack_test_field_rand(f, field, seed));
+		} else if (field == BKEY_FIELD_SNAPSHOT + 1) {
+			r.p = l.p;
+		}
+
+		bkey_pack_test_pack(lp, &l, f);
+		bkey_pack_test_pack(rp, &r, f);
+		bkey_pack_test_keys(f, lp, &l, rp, &r, compiled, seed);
+	}
+}
+
+static void bkey_pack_test_formats(void)
+{
+	static const struct {
+		u8		bits[BKEY_NR_FIELDS];
+		u64		offset[BKEY_NR_FIELDS];
+	} edge_formats[] = {
+		/* one word, filling it exactly: */
+		{ { 8, 24, 0, 8 } },
+		{ { 4, 8 }, { 1, 2 } },
+		/* no key bits at all: */
+		{ { 0 }, { 1, 2, 3, 4, 5, 6 } },
+		/* inode ends at the end of the first word, offset is a word: */
+		{ { 40, 64, 32 } },
+		/* offset straddles the first word boundary: */
+		{ { 20, 64, 32, 32, 32, 64 } },
+		{ { 39, 1, 1, 31, 0, 63 } },
+		/* offsets that don't fit in a sign extended imm32: */
+		{ { 0, 8, 0, 4, 0, 0 },
+		  { 1ULL << 40, S32_MAX + 1ULL, S32_MAX + 1ULL,
+		    U32_MAX - 15, U32_MAX, U64_MAX } },
+		{ { 12, 12, 4, 0, 0, 8 },
+		  { U64_MAX - 4095, S32_MAX + 1ULL, U32_MAX - 15,
+		    S32_MAX + 1ULL, 0, 1ULL << 63 } },
+	};
+	struct bkey_format f;
+	void *exec = NULL;
+	u64 seed = get_random_u64() ?: 1;
+	unsigned i, j;
+
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
+	/* if we can't get executable memory, just test the C versions: */
+	exec = __vmalloc(PAGE_SIZE, GFP_KERNEL, PAGE_KERNEL_EXEC);
+#endif
+
+	for (i = 0; i < ARRAY_SIZE(edge_formats); i++) {
+		memset(&f, 0, sizeof(f));
+		for (j = 0; j < BKEY_NR_FIELDS; j++)
+			set_format_field(&f, j, edge_formats[i].bits[j],
+					 edge_formats[i].offset[j]);
+		bkey_pack_test_format_done(&f);
+		bkey_pack_test_format(&f, exec, &seed);
+	}
+
+	for (i = 0; i < BKEY_PACK_TEST_FORMATS; i++) {
+		bkey_pack_test_format_rand(&f, &seed);
+		bkey_pack_test_format(&f, exec, &seed);
+	}
+
+	vfree(exec);
+}
+
 void bch2_bkey_pack_test(void)
 {
 	struct bkey t = KEY(4134ULL, 1250629070527416633ULL, 0);
@@ -1156,5 +1900,7 @@ void bch2_bkey_pack_test(void)
 	}
 
 	BUG_ON(!bch2_bkey_pack_key(&p, &t, &test_format));
+
+	bkey_pack_test_formats();
 }
 #endif
@@ -338,11 +338,50 @@ bool bch2_bkey_transform(const struct bkey_format *,
 
 struct bkey __bch2_bkey_unpack_key(const struct bkey_format *,
 				   const struct bkey_packed *);
-
-#ifndef HAVE_BCACHEFS_COMPILED_UNPACK
 struct bpos __bkey_unpack_pos(const struct bkey_format *,
 			      const struct bkey_packed *);
-#endif
+
+/*
+ * Key formats are computed per node, but in practice only a few shapes occur -
+ * which fields have any bits at all depends mostly on the btree. When we can't
+ * generate code at runtime, we pick a C unpack function specialized for the
+ * smallest shape that covers the format, with the absent fields folded away:
+ */
+#define bkey_format_shapes()						\
+	x(inode,		(1U << BKEY_FIELD_INODE))		\
+	x(inode_offset,		(1U << BKEY_FIELD_INODE)|		\
+				(1U << BKEY_FIELD_OFFSET))		\
+	x(extent,		(1U << BKEY_FIELD_INODE)|		\
+				(1U << BKEY_FIELD_OFFSET)|		\
+				(1U << BKEY_FIELD_SIZE))		\
+	x(extent_version,	(1U << BKEY_FIELD_INODE)|		\
+				(1U << BKEY_FIELD_OFFSET)|		\
+				(1U << BKEY_FIELD_SIZE)|		\
+				(1U << BKEY_FIELD_VERSION_LO))
+
+/* _1w: the key fits in a single word, so fields never straddle words */
+enum bkey_format_shape {
+	BKEY_FORMAT_SHAPE_generic,
+#define x(name, fields)							\
+	BKEY_FORMAT_SHAPE_##name,					\
+	BKEY_FORMAT_SHAPE_##name##_1w,
+	bkey_format_shapes()
+#undef x
+};
+
+struct bkey_shape_fns {
+	void		(*unpack_key)(const struct bkey_format *, struct bkey *,
+				      const struct bkey_packed *);
+	struct bpos	(*unpack_pos)(const struct bkey_format *,
+				      const struct bkey_packed *);
+	int		(*cmp_left)(const struct bkey_format *,
+				    const struct bkey_packed *,
+				    const struct bpos *);
+};
+
+extern const struct bkey_shape_fns bch2_bkey_shape_fns[];
+
+enum bkey_format_shape bch2_bkey_format_shape(const struct bkey_format *);
 
 bool bch2_bkey_pack_key(struct bkey_packed *, const struct bkey *,
 		   const struct bkey_format *);
@@ -379,11 +418,17 @@ static inline u64 bkey_field_max(const struct bkey_format *f,
 #ifdef HAVE_BCACHEFS_COMPILED_UNPACK
 
 int bch2_compile_bkey_format(const struct bkey_format *, void *);
+int bch2_compile_bkey_format_cmp(const struct bkey_format *, void *);
+int bch2_compile_bkey_format_cmp_left(const struct bkey_format *, void *);
 
 #else
 
 static inline int bch2_compile_bkey_format(const struct bkey_format *format,
 					  void *out) { return 0; }
+static inline int bch2_compile_bkey_format_cmp(const struct bkey_format *format,
+					      void *out) { return 0; }
+static inline int bch2_compile_bkey_format_cmp_left(const struct bkey_format *format,
+						   void *out) { return 0; }
 
 #endif
 
@@ -367,7 +367,7 @@ static unsigned bset_aux_tree_buf_start(const struct btree *b,
 					const struct bset_tree *t)
 {
 	return t == b->set
-		? DIV_ROUND_UP(b->unpack_fn_len, 8)
+		? DIV_ROUND_UP(btree_compiled_fns_bytes(b), 8)
 		: bset_aux_tree_buf_end(t - 1);
 }
 
@@ -427,6 +427,11 @@ static void bset_aux_tree_verify(struct btree *b)
 
 /* Memory allocation */
 
+size_t bch2_btree_aux_data_bytes(unsigned page_order)
+{
+	return (PAGE_SIZE << page_order) / BSET_CACHELINE * 8;
+}
+
 void bch2_btree_keys_free(struct btree *b)
 {
 	vfree(b->aux_data);
@@ -440,8 +445,20 @@ void bch2_btree_keys_free(struct btree *b)
 int bch2_btree_keys_alloc(struct btree *b, unsigned page_order, gfp_t gfp)
 {
 	b->page_order	= page_order;
+	b->aux_data	= NULL;
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
 	b->aux_data	= __vmalloc(btree_aux_data_bytes(b), gfp,
 				    PAGE_KERNEL_EXEC);
+#endif
+	b->aux_data_exec = b->aux_data != NULL;
+
+	/*
+	 * Executable memory may be disallowed (W^X) - then we don't compile
+	 * unpack functions, and use the shape specialized ones instead:
+	 */
+	if (!b->aux_data)
+		b->aux_data = __vmalloc(btree_aux_data_bytes(b), gfp,
+					PAGE_KERNEL);
 	if (!b->aux_data)
 		return -ENOMEM;
 
@@ -1452,6 +1469,22 @@ static struct bkey_packed *bch2_bset_search(struct btree *b,
 	return m;
 }
 
+#ifdef CONFIG_BCACHEFS_TESTS
+/*
+ * bch2_bset_search() is always inlined into its callers - an out of line copy,
+ * so that it can be benchmarked on its own:
+ */
+noinline
+struct bkey_packed *__bch2_bset_search(struct btree *b, struct bset_tree *t,
+				struct bpos *search,
+				struct bkey_packed *packed_search,
+				const struct bkey_packed *lossy_packed_search)
+{
+	return bch2_bset_search(b, t, search, packed_search,
+				lossy_packed_search);
+}
+#endif
+
 /* Btree node iterator */
 
 static inline void __bch2_btree_node_iter_push(struct btree_node_iter *iter,
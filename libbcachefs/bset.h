@@ -185,6 +185,27 @@ static inline enum bset_aux_tree_type bset_aux_tree_type(const struct bset_tree
 }
 
 typedef void (*compiled_unpack_fn)(struct bkey *, const struct bkey_packed *);
+typedef int (*compiled_cmp_fn)(const struct bkey_packed *,
+			       const struct bkey_packed *);
+/* note the argument order - the packed key is passed second: */
+typedef int (*compiled_cmp_left_fn)(const struct bpos *,
+				    const struct bkey_packed *);
+
+static inline unsigned btree_compiled_fns_bytes(const struct btree *b)
+{
+	return b->unpack_fn_len + b->cmp_fn_len + b->cmp_left_fn_len;
+}
+
+static inline compiled_cmp_fn btree_compiled_cmp_fn(const struct btree *b)
+{
+	return b->aux_data + b->unpack_fn_len;
+}
+
+static inline compiled_cmp_left_fn
+btree_compiled_cmp_left_fn(const struct btree *b)
+{
+	return b->aux_data + b->unpack_fn_len + b->cmp_fn_len;
+}
 
 static inline void
 __bkey_unpack_key_format_checked(const struct btree *b,
@@ -192,25 +213,25 @@ __bkey_unpack_key_format_checked(const struct btree *b,
 			       const struct bkey_packed *src)
 {
 #ifdef HAVE_BCACHEFS_COMPILED_UNPACK
-	{
+	if (likely(b->unpack_fn_len)) {
 		compiled_unpack_fn unpack_fn = b->aux_data;
 		unpack_fn(dst, src);
+	} else
+#endif
+		bch2_bkey_shape_fns[b->format_shape].unpack_key(&b->format,
+								dst, src);
 
-		if (btree_keys_expensive_checks(b)) {
-			struct bkey dst2 = __bch2_bkey_unpack_key(&b->format, src);
+	if (btree_keys_expensive_checks(b)) {
+		struct bkey dst2 = __bch2_bkey_unpack_key(&b->format, src);
 
-			/*
-			 * hack around a harmless race when compacting whiteouts
-			 * for a write:
-			 */
-			dst2.needs_whiteout = dst->needs_whiteout;
+		/*
+		 * hack around a harmless race when compacting whiteouts
+		 * for a write:
+		 */
+		dst2.needs_whiteout = dst->needs_whiteout;
 
-			BUG_ON(memcmp(dst, &dst2, sizeof(*dst)));
-		}
+		BUG_ON(memcmp(dst, &dst2, sizeof(*dst)));
 	}
-#else
-	*dst = __bch2_bkey_unpack_key(&b->format, src);
-#endif
 }
 
 static inline struct bkey
@@ -249,10 +270,10 @@ bkey_unpack_pos_format_checked(const struct btree *b,
 			       const struct bkey_packed *src)
 {
 #ifdef HAVE_BCACHEFS_COMPILED_UNPACK
-	return bkey_unpack_key_format_checked(b, src).p;
-#else
-	return __bkey_unpack_pos(&b->format, src);
+	if (likely(b->unpack_fn_len))
+		return bkey_unpack_key_format_checked(b, src).p;
 #endif
+	return bch2_bkey_shape_fns[b->format_shape].unpack_pos(&b->format, src);
 }
 
 static inline struct bpos bkey_unpack_pos(const struct btree *b,
@@ -316,12 +337,33 @@ static inline void btree_node_set_format(struct btree *b,
 
 	b->format	= f;
 	b->nr_key_bits	= bkey_format_key_bits(&f);
+	b->format_shape	= bch2_bkey_format_shape(&f);
+
+	if (!b->aux_data_exec) {
+		b->unpack_fn_len	= 0;
+		b->cmp_fn_len		= 0;
+		b->cmp_left_fn_len	= 0;
+		goto out;
+	}
 
 	len = bch2_compile_bkey_format(&b->format, b->aux_data);
 	BUG_ON(len < 0 || len > U8_MAX);
 
 	b->unpack_fn_len = len;
 
+	len = bch2_compile_bkey_format_cmp(&b->format,
+					   b->aux_data + b->unpack_fn_len);
+	BUG_ON(len < 0 || len > U8_MAX);
+
+	b->cmp_fn_len = len;
+
+	len = bch2_compile_bkey_format_cmp_left(&b->format,
+					b->aux_data + b->unpack_fn_len +
+					b->cmp_fn_len);
+	BUG_ON(len < 0 || len > U8_MAX);
+
+	b->cmp_left_fn_len = len;
+out:
 	bch2_bset_set_no_aux_tree(b, b->set);
 }
 
@@ -335,6 +377,7 @@ static inline struct bset *bset_next_set(struct btree *b,
 	return ((void *) i) + round_up(vstruct_bytes(i), block_bytes);
 }
 
+size_t bch2_btree_aux_data_bytes(unsigned);
 void bch2_btree_keys_free(struct btree *);
 int bch2_btree_keys_alloc(struct btree *, unsigned, gfp_t);
 void bch2_btree_keys_init(struct btree *, bool *);
@@ -370,6 +413,12 @@ static inline int bkey_cmp_p_or_unp(const struct btree *b,
 
 struct bset_tree *bch2_bkey_to_bset(struct btree *, struct bkey_packed *);
 
+#ifdef CONFIG_BCACHEFS_TESTS
+struct bkey_packed *__bch2_bset_search(struct btree *, struct bset_tree *,
+				       struct bpos *, struct bkey_packed *,
+				       const struct bkey_packed *);
+#endif
+
 struct bkey_packed *bch2_bkey_prev_filter(struct btree *, struct bset_tree *,
 					  struct bkey_packed *, unsigned);
 
@@ -8,6 +8,7 @@
 #include "debug.h"
 
 #include <linux/prefetch.h>
+#include <linux/set_memory.h>
 #include <linux/sched/mm.h>
 #include <trace/events/bcachefs.h>
 
@@ -38,22 +39,285 @@ static inline unsigned btree_cache_can_free(struct btree_cache *bc)
 	return max_t(int, 0, bc->used - bc->reserve);
 }
 
-static void __btree_node_data_free(struct bch_fs *c, struct btree *b)
+/*
+ * Btree node arena:
+ *
+ * Node buffers and their auxiliary search trees are allocated in node sized
+ * slots carved out of huge pages, instead of one by one: with tens of
+ * thousands of nodes cached, that's much kinder to the TLB (and the heap).
+ *
+ * New slots come from the fullest huge page that has a free slot, so that as
+ * the shrinker frees nodes whole huge pages become empty, and can be given
+ * back by bch2_btree_arena_trim(). Chunks are kept on lists by how many free
+ * slots they have, so finding that chunk doesn't mean looking at all of them.
+ * If we can't get a huge page, we fall back to allocating buffers
+ * individually.
+ */
+
+static void bch2_btree_arena_init(struct btree_arena *a, size_t slot_size,
+				  bool exec)
+{
+	unsigned i;
+
+	mutex_init(&a->lock);
+	a->slot_size	= slot_size;
+	a->nr_slots	= slot_size >= PAGE_SIZE ? HPAGE_PMD_SIZE / slot_size : 0;
+	a->exec		= exec;
+
+	for (i = 0; i < ARRAY_SIZE(a->by_nr_free); i++)
+		INIT_LIST_HEAD(&a->by_nr_free[i]);
+}
+
+static void btree_arena_chunk_list_add(struct btree_arena *a,
+				       struct btree_arena_chunk *chunk)
+{
+	list_add(&chunk->list, &a->by_nr_free[chunk->nr_free]);
+	__set_bit(chunk->nr_free, a->nr_free_used);
+}
+
+static void btree_arena_chunk_list_del(struct btree_arena *a,
+				       struct btree_arena_chunk *chunk)
+{
+	list_del(&chunk->list);
+	if (list_empty(&a->by_nr_free[chunk->nr_free]))
+		__clear_bit(chunk->nr_free, a->nr_free_used);
+}
+
+/* returns the index of the first chunk starting after @p: */
+static size_t btree_arena_chunk_idx(struct btree_arena *a, const void *p)
+{
+	size_t l = 0, r = a->nr;
+
+	while (l < r) {
+		size_t m = l + (r - l) / 2;
+
+		if (a->chunks[m]->mem <= p)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+static struct btree_arena_chunk *btree_arena_chunk_find(struct btree_arena *a,
+							 const void *p)
+{
+	size_t idx = btree_arena_chunk_idx(a, p);
+	struct btree_arena_chunk *chunk = idx ? a->chunks[idx - 1] : NULL;
+
+	return chunk && p < chunk->mem + HPAGE_PMD_SIZE ? chunk : NULL;
+}
+
+static struct btree_arena_chunk *btree_arena_chunk_alloc(struct btree_arena *a,
+							  gfp_t gfp)
+{
+	struct btree_arena_chunk *chunk;
+	size_t idx;
+
+	if (a->nr == a->size) {
+		size_t new_size = max_t(size_t, 8, a->size * 2);
+		struct btree_arena_chunk **chunks =
+			krealloc(a->chunks, new_size * sizeof(chunks[0]), gfp);
+
+		if (!chunks)
+			return NULL;
+
+		a->chunks	= chunks;
+		a->size		= new_size;
+	}
+
+	chunk = kzalloc(sizeof(*chunk), gfp);
+	if (!chunk)
+		return NULL;
+
+	chunk->mem = (void *) __get_free_pages(gfp|__GFP_COMP|__GFP_NOWARN,
+					       HPAGE_PMD_ORDER);
+	if (!chunk->mem)
+		goto err;
+
+	/*
+	 * If we can't make it executable, don't keep trying: nodes allocated
+	 * from this and later chunks just won't get compiled unpack functions,
+	 * but chunks that are already executable stay usable as such:
+	 */
+	if (a->exec) {
+		chunk->exec = !set_memory_x((unsigned long) chunk->mem,
+					    HPAGE_PMD_NR);
+		a->exec = chunk->exec;
+	}
+
+	chunk->nr_free = a->nr_slots;
+	bitmap_fill(chunk->free_map, a->nr_slots);
+	btree_arena_chunk_list_add(a, chunk);
+
+	idx = btree_arena_chunk_idx(a, chunk->mem);
+	memmove(&a->chunks[idx + 1],
+		&a->chunks[idx],
+		(a->nr - idx) * sizeof(a->chunks[0]));
+	a->chunks[idx] = chunk;
+	a->nr++;
+
+	return chunk;
+err:
+	kfree(chunk);
+	return NULL;
+}
+
+/* @exec, if not NULL, is set to whether the slot is in executable memory: */
+static void *bch2_btree_arena_alloc(struct btree_arena *a, gfp_t gfp,
+				    bool *exec)
+{
+	struct btree_arena_chunk *chunk;
+	unsigned nr_free, slot;
+
+	if (!a->nr_slots)
+		return NULL;
+
+	/* callers that can't block have somewhere else to get memory: */
+	if (gfp & __GFP_DIRECT_RECLAIM)
+		mutex_lock(&a->lock);
+	else if (!mutex_trylock(&a->lock))
+		return NULL;
+
+	/* the fullest chunk that has a free slot: */
+	nr_free = find_next_bit(a->nr_free_used, a->nr_slots + 1, 1);
+	chunk = nr_free <= a->nr_slots
+		? list_first_entry(&a->by_nr_free[nr_free],
+				   struct btree_arena_chunk, list)
+		: btree_arena_chunk_alloc(a, gfp);
+	if (!chunk) {
+		mutex_unlock(&a->lock);
+		return NULL;
+	}
+
+	slot = find_first_bit(chunk->free_map, a->nr_slots);
+	BUG_ON(slot >= a->nr_slots);
+
+	__clear_bit(slot, chunk->free_map);
+	btree_arena_chunk_list_del(a, chunk);
+	chunk->nr_free--;
+	btree_arena_chunk_list_add(a, chunk);
+	mutex_unlock(&a->lock);
+
+	if (exec)
+		*exec = chunk->exec;
+	return chunk->mem + slot * a->slot_size;
+}
+
+/* returns false if @p wasn't allocated from @a: */
+static bool bch2_btree_arena_free(struct btree_arena *a, void *p)
+{
+	struct btree_arena_chunk *chunk;
+	unsigned slot;
+
+	if (!p || !a->nr)
+		return false;
+
+	mutex_lock(&a->lock);
+	chunk = btree_arena_chunk_find(a, p);
+	if (!chunk) {
+		mutex_unlock(&a->lock);
+		return false;
+	}
+
+	slot = (p - chunk->mem) / a->slot_size;
+	BUG_ON(test_bit(slot, chunk->free_map));
+
+	__set_bit(slot, chunk->free_map);
+	btree_arena_chunk_list_del(a, chunk);
+	chunk->nr_free++;
+	btree_arena_chunk_list_add(a, chunk);
+	mutex_unlock(&a->lock);
+	return true;
+}
+
+/* Frees huge pages with no slots in use, returns number of pages freed: */
+static unsigned long bch2_btree_arena_trim(struct btree_arena *a)
+{
+	unsigned long freed = 0;
+	size_t i, j = 0;
+
+	mutex_lock(&a->lock);
+	for (i = 0; i < a->nr; i++) {
+		struct btree_arena_chunk *chunk = a->chunks[i];
+
+		if (chunk->nr_free == a->nr_slots) {
+			btree_arena_chunk_list_del(a, chunk);
+			free_pages((unsigned long) chunk->mem, HPAGE_PMD_ORDER);
+			kfree(chunk);
+			freed += HPAGE_PMD_NR;
+		} else {
+			a->chunks[j++] = chunk;
+		}
+	}
+	a->nr = j;
+	mutex_unlock(&a->lock);
+
+	return freed;
+}
+
+static void bch2_btree_arena_exit(struct btree_arena *a)
+{
+	bch2_btree_arena_trim(a);
+	BUG_ON(a->nr);
+
+	kfree(a->chunks);
+	a->chunks	= NULL;
+	a->size		= 0;
+}
+
+/*
+ * Node buffers may be swapped with bounce buffers when sorting (see
+ * btree_io.c), so bounce buffers come from the arena too:
+ */
+void *bch2_btree_node_buf_alloc(struct bch_fs *c, gfp_t gfp)
 {
+	return bch2_btree_arena_alloc(&c->btree_cache.data_arena, gfp, NULL);
+}
+
+bool bch2_btree_node_buf_free(struct bch_fs *c, void *p)
+{
+	return bch2_btree_arena_free(&c->btree_cache.data_arena, p);
+}
+
+/*
+ * Returns number of pages freed - memory that goes back to the arena isn't
+ * freed until bch2_btree_arena_trim():
+ */
+static unsigned long __btree_node_data_free(struct bch_fs *c, struct btree *b)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	unsigned long freed = 0;
+
 	EBUG_ON(btree_node_write_in_flight(b));
 
-	kvpfree(b->data, btree_bytes(c));
+	if (!bch2_btree_node_buf_free(c, b->data)) {
+		kvpfree(b->data, btree_bytes(c));
+		freed += btree_pages(c);
+	}
 	b->data = NULL;
-	bch2_btree_keys_free(b);
+
+	if (bch2_btree_arena_free(&bc->aux_arena, b->aux_data)) {
+		b->aux_data = NULL;
+	} else {
+		if (b->aux_data)
+			freed += bch2_btree_aux_data_bytes(b->page_order) >>
+				PAGE_SHIFT;
+		bch2_btree_keys_free(b);
+	}
+
+	return freed;
 }
 
-static void btree_node_data_free(struct bch_fs *c, struct btree *b)
+static unsigned long btree_node_data_free(struct bch_fs *c, struct btree *b)
 {
 	struct btree_cache *bc = &c->btree_cache;
+	unsigned long freed = __btree_node_data_free(c, b);
 
-	__btree_node_data_free(c, b);
 	bc->used--;
 	list_move(&b->list, &bc->freed);
+	return freed;
 }
 
 static int bch2_btree_cache_cmp_fn(struct rhashtable_compare_arg *arg,
@@ -76,18 +340,24 @@ static void btree_node_data_alloc(struct bch_fs *c, struct btree *b, gfp_t gfp)
 {
 	struct btree_cache *bc = &c->btree_cache;
 
-	b->data = kvpmalloc(btree_bytes(c), gfp);
+	b->data = bch2_btree_node_buf_alloc(c, gfp) ?:
+		kvpmalloc(btree_bytes(c), gfp);
 	if (!b->data)
 		goto err;
 
-	if (bch2_btree_keys_alloc(b, btree_page_order(c), gfp))
+	b->page_order	= btree_page_order(c);
+	b->aux_data	= bch2_btree_arena_alloc(&bc->aux_arena, gfp,
+						 &b->aux_data_exec);
+	if (!b->aux_data &&
+	    bch2_btree_keys_alloc(b, btree_page_order(c), gfp))
 		goto err;
 
 	bc->used++;
 	list_move(&b->list, &bc->freeable);
 	return;
 err:
-	kvpfree(b->data, btree_bytes(c));
+	if (!bch2_btree_node_buf_free(c, b->data))
+		kvpfree(b->data, btree_bytes(c));
 	b->data = NULL;
 	list_move(&b->list, &bc->freed);
 }
@@ -131,6 +401,13 @@ int bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b,
 	b->level	= level;
 	b->btree_id	= id;
 
+	/*
+	 * Every lookup goes through the root and interior nodes, and they're
+	 * only rarely write locked: give them per cpu reader counts. Nodes
+	 * being hashed are always held for write:
+	 */
+	six_lock_pcpu_readers(&b->lock, level > 0);
+
 	mutex_lock(&bc->lock);
 	ret = __bch2_btree_node_hash_insert(bc, b);
 	if (!ret)
@@ -231,6 +508,7 @@ static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 	unsigned long can_free;
 	unsigned long touched = 0;
 	unsigned long freed = 0;
+	unsigned long pages_freed = 0;
 	unsigned i;
 
 	if (btree_shrinker_disabled(c))
@@ -262,7 +540,7 @@ static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 
 		if (++i > 3 &&
 		    !btree_node_reclaim(c, b)) {
-			btree_node_data_free(c, b);
+			pages_freed += btree_node_data_free(c, b);
 			six_unlock_write(&b->lock);
 			six_unlock_intent(&b->lock);
 			freed++;
@@ -286,7 +564,7 @@ restart:
 			if (&t->list != &bc->live)
 				list_move_tail(&bc->live, &t->list);
 
-			btree_node_data_free(c, b);
+			pages_freed += btree_node_data_free(c, b);
 			mutex_unlock(&bc->lock);
 
 			bch2_btree_node_hash_remove(bc, b);
@@ -307,7 +585,14 @@ restart:
 
 	mutex_unlock(&bc->lock);
 out:
-	return (unsigned long) freed * btree_pages(c);
+	/*
+	 * Nodes freed to the arena only give memory back once every node in a
+	 * huge page has been freed - only count what was actually given back:
+	 */
+	pages_freed += bch2_btree_arena_trim(&bc->data_arena);
+	pages_freed += bch2_btree_arena_trim(&bc->aux_arena);
+
+	return pages_freed;
 }
 
 static unsigned long bch2_btree_cache_count(struct shrinker *shrink,
@@ -363,11 +648,15 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 	while (!list_empty(&bc->freed)) {
 		b = list_first_entry(&bc->freed, struct btree, list);
 		list_del(&b->list);
+		six_lock_exit(&b->lock);
 		kfree(b);
 	}
 
 	mutex_unlock(&bc->lock);
 
+	bch2_btree_arena_exit(&bc->data_arena);
+	bch2_btree_arena_exit(&bc->aux_arena);
+
 	if (bc->table_init_done)
 		rhashtable_destroy(&bc->table);
 }
@@ -386,6 +675,17 @@ int bch2_fs_btree_cache_init(struct bch_fs *c)
 
 	bc->table_init_done = true;
 
+	bch2_btree_arena_init(&bc->data_arena, btree_bytes(c), false);
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
+	bch2_btree_arena_init(&bc->aux_arena,
+			      bch2_btree_aux_data_bytes(btree_page_order(c)),
+			      true);
+#else
+	bch2_btree_arena_init(&bc->aux_arena,
+			      bch2_btree_aux_data_bytes(btree_page_order(c)),
+			      false);
+#endif
+
 	bch2_recalc_btree_reserve(c);
 
 	for (i = 0; i < bc->reserve; i++)
@@ -734,7 +1034,7 @@ retry:
 			if (bch2_btree_node_relock(iter, level + 1))
 				goto retry;
 
-			trace_trans_restart_btree_node_reused(iter->trans->ip);
+			trace_and_count_restart(iter->trans, btree_node_reused);
 			return ERR_PTR(-EINTR);
 		}
 	}
@@ -869,6 +1169,21 @@ out:
 	return ret;
 }
 
+/*
+ * Look up a node without an iterator and without locking it: the caller must
+ * lock it and then check PTR_HASH() to see if it's still the node for @k:
+ */
+struct btree *bch2_btree_node_find(struct bch_fs *c, const struct bkey_i *k)
+{
+	struct btree *b;
+
+	rcu_read_lock();
+	b = btree_cache_find(&c->btree_cache, k);
+	rcu_read_unlock();
+
+	return b;
+}
+
 void bch2_btree_node_prefetch(struct bch_fs *c, struct btree_iter *iter,
 			      const struct bkey_i *k, unsigned level)
 {
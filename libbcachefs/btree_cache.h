@@ -11,6 +11,9 @@ extern const char * const bch2_btree_ids[];
 
 void bch2_recalc_btree_reserve(struct bch_fs *);
 
+void *bch2_btree_node_buf_alloc(struct bch_fs *, gfp_t);
+bool bch2_btree_node_buf_free(struct bch_fs *, void *);
+
 void bch2_btree_node_hash_remove(struct btree_cache *, struct btree *);
 int __bch2_btree_node_hash_insert(struct btree_cache *, struct btree *);
 int bch2_btree_node_hash_insert(struct btree_cache *, struct btree *,
@@ -28,6 +31,8 @@ struct btree *bch2_btree_node_get(struct bch_fs *, struct btree_iter *,
 struct btree *bch2_btree_node_get_sibling(struct bch_fs *, struct btree_iter *,
 				struct btree *, enum btree_node_sibling);
 
+struct btree *bch2_btree_node_find(struct bch_fs *, const struct bkey_i *);
+
 void bch2_btree_node_prefetch(struct bch_fs *, struct btree_iter *,
 			      const struct bkey_i *, unsigned);
 
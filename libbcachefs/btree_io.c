@@ -59,6 +59,9 @@ static void set_needs_whiteout(struct bset *i)
 static void btree_bounce_free(struct bch_fs *c, unsigned order,
 			      bool used_mempool, void *p)
 {
+	if (bch2_btree_node_buf_free(c, p))
+		return;
+
 	if (used_mempool)
 		mempool_free(p, &c->btree_bounce_pool);
 	else
@@ -73,6 +76,11 @@ static void *btree_bounce_alloc(struct bch_fs *c, unsigned order,
 	BUG_ON(order > btree_page_order(c));
 
 	*used_mempool = false;
+
+	if (order == btree_page_order(c) &&
+	    (p = bch2_btree_node_buf_alloc(c, __GFP_NOWARN|GFP_NOWAIT)))
+		return p;
+
 	p = (void *) __get_free_pages(__GFP_NOWARN|GFP_NOWAIT, order);
 	if (p)
 		return p;
@@ -1344,7 +1352,13 @@ void __bch2_btree_node_write(struct bch_fs *c, struct btree *b,
 	} while (cmpxchg_acquire(&b->flags, old, new) != old);
 
 	BUG_ON(btree_node_fake(b));
-	BUG_ON((b->will_make_reachable != 0) != !b->written);
+	BUG_ON(b->written && b->will_make_reachable);
+	/*
+	 * New nodes are normally made reachable by a btree_update; bulk loaded
+	 * nodes aren't reachable until the bulk load sets the new root:
+	 */
+	BUG_ON(!b->written && !b->will_make_reachable &&
+	       !btree_node_bulk_load(b));
 
 	BUG_ON(b->written >= c->opts.btree_node_size);
 	BUG_ON(b->written & (c->opts.block_size - 1));
@@ -99,11 +99,11 @@ void __bch2_btree_node_lock_write(struct btree *b, struct btree_iter *iter)
 	 * goes to 0, and it's safe because we have the node intent
 	 * locked:
 	 */
-	atomic64_sub(__SIX_VAL(read_lock, readers),
-		     &b->lock.state.counter);
-	btree_node_lock_type(iter->trans->c, b, SIX_LOCK_write);
-	atomic64_add(__SIX_VAL(read_lock, readers),
-		     &b->lock.state.counter);
+	six_lock_readers_add(&b->lock, -readers);
+	if (!six_trylock_write(&b->lock))
+		bch2_trans_profile_lock_wait(iter->trans, b->level, SIX_LOCK_write,
+			__btree_node_lock_type(iter->trans->c, b, SIX_LOCK_write));
+	six_lock_readers_add(&b->lock, readers);
 }
 
 bool __bch2_btree_node_relock(struct btree_iter *iter, unsigned level)
@@ -172,7 +172,8 @@ static inline bool btree_iter_get_locks(struct btree_iter *iter,
 		if (!(upgrade
 		      ? bch2_btree_node_upgrade(iter, l)
 		      : bch2_btree_node_relock(iter, l))) {
-			if (trace)
+			if (trace) {
+				bch2_trans_profile_lock_fail(iter->trans, l, upgrade);
 				(upgrade
 				 ? trace_node_upgrade_fail
 				 : trace_node_relock_fail)(l, iter->l[l].lock_seq,
@@ -182,6 +183,7 @@ static inline bool btree_iter_get_locks(struct btree_iter *iter,
 						is_btree_node(iter, l)
 						? iter->l[l].b->lock.state.seq
 						: 0);
+			}
 
 			fail_idx = l;
 			btree_iter_set_dirty(iter, BTREE_ITER_NEED_TRAVERSE);
@@ -269,11 +271,12 @@ bool __bch2_btree_node_lock(struct btree *b, struct bpos pos,
 	}
 
 	if (unlikely(!ret)) {
-		trace_trans_restart_would_deadlock(iter->trans->ip);
+		trace_and_count_restart(iter->trans, would_deadlock);
 		return false;
 	}
 
-	__btree_node_lock_type(iter->trans->c, b, type);
+	bch2_trans_profile_lock_wait(iter->trans, level, type,
+			__btree_node_lock_type(iter->trans->c, b, type));
 	return true;
 }
 
@@ -899,15 +902,18 @@ static void btree_iter_prefetch(struct btree_iter *iter)
 	struct btree_iter_level *l = &iter->l[iter->level];
 	struct btree_node_iter node_iter = l->iter;
 	struct bkey_packed *k;
+	struct blk_plug plug;
 	BKEY_PADDED(k) tmp;
 	unsigned nr = test_bit(BCH_FS_STARTED, &c->flags)
 		? (iter->level > 1 ? 0 :  2)
 		: (iter->level > 1 ? 1 : 16);
 	bool was_locked = btree_node_locked(iter, iter->level);
 
+	blk_start_plug(&plug);
+
 	while (nr) {
 		if (!bch2_btree_node_relock(iter, iter->level))
-			return;
+			goto out;
 
 		bch2_btree_node_iter_advance(&node_iter, l->b);
 		k = bch2_btree_node_iter_peek(&node_iter, l->b);
@@ -920,6 +926,8 @@ static void btree_iter_prefetch(struct btree_iter *iter)
 
 	if (!was_locked)
 		btree_node_unlock(iter, iter->level);
+out:
+	blk_finish_plug(&plug);
 }
 
 static inline int btree_iter_down(struct btree_iter *iter)
@@ -1713,7 +1721,7 @@ success:
 	trans->size	= new_size;
 
 	if (trans->iters_live) {
-		trace_trans_restart_iters_realloced(trans->ip, trans->size);
+		trace_and_count_restart(trans, iters_realloced, trans->size);
 		return -EINTR;
 	}
 
@@ -1872,7 +1880,7 @@ static int bch2_trans_preload_mem(struct btree_trans *trans, size_t size)
 		trans->mem_bytes = new_bytes;
 
 		if (old_bytes) {
-			trace_trans_restart_mem_realloced(trans->ip, new_bytes);
+			trace_and_count_restart(trans, mem_realloced, new_bytes);
 			return -EINTR;
 		}
 	}
@@ -1938,6 +1946,24 @@ void bch2_trans_begin(struct btree_trans *trans)
 	bch2_btree_iter_traverse_all(trans);
 }
 
+const char * const bch2_trans_restart_reasons[] = {
+#define x(name) #name,
+	BCH_TRANS_RESTARTS()
+#undef x
+	NULL
+};
+
+void bch2_trans_restarts_read(struct bch_fs *c, u64 *restarts)
+{
+	unsigned cpu, i;
+
+	memset(restarts, 0, sizeof(u64) * BCH_TRANS_RESTART_NR);
+
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < BCH_TRANS_RESTART_NR; i++)
+			restarts[i] += per_cpu_ptr(c->pcpu, cpu)->trans_restarts[i];
+}
+
 void bch2_trans_init(struct btree_trans *trans, struct bch_fs *c,
 		     unsigned expected_nr_iters,
 		     size_t expected_mem_bytes)
@@ -4,6 +4,7 @@
 
 #include "bset.h"
 #include "btree_types.h"
+#include "trans_profile.h"
 
 static inline void btree_iter_set_dirty(struct btree_iter *iter,
 					enum btree_iter_uptodate u)
@@ -300,6 +301,21 @@ static inline void bch2_trans_begin_updates(struct btree_trans *trans)
 }
 
 void *bch2_trans_kmalloc(struct btree_trans *, size_t);
+
+/*
+ * Count a transaction restart (in c->pcpu, see bch2_trans_restarts_read(), and
+ * against the transaction's callsite - see trans_profile.h) and fire the
+ * corresponding tracepoint:
+ */
+#define trace_and_count_restart(_trans, _reason, ...)			\
+do {									\
+	bch2_trans_profile_restart(_trans, BCH_TRANS_RESTART_##_reason);\
+	trace_trans_restart_##_reason((_trans)->ip, ##__VA_ARGS__);	\
+} while (0)
+
+extern const char * const bch2_trans_restart_reasons[];
+void bch2_trans_restarts_read(struct bch_fs *, u64 *);
+
 void bch2_trans_init(struct btree_trans *, struct bch_fs *, unsigned, size_t);
 int bch2_trans_exit(struct btree_trans *);
 
@@ -136,15 +136,17 @@ static inline enum bch_time_stats lock_to_time_stat(enum six_lock_type type)
 }
 
 /*
- * wrapper around six locks that just traces lock contended time
+ * wrapper around six locks that just traces lock contended time - returns when
+ * we started waiting, for bch2_trans_profile_lock_wait():
  */
-static inline void __btree_node_lock_type(struct bch_fs *c, struct btree *b,
-					  enum six_lock_type type)
+static inline u64 __btree_node_lock_type(struct bch_fs *c, struct btree *b,
+					 enum six_lock_type type)
 {
 	u64 start_time = local_clock();
 
 	six_lock_type(&b->lock, type);
 	bch2_time_stats_update(&c->times[lock_to_time_stat(type)], start_time);
+	return start_time;
 }
 
 static inline void btree_node_lock_type(struct bch_fs *c, struct btree *b,
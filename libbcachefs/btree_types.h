@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_BTREE_TYPES_H
 #define _BCACHEFS_BTREE_TYPES_H
 
+#include <linux/huge_mm.h>
 #include <linux/list.h>
 #include <linux/rhashtable.h>
 #include <linux/six.h>
@@ -97,6 +98,13 @@ struct btree {
 	u16			uncompacted_whiteout_u64s;
 	u8			page_order;
 	u8			unpack_fn_len;
+	/* compiled comparisons, in aux_data after the unpack function: */
+	u8			cmp_fn_len;
+	u8			cmp_left_fn_len;
+	/* enum bkey_format_shape, for when we didn't compile: */
+	u8			format_shape;
+	/* false if we couldn't get executable memory for aux_data: */
+	bool			aux_data_exec;
 
 	/*
 	 * XXX: add a delete sequence number, so when bch2_btree_node_relock()
@@ -136,6 +144,37 @@ struct btree {
 #endif
 };
 
+/*
+ * Btree node buffers are allocated from huge pages, several nodes per page, to
+ * cut TLB misses and heap fragmentation - see btree_cache.c:
+ */
+struct btree_arena_chunk {
+	struct list_head	list;
+	void			*mem;
+	unsigned		nr_free;
+	/* set_memory_x() succeeded on this chunk: */
+	bool			exec;
+	/* set bits are free slots: */
+	unsigned long		free_map[BITS_TO_LONGS(HPAGE_PMD_NR)];
+};
+
+struct btree_arena {
+	struct mutex		lock;
+	size_t			slot_size;
+	unsigned		nr_slots;
+	bool			exec;
+	/*
+	 * Chunks on lists by number of free slots, and which lists are
+	 * nonempty - so finding the fullest chunk with a free slot is cheap:
+	 */
+	struct list_head	by_nr_free[HPAGE_PMD_NR + 1];
+	unsigned long		nr_free_used[BITS_TO_LONGS(HPAGE_PMD_NR + 1)];
+	/* sorted by address: */
+	size_t			nr;
+	size_t			size;
+	struct btree_arena_chunk **chunks;
+};
+
 struct btree_cache {
 	struct rhashtable	table;
 	bool			table_init_done;
@@ -170,6 +209,10 @@ struct btree_cache {
 	 */
 	struct task_struct	*alloc_lock;
 	struct closure_waitlist	alloc_wait;
+
+	/* for node buffers, and their auxiliary search trees: */
+	struct btree_arena	data_arena;
+	struct btree_arena	aux_arena;
 };
 
 struct btree_node_iter {
@@ -328,6 +371,7 @@ enum btree_flags {
 	BTREE_NODE_just_written,
 	BTREE_NODE_dying,
 	BTREE_NODE_fake,
+	BTREE_NODE_bulk_load,
 };
 
 BTREE_FLAG(read_in_flight);
@@ -341,6 +385,7 @@ BTREE_FLAG(write_in_flight);
 BTREE_FLAG(just_written);
 BTREE_FLAG(dying);
 BTREE_FLAG(fake);
+BTREE_FLAG(bulk_load);
 
 static inline struct btree_write *btree_current_write(struct btree *b)
 {
@@ -493,6 +538,8 @@ struct btree_root {
 	u8			level;
 	u8			alive;
 	s8			error;
+	/* claimed by bch2_btree_bulk_load_start(): */
+	u8			bulk_load;
 };
 
 /*
@@ -7,6 +7,7 @@
 
 struct bch_fs;
 struct btree;
+struct keylist;
 
 void bch2_btree_node_lock_for_insert(struct bch_fs *, struct btree *,
 				     struct btree_iter *);
@@ -108,6 +109,8 @@ int bch2_btree_delete_at(struct btree_trans *, struct btree_iter *, unsigned);
 
 int bch2_btree_insert(struct bch_fs *, enum btree_id, struct bkey_i *,
 		     struct disk_reservation *, u64 *, int flags);
+int bch2_btree_insert_list(struct bch_fs *, enum btree_id, struct keylist *,
+			   struct disk_reservation *, u64 *, int flags);
 
 int bch2_btree_delete_at_range(struct btree_trans *, struct btree_iter *,
 			       struct bpos, u64 *);
@@ -1593,7 +1593,7 @@ int bch2_btree_split_leaf(struct bch_fs *c, struct btree_iter *iter,
 	 * instead of locking/reserving all the way to the root:
 	 */
 	if (!bch2_btree_iter_upgrade(iter, U8_MAX)) {
-		trace_trans_restart_iter_upgrade(trans->ip);
+		trace_and_count_restart(trans, iter_upgrade);
 		ret = -EINTR;
 		goto out;
 	}
@@ -2131,6 +2131,520 @@ err_free_update:
 	goto err;
 }
 
+/* Bulk loading: */
+
+/*
+ * Nodes are filled to the same size a compacted node is allowed to be before
+ * btree_split() would split it, so that the first insert into a bulk loaded
+ * node doesn't immediately cause a split:
+ */
+static unsigned bulk_load_target_u64s(struct bch_fs *c)
+{
+	return ((BTREE_SPLIT_THRESHOLD(c) << (c->block_bits + 9)) -
+		sizeof(struct btree_node)) / sizeof(u64);
+}
+
+static struct btree *bulk_load_node_alloc(struct btree_bulk_load *bl,
+					  unsigned level)
+{
+	struct bch_fs *c = bl->c;
+	struct btree_reserve *reserve;
+	struct btree *b;
+	struct closure cl;
+
+	if (bl->reserve && !bl->reserve->nr) {
+		bch2_btree_reserve_put(c, bl->reserve);
+		bl->reserve = NULL;
+	}
+
+	if (!bl->reserve) {
+		closure_init_stack(&cl);
+
+		do {
+			reserve = bch2_btree_reserve_get(c, BTREE_RESERVE_MAX,
+							 bl->flags, &cl);
+			closure_sync(&cl);
+		} while (PTR_ERR_OR_ZERO(reserve) == -EAGAIN);
+
+		if (IS_ERR(reserve))
+			return ERR_CAST(reserve);
+
+		bl->reserve = reserve;
+	}
+
+	b = bl->reserve->b[--bl->reserve->nr];
+
+	BUG_ON(bch2_btree_node_hash_insert(&c->btree_cache, b, level, bl->btree_id));
+
+	set_btree_node_accessed(b);
+	set_btree_node_dirty(b);
+	set_btree_node_need_write(b);
+	set_btree_node_bulk_load(b);
+
+	bch2_bset_init_first(b, &b->data->keys);
+	memset(&b->nr, 0, sizeof(b->nr));
+	b->data->magic = cpu_to_le64(bset_magic(c));
+	b->data->flags = 0;
+	SET_BTREE_NODE_ID(b->data, bl->btree_id);
+	SET_BTREE_NODE_LEVEL(b->data, level);
+	b->data->ptr = bkey_i_to_btree_ptr(&b->key)->v.start[0];
+
+	trace_btree_node_alloc(c, b);
+	return b;
+}
+
+static void bulk_load_level_reset(struct btree_bulk_load_level *l)
+{
+	bch2_keylist_init(&l->keys, l->buf);
+	bch2_bkey_format_init(&l->format);
+	bch2_bkey_format_add_pos(&l->format, l->min_key);
+	l->nr_keys	= 0;
+	l->val_u64s	= 0;
+}
+
+static bool bulk_load_marks_keys(struct btree_bulk_load *bl, unsigned level)
+{
+	return !level && btree_node_type_needs_gc(bl->btree_id) &&
+		!(bl->flags & BTREE_INSERT_NOMARK);
+}
+
+/*
+ * Leaf keys are accounted for here, when they're written out, instead of by
+ * transactional triggers - the same as BTREE_INSERT_MARK_INMEM:
+ */
+static void bulk_load_mark_keys(struct btree_bulk_load *bl,
+				struct keylist *keys)
+{
+	struct bch_fs *c = bl->c;
+	struct bch_fs_usage *fs_usage;
+	struct bkey_i *k;
+	bool gc = gc_visited(c, gc_pos_btree_root(bl->btree_id));
+
+	percpu_down_read(&c->mark_lock);
+	fs_usage = bch2_fs_usage_scratch_get(c);
+
+	for_each_keylist_key(keys, k) {
+		bch2_mark_key_locked(c, bkey_i_to_s_c(k), k->k.size,
+				     fs_usage, 0, BCH_BUCKET_MARK_INSERT);
+		if (gc)
+			bch2_mark_key_locked(c, bkey_i_to_s_c(k), k->k.size,
+					     NULL, 0,
+					     BCH_BUCKET_MARK_INSERT|
+					     BCH_BUCKET_MARK_GC);
+	}
+
+	bch2_fs_usage_apply(c, fs_usage, bl->disk_res, 0);
+
+	bch2_fs_usage_scratch_put(c, fs_usage);
+	percpu_up_read(&c->mark_lock);
+}
+
+static void bulk_load_mark_node(struct btree_bulk_load *bl, struct btree *b)
+{
+	struct bch_fs *c = bl->c;
+	struct bch_fs_usage *fs_usage;
+
+	percpu_down_read(&c->mark_lock);
+	fs_usage = bch2_fs_usage_scratch_get(c);
+
+	bch2_mark_key_locked(c, bkey_i_to_s_c(&b->key),
+			     0, fs_usage, 0,
+			     BCH_BUCKET_MARK_INSERT);
+	if (gc_visited(c, gc_pos_btree_root(bl->btree_id)))
+		bch2_mark_key_locked(c, bkey_i_to_s_c(&b->key),
+				     0, NULL, 0,
+				     BCH_BUCKET_MARK_INSERT|
+				     BCH_BUCKET_MARK_GC);
+
+	bch2_fs_usage_apply(c, fs_usage, &bl->reserve->disk_res, 0);
+
+	bch2_fs_usage_scratch_put(c, fs_usage);
+	percpu_up_read(&c->mark_lock);
+}
+
+/*
+ * Write out the keys buffered at @level as a new node, packed with the best
+ * format for exactly those keys - returns the new node, still intent locked:
+ */
+static struct btree *bulk_load_write_node(struct btree_bulk_load *bl,
+					  unsigned level, bool last)
+{
+	struct bch_fs *c = bl->c;
+	struct btree_bulk_load_level *l = &bl->l[level];
+	struct btree *b;
+	struct bset *i;
+	struct bkey_packed *out;
+	struct bkey_i *k;
+	bool mark_keys = bulk_load_marks_keys(bl, level);
+	int ret;
+
+	/*
+	 * Everything that can fail happens before the node is allocated, so
+	 * that every node in @bl->nodes is fully accounted for:
+	 */
+	if (mark_keys)
+		for_each_keylist_key(&l->keys, k) {
+			ret = bch2_mark_bkey_replicas(c, bkey_i_to_s_c(k));
+			if (ret)
+				return ERR_PTR(ret);
+		}
+
+	ret = bch2_keylist_realloc(&bl->nodes, NULL, 0,
+				   BKEY_BTREE_PTR_U64s_MAX);
+	if (ret)
+		return ERR_PTR(ret);
+
+	b = bulk_load_node_alloc(bl, level);
+	if (IS_ERR(b))
+		return b;
+
+	b->data->min_key	= l->min_key;
+	b->data->max_key	= last ? POS_MAX : l->max_key;
+	b->data->format		= bch2_bkey_format_done(&l->format);
+	b->key.k.p		= b->data->max_key;
+
+	btree_node_set_format(b, b->data->format);
+
+	i = btree_bset_first(b);
+	i->journal_seq = cpu_to_le64(journal_cur_seq(&c->journal));
+
+	out = i->start;
+	for_each_keylist_key(&l->keys, k) {
+		if (!bch2_bkey_pack(out, k, &b->format))
+			bkey_copy((struct bkey_i *) out, k);
+
+		btree_keys_account_key_add(&b->nr, 0, out);
+		out = bkey_next(out);
+	}
+
+	i->u64s = cpu_to_le16((u64 *) out - i->_data);
+	set_btree_bset_end(b, b->set);
+	BUG_ON(b->nr.live_u64s > btree_max_u64s(c));
+
+	btree_node_reset_sib_u64s(b);
+	bch2_btree_build_aux_trees(b);
+
+	bch2_keylist_add(&bl->nodes, &b->key);
+
+	if (mark_keys)
+		bulk_load_mark_keys(bl, &l->keys);
+	bulk_load_mark_node(bl, b);
+
+	six_unlock_write(&b->lock);
+
+	bch2_btree_node_write(c, b, SIX_LOCK_intent);
+	clear_btree_node_bulk_load(b);
+
+	bch2_open_buckets_put(c, &b->ob);
+
+	l->nr_nodes++;
+	bl->nr_nodes++;
+
+	if (!last) {
+		l->min_key = btree_type_successor(bl->btree_id, l->max_key);
+		bulk_load_level_reset(l);
+	}
+
+	return b;
+}
+
+static int bulk_load_push(struct btree_bulk_load *bl, unsigned level,
+			  struct bkey_i *k)
+{
+	struct btree_bulk_load_level *l = &bl->l[level];
+	struct bkey_format_state s, tmp;
+	struct bkey_format f;
+	struct btree *b;
+	int ret;
+
+	if (level >= BTREE_MAX_DEPTH)
+		return -ENOSPC;
+
+	if (!l->buf) {
+		/* enough for a full node of keys that pack to a single u64: */
+		l->buf_u64s	= bl->target_u64s * BKEY_U64s;
+		l->buf		= kvpmalloc(l->buf_u64s * sizeof(u64), GFP_KERNEL);
+		if (!l->buf)
+			return -ENOMEM;
+
+		l->min_key	= POS_MIN;
+		bulk_load_level_reset(l);
+	}
+
+	s = l->format;
+	bch2_bkey_format_add_key(&s, &k->k);
+
+	tmp = s;
+	f = bch2_bkey_format_done(&tmp);
+
+	if (l->nr_keys &&
+	    ((l->nr_keys + 1) * f.key_u64s + l->val_u64s +
+	     bkey_val_u64s(&k->k) > bl->target_u64s ||
+	     bch_keylist_u64s(&l->keys) + k->k.u64s > l->buf_u64s)) {
+		b = bulk_load_write_node(bl, level, false);
+		if (IS_ERR(b))
+			return PTR_ERR(b);
+
+		ret = bulk_load_push(bl, level + 1, &b->key);
+		six_unlock_intent(&b->lock);
+		if (ret)
+			return ret;
+
+		s = l->format;
+		bch2_bkey_format_add_key(&s, &k->k);
+	}
+
+	l->format	= s;
+	l->nr_keys++;
+	l->val_u64s	+= bkey_val_u64s(&k->k);
+	l->max_key	= k->k.p;
+	bch2_keylist_add(&l->keys, k);
+	return 0;
+}
+
+/**
+ * bch2_btree_bulk_load_add - add the next key to a bulk load
+ *
+ * Keys must be added in sorted order, and mustn't overlap; they're buffered
+ * until there's enough for a full node, so @k may be reused after this returns.
+ */
+int bch2_btree_bulk_load_add(struct btree_bulk_load *bl, struct bkey_i *k)
+{
+	if (bkey_deleted(&k->k) ||
+	    bkey_cmp(bkey_start_pos(&k->k), bl->pos) < 0)
+		return -EINVAL;
+
+	bl->pos = btree_type_successor(bl->btree_id, k->k.p);
+
+	return bulk_load_push(bl, 0, k);
+}
+
+static void bulk_load_set_root(struct btree_bulk_load *bl, struct btree *b)
+{
+	struct bch_fs *c = bl->c;
+	struct btree *old = btree_node_root(c, b);
+
+	trace_btree_set_root(c, b);
+
+	btree_node_lock_type(c, old, SIX_LOCK_intent);
+	btree_node_lock_type(c, old, SIX_LOCK_write);
+	set_btree_node_dying(old);
+
+	__bch2_btree_set_root_inmem(c, b);
+	bch2_btree_set_root_ondisk(c, b, WRITE);
+
+	__btree_node_free(c, old);
+	six_unlock_write(&old->lock);
+	six_unlock_intent(&old->lock);
+
+	bl->done = true;
+}
+
+/**
+ * bch2_btree_bulk_load_finish - write out the rest of a bulk load
+ *
+ * Flushes partially filled nodes at every level, waits for all the new nodes
+ * to be written and then points the btree root at the new tree, with a single
+ * journal write - that's the only part of a bulk load that goes through the
+ * journal.
+ */
+int bch2_btree_bulk_load_finish(struct btree_bulk_load *bl)
+{
+	struct bch_fs *c = bl->c;
+	struct btree *b;
+	unsigned level;
+	int ret = 0;
+
+	if (!bl->l[0].nr_keys)
+		goto out;
+
+	for (level = 0;; level++) {
+		/* the first node at a level that's written last is the root: */
+		bool root = !bl->l[level].nr_nodes;
+
+		b = bulk_load_write_node(bl, level, true);
+		if (IS_ERR(b)) {
+			ret = PTR_ERR(b);
+			goto out;
+		}
+
+		if (root)
+			break;
+
+		ret = bulk_load_push(bl, level + 1, &b->key);
+		six_unlock_intent(&b->lock);
+		if (ret)
+			goto out;
+	}
+
+	bch2_btree_flush_all_writes(c);
+
+	/* a failed btree node write halts the journal: */
+	ret = bch2_journal_error(&c->journal);
+	if (!ret)
+		bulk_load_set_root(bl, b);
+	six_unlock_intent(&b->lock);
+
+	if (!ret)
+		ret = bch2_journal_meta(&c->journal);
+out:
+	bch2_btree_bulk_load_exit(bl);
+	return ret;
+}
+
+static void bulk_load_unmark_keys(struct btree_bulk_load *bl,
+				  struct btree *b, bool gc)
+{
+	struct bch_fs *c = bl->c;
+	struct btree_node_iter iter;
+	struct bkey unpacked;
+	struct bkey_s_c k;
+
+	percpu_down_read(&c->mark_lock);
+
+	for_each_btree_node_key_unpack(b, k, &iter, &unpacked) {
+		bch2_mark_key_locked(c, k, -((s64) k.k->size),
+				     NULL, 0, BCH_BUCKET_MARK_OVERWRITE);
+		if (gc)
+			bch2_mark_key_locked(c, k, -((s64) k.k->size),
+					     NULL, 0,
+					     BCH_BUCKET_MARK_OVERWRITE|
+					     BCH_BUCKET_MARK_GC);
+	}
+
+	percpu_up_read(&c->mark_lock);
+}
+
+/*
+ * A bulk load that failed before setting the new root leaves behind nodes that
+ * nothing points to: undo their accounting, and that of the keys in the leaves,
+ * and drop them from the btree node cache.
+ *
+ * Leaves the shrinker has already evicted can't be read back without an
+ * iterator, so the accounting for the keys in them stays until fsck:
+ */
+static void bulk_load_free_nodes(struct btree_bulk_load *bl)
+{
+	struct bch_fs *c = bl->c;
+	bool mark_keys = bulk_load_marks_keys(bl, 0);
+	bool gc = gc_visited(c, gc_pos_btree_root(bl->btree_id));
+	unsigned nr_evicted = 0;
+	struct bkey_i *k;
+	struct btree *b;
+
+	/* nodes we wrote may still be in flight: */
+	bch2_btree_flush_all_writes(c);
+
+	for_each_keylist_key(&bl->nodes, k) {
+		bch2_mark_key(c, bkey_i_to_s_c(k), 0, NULL, 0,
+			      BCH_BUCKET_MARK_OVERWRITE);
+		if (gc)
+			bch2_mark_key(c, bkey_i_to_s_c(k), 0, NULL, 0,
+				      BCH_BUCKET_MARK_OVERWRITE|
+				      BCH_BUCKET_MARK_GC);
+
+		b = bch2_btree_node_find(c, k);
+		if (b) {
+			six_lock_intent(&b->lock);
+			if (PTR_HASH(&b->key) != PTR_HASH(k)) {
+				six_unlock_intent(&b->lock);
+				b = NULL;
+			}
+		}
+
+		if (!b) {
+			nr_evicted++;
+			continue;
+		}
+
+		if (!b->level && mark_keys)
+			bulk_load_unmark_keys(bl, b, gc);
+
+		btree_node_lock_type(c, b, SIX_LOCK_write);
+		/* a failed write isn't retried, and nothing will read it: */
+		clear_btree_node_dirty(b);
+		clear_btree_node_need_write(b);
+		__btree_node_free(c, b);
+		six_unlock_write(&b->lock);
+		six_unlock_intent(&b->lock);
+	}
+
+	if (nr_evicted && mark_keys)
+		bch_err(c, "bulk load of btree %s failed after %u nodes were evicted, run fsck to fix accounting",
+			bch2_btree_ids[bl->btree_id], nr_evicted);
+}
+
+void bch2_btree_bulk_load_exit(struct btree_bulk_load *bl)
+{
+	struct bch_fs *c = bl->c;
+	unsigned i;
+
+	if (!c)
+		return;
+
+	if (!bl->done)
+		bulk_load_free_nodes(bl);
+	bch2_keylist_free(&bl->nodes, NULL);
+
+	if (bl->reserve)
+		bch2_btree_reserve_put(c, bl->reserve);
+	bl->reserve = NULL;
+
+	for (i = 0; i < BTREE_MAX_DEPTH; i++) {
+		kvpfree(bl->l[i].buf, bl->l[i].buf_u64s * sizeof(u64));
+		bl->l[i].buf = NULL;
+	}
+
+	mutex_lock(&c->btree_root_lock);
+	c->btree_roots[bl->btree_id].bulk_load = false;
+	mutex_unlock(&c->btree_root_lock);
+	bl->c = NULL;
+}
+
+/**
+ * bch2_btree_bulk_load_start - start building btree @id from sorted keys
+ *
+ * Only valid on a btree that's never been written to (i.e. still has the fake
+ * root from bch2_btree_root_alloc()): returns -EEXIST if it has been, and
+ * -EBUSY if another bulk load already claimed it. Other than that, the caller
+ * must guarantee nothing else uses the btree until bch2_btree_bulk_load_finish()
+ * returns.
+ *
+ * If the bulk load fails, the nodes written so far are freed; see
+ * bulk_load_free_nodes() for when that needs fsck to fix up accounting.
+ */
+int bch2_btree_bulk_load_start(struct btree_bulk_load *bl, struct bch_fs *c,
+			       enum btree_id id,
+			       struct disk_reservation *disk_res,
+			       unsigned flags)
+{
+	struct btree_root *r = &c->btree_roots[id];
+	int ret = 0;
+
+	memset(bl, 0, sizeof(*bl));
+
+	mutex_lock(&c->btree_root_lock);
+	if (!btree_node_fake(r->b))
+		ret = -EEXIST;
+	else if (r->bulk_load)
+		ret = -EBUSY;
+	else
+		r->bulk_load = true;
+	mutex_unlock(&c->btree_root_lock);
+
+	if (ret)
+		return ret;
+
+	bl->c		= c;
+	bl->btree_id	= id;
+	bl->flags	= flags;
+	bl->disk_res	= disk_res;
+	bl->pos		= POS_MIN;
+	bl->target_u64s	= bulk_load_target_u64s(c);
+	bch2_keylist_init(&bl->nodes, NULL);
+	return 0;
+}
+
 /* Init code: */
 
 /*
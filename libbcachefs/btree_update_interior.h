@@ -187,6 +187,53 @@ static inline void bch2_foreground_maybe_merge(struct bch_fs *c,
 void bch2_btree_set_root_for_read(struct bch_fs *, struct btree *);
 void bch2_btree_root_alloc(struct bch_fs *, enum btree_id);
 
+/*
+ * Bulk loading - building an entire btree bottom up from a sorted stream of
+ * keys, for when the btree is empty and we have exclusive access to it:
+ */
+
+struct btree_bulk_load_level {
+	/* unpacked keys for the node currently being filled: */
+	struct keylist			keys;
+	u64				*buf;
+	size_t				buf_u64s;
+
+	struct bkey_format_state	format;
+	unsigned			nr_keys;
+	unsigned			val_u64s;
+	unsigned			nr_nodes;
+
+	struct bpos			min_key;
+	struct bpos			max_key;
+};
+
+struct btree_bulk_load {
+	struct bch_fs			*c;
+	enum btree_id			btree_id;
+	unsigned			flags;
+	struct disk_reservation		*disk_res;
+	struct btree_reserve		*reserve;
+
+	/* keys must be added in order, starting at or after @pos: */
+	struct bpos			pos;
+	unsigned			target_u64s;
+	u64				nr_nodes;
+	/* new root has been set, nothing to undo: */
+	bool				done;
+
+	/* keys of every node written, to free them if we fail: */
+	struct keylist			nodes;
+
+	struct btree_bulk_load_level	l[BTREE_MAX_DEPTH];
+};
+
+int bch2_btree_bulk_load_start(struct btree_bulk_load *, struct bch_fs *,
+			       enum btree_id, struct disk_reservation *,
+			       unsigned);
+int bch2_btree_bulk_load_add(struct btree_bulk_load *, struct bkey_i *);
+int bch2_btree_bulk_load_finish(struct btree_bulk_load *);
+void bch2_btree_bulk_load_exit(struct btree_bulk_load *);
+
 static inline unsigned btree_update_reserve_required(struct bch_fs *c,
 						     struct btree *b)
 {
@@ -439,7 +439,7 @@ static int bch2_trans_journal_preres_get(struct btree_trans *trans)
 		return ret;
 
 	if (!bch2_trans_relock(trans)) {
-		trace_trans_restart_journal_preres_get(trans->ip);
+		trace_and_count_restart(trans, journal_preres_get);
 		return -EINTR;
 	}
 
@@ -508,6 +508,24 @@ static int btree_trans_check_can_insert(struct btree_trans *trans,
 	return 0;
 }
 
+/*
+ * The journal_seq_verify and inject_invalid_keys debug options overwrite the
+ * version of every key inserted; needs the journal reservation:
+ */
+static inline void btree_insert_key_debug_version(struct btree_trans *trans,
+						  struct bkey_i *k)
+{
+	struct bch_fs *c = trans->c;
+
+	if (trans->flags & BTREE_INSERT_JOURNAL_REPLAY)
+		return;
+
+	if (journal_seq_verify(c))
+		k->k.version.lo = trans->journal_res.seq;
+	else if (inject_invalid_keys(c))
+		k->k.version = MAX_VERSION;
+}
+
 static inline void do_btree_insert_one(struct btree_trans *trans,
 				       struct btree_insert_entry *insert)
 {
@@ -517,12 +535,18 @@ static inline void do_btree_insert_one(struct btree_trans *trans,
 		btree_insert_key_deferred(trans, insert);
 }
 
+static inline bool btree_triggers_transactional(enum btree_id id,
+						unsigned flags)
+{
+	return likely(!(flags & BTREE_INSERT_MARK_INMEM)) &&
+		(id == BTREE_ID_EXTENTS ||
+		 id == BTREE_ID_INODES);
+}
+
 static inline bool update_triggers_transactional(struct btree_trans *trans,
 						 struct btree_insert_entry *i)
 {
-	return likely(!(trans->flags & BTREE_INSERT_MARK_INMEM)) &&
-		(i->iter->btree_id == BTREE_ID_EXTENTS ||
-		 i->iter->btree_id == BTREE_ID_INODES);
+	return btree_triggers_transactional(i->iter->btree_id, trans->flags);
 }
 
 static inline bool update_has_triggers(struct btree_trans *trans,
@@ -568,7 +592,7 @@ static inline int do_btree_insert_at(struct btree_trans *trans,
 			    update_triggers_transactional(trans, i)) {
 				ret = bch2_trans_mark_update(trans, i->iter, i->k);
 				if (ret == -EINTR)
-					trace_trans_restart_mark(trans->ip);
+					trace_and_count_restart(trans, mark);
 				if (ret)
 					goto out_clear_replicas;
 			}
@@ -579,7 +603,7 @@ static inline int do_btree_insert_at(struct btree_trans *trans,
 
 	if (race_fault()) {
 		ret = -EINTR;
-		trace_trans_restart_fault_inject(trans->ip);
+		trace_and_count_restart(trans, fault_inject);
 		goto out;
 	}
 
@@ -624,14 +648,8 @@ static inline int do_btree_insert_at(struct btree_trans *trans,
 			goto out;
 	}
 
-	if (!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)) {
-		if (journal_seq_verify(c))
-			trans_for_each_update(trans, i)
-				i->k->k.version.lo = trans->journal_res.seq;
-		else if (inject_invalid_keys(c))
-			trans_for_each_update(trans, i)
-				i->k->k.version = MAX_VERSION;
-	}
+	trans_for_each_update(trans, i)
+		btree_insert_key_debug_version(trans, i->k);
 
 	trans_for_each_update_iter(trans, i)
 		if (update_has_triggers(trans, i) &&
@@ -735,7 +753,7 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		if (!ret ||
 		    ret == -EINTR ||
 		    (flags & BTREE_INSERT_NOUNLOCK)) {
-			trace_trans_restart_btree_node_split(trans->ip);
+			trace_and_count_restart(trans, btree_node_split);
 			ret = -EINTR;
 		}
 		break;
@@ -754,7 +772,7 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		if (bch2_trans_relock(trans))
 			return 0;
 
-		trace_trans_restart_mark_replicas(trans->ip);
+		trace_and_count_restart(trans, mark_replicas);
 		ret = -EINTR;
 		break;
 	case BTREE_INSERT_NEED_JOURNAL_RES:
@@ -767,7 +785,7 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		if (bch2_trans_relock(trans))
 			return 0;
 
-		trace_trans_restart_journal_res_get(trans->ip);
+		trace_and_count_restart(trans, journal_res_get);
 		ret = -EINTR;
 		break;
 	default:
@@ -779,7 +797,7 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		int ret2 = bch2_btree_iter_traverse_all(trans);
 
 		if (ret2) {
-			trace_trans_restart_traverse(trans->ip);
+			trace_and_count_restart(trans, traverse);
 			return ret2;
 		}
 
@@ -790,7 +808,7 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		if (!(flags & BTREE_INSERT_ATOMIC))
 			return 0;
 
-		trace_trans_restart_atomic(trans->ip);
+		trace_and_count_restart(trans, atomic);
 	}
 
 	return ret;
@@ -816,7 +834,7 @@ static int __bch2_trans_commit(struct btree_trans *trans,
 
 	trans_for_each_update_iter(trans, i) {
 		if (!bch2_btree_iter_upgrade(i->iter, 1)) {
-			trace_trans_restart_upgrade(trans->ip);
+			trace_and_count_restart(trans, upgrade);
 			ret = -EINTR;
 			goto err;
 		}
@@ -999,6 +1017,223 @@ retry:
 	return ret;
 }
 
+/* Batched inserts: */
+
+/*
+ * Insert as many of the keys in [*k, end) as fit in the leaf @iter points to,
+ * under one write lock and one journal reservation, and with one usage
+ * update; on success *k is advanced past the keys inserted:
+ */
+static int btree_insert_list_leaf(struct btree_trans *trans,
+				  struct btree_iter *iter,
+				  struct bkey_i **k, struct bkey_i *end)
+{
+	struct bch_fs *c = trans->c;
+	struct btree *b = iter->l[0].b;
+	struct btree_insert_entry insert = BTREE_INSERT_ENTRY(iter, NULL);
+	struct bch_fs_usage *fs_usage = NULL;
+	struct bkey_i *i, *last;
+	unsigned u64s = 0, u64s_remaining;
+	unsigned mark_flags = trans->flags & BTREE_INSERT_BUCKET_INVALIDATE
+		? BCH_BUCKET_MARK_BUCKET_INVALIDATE
+		: 0;
+	int ret = 0;
+
+	bch2_btree_node_lock_for_insert(c, b, iter);
+
+	/*
+	 * Don't grow the unwritten bset much past what a new bset would be
+	 * started at, the same as key at a time inserts would:
+	 */
+	u64s_remaining = min_t(unsigned,
+			       bch_btree_keys_u64s_remaining(c, b),
+			       btree_write_set_buffer(b) / sizeof(u64));
+	trans->journal_u64s = 0;
+
+	for (last = *k; last != end; last = bkey_next(last)) {
+		if (bkey_cmp(last->k.p, b->key.k.p) > 0 ||
+		    u64s + last->k.u64s > u64s_remaining)
+			break;
+
+		u64s += last->k.u64s;
+		trans->journal_u64s += jset_u64s(last->k.u64s);
+	}
+
+	if (last == *k ||
+	    unlikely(btree_node_fake(b))) {
+		ret = BTREE_INSERT_BTREE_NODE_FULL;
+		goto out;
+	}
+
+	if (btree_node_type_needs_gc(iter->btree_id)) {
+		percpu_down_read(&c->mark_lock);
+		fs_usage = bch2_fs_usage_scratch_get(c);
+
+		/* Stop at the first key that needs its replicas marked: */
+		for (i = *k; i != last; i = bkey_next(i))
+			if (!bch2_bkey_replicas_marked_locked(c,
+					bkey_i_to_s_c(i), true)) {
+				last = i;
+				break;
+			}
+
+		if (last == *k) {
+			ret = BTREE_INSERT_NEED_MARK_REPLICAS;
+			goto out;
+		}
+	}
+
+	if (likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY))) {
+		ret = bch2_trans_journal_res_get(trans,
+				JOURNAL_RES_GET_NONBLOCK);
+		if (ret)
+			goto out;
+	}
+
+	for (i = *k; i != last; i = bkey_next(i)) {
+		/* Moves the node iterator forward, without retraversing: */
+		bch2_btree_iter_set_pos(iter, bkey_start_pos(&i->k));
+		insert.k = i;
+
+		btree_insert_entry_checks(trans, &insert);
+		btree_insert_key_debug_version(trans, i);
+
+		if (update_has_triggers(trans, &insert))
+			bch2_mark_update(trans, &insert, fs_usage, mark_flags);
+
+		if (likely(!(trans->flags & BTREE_INSERT_NOMARK)) &&
+		    unlikely(c->gc_pos.phase) &&
+		    gc_visited(c, gc_pos_btree_node(b)))
+			bch2_mark_update(trans, &insert, NULL,
+					 mark_flags|BCH_BUCKET_MARK_GC);
+
+		btree_insert_key_leaf(trans, &insert);
+	}
+
+	if (fs_usage)
+		bch2_trans_fs_usage_apply(trans, fs_usage);
+
+	*k = last;
+out:
+	bch2_btree_node_unlock_write(b, iter);
+
+	if (fs_usage) {
+		bch2_fs_usage_scratch_put(c, fs_usage);
+		percpu_up_read(&c->mark_lock);
+	}
+
+	bch2_journal_res_put(&c->journal, &trans->journal_res);
+	return ret;
+}
+
+/**
+ * bch2_btree_insert_list - insert a sorted list of keys
+ * @c:			pointer to struct bch_fs
+ * @id:			btree to insert into
+ * @keys:		keys to insert, sorted and non overlapping
+ * @disk_res:		disk reservation covering all of @keys
+ * @journal_seq:	if non NULL, set to the journal sequence number of the
+ *			last insert
+ * @flags:		BTREE_INSERT_* flags
+ *
+ * Equivalent to calling bch2_btree_insert() on each key, but keys that go in
+ * the same leaf are inserted together: one traverse, one leaf write lock, one
+ * journal reservation and one accounting update per leaf, instead of per key.
+ * A leaf that's too full for the next key is split before continuing.
+ *
+ * Each leaf's worth of keys is inserted atomically, the list as a whole is
+ * not. The keys in @keys are only modified by the journal_seq_verify and
+ * inject_invalid_keys debug options, which overwrite each key's version as it's
+ * inserted, the same as bch2_btree_insert() does.
+ *
+ * Extents, and inodes without BTREE_INSERT_MARK_INMEM, gain nothing from this:
+ * each key is passed to bch2_btree_insert() in its own transaction. Inodes need
+ * their triggers run transactionally, and extents need bch2_extent_can_insert()
+ * per key to account for the existing extents an insert splits.
+ */
+int bch2_btree_insert_list(struct bch_fs *c, enum btree_id id,
+			   struct keylist *keys,
+			   struct disk_reservation *disk_res,
+			   u64 *journal_seq, int flags)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_i *k;
+	int ret = 0;
+
+	bch2_verify_keylist_sorted(keys);
+
+	if (btree_node_type_is_extents(id) ||
+	    btree_triggers_transactional(id, flags)) {
+		for_each_keylist_key(keys, k) {
+			ret = bch2_btree_insert(c, id, k, disk_res,
+						journal_seq, flags);
+			if (ret)
+				break;
+		}
+		return ret;
+	}
+
+	if (unlikely(!(flags & BTREE_INSERT_NOCHECK_RW) &&
+		     !percpu_ref_tryget(&c->writes)))
+		return -EROFS;
+
+	if (btree_node_type_needs_gc(id))
+		for_each_keylist_key(keys, k) {
+			ret = bch2_mark_bkey_replicas(c, bkey_i_to_s_c(k));
+			if (ret)
+				goto out;
+		}
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	memset(&trans.journal_res, 0, sizeof(trans.journal_res));
+	trans.disk_res		= disk_res;
+	trans.journal_seq	= journal_seq;
+	trans.flags		= flags;
+	trans.commit_start	= local_clock();
+
+	k = keys->keys;
+	iter = bch2_trans_get_iter(&trans, id, bkey_start_pos(&k->k),
+				   BTREE_ITER_INTENT);
+
+	while (k != keys->top) {
+		bch2_btree_iter_set_pos(iter, bkey_start_pos(&k->k));
+
+		ret = bch2_btree_iter_traverse(iter);
+		if (ret)
+			break;
+
+		ret = btree_insert_list_leaf(&trans, iter, &k, keys->top);
+		if (ret) {
+			/* Split, wait on journal reservation, etc.: */
+			trans.updates[0]	= BTREE_INSERT_ENTRY(iter, k);
+			trans.nr_updates	= 1;
+
+			ret = bch2_trans_commit_error(&trans,
+						trans.updates, ret);
+			trans.nr_updates	= 0;
+
+			if (ret == -EINTR)
+				ret = 0;
+			if (ret)
+				break;
+		}
+
+		bch2_trans_cond_resched(&trans);
+	}
+
+	if (!ret)
+		bch2_time_stats_update(&c->times[BCH_TIME_btree_update],
+				       trans.commit_start);
+
+	ret = bch2_trans_exit(&trans) ?: ret;
+out:
+	if (unlikely(!(flags & BTREE_INSERT_NOCHECK_RW)))
+		percpu_ref_put(&c->writes);
+	return ret;
+}
+
 int bch2_btree_delete_at_range(struct btree_trans *trans,
 			       struct btree_iter *iter,
 			       struct bpos end,
@@ -207,20 +207,10 @@ out:
 
 /* Discards - last part of journal reclaim: */
 
-static bool should_discard_bucket(struct journal *j, struct journal_device *ja)
-{
-	bool ret;
-
-	spin_lock(&j->lock);
-	ret = ja->discard_idx != ja->dirty_idx_ondisk;
-	spin_unlock(&j->lock);
-
-	return ret;
-}
-
 /*
  * Advance ja->discard_idx as long as it points to buckets that are no longer
- * dirty, issuing discards if necessary:
+ * dirty, issuing discards if necessary - all at once, so that discards of
+ * adjacent buckets get merged:
  */
 void bch2_journal_do_discards(struct journal *j)
 {
@@ -232,21 +222,43 @@ void bch2_journal_do_discards(struct journal *j)
 
 	for_each_rw_member(ca, c, iter) {
 		struct journal_device *ja = &ca->journal;
+		struct block_device *bdev = ca->disk_sb.bdev;
+		struct bio *bio = NULL;
+		struct blk_plug plug;
+		unsigned idx, end;
 
-		while (should_discard_bucket(j, ja)) {
-			if (ca->mi.discard &&
-			    blk_queue_discard(bdev_get_queue(ca->disk_sb.bdev)))
-				blkdev_issue_discard(ca->disk_sb.bdev,
-					bucket_to_sector(ca,
-						ja->buckets[ja->discard_idx]),
-					ca->mi.bucket_size, GFP_NOIO, 0);
+		spin_lock(&j->lock);
+		end = ja->dirty_idx_ondisk;
+		spin_unlock(&j->lock);
 
-			spin_lock(&j->lock);
-			ja->discard_idx = (ja->discard_idx + 1) % ja->nr;
+		if (ja->discard_idx == end)
+			continue;
 
-			bch2_journal_space_available(j);
-			spin_unlock(&j->lock);
+		if (ca->mi.discard &&
+		    blk_queue_discard(bdev_get_queue(bdev))) {
+			blk_start_plug(&plug);
+
+			for (idx = ja->discard_idx;
+			     idx != end;
+			     idx = (idx + 1) % ja->nr)
+				if (__blkdev_issue_discard(bdev,
+						bucket_to_sector(ca, ja->buckets[idx]),
+						ca->mi.bucket_size, GFP_NOIO, 0,
+						&bio))
+					break;
+
+			if (bio) {
+				submit_bio_wait(bio);
+				bio_put(bio);
+			}
+			blk_finish_plug(&plug);
 		}
+
+		spin_lock(&j->lock);
+		ja->discard_idx = end;
+
+		bch2_journal_space_available(j);
+		spin_unlock(&j->lock);
 	}
 
 	mutex_unlock(&j->discard_lock);
@@ -493,6 +493,7 @@ int bch2_move_data(struct bch_fs *c,
 	struct bkey_s_c k;
 	struct data_opts data_opts;
 	enum data_cmd data_cmd;
+	struct blk_plug plug;
 	u64 delay, cur_inum = U64_MAX;
 	int ret = 0, ret2;
 
@@ -512,6 +513,9 @@ int bch2_move_data(struct bch_fs *c,
 	if (rate)
 		bch2_ratelimit_reset(rate);
 
+	/* reads of adjacent extents get merged: */
+	blk_start_plug(&plug);
+
 	while (1) {
 		do {
 			delay = rate ? bch2_ratelimit_delay(rate) : 0;
@@ -606,6 +610,7 @@ next_nondata:
 		bch2_trans_cond_resched(&trans);
 	}
 out:
+	blk_finish_plug(&plug);
 	bch2_trans_exit(&trans);
 
 	move_ctxt_wait_event(&ctxt, list_empty(&ctxt.reads));
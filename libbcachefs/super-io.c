@@ -636,8 +636,12 @@ static void write_super_endio(struct bio *bio)
 	if (bch2_dev_io_err_on(bio->bi_status, ca, "superblock write"))
 		ca->sb_write_error = 1;
 
-	closure_put(&ca->fs->sb_write);
+	/*
+	 * Drop io_ref first: once sb_write is put, bch2_write_super() may
+	 * return and the device may be freed:
+	 */
 	percpu_ref_put(&ca->io_ref);
+	closure_put(&ca->fs->sb_write);
 }
 
 static void read_back_super(struct bch_fs *c, struct bch_dev *ca)
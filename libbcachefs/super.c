@@ -41,6 +41,7 @@
 #include "super.h"
 #include "super-io.h"
 #include "sysfs.h"
+#include "trans_profile.h"
 
 #include <linux/backing-dev.h>
 #include <linux/blkdev.h>
@@ -148,6 +149,20 @@ struct bch_fs *bch2_uuid_to_fs(uuid_le uuid)
 	return c;
 }
 
+/*
+ * Call @fn on each filesystem that's been opened and isn't yet being shut down
+ * - filesystems can't go away while @fn runs:
+ */
+void bch2_for_each_fs(void (*fn)(struct bch_fs *, void *), void *arg)
+{
+	struct bch_fs *c;
+
+	mutex_lock(&bch_fs_list_lock);
+	list_for_each_entry(c, &bch_fs_list, list)
+		fn(c, arg);
+	mutex_unlock(&bch_fs_list_lock);
+}
+
 int bch2_congested(void *data, int bdi_bits)
 {
 	struct bch_fs *c = data;
@@ -504,6 +519,7 @@ static void bch2_fs_free(struct bch_fs *c)
 	free_percpu(c->usage[1]);
 	free_percpu(c->usage[0]);
 	kfree(c->usage_base);
+	bch2_fs_trans_profile_exit(c);
 	free_percpu(c->pcpu);
 	mempool_exit(&c->btree_iters_pool);
 	mempool_exit(&c->btree_bounce_pool);
@@ -756,6 +772,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 			    offsetof(struct btree_write_bio, wbio.bio)),
 			BIOSET_NEED_BVECS) ||
 	    !(c->pcpu = alloc_percpu(struct bch_fs_pcpu)) ||
+	    bch2_fs_trans_profile_init(c) ||
 	    mempool_init_kvpmalloc_pool(&c->btree_bounce_pool, 1,
 					btree_bytes(c)) ||
 	    mempool_init_kmalloc_pool(&c->btree_iters_pool, 1,
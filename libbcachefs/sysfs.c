@@ -491,15 +491,20 @@ STORE(__bch2_fs)
 		char *test		= strsep(&p, " \t\n");
 		char *nr_str		= strsep(&p, " \t\n");
 		char *threads_str	= strsep(&p, " \t\n");
+		struct btree_perf_test_result r;
 		unsigned threads;
 		u64 nr;
 		int ret = -EINVAL;
 
 		if (threads_str &&
 		    !(ret = kstrtouint(threads_str, 10, &threads)) &&
-		    !(ret = bch2_strtoull_h(nr_str, &nr)))
-			bch2_btree_perf_test(c, test, nr, threads);
-		else
+		    !(ret = bch2_strtoull_h(nr_str, &nr)) &&
+		    !(ret = bch2_btree_perf_test(c, test, nr, threads, &r))) {
+			char out[200];
+
+			bch2_btree_perf_test_to_text(&PBUF(out), test, &r);
+			printk(KERN_INFO "%s", out);
+		} else
 			size = ret;
 		kfree(tmp);
 	}
@@ -3,11 +3,14 @@
 
 #include "bcachefs.h"
 #include "btree_update.h"
+#include "btree_update_interior.h"
 #include "journal_reclaim.h"
+#include "keylist.h"
 #include "tests.h"
 
 #include "linux/kthread.h"
 #include "linux/random.h"
+#include "linux/sort.h"
 
 static void delete_test_keys(struct bch_fs *c)
 {
@@ -18,7 +21,7 @@ static void delete_test_keys(struct bch_fs *c)
 				      NULL);
 	BUG_ON(ret);
 
-	ret = bch2_btree_delete_range(c, BTREE_ID_DIRENTS,
+	ret = bch2_btree_delete_range(c, BTREE_ID_XATTRS,
 				      POS(0, 0), POS(0, U64_MAX),
 				      NULL);
 	BUG_ON(ret);
@@ -37,7 +40,7 @@ static void test_delete(struct bch_fs *c, u64 nr)
 
 	bch2_trans_init(&trans, c, 0, 0);
 
-	iter = bch2_trans_get_iter(&trans, BTREE_ID_DIRENTS, k.k.p,
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_XATTRS, k.k.p,
 				   BTREE_ITER_INTENT);
 
 	ret = bch2_btree_iter_traverse(iter);
@@ -69,7 +72,7 @@ static void test_delete_written(struct bch_fs *c, u64 nr)
 
 	bch2_trans_init(&trans, c, 0, 0);
 
-	iter = bch2_trans_get_iter(&trans, BTREE_ID_DIRENTS, k.k.p,
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_XATTRS, k.k.p,
 				   BTREE_ITER_INTENT);
 
 	ret = bch2_btree_iter_traverse(iter);
@@ -107,7 +110,7 @@ static void test_iterate(struct bch_fs *c, u64 nr)
 		bkey_cookie_init(&k.k_i);
 		k.k.p.offset = i;
 
-		ret = bch2_btree_insert(c, BTREE_ID_DIRENTS, &k.k_i,
+		ret = bch2_btree_insert(c, BTREE_ID_XATTRS, &k.k_i,
 					NULL, NULL, 0);
 		BUG_ON(ret);
 	}
@@ -116,7 +119,7 @@ static void test_iterate(struct bch_fs *c, u64 nr)
 
 	i = 0;
 
-	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS,
+	for_each_btree_key(&trans, iter, BTREE_ID_XATTRS,
 			   POS_MIN, 0, k, ret)
 		BUG_ON(k.k->p.offset != i++);
 
@@ -202,7 +205,7 @@ static void test_iterate_slots(struct bch_fs *c, u64 nr)
 		bkey_cookie_init(&k.k_i);
 		k.k.p.offset = i * 2;
 
-		ret = bch2_btree_insert(c, BTREE_ID_DIRENTS, &k.k_i,
+		ret = bch2_btree_insert(c, BTREE_ID_XATTRS, &k.k_i,
 					NULL, NULL, 0);
 		BUG_ON(ret);
 	}
@@ -211,7 +214,7 @@ static void test_iterate_slots(struct bch_fs *c, u64 nr)
 
 	i = 0;
 
-	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN,
+	for_each_btree_key(&trans, iter, BTREE_ID_XATTRS, POS_MIN,
 			   0, k, ret) {
 		BUG_ON(k.k->p.offset != i);
 		i += 2;
@@ -224,7 +227,7 @@ static void test_iterate_slots(struct bch_fs *c, u64 nr)
 
 	i = 0;
 
-	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN,
+	for_each_btree_key(&trans, iter, BTREE_ID_XATTRS, POS_MIN,
 			   BTREE_ITER_SLOTS, k, ret) {
 		BUG_ON(bkey_deleted(k.k) != (i & 1));
 		BUG_ON(k.k->p.offset != i++);
@@ -307,7 +310,7 @@ static void test_peek_end(struct bch_fs *c, u64 nr)
 
 	bch2_trans_init(&trans, c, 0, 0);
 
-	iter = bch2_trans_get_iter(&trans, BTREE_ID_DIRENTS, POS_MIN, 0);
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_XATTRS, POS_MIN, 0);
 
 	k = bch2_btree_iter_peek(iter);
 	BUG_ON(k.k);
@@ -396,6 +399,110 @@ static void test_extent_overwrite_all(struct bch_fs *c, u64 nr)
 
 /* perf tests */
 
+/*
+ * Per op latency histogram: log2 buckets, each split into
+ * 1 << PERF_LAT_SUB_BITS linear sub-buckets, i.e. values are accurate to
+ * within 12.5%:
+ */
+#define PERF_LAT_SUB_BITS	3
+#define PERF_LAT_BUCKETS	(64 << PERF_LAT_SUB_BITS)
+
+struct perf_lat {
+	u64			nr;
+	u64			sum;
+	u64			min;
+	u64			max;
+	u64			buckets[PERF_LAT_BUCKETS];
+};
+
+static unsigned perf_lat_bucket(u64 v)
+{
+	unsigned shift;
+
+	if (v < (1 << PERF_LAT_SUB_BITS))
+		return v;
+
+	shift = fls64(v) - 1 - PERF_LAT_SUB_BITS;
+	return ((shift + 1) << PERF_LAT_SUB_BITS) +
+		((v >> shift) & ((1 << PERF_LAT_SUB_BITS) - 1));
+}
+
+/* largest value that maps to bucket @b: */
+static u64 perf_lat_bucket_max(unsigned b)
+{
+	unsigned shift;
+
+	if (b < (1 << PERF_LAT_SUB_BITS))
+		return b;
+
+	shift = (b >> PERF_LAT_SUB_BITS) - 1;
+	return ((((u64) (1 << PERF_LAT_SUB_BITS) +
+		  (b & ((1 << PERF_LAT_SUB_BITS) - 1))) << shift) +
+		((1ULL << shift) - 1));
+}
+
+static void perf_lat_init(struct perf_lat *lat)
+{
+	memset(lat, 0, sizeof(*lat));
+	lat->min = U64_MAX;
+}
+
+/* record @nr ops that took @v ns in total: */
+static void perf_lat_add(struct perf_lat *lat, u64 v, u64 nr)
+{
+	u64 each = div64_u64(v, nr);
+
+	lat->nr		+= nr;
+	lat->sum	+= v;
+	lat->min	= min(lat->min, each);
+	lat->max	= max(lat->max, each);
+	lat->buckets[perf_lat_bucket(each)] += nr;
+}
+
+/* record an op that started at *start, and start the next one: */
+static inline void perf_lat_next(struct perf_lat *lat, u64 *start)
+{
+	u64 now = local_clock();
+	u64 v = now - *start;
+
+	lat->nr++;
+	lat->sum += v;
+	lat->min = min(lat->min, v);
+	lat->max = max(lat->max, v);
+	lat->buckets[perf_lat_bucket(v)]++;
+
+	*start = now;
+}
+
+static void perf_lat_merge(struct perf_lat *dst, struct perf_lat *src)
+{
+	unsigned i;
+
+	dst->nr		+= src->nr;
+	dst->sum	+= src->sum;
+	dst->min	= min(dst->min, src->min);
+	dst->max	= max(dst->max, src->max);
+
+	for (i = 0; i < PERF_LAT_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+/* @q in parts per thousand: */
+static u64 perf_lat_quantile(struct perf_lat *lat, unsigned q)
+{
+	u64 want = div_u64(lat->nr * q + 999, 1000), seen = 0;
+	unsigned i;
+
+	for (i = 0; i < PERF_LAT_BUCKETS; i++) {
+		seen += lat->buckets[i];
+		if (seen >= want)
+			return clamp_t(u64, perf_lat_bucket_max(i),
+				       lat->min, lat->max);
+	}
+
+	return lat->max;
+}
+
 static u64 test_rand(void)
 {
 	u64 v;
@@ -407,59 +514,148 @@ static u64 test_rand(void)
 	return v;
 }
 
-static void rand_insert(struct bch_fs *c, u64 nr)
+static int rand_insert(struct bch_fs *c, u64 nr, struct perf_lat *lat)
 {
 	struct bkey_i_cookie k;
-	int ret;
-	u64 i;
+	int ret = 0;
+	u64 i, start = local_clock();
 
 	for (i = 0; i < nr; i++) {
 		bkey_cookie_init(&k.k_i);
 		k.k.p.offset = test_rand();
 
-		ret = bch2_btree_insert(c, BTREE_ID_DIRENTS, &k.k_i,
+		ret = bch2_btree_insert(c, BTREE_ID_XATTRS, &k.k_i,
 					NULL, NULL, 0);
-		BUG_ON(ret);
+		if (ret) {
+			pr_err("error in rand_insert: %i", ret);
+			break;
+		}
+
+		perf_lat_next(lat, &start);
 	}
+	return ret;
+}
+
+#define TEST_BATCH	256
+
+static int bpos_sort_cmp(const void *l, const void *r)
+{
+	return bkey_cmp(*((struct bpos *) l), *((struct bpos *) r));
 }
 
-static void rand_lookup(struct bch_fs *c, u64 nr)
+/*
+ * Same as rand_insert, but inserting sorted batches with
+ * bch2_btree_insert_list(); latency is per key, averaged over each batch:
+ */
+static int rand_insert_batch(struct bch_fs *c, u64 nr, struct perf_lat *lat)
+{
+	struct bpos *pos = kmalloc_array(TEST_BATCH, sizeof(*pos), GFP_KERNEL);
+	u64 *inline_keys = kmalloc_array(TEST_BATCH,
+				sizeof(struct bkey_i_cookie), GFP_KERNEL);
+	struct keylist keys;
+	struct bkey_i_cookie *k;
+	u64 i, j, batch, start;
+	int ret = -ENOMEM;
+
+	if (!pos || !inline_keys)
+		goto err;
+
+	bch2_keylist_init(&keys, inline_keys);
+
+	for (i = 0; i < nr; i += batch) {
+		batch = min_t(u64, nr - i, TEST_BATCH);
+
+		for (j = 0; j < batch; j++)
+			pos[j] = POS(0, test_rand());
+
+		start = local_clock();
+		sort(pos, batch, sizeof(pos[0]), bpos_sort_cmp, NULL);
+
+		keys.top = keys.keys;
+		for (j = 0; j < batch; j++) {
+			if (j && !bkey_cmp(pos[j], pos[j - 1]))
+				continue;
+
+			k = bkey_i_to_cookie(keys.top);
+			bkey_cookie_init(&k->k_i);
+			k->k.p = pos[j];
+			bch2_keylist_push(&keys);
+		}
+
+		ret = bch2_btree_insert_list(c, BTREE_ID_XATTRS, &keys,
+					     NULL, NULL, 0);
+		if (ret) {
+			pr_err("error in rand_insert_batch: %i", ret);
+			goto err;
+		}
+
+		perf_lat_add(lat, local_clock() - start, batch);
+	}
+
+	ret = 0;
+err:
+	kfree(inline_keys);
+	kfree(pos);
+	return ret;
+}
+
+static int rand_lookup(struct bch_fs *c, u64 nr, struct perf_lat *lat)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
-	u64 i;
+	int ret = 0;
+	u64 i, start;
 
 	bch2_trans_init(&trans, c, 0, 0);
 
+	start = local_clock();
+
 	for (i = 0; i < nr; i++) {
-		iter = bch2_trans_get_iter(&trans, BTREE_ID_DIRENTS,
+		iter = bch2_trans_get_iter(&trans, BTREE_ID_XATTRS,
 					   POS(0, test_rand()), 0);
+		ret = PTR_ERR_OR_ZERO(iter);
+		if (ret)
+			break;
 
 		k = bch2_btree_iter_peek(iter);
+		ret = bkey_err(k);
 		bch2_trans_iter_free(&trans, iter);
+		if (ret)
+			break;
+
+		perf_lat_next(lat, &start);
 	}
 
-	bch2_trans_exit(&trans);
+	if (ret)
+		pr_err("error in rand_lookup: %i", ret);
+
+	return bch2_trans_exit(&trans) ?: ret;
 }
 
-static void rand_mixed(struct bch_fs *c, u64 nr)
+static int rand_mixed(struct bch_fs *c, u64 nr, struct perf_lat *lat)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
-	int ret;
-	u64 i;
+	int ret = 0;
+	u64 i, start;
 
 	bch2_trans_init(&trans, c, 0, 0);
 
+	start = local_clock();
+
 	for (i = 0; i < nr; i++) {
-		iter = bch2_trans_get_iter(&trans, BTREE_ID_DIRENTS,
+		iter = bch2_trans_get_iter(&trans, BTREE_ID_XATTRS,
 					   POS(0, test_rand()), 0);
+		ret = PTR_ERR_OR_ZERO(iter);
+		if (ret)
+			break;
 
 		k = bch2_btree_iter_peek(iter);
+		ret = bkey_err(k);
 
-		if (!(i & 3) && k.k) {
+		if (!ret && !(i & 3) && k.k) {
 			struct bkey_i_cookie k;
 
 			bkey_cookie_init(&k.k_i);
@@ -467,82 +663,155 @@ static void rand_mixed(struct bch_fs *c, u64 nr)
 
 			bch2_trans_update(&trans, BTREE_INSERT_ENTRY(iter, &k.k_i));
 			ret = bch2_trans_commit(&trans, NULL, NULL, 0);
-			BUG_ON(ret);
 		}
 
 		bch2_trans_iter_free(&trans, iter);
+		if (ret)
+			break;
+
+		perf_lat_next(lat, &start);
 	}
 
-	bch2_trans_exit(&trans);
+	if (ret)
+		pr_err("error in rand_mixed: %i", ret);
+
+	return bch2_trans_exit(&trans) ?: ret;
 }
 
-static void rand_delete(struct bch_fs *c, u64 nr)
+static int rand_delete(struct bch_fs *c, u64 nr, struct perf_lat *lat)
 {
 	struct bkey_i k;
-	int ret;
-	u64 i;
+	int ret = 0;
+	u64 i, start = local_clock();
 
 	for (i = 0; i < nr; i++) {
 		bkey_init(&k.k);
 		k.k.p.offset = test_rand();
 
-		ret = bch2_btree_insert(c, BTREE_ID_DIRENTS, &k,
+		ret = bch2_btree_insert(c, BTREE_ID_XATTRS, &k,
 					NULL, NULL, 0);
-		BUG_ON(ret);
+		if (ret) {
+			pr_err("error in rand_delete: %i", ret);
+			break;
+		}
+
+		perf_lat_next(lat, &start);
 	}
+	return ret;
 }
 
-static void seq_insert(struct bch_fs *c, u64 nr)
+static int seq_insert(struct bch_fs *c, u64 nr, struct perf_lat *lat)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
 	struct bkey_i_cookie insert;
 	int ret;
-	u64 i = 0;
+	u64 i = 0, start;
 
 	bkey_cookie_init(&insert.k_i);
 
 	bch2_trans_init(&trans, c, 0, 0);
 
-	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN,
+	start = local_clock();
+
+	for_each_btree_key(&trans, iter, BTREE_ID_XATTRS, POS_MIN,
 			   BTREE_ITER_SLOTS|BTREE_ITER_INTENT, k, ret) {
 		insert.k.p = iter->pos;
 
 		bch2_trans_update(&trans, BTREE_INSERT_ENTRY(iter, &insert.k_i));
 		ret = bch2_trans_commit(&trans, NULL, NULL, 0);
-		BUG_ON(ret);
+		if (ret)
+			break;
+
+		perf_lat_next(lat, &start);
 
 		if (++i == nr)
 			break;
 	}
-	bch2_trans_exit(&trans);
+
+	if (ret)
+		pr_err("error in seq_insert: %i", ret);
+
+	return bch2_trans_exit(&trans) ?: ret;
 }
 
-static void seq_lookup(struct bch_fs *c, u64 nr)
+/*
+ * like seq_insert, but builds the btree bottom up - needs a fresh filesystem,
+ * and only one thread:
+ */
+static int seq_bulk_load(struct bch_fs *c, u64 nr, struct perf_lat *lat)
+{
+	struct btree_bulk_load bl;
+	struct bkey_i_cookie insert;
+	u64 i, start;
+	int ret;
+
+	bkey_cookie_init(&insert.k_i);
+
+	start = local_clock();
+
+	ret = bch2_btree_bulk_load_start(&bl, c, BTREE_ID_XATTRS, NULL, 0);
+	if (ret) {
+		pr_err("error starting bulk load: %i", ret);
+		return ret;
+	}
+
+	for (i = 0; i < nr; i++) {
+		insert.k.p.offset = i;
+
+		ret = bch2_btree_bulk_load_add(&bl, &insert.k_i);
+		if (ret) {
+			pr_err("error in bulk load: %i", ret);
+			bch2_btree_bulk_load_exit(&bl);
+			return ret;
+		}
+	}
+
+	ret = bch2_btree_bulk_load_finish(&bl);
+	if (ret) {
+		pr_err("error finishing bulk load: %i", ret);
+		return ret;
+	}
+
+	perf_lat_add(lat, local_clock() - start, nr);
+	return 0;
+}
+
+static int seq_lookup(struct bch_fs *c, u64 nr, struct perf_lat *lat)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
 	int ret;
+	u64 start;
 
 	bch2_trans_init(&trans, c, 0, 0);
 
-	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN, 0, k, ret)
-		;
-	bch2_trans_exit(&trans);
+	start = local_clock();
+
+	for_each_btree_key(&trans, iter, BTREE_ID_XATTRS, POS_MIN, 0, k, ret)
+		perf_lat_next(lat, &start);
+
+	if (ret)
+		pr_err("error in seq_lookup: %i", ret);
+
+	return bch2_trans_exit(&trans) ?: ret;
 }
 
-static void seq_overwrite(struct bch_fs *c, u64 nr)
+static int seq_overwrite(struct bch_fs *c, u64 nr, struct perf_lat *lat)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
 	int ret;
+	u64 start;
 
 	bch2_trans_init(&trans, c, 0, 0);
 
-	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN,
+	start = local_clock();
+
+	for_each_btree_key(&trans, iter, BTREE_ID_XATTRS, POS_MIN,
 			   BTREE_ITER_INTENT, k, ret) {
 		struct bkey_i_cookie u;
 
@@ -550,28 +819,79 @@ static void seq_overwrite(struct bch_fs *c, u64 nr)
 
 		bch2_trans_update(&trans, BTREE_INSERT_ENTRY(iter, &u.k_i));
 		ret = bch2_trans_commit(&trans, NULL, NULL, 0);
-		BUG_ON(ret);
+		if (ret)
+			break;
+
+		perf_lat_next(lat, &start);
 	}
-	bch2_trans_exit(&trans);
+
+	if (ret)
+		pr_err("error in seq_overwrite: %i", ret);
+
+	return bch2_trans_exit(&trans) ?: ret;
 }
 
-static void seq_delete(struct bch_fs *c, u64 nr)
+static int seq_delete(struct bch_fs *c, u64 nr, struct perf_lat *lat)
 {
 	int ret;
+	u64 start = local_clock();
 
-	ret = bch2_btree_delete_range(c, BTREE_ID_DIRENTS,
+	ret = bch2_btree_delete_range(c, BTREE_ID_XATTRS,
 				      POS(0, 0), POS(0, U64_MAX),
 				      NULL);
-	BUG_ON(ret);
+	if (ret) {
+		pr_err("error in seq_delete: %i", ret);
+		return ret;
+	}
+
+	perf_lat_next(lat, &start);
+	return 0;
 }
 
-typedef void (*perf_test_fn)(struct bch_fs *, u64);
+#define BCH_PERF_TESTS()			\
+	x(rand_insert)				\
+	x(rand_insert_batch)			\
+	x(rand_lookup)				\
+	x(rand_mixed)				\
+	x(rand_delete)				\
+	x(seq_insert)				\
+	x(seq_bulk_load)			\
+	x(seq_lookup)				\
+	x(seq_overwrite)			\
+	x(seq_delete)
+
+/* unit tests, not perf tests - no per op latencies: */
+#define BCH_UNIT_TESTS()			\
+	x(test_delete)				\
+	x(test_delete_written)			\
+	x(test_iterate)				\
+	x(test_iterate_extents)			\
+	x(test_iterate_slots)			\
+	x(test_iterate_slots_extents)		\
+	x(test_peek_end)			\
+	x(test_peek_end_extents)		\
+	x(test_extent_overwrite_front)		\
+	x(test_extent_overwrite_back)		\
+	x(test_extent_overwrite_middle)		\
+	x(test_extent_overwrite_all)
+
+const char * const bch2_btree_perf_tests[] = {
+#define x(_test) #_test,
+	BCH_PERF_TESTS()
+	BCH_UNIT_TESTS()
+#undef x
+	NULL
+};
+
+typedef int (*perf_test_fn)(struct bch_fs *, u64, struct perf_lat *);
+typedef void (*unit_test_fn)(struct bch_fs *, u64);
 
 struct test_job {
 	struct bch_fs			*c;
 	u64				nr;
 	unsigned			nr_threads;
 	perf_test_fn			fn;
+	unit_test_fn			unit_fn;
 
 	atomic_t			ready;
 	wait_queue_head_t		ready_wait;
@@ -581,11 +901,23 @@ struct test_job {
 
 	u64				start;
 	u64				finish;
+
+	spinlock_t			lat_lock;
+	struct perf_lat			*lat;
+	int				ret;
 };
 
 static int btree_perf_test_thread(void *data)
 {
 	struct test_job *j = data;
+	struct perf_lat *lat = NULL;
+	int ret = 0;
+
+	if (j->fn) {
+		lat = kmalloc(sizeof(*lat), GFP_KERNEL);
+		BUG_ON(!lat);
+		perf_lat_init(lat);
+	}
 
 	if (atomic_dec_and_test(&j->ready)) {
 		wake_up(&j->ready_wait);
@@ -594,7 +926,18 @@ static int btree_perf_test_thread(void *data)
 		wait_event(j->ready_wait, !atomic_read(&j->ready));
 	}
 
-	j->fn(j->c, j->nr / j->nr_threads);
+	if (j->fn)
+		ret = j->fn(j->c, j->nr / j->nr_threads, lat);
+	else
+		j->unit_fn(j->c, j->nr / j->nr_threads);
+
+	spin_lock(&j->lat_lock);
+	if (lat)
+		perf_lat_merge(j->lat, lat);
+	if (ret && !j->ret)
+		j->ret = ret;
+	spin_unlock(&j->lat_lock);
+	kfree(lat);
 
 	if (atomic_dec_and_test(&j->done)) {
 		j->finish = sched_clock();
@@ -604,13 +947,18 @@ static int btree_perf_test_thread(void *data)
 	return 0;
 }
 
-void bch2_btree_perf_test(struct bch_fs *c, const char *testname,
-			  u64 nr, unsigned nr_threads)
+int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+			 u64 nr, unsigned nr_threads,
+			 struct btree_perf_test_result *r)
 {
 	struct test_job j = { .c = c, .nr = nr, .nr_threads = nr_threads };
-	char name_buf[20], nr_buf[20], per_sec_buf[20];
+	u64 restarts[BCH_TRANS_RESTART_NR];
 	unsigned i;
-	u64 time;
+
+	memset(r, 0, sizeof(*r));
+
+	if (!nr_threads)
+		return -EINVAL;
 
 	atomic_set(&j.ready, nr_threads);
 	init_waitqueue_head(&j.ready_wait);
@@ -618,41 +966,38 @@ void bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	atomic_set(&j.done, nr_threads);
 	init_completion(&j.done_completion);
 
-#define perf_test(_test)				\
-	if (!strcmp(testname, #_test)) j.fn = _test
-
-	perf_test(rand_insert);
-	perf_test(rand_lookup);
-	perf_test(rand_mixed);
-	perf_test(rand_delete);
-
-	perf_test(seq_insert);
-	perf_test(seq_lookup);
-	perf_test(seq_overwrite);
-	perf_test(seq_delete);
-
-	/* a unit test, not a perf test: */
-	perf_test(test_delete);
-	perf_test(test_delete_written);
-	perf_test(test_iterate);
-	perf_test(test_iterate_extents);
-	perf_test(test_iterate_slots);
-	perf_test(test_iterate_slots_extents);
-	perf_test(test_peek_end);
-	perf_test(test_peek_end_extents);
-
-	perf_test(test_extent_overwrite_front);
-	perf_test(test_extent_overwrite_back);
-	perf_test(test_extent_overwrite_middle);
-	perf_test(test_extent_overwrite_all);
-
-	if (!j.fn) {
+	spin_lock_init(&j.lat_lock);
+
+#define x(_test)					\
+	if (!strcmp(testname, #_test)) j.fn = _test;
+	BCH_PERF_TESTS()
+#undef x
+#define x(_test)					\
+	if (!strcmp(testname, #_test)) j.unit_fn = _test;
+	BCH_UNIT_TESTS()
+#undef x
+
+	if (!j.fn && !j.unit_fn) {
 		pr_err("unknown test %s", testname);
-		return;
+		return -EINVAL;
+	}
+
+	if (j.fn == seq_bulk_load && nr_threads > 1) {
+		pr_err("%s can't be run with more than one thread", testname);
+		return -EINVAL;
+	}
+
+	if (j.fn) {
+		j.lat = kmalloc(sizeof(*j.lat), GFP_KERNEL);
+		if (!j.lat)
+			return -ENOMEM;
+		perf_lat_init(j.lat);
 	}
 
 	//pr_info("running test %s:", testname);
 
+	bch2_trans_restarts_read(c, restarts);
+
 	if (nr_threads == 1)
 		btree_perf_test_thread(&j);
 	else
@@ -663,16 +1008,45 @@ void bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	while (wait_for_completion_interruptible(&j.done_completion))
 		;
 
-	time = j.finish - j.start;
+	bch2_trans_restarts_read(c, r->restarts);
+	for (i = 0; i < BCH_TRANS_RESTART_NR; i++) {
+		r->restarts[i] -= restarts[i];
+		r->nr_restarts += r->restarts[i];
+	}
+
+	r->nr		= nr;
+	r->nr_threads	= nr_threads;
+	r->time		= j.finish - j.start;
+
+	if (j.lat && j.lat->nr) {
+		r->lat_nr	= j.lat->nr;
+		r->lat_min	= j.lat->min;
+		r->lat_max	= j.lat->max;
+		r->lat_mean	= div64_u64(j.lat->sum, j.lat->nr);
+		r->lat_p50	= perf_lat_quantile(j.lat, 500);
+		r->lat_p90	= perf_lat_quantile(j.lat, 900);
+		r->lat_p99	= perf_lat_quantile(j.lat, 990);
+		r->lat_p999	= perf_lat_quantile(j.lat, 999);
+	}
+
+	kfree(j.lat);
+	return j.ret;
+}
+
+void bch2_btree_perf_test_to_text(struct printbuf *out, const char *testname,
+				  struct btree_perf_test_result *r)
+{
+	char name_buf[32], nr_buf[20], per_sec_buf[20];
+	u64 time = max_t(u64, r->time, 1);
 
 	scnprintf(name_buf, sizeof(name_buf), "%s:", testname);
-	bch2_hprint(&PBUF(nr_buf), nr);
-	bch2_hprint(&PBUF(per_sec_buf), nr * NSEC_PER_SEC / time);
-	printk(KERN_INFO "%-12s %s with %u threads in %5llu sec, %5llu nsec per iter, %5s per sec\n",
-		name_buf, nr_buf, nr_threads,
-		time / NSEC_PER_SEC,
-		time * nr_threads / nr,
-		per_sec_buf);
+	bch2_hprint(&PBUF(nr_buf), r->nr);
+	bch2_hprint(&PBUF(per_sec_buf), div64_u64(r->nr * NSEC_PER_SEC, time));
+	pr_buf(out, "%-12s %s with %u threads in %5llu sec, %5llu nsec per iter, %5s per sec\n",
+	       name_buf, nr_buf, r->nr_threads,
+	       time / NSEC_PER_SEC,
+	       div64_u64(time * r->nr_threads, max_t(u64, r->nr, 1)),
+	       per_sec_buf);
 }
 
 #endif /* CONFIG_BCACHEFS_TESTS */
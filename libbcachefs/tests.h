@@ -2,11 +2,35 @@
 #ifndef _BCACHEFS_TEST_H
 #define _BCACHEFS_TEST_H
 
-struct bch_fs;
+#include "bcachefs.h"
 
 #ifdef CONFIG_BCACHEFS_TESTS
 
-void bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned);
+struct btree_perf_test_result {
+	u64			nr;
+	unsigned		nr_threads;
+	u64			time;		/* ns */
+
+	/* per op latencies, in ns - not measured for unit tests: */
+	u64			lat_nr;
+	u64			lat_min;
+	u64			lat_max;
+	u64			lat_mean;
+	u64			lat_p50;
+	u64			lat_p90;
+	u64			lat_p99;
+	u64			lat_p999;
+
+	u64			nr_restarts;
+	u64			restarts[BCH_TRANS_RESTART_NR];
+};
+
+extern const char * const bch2_btree_perf_tests[];
+
+int bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned,
+			 struct btree_perf_test_result *);
+void bch2_btree_perf_test_to_text(struct printbuf *, const char *,
+				  struct btree_perf_test_result *);
 
 #else
 
@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "btree_iter.h"
+#include "trans_profile.h"
+
+#include <linux/hash.h>
+#include <linux/sched/clock.h>
+#include <linux/sort.h>
+
+struct trans_profile {
+	spinlock_t		lock;
+	/* events from callsites that didn't fit in the table: */
+	struct trans_profile_site other;
+	struct trans_profile_site sites[TRANS_PROFILE_SITES];
+};
+
+static struct trans_profile_site *
+trans_profile_site_get(struct trans_profile *p, unsigned long ip)
+{
+	unsigned i, idx = hash_long(ip, ilog2(TRANS_PROFILE_SITES));
+
+	for (i = 0; i < TRANS_PROFILE_SITES; i++) {
+		struct trans_profile_site *s =
+			&p->sites[(idx + i) & (TRANS_PROFILE_SITES - 1)];
+
+		if (s->ip == ip)
+			return s;
+		if (!s->ip) {
+			s->ip = ip;
+			return s;
+		}
+	}
+
+	return &p->other;
+}
+
+#define trans_profile_update(_trans, _fn)				\
+do {									\
+	struct trans_profile *p = (_trans)->c->trans_profile;		\
+	struct trans_profile_site *s;					\
+	unsigned long flags;						\
+									\
+	spin_lock_irqsave(&p->lock, flags);				\
+	s = trans_profile_site_get(p, (_trans)->ip);			\
+	_fn;								\
+	spin_unlock_irqrestore(&p->lock, flags);			\
+} while (0)
+
+void bch2_trans_profile_restart(struct btree_trans *trans,
+				enum bch_trans_restart reason)
+{
+	this_cpu_inc(trans->c->pcpu->trans_restarts[reason]);
+	trans_profile_update(trans, s->restarts[reason]++);
+}
+
+void bch2_trans_profile_lock_fail(struct btree_trans *trans,
+				  unsigned level, bool upgrade)
+{
+	if (upgrade) {
+		this_cpu_inc(trans->c->pcpu->node_upgrade_fail[level]);
+		trans_profile_update(trans, s->upgrade_fail++);
+	} else {
+		this_cpu_inc(trans->c->pcpu->node_relock_fail[level]);
+		trans_profile_update(trans, s->relock_fail++);
+	}
+}
+
+void bch2_trans_profile_lock_wait(struct btree_trans *trans, unsigned level,
+				  enum six_lock_type type, u64 start_time)
+{
+	u64 ns = local_clock() - start_time;
+	unsigned b = min_t(unsigned, fls64(ns), LOCK_WAIT_BUCKETS - 1);
+	struct lock_wait_hist __percpu *h =
+		&trans->c->pcpu->lock_wait[level][type];
+
+	this_cpu_inc(h->nr);
+	this_cpu_add(h->ns, ns);
+	this_cpu_inc(h->buckets[b]);
+
+	trans_profile_update(trans, ({
+		s->lock_waits++;
+		s->lock_wait_ns += ns;
+		s->lock_wait_max_ns = max(s->lock_wait_max_ns, ns);
+	}));
+}
+
+/* Reading: */
+
+void bch2_lock_wait_read(struct bch_fs *c,
+		struct lock_wait_hist h[BTREE_MAX_DEPTH][SIX_LOCK_write + 1])
+{
+	unsigned cpu, l, t, b;
+
+	memset(h, 0, sizeof(h[0]) * BTREE_MAX_DEPTH);
+
+	for_each_possible_cpu(cpu) {
+		struct bch_fs_pcpu *p = per_cpu_ptr(c->pcpu, cpu);
+
+		for (l = 0; l < BTREE_MAX_DEPTH; l++)
+			for (t = 0; t <= SIX_LOCK_write; t++) {
+				h[l][t].nr += p->lock_wait[l][t].nr;
+				h[l][t].ns += p->lock_wait[l][t].ns;
+				for (b = 0; b < LOCK_WAIT_BUCKETS; b++)
+					h[l][t].buckets[b] +=
+						p->lock_wait[l][t].buckets[b];
+			}
+	}
+}
+
+/*
+ * Returns the upper bound of the bucket the given quantile (in parts per
+ * thousand) falls in:
+ */
+u64 lock_wait_hist_quantile(struct lock_wait_hist *h, unsigned permille)
+{
+	u64 seen = 0, want = div_u64(h->nr * permille + 999, 1000);
+	unsigned b;
+
+	for (b = 0; b < LOCK_WAIT_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen && seen >= want)
+			return b ? 1ULL << b : 0;
+	}
+
+	return 1ULL << (LOCK_WAIT_BUCKETS - 1);
+}
+
+void bch2_lock_fails_read(struct bch_fs *c, u64 *relock_fail, u64 *upgrade_fail)
+{
+	unsigned cpu, l;
+
+	memset(relock_fail, 0, sizeof(u64) * BTREE_MAX_DEPTH);
+	memset(upgrade_fail, 0, sizeof(u64) * BTREE_MAX_DEPTH);
+
+	for_each_possible_cpu(cpu)
+		for (l = 0; l < BTREE_MAX_DEPTH; l++) {
+			relock_fail[l]	+= per_cpu_ptr(c->pcpu, cpu)->node_relock_fail[l];
+			upgrade_fail[l]	+= per_cpu_ptr(c->pcpu, cpu)->node_upgrade_fail[l];
+		}
+}
+
+static int trans_profile_site_cmp(const void *_l, const void *_r)
+{
+	struct trans_profile_site *l = (void *) _l, *r = (void *) _r;
+	u64 l_nr = trans_profile_site_events(l);
+	u64 r_nr = trans_profile_site_events(r);
+
+	return l_nr < r_nr ? 1 : l_nr > r_nr ? -1 : 0;
+}
+
+/*
+ * Copies out the (up to @nr) callsites with the most events, most first; if
+ * the table overflowed, the last entry returned has ip 0 and the events that
+ * couldn't be attributed:
+ */
+unsigned bch2_trans_profile_sites_read(struct bch_fs *c,
+				       struct trans_profile_site *sites,
+				       unsigned nr)
+{
+	struct trans_profile *p = c->trans_profile;
+	struct trans_profile_site *all, other;
+	unsigned i, ret = 0;
+
+	all = kvpmalloc(sizeof(p->sites), GFP_KERNEL);
+	if (!all)
+		return 0;
+
+	spin_lock_irq(&p->lock);
+	memcpy(all, p->sites, sizeof(p->sites));
+	other = p->other;
+	spin_unlock_irq(&p->lock);
+
+	for (i = 0; i < TRANS_PROFILE_SITES; i++)
+		if (all[i].ip)
+			all[ret++] = all[i];
+
+	sort(all, ret, sizeof(all[0]), trans_profile_site_cmp, NULL);
+
+	ret = min(ret, nr);
+	memcpy(sites, all, sizeof(all[0]) * ret);
+
+	if (trans_profile_site_events(&other) && ret < nr)
+		sites[ret++] = other;
+
+	kvpfree(all, sizeof(p->sites));
+	return ret;
+}
+
+void bch2_fs_trans_profile_exit(struct bch_fs *c)
+{
+	kvpfree(c->trans_profile, sizeof(*c->trans_profile));
+}
+
+int bch2_fs_trans_profile_init(struct bch_fs *c)
+{
+	c->trans_profile = kvpmalloc(sizeof(*c->trans_profile),
+				     GFP_KERNEL|__GFP_ZERO);
+	if (!c->trans_profile)
+		return -ENOMEM;
+
+	spin_lock_init(&c->trans_profile->lock);
+	return 0;
+}
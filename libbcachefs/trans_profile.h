@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_TRANS_PROFILE_H
+#define _BCACHEFS_TRANS_PROFILE_H
+
+/*
+ * Transaction restart and lock contention profiling:
+ *
+ * Restarts are counted per reason in c->pcpu (see trace_and_count_restart()),
+ * and relock/upgrade failures and time spent blocked on btree node locks are
+ * counted per btree level, also in c->pcpu.
+ *
+ * All of those are additionally attributed to the callsite that started the
+ * transaction (trans->ip, the _RET_IP_ of bch2_trans_init()) in a small hash
+ * table - these are all slowpaths, so a lock is fine there.
+ */
+
+#define TRANS_PROFILE_SITES	256
+
+struct trans_profile_site {
+	unsigned long		ip;
+	u64			restarts[BCH_TRANS_RESTART_NR];
+	u64			relock_fail;
+	u64			upgrade_fail;
+	u64			lock_waits;
+	u64			lock_wait_ns;
+	u64			lock_wait_max_ns;
+};
+
+static inline u64 trans_profile_site_events(struct trans_profile_site *s)
+{
+	u64 ret = s->relock_fail + s->upgrade_fail + s->lock_waits;
+	unsigned i;
+
+	for (i = 0; i < BCH_TRANS_RESTART_NR; i++)
+		ret += s->restarts[i];
+	return ret;
+}
+
+void bch2_trans_profile_restart(struct btree_trans *, enum bch_trans_restart);
+void bch2_trans_profile_lock_fail(struct btree_trans *, unsigned, bool);
+void bch2_trans_profile_lock_wait(struct btree_trans *, unsigned,
+				  enum six_lock_type, u64);
+
+void bch2_lock_wait_read(struct bch_fs *,
+		struct lock_wait_hist [BTREE_MAX_DEPTH][SIX_LOCK_write + 1]);
+u64 lock_wait_hist_quantile(struct lock_wait_hist *, unsigned);
+void bch2_lock_fails_read(struct bch_fs *, u64 *, u64 *);
+unsigned bch2_trans_profile_sites_read(struct bch_fs *,
+				       struct trans_profile_site *, unsigned);
+
+void bch2_fs_trans_profile_exit(struct bch_fs *);
+int bch2_fs_trans_profile_init(struct bch_fs *);
+
+#endif /* _BCACHEFS_TRANS_PROFILE_H */
@@ -117,7 +117,7 @@ void __bio_clone_fast(struct bio *bio, struct bio *bio_src)
 	 * most users will be overriding ->bi_bdev with a new target,
 	 * so we don't set nor calculate new physical/hw segment counts here
 	 */
-	bio->bi_bdev = bio_src->bi_bdev;
+	bio_copy_dev(bio, bio_src);
 	bio_set_flag(bio, BIO_CLONED);
 	bio->bi_opf = bio_src->bi_opf;
 	bio->bi_iter = bio_src->bi_iter;
@@ -178,11 +178,24 @@ void bio_advance(struct bio *bio, unsigned bytes)
 	bio_advance_iter(bio, &bio->bi_iter, bytes);
 }
 
+/*
+ * Bios from a bioset come from one of its slabs, by number of inline bvecs -
+ * the slab is recorded in BVEC_POOL_IDX(), as in the kernel:
+ */
+static const unsigned bvec_pool_sizes[BVEC_POOL_NR] = {
+	1, 4, 16, 64, 128, BIO_MAX_PAGES
+};
+
 static void bio_free(struct bio *bio)
 {
-	unsigned front_pad = bio->bi_pool ? bio->bi_pool->front_pad : 0;
+	struct bio_set *bs = bio->bi_pool;
+	unsigned idx = BVEC_POOL_IDX(bio);
+	void *p = (void *) bio - (bs ? bs->front_pad : 0);
 
-	kfree((void *) bio - front_pad);
+	if (idx)
+		kmem_cache_free(bs->bio_slabs[idx - 1], p);
+	else
+		kfree(p);
 }
 
 void bio_put(struct bio *bio)
@@ -251,6 +264,26 @@ static void bio_chain_endio(struct bio *bio)
 	bio_endio(__bio_chain_endio(bio));
 }
 
+/**
+ * bio_chain - chain bio completions
+ * @bio: the target bio
+ * @parent: the @bio's parent bio
+ *
+ * The caller won't have a bi_end_io called when @bio completes - instead,
+ * @parent's bi_end_io won't be called until both @parent and @bio have
+ * completed; the chained bio will also be freed when it completes.
+ *
+ * The caller must not set bi_private or bi_end_io in @bio.
+ */
+void bio_chain(struct bio *bio, struct bio *parent)
+{
+	BUG_ON(bio->bi_private || bio->bi_end_io);
+
+	bio->bi_private = parent;
+	bio->bi_end_io	= bio_chain_endio;
+	bio_inc_remaining(parent);
+}
+
 void bio_endio(struct bio *bio)
 {
 again:
@@ -283,27 +316,84 @@ void bio_reset(struct bio *bio)
 	atomic_set(&bio->__bi_remaining, 1);
 }
 
+static unsigned bvec_pool_idx(unsigned nr_iovecs)
+{
+	unsigned idx = 0;
+
+	while (idx < BVEC_POOL_NR &&
+	       bvec_pool_sizes[idx] < nr_iovecs)
+		idx++;
+	return idx;
+}
+
 struct bio *bio_alloc_bioset(gfp_t gfp_mask, int nr_iovecs, struct bio_set *bs)
 {
 	unsigned front_pad = bs ? bs->front_pad : 0;
+	unsigned idx = bvec_pool_idx(nr_iovecs);
 	struct bio *bio;
 	void *p;
 
-	p = kmalloc(front_pad +
-		    sizeof(struct bio) +
-		    nr_iovecs * sizeof(struct bio_vec),
-		    gfp_mask);
-
-	if (unlikely(!p))
-		return NULL;
+	if (bs && idx < BVEC_POOL_NR && bs->bio_slabs[idx]) {
+		p = kmem_cache_alloc(bs->bio_slabs[idx], gfp_mask);
+		if (unlikely(!p))
+			return NULL;
+
+		bio = p + front_pad;
+		bio_init(bio, bio->bi_inline_vecs, bvec_pool_sizes[idx]);
+		bio->bi_flags |= (idx + 1) << BVEC_POOL_OFFSET;
+	} else {
+		p = kmalloc(front_pad +
+			    sizeof(struct bio) +
+			    nr_iovecs * sizeof(struct bio_vec),
+			    gfp_mask);
+		if (unlikely(!p))
+			return NULL;
+
+		bio = p + front_pad;
+		bio_init(bio, bio->bi_inline_vecs, nr_iovecs);
+	}
 
-	bio = p + front_pad;
-	bio_init(bio, bio->bi_inline_vecs, nr_iovecs);
 	bio->bi_pool = bs;
-
 	return bio;
 }
 
+void bioset_exit(struct bio_set *bs)
+{
+	unsigned i;
+
+	for (i = 0; i < BVEC_POOL_NR; i++) {
+		kmem_cache_destroy(bs->bio_slabs[i]);
+		bs->bio_slabs[i] = NULL;
+	}
+}
+
+int bioset_init(struct bio_set *bs,
+		unsigned pool_size,
+		unsigned front_pad,
+		int flags)
+{
+	unsigned i;
+	char name[32];
+
+	bs->front_pad = front_pad;
+
+	/* slabs only take memory once they're used: */
+	for (i = 0; i < BVEC_POOL_NR; i++) {
+		snprintf(name, sizeof(name), "bio-%u-%u",
+			 front_pad, bvec_pool_sizes[i]);
+		bs->bio_slabs[i] = kmem_cache_create(name,
+				front_pad + sizeof(struct bio) +
+				bvec_pool_sizes[i] * sizeof(struct bio_vec),
+				__alignof__(struct bio), SLAB_HWCACHE_ALIGN, NULL);
+		if (!bs->bio_slabs[i]) {
+			bioset_exit(bs);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 struct bio *bio_clone_bioset(struct bio *bio_src, gfp_t gfp_mask,
 			     struct bio_set *bs)
 {
@@ -315,7 +405,7 @@ struct bio *bio_clone_bioset(struct bio *bio_src, gfp_t gfp_mask,
 	if (!bio)
 		return NULL;
 
-	bio->bi_bdev		= bio_src->bi_bdev;
+	bio_copy_dev(bio, bio_src);
 	bio->bi_opf		= bio_src->bi_opf;
 	bio->bi_iter.bi_sector	= bio_src->bi_iter.bi_sector;
 	bio->bi_iter.bi_size	= bio_src->bi_iter.bi_size;
@@ -1,89 +1,960 @@
-
 #include <alloca.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <linux/falloc.h>
 #include <libaio.h>
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blktrace_api.h>
 #include <linux/completion.h>
 #include <linux/fs.h>
 #include <linux/kthread.h>
+#include <linux/workqueue.h>
 
 #include "tools-util.h"
 
-static io_context_t aio_ctx;
+enum blkdev_io_engine {
+	IO_ENGINE_AIO,
+	IO_ENGINE_URING,
+};
 
-void generic_make_request(struct bio *bio)
+static enum blkdev_io_engine io_engine = IO_ENGINE_AIO;
+
+#ifdef HAVE_LIBURING
+#define URING_ENTRIES		256
+#define URING_MAX_FILES		256
+#endif
+
+/*
+ * A submission and completion context - an io_uring or an aio context, and the
+ * thread reaping its completions. Devices share one, unless
+ * BCACHEFS_IO_QUEUES=per-device:
+ */
+struct blk_ioq {
+	io_context_t		aio_ctx;
+#ifdef HAVE_LIBURING
+	struct io_uring		ring;
+	/* the submission queue is single producer: */
+	pthread_mutex_t		ring_lock;
+	int			ring_files[URING_MAX_FILES];
+#endif
+	struct task_struct	*reaper;
+};
+
+static struct blk_ioq	shared_ioq;
+static bool		ioq_per_device;
+#ifdef HAVE_LIBURING
+static bool		uring_sqpoll;
+#endif
+
+/*
+ * Reapers hand completions to the completion threads, so that endio work
+ * (checksumming, decompression) doesn't hold up reaping - if there are none,
+ * completions are run by the reapers.
+ *
+ * These are our own threads, not a workqueue: work items that wait on I/O
+ * (submit_bio_wait()) can fill up a workqueue's workers, and then nothing
+ * would be left to run the completions they're waiting on.
+ */
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	struct list_head	reqs;
+	unsigned		nr_threads;
+	/* started by the first blkdev_get_by_path(): */
+	unsigned		want_threads;
+}			endio = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.wait	= PTHREAD_COND_INITIALIZER,
+	.reqs	= LIST_HEAD_INIT(endio.reqs),
+};
+
+static struct workqueue_struct *discard_wq;
+
+enum blkdev_io_mode {
+	IO_MODE_DIRECT,
+	IO_MODE_BUFFERED,
+};
+
+static enum blkdev_io_mode io_mode = IO_MODE_DIRECT;
+
+/*
+ * A read or write as handed to the kernel: either a single bio, or a run of
+ * bios to adjacent sectors that were merged while plugged, chained through
+ * bi_next - or a flush, or a discard.
+ *
+ * REQ_FUA writes are done with RWF_DSYNC; REQ_PREFLUSH is an fdatasync that
+ * the read or write is ordered after - linked, with io_uring, and submitted
+ * from the completion of the fdatasync with aio.
+ *
+ * Neither aio nor io_uring can discard, so discards (merged like writes) are
+ * done from discard_wq:
+ */
+struct blk_req {
+	struct bio		*bios;
+	bool			preflush;
+	u64			offset;
+	size_t			bytes;
+	/*
+	 * O_DIRECT requests that aren't aligned to the device's logical block
+	 * size are done to an aligned bounce buffer, which starts bounce_skip
+	 * bytes before offset:
+	 */
+	struct iovec		bounce;
+	unsigned		bounce_skip;
+	long			res;
+	union {
+		struct iocb		iocb;
+		struct work_struct	work;
+		/* on endio.reqs: */
+		struct list_head	endio_list;
+	};
+	unsigned		nr_iov;
+	struct iovec		iov[];
+};
+
+static bool blk_req_aligned(struct blk_req *req, unsigned align)
+{
+	unsigned long v = req->offset|req->bytes;
+	unsigned i;
+
+	for (i = 0; i < req->nr_iov; i++)
+		v |= (unsigned long) req->iov[i].iov_base|req->iov[i].iov_len;
+
+	return !(v & (align - 1));
+}
+
+static void blk_req_bounce_copy(struct blk_req *req, bool to_bounce)
+{
+	void *p = req->bounce.iov_base + req->bounce_skip;
+	unsigned i;
+
+	for (i = 0; i < req->nr_iov; i++) {
+		if (to_bounce)
+			memcpy(p, req->iov[i].iov_base, req->iov[i].iov_len);
+		else
+			memcpy(req->iov[i].iov_base, p, req->iov[i].iov_len);
+		p += req->iov[i].iov_len;
+	}
+}
+
+/* @res: bytes transferred, or -errno */
+static void blk_req_endio(struct blk_req *req, long res)
+{
+	struct bio *bio = req->bios, *next;
+	size_t done = 0;
+
+	if (req->bounce.iov_base) {
+		if (res >= 0) {
+			res = max_t(long, res - req->bounce_skip, 0);
+			res = min_t(long, res, req->bytes);
+		}
+
+		if (res > 0 && bio_op(req->bios) == REQ_OP_READ)
+			blk_req_bounce_copy(req, false);
+		free(req->bounce.iov_base);
+	}
+
+	/* on a short read or write, only the bios past the end failed: */
+	while (bio) {
+		next = bio->bi_next;
+		bio->bi_next = NULL;
+
+		done += bio->bi_iter.bi_size;
+		if (res < 0 || done > (size_t) res)
+			bio->bi_status = BLK_STS_IOERR;
+
+		bio_endio(bio);
+		bio = next;
+	}
+
+	free(req);
+}
+
+static int blk_endio_thread(void *arg)
+{
+	struct blk_req *req;
+
+	pthread_mutex_lock(&endio.lock);
+	while (1) {
+		while (list_empty(&endio.reqs))
+			pthread_cond_wait(&endio.wait, &endio.lock);
+
+		req = list_first_entry(&endio.reqs, struct blk_req, endio_list);
+		list_del(&req->endio_list);
+		pthread_mutex_unlock(&endio.lock);
+
+		blk_req_endio(req, req->res);
+
+		pthread_mutex_lock(&endio.lock);
+	}
+
+	return 0;
+}
+
+/*
+ * Before any device is opened there's no I/O, so commands that never open one
+ * (--help, format) don't start completion threads at all:
+ */
+static void blk_endio_threads_start(void)
+{
+	pthread_mutex_lock(&endio.lock);
+	for (;
+	     endio.nr_threads < endio.want_threads;
+	     endio.nr_threads++)
+		BUG_ON(IS_ERR(kthread_run(blk_endio_thread, NULL,
+					  "io_completion/%u", endio.nr_threads)));
+	pthread_mutex_unlock(&endio.lock);
+}
+
+/* called by the reapers: */
+static void blk_req_complete(struct blk_req *req, long res)
+{
+	if (!endio.nr_threads) {
+		blk_req_endio(req, res);
+		return;
+	}
+
+	req->res = res;
+
+	pthread_mutex_lock(&endio.lock);
+	list_add_tail(&req->endio_list, &endio.reqs);
+	pthread_cond_signal(&endio.wait);
+	pthread_mutex_unlock(&endio.lock);
+}
+
+static int blk_req_rw_flags(struct blk_req *req)
 {
-	struct iovec *iov;
+	return req->bios->bi_opf & REQ_FUA ? RWF_DSYNC : 0;
+}
+
+static bool blk_req_partial_block(struct blk_req *req, unsigned align)
+{
+	return ((req->offset|req->bytes) & (align - 1)) != 0;
+}
+
+static int blk_req_bounce(struct blk_req *req, unsigned align)
+{
+	u64 start	= round_down(req->offset, align);
+	u64 end		= round_up(req->offset + req->bytes, align);
+	size_t len	= end - start;
+	void *buf	= aligned_alloc(align, len);
+
+	if (!buf)
+		return -ENOMEM;
+
+	req->bounce	= (struct iovec) { .iov_base = buf, .iov_len = len };
+	req->bounce_skip = req->offset - start;
+
+	/* partial block writes are copied in by blk_req_rmw(): */
+	if (bio_op(req->bios) == REQ_OP_WRITE &&
+	    !blk_req_partial_block(req, align))
+		blk_req_bounce_copy(req, true);
+
+	return 0;
+}
+
+/*
+ * Writes of partial blocks are read-modify-write of the blocks at either end -
+ * and writes to different parts of the same block (a filesystem with a smaller
+ * block size than the device's O_DIRECT alignment) can be in flight at the
+ * same time, so we do them synchronously, under bd_rmw_lock.
+ *
+ * Full block writes never overlap a write in progress to part of the same
+ * block, so they don't need the lock.
+ *
+ * @req has been bounced; returns bytes written or -errno.
+ */
+static long blk_req_rmw(struct blk_req *req, unsigned align)
+{
+	struct block_device *bdev = req->bios->bi_bdev;
+	void *buf	= req->bounce.iov_base;
+	size_t len	= req->bounce.iov_len;
+	u64 start	= req->offset - req->bounce_skip;
+	u64 end		= start + len;
+	ssize_t ret;
+
+	if (req->preflush && fdatasync(bdev->bd_fd))
+		return -errno;
+
+	mutex_lock(&bdev->bd_rmw_lock);
+	if (start != req->offset) {
+		ret = pread(bdev->bd_fd, buf, align, start);
+		if (ret != align)
+			goto err;
+	}
+
+	if (end != req->offset + req->bytes &&
+	    (len > align || start == req->offset)) {
+		ret = pread(bdev->bd_fd, buf + len - align, align, end - align);
+		if (ret != align)
+			goto err;
+	}
+
+	blk_req_bounce_copy(req, true);
+
+	ret = pwritev2(bdev->bd_fd, &req->bounce, 1, start,
+		       blk_req_rw_flags(req));
+	if (ret < 0)
+		ret = -errno;
+	mutex_unlock(&bdev->bd_rmw_lock);
+
+	return ret;
+err:
+	ret = ret < 0 ? -errno : -EIO;
+	mutex_unlock(&bdev->bd_rmw_lock);
+	return ret;
+}
+
+static struct blk_req *blk_req_alloc(struct bio *bios, unsigned nr_iov)
+{
+	struct blk_req *req = xmalloc(sizeof(*req) + sizeof(req->iov[0]) * nr_iov);
+	unsigned align = bios->bi_bdev->bd_dio_align;
 	struct bvec_iter iter;
 	struct bio_vec bv;
-	ssize_t ret;
-	unsigned i;
+	struct bio *bio;
+	int ret;
+
+	req->bios	= bios;
+	req->preflush	= bio_op(bios) != REQ_OP_FLUSH &&
+		(bios->bi_opf & REQ_PREFLUSH);
+	req->offset	= bios->bi_iter.bi_sector << 9;
+	req->bytes	= 0;
+	req->bounce	= (struct iovec) { NULL, 0 };
+	req->bounce_skip = 0;
+	req->nr_iov	= 0;
 
-	if (bio->bi_opf & REQ_PREFLUSH) {
-		ret = fdatasync(bio->bi_bdev->bd_fd);
+	for (bio = bios; bio; bio = bio->bi_next) {
+		if (bio_has_data(bio))
+			bio_for_each_segment(bv, bio, iter)
+				req->iov[req->nr_iov++] = (struct iovec) {
+					.iov_base = page_address(bv.bv_page) + bv.bv_offset,
+					.iov_len = bv.bv_len,
+				};
+		req->bytes += bio->bi_iter.bi_size;
+	}
+
+	BUG_ON(req->nr_iov != nr_iov);
+
+	if (align && req->nr_iov && !blk_req_aligned(req, align)) {
+		ret = blk_req_bounce(req, align);
 		if (ret) {
-			fprintf(stderr, "fsync error: %m\n");
-			bio->bi_status = BLK_STS_IOERR;
-			bio_endio(bio);
-			return;
+			blk_req_endio(req, ret);
+			return NULL;
+		}
+
+		if (bio_op(bios) == REQ_OP_WRITE &&
+		    blk_req_partial_block(req, align)) {
+			blk_req_endio(req, blk_req_rmw(req, align));
+			return NULL;
 		}
 	}
 
-	i = 0;
-	bio_for_each_segment(bv, bio, iter)
-		i++;
+	return req;
+}
 
-	iov = alloca(sizeof(*iov) * i);
+/* the iovec and offset the I/O is actually issued with: */
+static const struct iovec *blk_req_iov(struct blk_req *req, unsigned *nr)
+{
+	if (req->bounce.iov_base) {
+		*nr = 1;
+		return &req->bounce;
+	}
 
-	i = 0;
-	bio_for_each_segment(bv, bio, iter)
-		iov[i++] = (struct iovec) {
-			.iov_base = page_address(bv.bv_page) + bv.bv_offset,
-			.iov_len = bv.bv_len,
-		};
+	*nr = req->nr_iov;
+	return req->iov;
+}
 
-	struct iocb iocb = {
-		.data		= bio,
-		.aio_fildes	= bio->bi_opf & REQ_FUA
-			? bio->bi_bdev->bd_sync_fd
-			: bio->bi_bdev->bd_fd,
-	}, *iocbp = &iocb;
+static u64 blk_req_offset(struct blk_req *req)
+{
+	return req->offset - req->bounce_skip;
+}
 
-	switch (bio_op(bio)) {
-	case REQ_OP_READ:
-		iocb.aio_lio_opcode	= IO_CMD_PREADV;
-		iocb.u.v.vec		= iov;
-		iocb.u.v.nr		= i;
-		iocb.u.v.offset		= bio->bi_iter.bi_sector << 9;
+#ifdef HAVE_LIBURING
+
+static int uring_register_fd(struct blk_ioq *q, int fd)
+{
+	int i;
+
+	pthread_mutex_lock(&q->ring_lock);
+	for (i = 0; i < URING_MAX_FILES; i++)
+		if (q->ring_files[i] < 0)
+			break;
+
+	if (i == URING_MAX_FILES ||
+	    io_uring_register_files_update(&q->ring, i, &fd, 1) != 1)
+		i = -1;
+	else
+		q->ring_files[i] = fd;
+	pthread_mutex_unlock(&q->ring_lock);
+
+	return i;
+}
+
+static void uring_unregister_fd(struct blk_ioq *q, int idx)
+{
+	int fd = -1;
+
+	if (idx < 0)
+		return;
+
+	pthread_mutex_lock(&q->ring_lock);
+	io_uring_register_files_update(&q->ring, idx, &fd, 1);
+	q->ring_files[idx] = -1;
+	pthread_mutex_unlock(&q->ring_lock);
+}
+
+/*
+ * Make room for @nr sqes: a chain of linked sqes must be submitted together,
+ * the link doesn't carry over to the next io_uring_submit()
+ */
+static void uring_reserve_sqes(struct blk_ioq *q, unsigned nr)
+{
+	while (io_uring_sq_space_left(&q->ring) < nr)
+		io_uring_submit(&q->ring);
+}
+
+static void uring_submit_reqs(struct blk_ioq *q, struct blk_req **reqs,
+			      unsigned nr)
+{
+	unsigned i;
+	int ret;
+
+	pthread_mutex_lock(&q->ring_lock);
+	for (i = 0; i < nr; i++) {
+		struct blk_req *req = reqs[i];
+		struct block_device *bdev = req->bios->bi_bdev;
+		struct io_uring_sqe *sqe;
+		int idx = bdev->bd_fd_idx;
+		int fd = idx >= 0 ? idx : bdev->bd_fd;
+		unsigned flags = idx >= 0 ? IOSQE_FIXED_FILE : 0;
+		unsigned nr_iov;
+		const struct iovec *iov = blk_req_iov(req, &nr_iov);
+
+		uring_reserve_sqes(q, req->preflush ? 2 : 1);
+
+		if (req->preflush) {
+			/* if the flush fails the linked I/O gets -ECANCELED: */
+			sqe = io_uring_get_sqe(&q->ring);
+			io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+			io_uring_sqe_set_flags(sqe, flags|IOSQE_IO_LINK);
+			io_uring_sqe_set_data(sqe, NULL);
+		}
+
+		sqe = io_uring_get_sqe(&q->ring);
+
+		/*
+		 * With SQPOLL the kernel may read the iovec after we return,
+		 * so it lives in the request until completion:
+		 */
+		switch (bio_op(req->bios)) {
+		case REQ_OP_READ:
+			io_uring_prep_readv(sqe, fd, iov, nr_iov,
+					    blk_req_offset(req));
+			break;
+		case REQ_OP_WRITE:
+			io_uring_prep_writev2(sqe, fd, iov, nr_iov,
+					      blk_req_offset(req),
+					      blk_req_rw_flags(req));
+			break;
+		case REQ_OP_FLUSH:
+			io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+			break;
+		default:
+			BUG();
+		}
+
+		io_uring_sqe_set_flags(sqe, flags);
+		io_uring_sqe_set_data(sqe, req);
+	}
+
+	ret = io_uring_submit(&q->ring);
+	pthread_mutex_unlock(&q->ring_lock);
+
+	if (ret < 0)
+		die("io_uring_submit err: %s", strerror(-ret));
+}
+
+/* a nop with the queue as user_data tells the reaper to exit: */
+static void uring_stop_reaper(struct blk_ioq *q)
+{
+	struct io_uring_sqe *sqe;
+
+	pthread_mutex_lock(&q->ring_lock);
+	uring_reserve_sqes(q, 1);
+	sqe = io_uring_get_sqe(&q->ring);
+	io_uring_prep_nop(sqe);
+	io_uring_sqe_set_data(sqe, q);
+	io_uring_submit(&q->ring);
+	pthread_mutex_unlock(&q->ring_lock);
+}
+
+static int uring_reaper(void *arg)
+{
+	struct blk_ioq *q = arg;
+	struct io_uring_cqe *cqes[32], *cqe;
+	struct {
+		struct blk_req	*req;
+		int		res;
+	} done[ARRAY_SIZE(cqes)];
+	unsigned i, nr;
+	bool stop = false;
+	int ret;
+
+	while (!stop) {
+		ret = io_uring_wait_cqe(&q->ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0)
+			die("io_uring_wait_cqe() error: %s", strerror(-ret));
+
+		nr = io_uring_peek_batch_cqe(&q->ring, cqes, ARRAY_SIZE(cqes));
+		for (i = 0; i < nr; i++) {
+			done[i].req = io_uring_cqe_get_data(cqes[i]);
+			done[i].res = cqes[i]->res;
+		}
+		io_uring_cq_advance(&q->ring, nr);
 
-		ret = io_submit(aio_ctx, 1, &iocbp);
-		if (ret != 1)
+		/* preflushes have no request, the I/O linked to them does: */
+		for (i = 0; i < nr; i++)
+			if (done[i].req == (void *) q)
+				stop = true;
+			else if (done[i].req)
+				blk_req_complete(done[i].req, done[i].res);
+	}
+
+	return 0;
+}
+
+static int uring_ioq_init(struct blk_ioq *q)
+{
+	struct io_uring_params p;
+	unsigned i;
+	int ret;
+
+	memset(&p, 0, sizeof(p));
+	if (uring_sqpoll) {
+		p.flags		|= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 100;
+	}
+
+	ret = io_uring_queue_init_params(URING_ENTRIES, &q->ring, &p);
+	if (ret && uring_sqpoll) {
+		fprintf(stderr, "io_uring SQPOLL setup error: %s, "
+			"falling back to normal submission\n", strerror(-ret));
+		uring_sqpoll = false;
+		return uring_ioq_init(q);
+	}
+	if (ret)
+		return ret;
+
+	pthread_mutex_init(&q->ring_lock, NULL);
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		q->ring_files[i] = -1;
+
+	ret = io_uring_register_files(&q->ring, q->ring_files, URING_MAX_FILES);
+	if (ret)
+		fprintf(stderr, "io_uring file registration error: %s\n",
+			strerror(-ret));
+
+	return 0;
+}
+
+#endif /* HAVE_LIBURING */
+
+static void aio_submit_reqs(struct blk_ioq *q, struct blk_req **reqs,
+			    unsigned nr)
+{
+	struct iocb **iocbs = alloca(sizeof(iocbs[0]) * nr);
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < nr; i++) {
+		struct blk_req *req = reqs[i];
+		unsigned nr_iov;
+		const struct iovec *iov = blk_req_iov(req, &nr_iov);
+
+		req->iocb = (struct iocb) {
+			.data		= req,
+			.aio_fildes	= req->bios->bi_bdev->bd_fd,
+		};
+
+		if (req->preflush || bio_op(req->bios) == REQ_OP_FLUSH) {
+			/* io_prep_fdsync() zeroes the whole iocb, data included: */
+			io_prep_fdsync(&req->iocb, req->iocb.aio_fildes);
+			req->iocb.data = req;
+		} else {
+			req->iocb.aio_lio_opcode = bio_op(req->bios) == REQ_OP_READ
+				? IO_CMD_PREADV
+				: IO_CMD_PWRITEV;
+			req->iocb.aio_rw_flags	= blk_req_rw_flags(req);
+			req->iocb.u.v.vec	= (struct iovec *) iov;
+			req->iocb.u.v.nr	= nr_iov;
+			req->iocb.u.v.offset	= blk_req_offset(req);
+		}
+		iocbs[i] = &req->iocb;
+	}
+
+	while (nr) {
+		ret = io_submit(q->aio_ctx, nr, iocbs);
+		if (ret <= 0)
 			die("io_submit err: %s", strerror(-ret));
+
+		iocbs	+= ret;
+		nr	-= ret;
+	}
+}
+
+static int aio_reaper(void *arg)
+{
+	struct blk_ioq *q = arg;
+	struct io_event events[8], *ev;
+	bool stop = false;
+	int ret;
+
+	while (!stop) {
+		ret = io_getevents(q->aio_ctx, 1, ARRAY_SIZE(events),
+				   events, NULL);
+
+		if (ret < 0 && ret == -EINTR)
+			continue;
+		if (ret < 0)
+			die("io_getevents() error: %s", strerror(-ret));
+
+		for (ev = events; ev < events + ret; ev++) {
+			struct blk_req *req = ev->data;
+
+			if (ev->data == (void *) q) {
+				stop = true;
+				continue;
+			}
+
+			if (req->preflush && (long) ev->res >= 0) {
+				req->preflush = false;
+				aio_submit_reqs(q, &req, 1);
+				continue;
+			}
+
+			blk_req_complete(req, (long) ev->res);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * aio has no nop: an fdatasync of @fd, with the queue as data, tells the reaper
+ * to exit
+ */
+static void aio_stop_reaper(struct blk_ioq *q, int fd)
+{
+	struct iocb iocb, *iocbp = &iocb;
+
+	/* io_prep_fdsync() zeroes the iocb, so set data afterwards: */
+	io_prep_fdsync(&iocb, fd);
+	iocb.data = q;
+	if (io_submit(q->aio_ctx, 1, &iocbp) != 1)
+		die("io_submit err: %m");
+}
+
+static int blk_ioq_init(struct blk_ioq *q, const char *name)
+{
+	int (*reaper)(void *) = aio_reaper;
+	int ret;
+
+#ifdef HAVE_LIBURING
+	if (io_engine == IO_ENGINE_URING) {
+		ret = uring_ioq_init(q);
+		if (ret)
+			return ret;
+		reaper = uring_reaper;
+	} else
+#endif
+	{
+		ret = io_setup(256, &q->aio_ctx);
+		if (ret)
+			return ret;
+	}
+
+	q->reaper = kthread_create(reaper, q, "%s", name);
+	BUG_ON(IS_ERR(q->reaper));
+	get_task_struct(q->reaper);
+	wake_up_process(q->reaper);
+	return 0;
+}
+
+static void blk_ioq_exit(struct blk_ioq *q, int fd)
+{
+#ifdef HAVE_LIBURING
+	if (io_engine == IO_ENGINE_URING)
+		uring_stop_reaper(q);
+	else
+#endif
+		aio_stop_reaper(q, fd);
+
+	kthread_stop(q->reaper);
+	put_task_struct(q->reaper);
+
+#ifdef HAVE_LIBURING
+	if (io_engine == IO_ENGINE_URING)
+		io_uring_queue_exit(&q->ring);
+	else
+#endif
+		io_destroy(q->aio_ctx);
+}
+
+static int blk_discard(struct block_device *bdev, u64 offset, u64 len)
+{
+	struct stat statbuf;
+	int ret;
+
+	ret = fstat(bdev->bd_fd, &statbuf);
+	BUG_ON(ret);
+
+	if (S_ISBLK(statbuf.st_mode)) {
+		u64 range[2] = { offset, len };
+
+		ret = ioctl(bdev->bd_fd, BLKDISCARD, range);
+	} else {
+		ret = fallocate(bdev->bd_fd,
+				FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+				offset, len);
+	}
+
+	if (!ret)
+		return 0;
+
+	ret = -errno;
+	if (ret == -EOPNOTSUPP || ret == -ENOTTY) {
+		clear_bit(QUEUE_FLAG_DISCARD, &bdev->queue.queue_flags);
+		ret = -EOPNOTSUPP;
+	}
+
+	return ret;
+}
+
+static void blk_discard_work(struct work_struct *work)
+{
+	struct blk_req *req = container_of(work, struct blk_req, work);
+	int ret = blk_discard(req->bios->bi_bdev, req->offset, req->bytes);
+
+	blk_req_endio(req, ret ?: req->bytes);
+}
+
+static void blk_ioq_submit(struct blk_ioq *q, struct blk_req **reqs,
+			   unsigned nr)
+{
+#ifdef HAVE_LIBURING
+	if (io_engine == IO_ENGINE_URING) {
+		uring_submit_reqs(q, reqs, nr);
+		return;
+	}
+#endif
+	aio_submit_reqs(q, reqs, nr);
+}
+
+static inline struct blk_ioq *blk_req_ioq(struct blk_req *req)
+{
+	return req->bios->bi_bdev->bd_ioq;
+}
+
+static void submit_reqs(struct blk_req **reqs, unsigned nr)
+{
+	unsigned i, j, nr_rw = 0;
+
+	for (i = 0; i < nr; i++)
+		if (bio_op(reqs[i]->bios) == REQ_OP_DISCARD) {
+			INIT_WORK(&reqs[i]->work, blk_discard_work);
+			queue_work(discard_wq, &reqs[i]->work);
+		} else {
+			reqs[nr_rw++] = reqs[i];
+		}
+
+	/* plugged requests are sorted by device, so this batches per queue: */
+	for (i = 0; i < nr_rw; i = j) {
+		for (j = i + 1;
+		     j < nr_rw && blk_req_ioq(reqs[j]) == blk_req_ioq(reqs[i]);
+		     j++)
+			;
+
+		blk_ioq_submit(blk_req_ioq(reqs[i]), reqs + i, j - i);
+	}
+}
+
+static unsigned bio_nr_iov(struct bio *bio)
+{
+	return bio_has_data(bio) ? bio_segments(bio) : 0;
+}
+
+static bool bios_mergeable(struct bio *l, struct bio *r)
+{
+	return l->bi_bdev == r->bi_bdev &&
+		bio_op(l) == bio_op(r) &&
+		!((l->bi_opf|r->bi_opf) & REQ_NOMERGE_FLAGS) &&
+		l->bi_iter.bi_sector + bio_sectors(l) == r->bi_iter.bi_sector;
+}
+
+static inline bool bio_plug_cmp(struct bio *l, struct bio *r)
+{
+	return l->bi_bdev != r->bi_bdev
+		? l->bi_bdev > r->bi_bdev
+		: l->bi_iter.bi_sector > r->bi_iter.bi_sector;
+}
+
+static void __blk_flush_plug(struct blk_plug *plug)
+{
+	struct bio *bios[BLK_MAX_REQUEST_COUNT], *bio;
+	struct blk_req *reqs[BLK_MAX_REQUEST_COUNT];
+	unsigned i, j, nr = 0, nr_reqs = 0;
+
+	while ((bio = plug->head)) {
+		plug->head = bio->bi_next;
+		bio->bi_next = NULL;
+
+		/* insertion sort, to keep submission order for equal keys: */
+		for (i = nr++; i && bio_plug_cmp(bios[i - 1], bio); --i)
+			bios[i] = bios[i - 1];
+		bios[i] = bio;
+	}
+
+	plug->tail	= NULL;
+	plug->nr	= 0;
+
+	for (i = 0; i < nr; i = j) {
+		unsigned nr_iov = bio_nr_iov(bios[i]);
+
+		for (j = i + 1;
+		     j < nr &&
+		     bios_mergeable(bios[j - 1], bios[j]) &&
+		     nr_iov + bio_nr_iov(bios[j]) <= IOV_MAX;
+		     j++) {
+			nr_iov += bio_nr_iov(bios[j]);
+			bios[j - 1]->bi_next = bios[j];
+		}
+
+		reqs[nr_reqs] = blk_req_alloc(bios[i], nr_iov);
+		if (reqs[nr_reqs])
+			nr_reqs++;
+	}
+
+	if (nr_reqs)
+		submit_reqs(reqs, nr_reqs);
+}
+
+void blk_start_plug(struct blk_plug *plug)
+{
+	plug->head	= NULL;
+	plug->tail	= NULL;
+	plug->nr	= 0;
+
+	/* nested plugs are ignored, the outermost one is flushed: */
+	if (!current->plug)
+		current->plug = plug;
+}
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+	if (plug != current->plug)
+		return;
+
+	__blk_flush_plug(plug);
+	current->plug = NULL;
+}
+
+/* called before sleeping, so plugged IO can't be waited on: */
+void blk_flush_plug(struct task_struct *tsk)
+{
+	if (tsk->plug)
+		__blk_flush_plug(tsk->plug);
+}
+
+void blk_fill_rwbs(char *rwbs, unsigned int op, int bytes)
+{
+	int i = 0;
+
+	if (op & REQ_PREFLUSH)
+		rwbs[i++] = 'F';
+
+	switch (op & REQ_OP_MASK) {
+	case REQ_OP_WRITE:
+	case REQ_OP_WRITE_SAME:
+		rwbs[i++] = 'W';
+		break;
+	case REQ_OP_DISCARD:
+		rwbs[i++] = 'D';
+		break;
+	case REQ_OP_SECURE_ERASE:
+		rwbs[i++] = 'D';
+		rwbs[i++] = 'E';
 		break;
+	case REQ_OP_FLUSH:
+		rwbs[i++] = 'F';
+		break;
+	case REQ_OP_READ:
+		rwbs[i++] = 'R';
+		break;
+	default:
+		rwbs[i++] = 'N';
+	}
+
+	if (op & REQ_FUA)
+		rwbs[i++] = 'F';
+	if (op & REQ_RAHEAD)
+		rwbs[i++] = 'A';
+	if (op & REQ_SYNC)
+		rwbs[i++] = 'S';
+	if (op & REQ_META)
+		rwbs[i++] = 'M';
+
+	rwbs[i] = '\0';
+}
+
+void generic_make_request(struct bio *bio)
+{
+	struct blk_plug *plug = current->plug;
+	struct blk_req *req;
+
+	switch (bio_op(bio)) {
+	case REQ_OP_READ:
 	case REQ_OP_WRITE:
-		iocb.aio_lio_opcode	= IO_CMD_PWRITEV;
-		iocb.u.v.vec		= iov;
-		iocb.u.v.nr		= i;
-		iocb.u.v.offset		= bio->bi_iter.bi_sector << 9;
+	case REQ_OP_DISCARD:
+		if (plug) {
+			bio->bi_next = NULL;
+			if (plug->tail)
+				plug->tail->bi_next = bio;
+			else
+				plug->head = bio;
+			plug->tail = bio;
 
-		ret = io_submit(aio_ctx, 1, &iocbp);
-		if (ret != 1)
-			die("io_submit err: %s", strerror(-ret));
+			if (++plug->nr >= BLK_MAX_REQUEST_COUNT)
+				__blk_flush_plug(plug);
+			break;
+		}
+
+		req = blk_req_alloc(bio, bio_nr_iov(bio));
+		if (req)
+			submit_reqs(&req, 1);
 		break;
 	case REQ_OP_FLUSH:
-		ret = fsync(bio->bi_bdev->bd_fd);
-		if (ret)
-			die("fsync error: %m");
-		bio_endio(bio);
+		req = blk_req_alloc(bio, 0);
+		if (req)
+			submit_reqs(&req, 1);
 		break;
 	default:
 		BUG();
@@ -109,11 +980,60 @@ int submit_bio_wait(struct bio *bio)
 	return blk_status_to_errno(bio->bi_status);
 }
 
+int __blkdev_issue_discard(struct block_device *bdev, sector_t sector,
+			   sector_t nr_sects, gfp_t gfp_mask, int flags,
+			   struct bio **biop)
+{
+	struct bio *bio = *biop;
+	sector_t len;
+
+	if (!blk_queue_discard(bdev_get_queue(bdev)))
+		return -EOPNOTSUPP;
+
+	while (nr_sects) {
+		len = min_t(sector_t, nr_sects, UINT_MAX >> 9);
+
+		if (bio) {
+			struct bio *next = bio_alloc(gfp_mask, 0);
+
+			bio_chain(bio, next);
+			submit_bio(bio);
+			bio = next;
+		} else {
+			bio = bio_alloc(gfp_mask, 0);
+		}
+
+		bio_set_dev(bio, bdev);
+		bio->bi_opf		= REQ_OP_DISCARD;
+		bio->bi_iter.bi_sector	= sector;
+		bio->bi_iter.bi_size	= len << 9;
+
+		sector		+= len;
+		nr_sects	-= len;
+	}
+
+	*biop = bio;
+	return 0;
+}
+
 int blkdev_issue_discard(struct block_device *bdev,
 			 sector_t sector, sector_t nr_sects,
 			 gfp_t gfp_mask, unsigned long flags)
 {
-	return 0;
+	struct bio *bio = NULL;
+	struct blk_plug plug;
+	int ret;
+
+	blk_start_plug(&plug);
+	ret = __blkdev_issue_discard(bdev, sector, nr_sects, gfp_mask,
+				     flags, &bio);
+	if (!ret && bio) {
+		ret = submit_bio_wait(bio);
+		bio_put(bio);
+	}
+	blk_finish_plug(&plug);
+
+	return ret;
 }
 
 unsigned bdev_logical_block_size(struct block_device *bdev)
@@ -157,16 +1077,99 @@ sector_t get_capacity(struct gendisk *disk)
 void blkdev_put(struct block_device *bdev, fmode_t mode)
 {
 	fdatasync(bdev->bd_fd);
-	close(bdev->bd_sync_fd);
+#ifdef HAVE_LIBURING
+	if (io_engine == IO_ENGINE_URING)
+		uring_unregister_fd(bdev->bd_ioq, bdev->bd_fd_idx);
+#endif
+	if (bdev->bd_ioq != &shared_ioq) {
+		blk_ioq_exit(bdev->bd_ioq, bdev->bd_fd);
+		free(bdev->bd_ioq);
+	}
 	close(bdev->bd_fd);
 	free(bdev);
 }
 
+/*
+ * struct statx as the kernel has it - glibc's may predate the direct I/O
+ * alignment fields, and linux/stat.h here is our own:
+ */
+struct dio_statx {
+	u32		mask;
+	u32		blksize;
+	u64		attributes;
+	u32		nlink;
+	u32		uid;
+	u32		gid;
+	u16		mode;
+	u16		__spare0;
+	u64		ino;
+	u64		size;
+	u64		blocks;
+	u64		attributes_mask;
+	struct {
+		s64	tv_sec;
+		u32	tv_nsec;
+		s32	__reserved;
+	}		atime, btime, ctime, mtime;
+	u32		rdev_major;
+	u32		rdev_minor;
+	u32		dev_major;
+	u32		dev_minor;
+	u64		mnt_id;
+	u32		dio_mem_align;
+	u32		dio_offset_align;
+	u64		__spare3[12];
+};
+
+#ifndef STATX_DIOALIGN
+#define STATX_DIOALIGN		0x00002000U
+#endif
+
+/*
+ * Alignment O_DIRECT requires of buffers, offsets and lengths: the logical
+ * block size for block devices; for files, what statx() reports, or if the
+ * kernel is too old to say, the filesystem block size - which is always
+ * sufficient, but is usually more than needed.
+ *
+ * Returns 0 if the file can't do O_DIRECT at all.
+ */
+static unsigned dio_alignment(int fd)
+{
+	struct dio_statx stx;
+	struct stat statbuf;
+	int ssz;
+
+	BUILD_BUG_ON(sizeof(stx) != 256);
+	BUILD_BUG_ON(offsetof(struct dio_statx, dio_offset_align) != 156);
+
+	if (fstat(fd, &statbuf))
+		return PAGE_SIZE;
+
+	if (S_ISBLK(statbuf.st_mode))
+		return !ioctl(fd, BLKSSZGET, &ssz) ? ssz : PAGE_SIZE;
+
+	if (!syscall(SYS_statx, fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) &&
+	    (stx.mask & STATX_DIOALIGN))
+		return max(stx.dio_offset_align, stx.dio_mem_align);
+
+	return statbuf.st_blksize ?: PAGE_SIZE;
+}
+
+/* device number, for tracepoints: 0 if we're not on a block device */
+static dev_t bdev_devt(int fd)
+{
+	struct stat statbuf;
+
+	return !fstat(fd, &statbuf) && S_ISBLK(statbuf.st_mode)
+		? statbuf.st_rdev : 0;
+}
+
 struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 					void *holder)
 {
 	struct block_device *bdev;
-	int fd, sync_fd, flags = O_DIRECT;
+	unsigned dio_align = 0;
+	int fd, flags = 0;
 
 	if ((mode & (FMODE_READ|FMODE_WRITE)) == (FMODE_READ|FMODE_WRITE))
 		flags = O_RDWR;
@@ -175,21 +1178,35 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	else if (mode & FMODE_WRITE)
 		flags = O_WRONLY;
 
-#if 0
-	/* using O_EXCL doesn't work with opening twice for an O_SYNC fd: */
+	if (io_mode == IO_MODE_DIRECT)
+		flags |= O_DIRECT;
+
 	if (mode & FMODE_EXCL)
 		flags |= O_EXCL;
-#endif
 
 	fd = open(path, flags);
+	if (fd < 0 && errno == EINVAL && (flags & O_DIRECT)) {
+		fprintf(stderr, "%s: O_DIRECT not supported, "
+			"falling back to buffered I/O\n", path);
+		flags &= ~O_DIRECT;
+		fd = open(path, flags);
+	}
 	if (fd < 0)
 		return ERR_PTR(-errno);
 
-	sync_fd = open(path, flags|O_SYNC);
-	if (sync_fd < 0) {
-		assert(0);
-		close(fd);
-		return ERR_PTR(-errno);
+	blk_endio_threads_start();
+
+	if (flags & O_DIRECT) {
+		dio_align = dio_alignment(fd);
+		if (!dio_align) {
+			fprintf(stderr, "%s: O_DIRECT not supported, "
+				"falling back to buffered I/O\n", path);
+			close(fd);
+			flags &= ~O_DIRECT;
+			fd = open(path, flags);
+			if (fd < 0)
+				return ERR_PTR(-errno);
+		}
 	}
 
 	bdev = malloc(sizeof(*bdev));
@@ -199,11 +1216,36 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	bdev->name[sizeof(bdev->name) - 1] = '\0';
 
 	bdev->bd_fd		= fd;
-	bdev->bd_sync_fd	= sync_fd;
+	bdev->bd_dev		= bdev_devt(fd);
+	bdev->bd_dio_align	= dio_align;
+	mutex_init(&bdev->bd_rmw_lock);
+	bdev->bd_fd_idx		= -1;
+	bdev->bd_ioq		= &shared_ioq;
+
+	if (ioq_per_device) {
+		struct blk_ioq *q = xmalloc(sizeof(*q));
+		const char *p = strrchr(path, '/');
+		int ret = blk_ioq_init(q, p ? p + 1 : path);
+
+		if (!ret) {
+			bdev->bd_ioq = q;
+		} else {
+			fprintf(stderr, "%s: error creating I/O queue: %s, "
+				"using shared queue\n", path, strerror(-ret));
+			free(q);
+		}
+	}
+#ifdef HAVE_LIBURING
+	if (io_engine == IO_ENGINE_URING)
+		bdev->bd_fd_idx		= uring_register_fd(bdev->bd_ioq, fd);
+#endif
 	bdev->bd_holder		= holder;
 	bdev->bd_disk		= &bdev->__bd_disk;
 	bdev->bd_bdi		= &bdev->__bd_bdi;
 	bdev->queue.backing_dev_info = bdev->bd_bdi;
+	/* cleared on the first discard the device doesn't support: */
+	if (mode & FMODE_WRITE)
+		set_bit(QUEUE_FLAG_DISCARD, &bdev->queue.queue_flags);
 
 	return bdev;
 }
@@ -218,41 +1260,81 @@ struct block_device *lookup_bdev(const char *path)
 	return ERR_PTR(-EINVAL);
 }
 
-static int aio_completion_thread(void *arg)
+/*
+ * BCACHEFS_IO_ENGINE selects how bios are submitted: "io_uring" (the default
+ * when built with liburing), "io_uring_sqpoll", or "aio"; if io_uring can't be
+ * set up we fall back to aio.
+ *
+ * BCACHEFS_IO_MODE is "direct" (the default, devices are opened O_DIRECT) or
+ * "buffered", for going through the page cache.
+ *
+ * BCACHEFS_IO_QUEUES is "shared" (the default) or "per-device", for giving
+ * each device its own ring or aio context and reaper thread.
+ *
+ * BCACHEFS_IO_COMPLETION_THREADS is the number of threads running completions
+ * handed off by the reapers, by default the number of CPUs; 0 runs them in the
+ * reapers. They're started when the first device is opened.
+ */
+__attribute__((constructor(102)))
+static void blkdev_init(void)
 {
-	struct io_event events[8], *ev;
+	const char *engine = getenv("BCACHEFS_IO_ENGINE");
+	const char *mode = getenv("BCACHEFS_IO_MODE");
+	const char *queues = getenv("BCACHEFS_IO_QUEUES");
+	const char *threads = getenv("BCACHEFS_IO_COMPLETION_THREADS");
 	int ret;
 
-	while (1) {
-		ret = io_getevents(aio_ctx, 1, ARRAY_SIZE(events),
-				   events, NULL);
-
-		if (ret < 0 && ret == -EINTR)
-			continue;
-		if (ret < 0)
-			die("io_getevents() error: %s", strerror(-ret));
+	if (engine && !*engine)
+		engine = NULL;
 
-		for (ev = events; ev < events + ret; ev++) {
-			struct bio *bio = (struct bio *) ev->data;
+	if (engine &&
+	    strcmp(engine, "aio") &&
+	    strcmp(engine, "io_uring") &&
+	    strcmp(engine, "io_uring_sqpoll"))
+		die("invalid BCACHEFS_IO_ENGINE %s", engine);
 
-			if (ev->res != bio->bi_iter.bi_size)
-				bio->bi_status = BLK_STS_IOERR;
+	if (mode && *mode) {
+		if (!strcmp(mode, "direct"))
+			io_mode = IO_MODE_DIRECT;
+		else if (!strcmp(mode, "buffered"))
+			io_mode = IO_MODE_BUFFERED;
+		else
+			die("invalid BCACHEFS_IO_MODE %s", mode);
+	}
 
-			bio_endio(bio);
-		}
+	if (queues && *queues) {
+		if (!strcmp(queues, "per-device"))
+			ioq_per_device = true;
+		else if (strcmp(queues, "shared"))
+			die("invalid BCACHEFS_IO_QUEUES %s", queues);
 	}
 
-	return 0;
-}
+	endio.want_threads = get_nprocs();
+	if (threads && *threads &&
+	    kstrtouint(threads, 10, &endio.want_threads))
+		die("invalid BCACHEFS_IO_COMPLETION_THREADS %s", threads);
 
-__attribute__((constructor(102)))
-static void blkdev_init(void)
-{
-	struct task_struct *p;
+	discard_wq = alloc_workqueue("bcachefs_discard", WQ_UNBOUND, 1);
+	BUG_ON(!discard_wq);
+
+#ifdef HAVE_LIBURING
+	if (!engine || strcmp(engine, "aio")) {
+		io_engine	= IO_ENGINE_URING;
+		uring_sqpoll	= engine && !strcmp(engine, "io_uring_sqpoll");
 
-	if (io_setup(256, &aio_ctx))
-		die("io_setup() error: %m");
+		if (!blk_ioq_init(&shared_ioq, "io_reaper"))
+			return;
 
-	p = kthread_run(aio_completion_thread, NULL, "aio_completion");
-	BUG_ON(IS_ERR(p));
+		if (engine)
+			fprintf(stderr, "io_uring setup error, "
+				"falling back to aio\n");
+	}
+#else
+	if (engine && strcmp(engine, "aio"))
+		fprintf(stderr, "built without io_uring support, using aio\n");
+#endif
+	io_engine = IO_ENGINE_AIO;
+	ret = blk_ioq_init(&shared_ioq, "io_reaper");
+	if (ret)
+		die("io_setup() error: %s", strerror(-ret));
 }
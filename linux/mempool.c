@@ -0,0 +1,501 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/mempool.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+/*
+ * Mempools, much as in the kernel: each pool preallocates min_nr elements,
+ * which are only handed out when the underlying allocator fails - and elements
+ * are freed back to this reserve before anything else, until it's full again.
+ *
+ * On top of that, recently freed elements are kept in small per-cpu caches,
+ * so that pools of large buffers (bounce buffers, compression workspaces)
+ * don't go back to malloc for every I/O. The per-cpu slots are claimed and
+ * emptied with atomic exchanges, so they need no locking - and can be drained
+ * by the shrinker, from any thread. Slab backed pools don't need them, their
+ * slab cache has per-thread magazines already.
+ */
+
+/* cached elements, per cpu per pool: */
+#define MEMPOOL_PCPU_NR		2
+
+struct mempool_pcpu {
+	void			*elements[MEMPOOL_PCPU_NR];
+
+	u64			alloc_cached;
+	u64			alloc_new;
+	u64			alloc_reserve;
+	u64			alloc_wait;
+	u64			free_cached;
+	u64			free_reserve;
+	u64			free_released;
+};
+
+/* all pools, for the shrinker and for statistics: */
+static LIST_HEAD(mempools);
+static DEFINE_MUTEX(mempools_lock);
+
+static struct shrinker mempool_shrinker;
+static bool mempool_shrinker_registered;
+
+#define mempool_stat_inc(pool, stat)	this_cpu_inc((pool)->pcpu->stat)
+
+static inline bool mempool_recycles(mempool_t *pool)
+{
+	return pool->alloc != mempool_alloc_slab;
+}
+
+static void *mempool_pcpu_get(mempool_t *pool)
+{
+	struct mempool_pcpu *p = raw_cpu_ptr(pool->pcpu);
+	void *element;
+	unsigned i;
+
+	for (i = 0; i < MEMPOOL_PCPU_NR; i++)
+		if (READ_ONCE(p->elements[i]) &&
+		    (element = xchg(&p->elements[i], NULL)))
+			return element;
+
+	return NULL;
+}
+
+static bool mempool_pcpu_put(mempool_t *pool, void *element)
+{
+	struct mempool_pcpu *p = raw_cpu_ptr(pool->pcpu);
+	unsigned i;
+
+	for (i = 0; i < MEMPOOL_PCPU_NR; i++)
+		if (!READ_ONCE(p->elements[i]) &&
+		    !cmpxchg(&p->elements[i], NULL, element))
+			return true;
+
+	return false;
+}
+
+static unsigned long mempool_pcpu_drain(mempool_t *pool)
+{
+	unsigned long freed = 0;
+	void *element;
+	int cpu;
+	unsigned i;
+
+	for_each_possible_cpu(cpu) {
+		struct mempool_pcpu *p = per_cpu_ptr(pool->pcpu, cpu);
+
+		for (i = 0; i < MEMPOOL_PCPU_NR; i++)
+			if ((element = xchg(&p->elements[i], NULL))) {
+				pool->free(element, pool->pool_data);
+				freed++;
+			}
+	}
+
+	return freed;
+}
+
+static unsigned long mempool_shrink_scan(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	unsigned long freed = 0;
+	mempool_t *pool;
+
+	mutex_lock(&mempools_lock);
+	list_for_each_entry(pool, &mempools, list)
+		if (mempool_recycles(pool))
+			freed += mempool_pcpu_drain(pool);
+	mutex_unlock(&mempools_lock);
+
+	return freed;
+}
+
+static void add_element(mempool_t *pool, void *element)
+{
+	BUG_ON(pool->curr_nr >= pool->min_nr);
+	pool->elements[pool->curr_nr++] = element;
+}
+
+static void *remove_element(mempool_t *pool)
+{
+	BUG_ON(pool->curr_nr <= 0);
+	return pool->elements[--pool->curr_nr];
+}
+
+static void mempool_stats_print(FILE *f, mempool_t *pool)
+{
+	struct mempool_pcpu s = { { NULL } };
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct mempool_pcpu *p = per_cpu_ptr(pool->pcpu, cpu);
+
+		s.alloc_cached	+= p->alloc_cached;
+		s.alloc_new	+= p->alloc_new;
+		s.alloc_reserve	+= p->alloc_reserve;
+		s.alloc_wait	+= p->alloc_wait;
+		s.free_cached	+= p->free_cached;
+		s.free_reserve	+= p->free_reserve;
+		s.free_released	+= p->free_released;
+	}
+
+	fprintf(f, "%-32s min %3i alloc cached %llu new %llu reserve %llu waits %llu free cached %llu reserve %llu released %llu\n",
+		pool->name[0] == '&' ? pool->name + 1 : pool->name,
+		pool->min_nr,
+		s.alloc_cached, s.alloc_new, s.alloc_reserve, s.alloc_wait,
+		s.free_cached, s.free_reserve, s.free_released);
+}
+
+void mempools_print_stats(FILE *f)
+{
+	mempool_t *pool;
+
+	mutex_lock(&mempools_lock);
+	list_for_each_entry(pool, &mempools, list)
+		mempool_stats_print(f, pool);
+	mutex_unlock(&mempools_lock);
+}
+
+void mempool_exit(mempool_t *pool)
+{
+	if (pool->pcpu) {
+		mutex_lock(&mempools_lock);
+		list_del(&pool->list);
+		if (kmem_print_stats)
+			mempool_stats_print(stderr, pool);
+		mutex_unlock(&mempools_lock);
+
+		mempool_pcpu_drain(pool);
+		free_percpu(pool->pcpu);
+		pool->pcpu = NULL;
+	}
+
+	while (pool->curr_nr) {
+		void *element = remove_element(pool);
+		pool->free(element, pool->pool_data);
+	}
+	kfree(pool->elements);
+	pool->elements = NULL;
+
+	if (pool->cache_owned) {
+		kmem_cache_destroy(pool->pool_data);
+		pool->pool_data		= NULL;
+		pool->cache_owned	= false;
+	}
+}
+
+void mempool_destroy(mempool_t *pool)
+{
+	if (unlikely(!pool))
+		return;
+
+	mempool_exit(pool);
+	kfree(pool);
+}
+
+int __mempool_init(mempool_t *pool, int min_nr, mempool_alloc_t *alloc_fn,
+		   mempool_free_t *free_fn, void *pool_data, const char *name)
+{
+	memset(pool, 0, sizeof(*pool));
+	spin_lock_init(&pool->lock);
+	init_waitqueue_head(&pool->wait);
+	pool->min_nr		= min_nr;
+	pool->pool_data		= pool_data;
+	pool->alloc		= alloc_fn;
+	pool->free		= free_fn;
+	pool->name		= name;
+
+	pool->elements = kmalloc_array(max(min_nr, 1), sizeof(void *),
+				       GFP_KERNEL);
+	if (!pool->elements)
+		goto err;
+
+	pool->pcpu = alloc_percpu(struct mempool_pcpu);
+	if (!pool->pcpu)
+		goto err;
+
+	mutex_lock(&mempools_lock);
+	list_add_tail(&pool->list, &mempools);
+	if (!mempool_shrinker_registered && mempool_recycles(pool)) {
+		mempool_shrinker.scan_objects	= mempool_shrink_scan;
+		register_shrinker(&mempool_shrinker);
+		mempool_shrinker_registered	= true;
+	}
+	mutex_unlock(&mempools_lock);
+
+	/*
+	 * First pre-allocate the guaranteed number of buffers.
+	 */
+	while (pool->curr_nr < pool->min_nr) {
+		void *element;
+
+		element = pool->alloc(GFP_KERNEL, pool->pool_data);
+		if (unlikely(!element))
+			goto err;
+		add_element(pool, element);
+	}
+
+	return 0;
+err:
+	mempool_exit(pool);
+	return -ENOMEM;
+}
+
+mempool_t *__mempool_create(int min_nr, mempool_alloc_t *alloc_fn,
+			    mempool_free_t *free_fn, void *pool_data,
+			    const char *name)
+{
+	mempool_t *pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+
+	if (!pool)
+		return NULL;
+
+	if (__mempool_init(pool, min_nr, alloc_fn, free_fn, pool_data, name)) {
+		kfree(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+int __mempool_init_kmalloc_pool(mempool_t *pool, int min_nr, size_t size,
+				const char *name)
+{
+	struct kmem_cache *c =
+		kmem_cache_create(name[0] == '&' ? name + 1 : name,
+				  size, 0, 0, NULL);
+	int ret;
+
+	if (!c)
+		return -ENOMEM;
+
+	ret = __mempool_init(pool, min_nr, mempool_alloc_slab,
+			     mempool_free_slab, c, name);
+	if (ret) {
+		kmem_cache_destroy(c);
+		return ret;
+	}
+
+	pool->cache_owned = true;
+	return 0;
+}
+
+/**
+ * mempool_resize - resize an existing memory pool
+ * @pool:       pointer to the memory pool which was allocated via
+ *              mempool_create().
+ * @new_min_nr: the new minimum number of elements guaranteed to be
+ *              allocated for this pool.
+ *
+ * This function shrinks/grows the pool. In the case of growing,
+ * it cannot be guaranteed that the pool will be grown to the new
+ * size immediately, but new mempool_free() calls will refill it.
+ * This function may sleep.
+ */
+int mempool_resize(mempool_t *pool, int new_min_nr)
+{
+	void *element;
+	void **new_elements;
+	unsigned long flags;
+
+	BUG_ON(new_min_nr <= 0);
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (new_min_nr <= pool->min_nr) {
+		while (new_min_nr < pool->curr_nr) {
+			element = remove_element(pool);
+			spin_unlock_irqrestore(&pool->lock, flags);
+			pool->free(element, pool->pool_data);
+			spin_lock_irqsave(&pool->lock, flags);
+		}
+		pool->min_nr = new_min_nr;
+		goto out_unlock;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	/* Grow the pool */
+	new_elements = kmalloc_array(new_min_nr, sizeof(*new_elements),
+				     GFP_KERNEL);
+	if (!new_elements)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (unlikely(new_min_nr <= pool->min_nr)) {
+		/* Raced, other resize will do our work */
+		spin_unlock_irqrestore(&pool->lock, flags);
+		kfree(new_elements);
+		goto out;
+	}
+	memcpy(new_elements, pool->elements,
+			pool->curr_nr * sizeof(*new_elements));
+	kfree(pool->elements);
+	pool->elements = new_elements;
+	pool->min_nr = new_min_nr;
+
+	while (pool->curr_nr < pool->min_nr) {
+		spin_unlock_irqrestore(&pool->lock, flags);
+		element = pool->alloc(GFP_KERNEL, pool->pool_data);
+		if (!element)
+			goto out;
+		spin_lock_irqsave(&pool->lock, flags);
+		if (pool->curr_nr < pool->min_nr) {
+			add_element(pool, element);
+		} else {
+			spin_unlock_irqrestore(&pool->lock, flags);
+			pool->free(element, pool->pool_data);	/* Raced */
+			goto out;
+		}
+	}
+out_unlock:
+	spin_unlock_irqrestore(&pool->lock, flags);
+out:
+	return 0;
+}
+
+/**
+ * mempool_alloc - allocate an element from a specific memory pool
+ * @pool:      pointer to the memory pool which was allocated via
+ *             mempool_create().
+ * @gfp_mask:  the usual allocation bitmask.
+ *
+ * this function only sleeps if the alloc_fn() function sleeps or
+ * returns NULL. Note that due to preallocation, this function
+ * *never* fails when called from process contexts. (it might
+ * fail if called from an IRQ context.)
+ */
+void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask)
+{
+	void *element;
+	unsigned long flags;
+	DEFINE_WAIT(wait);
+
+	if (mempool_recycles(pool) &&
+	    (element = mempool_pcpu_get(pool))) {
+		mempool_stat_inc(pool, alloc_cached);
+		return element;
+	}
+repeat_alloc:
+	element = pool->alloc(gfp_mask, pool->pool_data);
+	if (likely(element != NULL)) {
+		mempool_stat_inc(pool, alloc_new);
+		return element;
+	}
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (likely(pool->curr_nr)) {
+		element = remove_element(pool);
+		spin_unlock_irqrestore(&pool->lock, flags);
+		/* paired with rmb in mempool_free(), read comment there */
+		smp_wmb();
+		mempool_stat_inc(pool, alloc_reserve);
+		return element;
+	}
+
+	/* We must not sleep if !__GFP_DIRECT_RECLAIM */
+	if (!(gfp_mask & __GFP_DIRECT_RECLAIM)) {
+		spin_unlock_irqrestore(&pool->lock, flags);
+		return NULL;
+	}
+
+	/* Let's wait for someone else to return an element to @pool */
+	mempool_stat_inc(pool, alloc_wait);
+	prepare_to_wait(&pool->wait, &wait, TASK_UNINTERRUPTIBLE);
+
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	/*
+	 * FIXME: this should be io_schedule().  The timeout is there as a
+	 * workaround for some DM problems in 2.6.18.
+	 */
+	io_schedule_timeout(5*HZ);
+
+	finish_wait(&pool->wait, &wait);
+	goto repeat_alloc;
+}
+
+/**
+ * mempool_free - return an element to the pool.
+ * @element:   pool element pointer.
+ * @pool:      pointer to the memory pool which was allocated via
+ *             mempool_create().
+ */
+void mempool_free(void *element, mempool_t *pool)
+{
+	unsigned long flags;
+
+	if (unlikely(element == NULL))
+		return;
+
+	/*
+	 * Paired with the wmb in mempool_alloc(): if we see curr_nr below
+	 * min_nr, the allocation that emptied the reserve is visible to us,
+	 * and the element goes back to the reserve.
+	 */
+	smp_rmb();
+
+	if (unlikely(READ_ONCE(pool->curr_nr) < pool->min_nr)) {
+		spin_lock_irqsave(&pool->lock, flags);
+		if (likely(pool->curr_nr < pool->min_nr)) {
+			add_element(pool, element);
+			spin_unlock_irqrestore(&pool->lock, flags);
+			wake_up(&pool->wait);
+			mempool_stat_inc(pool, free_reserve);
+			return;
+		}
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+
+	if (mempool_recycles(pool) &&
+	    mempool_pcpu_put(pool, element)) {
+		mempool_stat_inc(pool, free_cached);
+		return;
+	}
+
+	pool->free(element, pool->pool_data);
+	mempool_stat_inc(pool, free_released);
+}
+
+/*
+ * A commonly used alloc and free fn.
+ */
+void *mempool_alloc_slab(gfp_t gfp_mask, void *pool_data)
+{
+	struct kmem_cache *mem = pool_data;
+	return kmem_cache_alloc(mem, gfp_mask);
+}
+
+void mempool_free_slab(void *element, void *pool_data)
+{
+	struct kmem_cache *mem = pool_data;
+	kmem_cache_free(mem, element);
+}
+
+void *mempool_alloc_pages(gfp_t gfp_mask, void *pool_data)
+{
+	int order = (int)(long)pool_data;
+	return alloc_pages(gfp_mask, order);
+}
+
+void mempool_free_pages(void *element, void *pool_data)
+{
+	int order = (int)(long)pool_data;
+	__free_pages(element, order);
+}
+
+static void mempool_print_exit(void)
+{
+	mempools_print_stats(stderr);
+}
+
+__attribute__((constructor(102)))
+static void mempool_init_stats(void)
+{
+	if (kmem_print_stats)
+		atexit(mempool_print_exit);
+}
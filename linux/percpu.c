@@ -0,0 +1,242 @@
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+
+#include <linux/bitops.h>
+#include <linux/cache.h>
+#include <linux/cpumask.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/preempt.h>
+
+#include "tools-util.h"
+
+/*
+ * Percpu data: as in the kernel, every cpu has its own unit of percpu memory,
+ * and a cpu's copy of a percpu variable is at the same offset within that
+ * cpu's unit. Units are PCPU_UNIT_SIZE apart, so per_cpu_ptr() is just pointer
+ * arithmetic.
+ *
+ * But we can't disable preemption or keep a thread on a cpu, and code that
+ * disables preemption expects its cpu's percpu data to itself: so our "cpus"
+ * are really threads. Each thread gets a slot - a unit of percpu memory - the
+ * first time it touches percpu data, and owns it until it exits; then the slot
+ * is reused by the next new thread, keeping whatever counts it had.
+ *
+ * So this_cpu_*() ops are plain loads and stores as in the kernel, and
+ * preempt_disable() doesn't have to exclude anyone - it's just a counter. The
+ * cost is that for_each_possible_cpu() walks every slot handed out so far,
+ * which grows with the number of threads, not cpus.
+ */
+
+#define PCPU_NR_SLOTS		4096
+
+/* Number of slots handed out so far, only grows: */
+unsigned nr_cpu_ids;
+unsigned nr_online_cpus = 1;
+
+__thread unsigned __preempt_count;
+__thread int __pcpu_slot = -1;
+
+static pthread_key_t pcpu_slot_key;
+
+/* Protected by pcpu_alloc_lock: */
+static unsigned pcpu_free_slots[PCPU_NR_SLOTS];
+static unsigned pcpu_nr_free_slots;
+
+/* Allocator: */
+
+#define PCPU_BLOCK_SIZE		L1_CACHE_BYTES
+#define PCPU_UNIT_BLOCKS	(PCPU_UNIT_SIZE / PCPU_BLOCK_SIZE)
+
+struct pcpu_chunk {
+	struct list_head	list;
+	void			*base;
+	unsigned		nr_free;
+	unsigned long		alloc_map[BITS_TO_LONGS(PCPU_UNIT_BLOCKS)];
+	/* size of each allocation, indexed by its first block: */
+	u16			alloc_len[PCPU_UNIT_BLOCKS];
+};
+
+static LIST_HEAD(pcpu_chunks);
+static DEFINE_MUTEX(pcpu_alloc_lock);
+
+static int pcpu_unit_map(struct pcpu_chunk *chunk, unsigned slot)
+{
+	return mprotect(chunk->base + per_cpu_offset(slot), PCPU_UNIT_SIZE,
+			PROT_READ|PROT_WRITE);
+}
+
+static struct pcpu_chunk *pcpu_chunk_alloc(void)
+{
+	struct pcpu_chunk *chunk = calloc(1, sizeof(*chunk));
+	unsigned slot;
+
+	if (!chunk)
+		return NULL;
+
+	/*
+	 * Reserve address space for every slot we might hand out; units are
+	 * mapped as slots come into use, and only pages that are actually used
+	 * get backed by memory:
+	 */
+	chunk->base = mmap(NULL, (size_t) PCPU_NR_SLOTS * PCPU_UNIT_SIZE,
+			   PROT_NONE,
+			   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (chunk->base == MAP_FAILED)
+		goto err;
+
+	for (slot = 0; slot < nr_cpu_ids; slot++)
+		if (pcpu_unit_map(chunk, slot))
+			goto err_unmap;
+
+	chunk->nr_free = PCPU_UNIT_BLOCKS;
+	list_add_tail(&chunk->list, &pcpu_chunks);
+	return chunk;
+err_unmap:
+	munmap(chunk->base, (size_t) PCPU_NR_SLOTS * PCPU_UNIT_SIZE);
+err:
+	free(chunk);
+	return NULL;
+}
+
+static int pcpu_find_area(struct pcpu_chunk *chunk, unsigned nr)
+{
+	unsigned i, run = 0;
+
+	if (chunk->nr_free < nr)
+		return -1;
+
+	for (i = 0; i < PCPU_UNIT_BLOCKS; i++) {
+		run = test_bit(i, chunk->alloc_map) ? 0 : run + 1;
+		if (run == nr)
+			return i + 1 - nr;
+	}
+
+	return -1;
+}
+
+void __percpu *__alloc_percpu_gfp(size_t size, size_t align, gfp_t gfp)
+{
+	struct pcpu_chunk *chunk;
+	unsigned i, nr = DIV_ROUND_UP(max_t(size_t, size, 1), PCPU_BLOCK_SIZE);
+	void *ret = NULL;
+	int cpu, start = -1;
+
+	if (size > PCPU_UNIT_SIZE || align > PCPU_BLOCK_SIZE)
+		return NULL;
+
+	mutex_lock(&pcpu_alloc_lock);
+	list_for_each_entry(chunk, &pcpu_chunks, list)
+		if ((start = pcpu_find_area(chunk, nr)) >= 0)
+			goto found;
+
+	chunk = pcpu_chunk_alloc();
+	if (!chunk)
+		goto out;
+	start = 0;
+found:
+	for (i = start; i < start + nr; i++)
+		__set_bit(i, chunk->alloc_map);
+	chunk->alloc_len[start]	= nr;
+	chunk->nr_free		-= nr;
+
+	ret = chunk->base + start * PCPU_BLOCK_SIZE;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(ret, cpu), 0, size);
+out:
+	mutex_unlock(&pcpu_alloc_lock);
+	return ret;
+}
+
+void __percpu *__alloc_percpu(size_t size, size_t align)
+{
+	return __alloc_percpu_gfp(size, align, GFP_KERNEL);
+}
+
+void free_percpu(void __percpu *p)
+{
+	struct pcpu_chunk *chunk;
+	unsigned i, start, nr;
+
+	if (!p)
+		return;
+
+	mutex_lock(&pcpu_alloc_lock);
+	list_for_each_entry(chunk, &pcpu_chunks, list)
+		if (p >= chunk->base &&
+		    p < chunk->base + PCPU_UNIT_SIZE)
+			goto found;
+	BUG();
+found:
+	start	= (p - chunk->base) / PCPU_BLOCK_SIZE;
+	nr	= chunk->alloc_len[start];
+	BUG_ON(!nr);
+
+	for (i = start; i < start + nr; i++)
+		__clear_bit(i, chunk->alloc_map);
+	chunk->alloc_len[start]	= 0;
+	chunk->nr_free		+= nr;
+	mutex_unlock(&pcpu_alloc_lock);
+}
+
+/* Slots: */
+
+unsigned __pcpu_slot_get(void)
+{
+	struct pcpu_chunk *chunk;
+	unsigned slot;
+	int ret;
+
+	mutex_lock(&pcpu_alloc_lock);
+	if (pcpu_nr_free_slots) {
+		slot = pcpu_free_slots[--pcpu_nr_free_slots];
+	} else {
+		slot = nr_cpu_ids;
+		if (slot == PCPU_NR_SLOTS)
+			die("more than %u threads using percpu data", PCPU_NR_SLOTS);
+
+		list_for_each_entry(chunk, &pcpu_chunks, list)
+			if (pcpu_unit_map(chunk, slot))
+				die("error mapping percpu memory: %m");
+
+		WRITE_ONCE(nr_cpu_ids, slot + 1);
+	}
+	mutex_unlock(&pcpu_alloc_lock);
+
+	/* so that pcpu_slot_put() gets called when we exit: */
+	ret = pthread_setspecific(pcpu_slot_key, (void *) (unsigned long) (slot + 1));
+	BUG_ON(ret);
+
+	__pcpu_slot = slot;
+	return slot;
+}
+
+static void pcpu_slot_put(void *p)
+{
+	mutex_lock(&pcpu_alloc_lock);
+	pcpu_free_slots[pcpu_nr_free_slots++] = (unsigned long) p - 1;
+	mutex_unlock(&pcpu_alloc_lock);
+
+	/* in case another thread exit destructor touches percpu data: */
+	__pcpu_slot = -1;
+}
+
+__attribute__((constructor(101)))
+static void percpu_init(void)
+{
+	int ret = pthread_key_create(&pcpu_slot_key, pcpu_slot_put);
+
+	BUG_ON(ret);
+
+	nr_online_cpus = max(get_nprocs(), 1);
+
+	/* the main thread gets slot 0, so there's always at least one: */
+	__pcpu_slot_get();
+}
@@ -8,6 +8,7 @@
 #define CONFIG_RCU_HAVE_FUTEX 1
 #include <urcu/futex.h>
 
+#include <linux/blkdev.h>
 #include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/timer.h>
@@ -35,6 +36,7 @@ void schedule(void)
 {
 	int v;
 
+	blk_flush_plug(current);
 	rcu_quiescent_state();
 
 	while ((v = READ_ONCE(current->state)) != TASK_RUNNING)
@@ -1,94 +1,317 @@
 
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
+#include <unistd.h>
 
+#include <linux/kthread.h>
 #include <linux/list.h>
+#include <linux/lockdep.h>
 #include <linux/mutex.h>
 #include <linux/shrinker.h>
+#include <linux/string.h>
 
 #include "tools-util.h"
 
+/*
+ * Memory pressure is tracked by a background thread, not by the allocation
+ * paths: it samples /proc/meminfo - and, when we're running in a memory
+ * limited cgroup, the cgroup's memory.max/memory.current - once a second, or
+ * every 100ms while under pressure, and runs the shrinkers itself.
+ *
+ * Where the kernel supports it we also poll a PSI trigger on memory stalls and
+ * the cgroup's memory.events, so that we notice pressure as soon as it starts
+ * instead of on the next tick.
+ *
+ * Allocations only look at the cached pressure level, and only shrink
+ * directly when memory is critically low.
+ */
+
+#define SHRINKER_INTERVAL_MS		1000
+#define SHRINKER_PRESSURE_INTERVAL_MS	100
+
 static LIST_HEAD(shrinker_list);
 static DEFINE_MUTEX(shrinker_lock);
 
-int register_shrinker(struct shrinker *shrinker)
-{
-	mutex_lock(&shrinker_lock);
-	list_add_tail(&shrinker->list, &shrinker_list);
-	mutex_unlock(&shrinker_lock);
-	return 0;
-}
+int memory_pressure;
 
-void unregister_shrinker(struct shrinker *shrinker)
-{
-	mutex_lock(&shrinker_lock);
-	list_del(&shrinker->list);
-	mutex_unlock(&shrinker_lock);
-}
+static struct task_struct *shrinker_task;
+
+/* protected by shrinker_lock: */
+static int meminfo_fd = -1;
+static int cg_max_fd = -1;
+static int cg_current_fd = -1;
+static int cg_stat_fd = -1;
+static int cg_events_fd = -1;
+static int psi_fd = -1;
+static char sample_buf[8192];
 
 struct meminfo {
 	u64		total;
 	u64		available;
-
 };
 
-static u64 parse_meminfo_line(const char *line)
+static const char *find_field(const char *buf, const char *field)
 {
-	u64 v;
+	size_t len = strlen(field);
+	const char *p = buf;
+
+	while (p) {
+		if (!strncmp(p, field, len))
+			return p + len;
 
-	if (sscanf(line, " %llu kB", &v) < 1)
-		die("sscanf error");
-	return v << 10;
+		p = strchr(p, '\n');
+		if (p)
+			p++;
+	}
+
+	return NULL;
+}
+
+static u64 parse_field(const char *buf, const char *field)
+{
+	const char *v = find_field(buf, field);
+
+	return v ? strtoull(v, NULL, 10) : 0;
+}
+
+/* proc and sysfs files are regenerated on every read from offset 0: */
+static char *read_fd(int fd)
+{
+	ssize_t len = pread(fd, sample_buf, sizeof(sample_buf) - 1, 0);
+
+	if (len < 0)
+		die("error reading memory statistics: %m");
+
+	sample_buf[len] = '\0';
+	return sample_buf;
 }
 
 static struct meminfo read_meminfo(void)
 {
-	struct meminfo ret = { 0 };
-	size_t len, n = 0;
-	char *line = NULL;
-	const char *v;
-	FILE *f;
+	struct meminfo ret;
+	char *buf;
 
-	f = fopen("/proc/meminfo", "r");
-	if (!f)
-		die("error opening /proc/meminfo: %m");
+	buf = read_fd(meminfo_fd);
+	ret.total	= parse_field(buf, "MemTotal:") << 10;
+	ret.available	= parse_field(buf, "MemAvailable:") << 10;
+
+	if (cg_max_fd >= 0) {
+		u64 limit, usage, inactive_file;
+
+		buf = read_fd(cg_max_fd);
+		if (!strncmp(buf, "max", 3))
+			return ret;
+		limit = strtoull(buf, NULL, 10);
 
-	while ((len = getline(&line, &n, f)) != -1) {
-		if ((v = strcmp_prefix(line, "MemTotal:")))
-			ret.total = parse_meminfo_line(v);
+		usage = strtoull(read_fd(cg_current_fd), NULL, 10);
 
-		if ((v = strcmp_prefix(line, "MemAvailable:")))
-			ret.available = parse_meminfo_line(v);
+		/* page cache we could drop doesn't count against us: */
+		inactive_file = cg_stat_fd >= 0
+			? parse_field(read_fd(cg_stat_fd), "inactive_file ")
+			: 0;
+
+		ret.total = min(ret.total, limit);
+		ret.available = min(ret.available,
+			limit - min(limit, usage - min(usage, inactive_file)));
 	}
 
+	return ret;
+}
+
+/*
+ * Find the nearest cgroup (v2) we're in that has a memory limit - in a
+ * container, that's usually the root of the cgroup namespace:
+ */
+static void open_memory_cgroup(void)
+{
+	char *line = NULL, *path = NULL, *p, fname[PATH_MAX];
+	size_t n = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return;
+
+	while (getline(&line, &n, f) != -1)
+		if ((p = strcmp_prefix(line, "0::"))) {
+			path = strdup(strim(p));
+			break;
+		}
+
 	fclose(f);
 	free(line);
 
-	return ret;
+	if (!path)
+		return;
+
+	while (1) {
+		int fd;
+
+		if (!strcmp(path, "/"))
+			*path = '\0';
+
+		snprintf(fname, sizeof(fname), "/sys/fs/cgroup%s/memory.max", path);
+
+		fd = open(fname, O_RDONLY|O_CLOEXEC);
+		if (fd >= 0) {
+			if (strncmp(read_fd(fd), "max", 3)) {
+				cg_max_fd = fd;
+				break;
+			}
+			close(fd);
+		}
+
+		p = strrchr(path, '/');
+		if (!p)
+			goto out;
+		*p = '\0';
+	}
+
+	snprintf(fname, sizeof(fname), "/sys/fs/cgroup%s/memory.current", path);
+	cg_current_fd = open(fname, O_RDONLY|O_CLOEXEC);
+	if (cg_current_fd < 0) {
+		close(cg_max_fd);
+		cg_max_fd = -1;
+		goto out;
+	}
+
+	snprintf(fname, sizeof(fname), "/sys/fs/cgroup%s/memory.stat", path);
+	cg_stat_fd = open(fname, O_RDONLY|O_CLOEXEC);
+
+	snprintf(fname, sizeof(fname), "/sys/fs/cgroup%s/memory.events", path);
+	cg_events_fd = open(fname, O_RDONLY|O_CLOEXEC);
+
+	snprintf(fname, sizeof(fname), "/sys/fs/cgroup%s/memory.pressure", path);
+	psi_fd = open(fname, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+out:
+	free(path);
+}
+
+static void open_psi_trigger(void)
+{
+	/* unprivileged triggers need a window that's a multiple of 2s: */
+	static const char * const triggers[] = {
+		"some 150000 1000000",
+		"some 300000 2000000",
+	};
+	unsigned i;
+
+	if (psi_fd < 0)
+		psi_fd = open("/proc/pressure/memory", O_RDWR|O_NONBLOCK|O_CLOEXEC);
+	if (psi_fd < 0)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(triggers); i++)
+		if (write(psi_fd, triggers[i], strlen(triggers[i]) + 1) >= 0)
+			return;
+
+	close(psi_fd);
+	psi_fd = -1;
 }
 
-void run_shrinkers(void)
+static void shrink_memory(gfp_t gfp_mask)
 {
 	struct shrinker *shrinker;
 	struct meminfo info;
 	s64 want_shrink;
 
-	/* Fast out if there are no shrinkers to run. */
-	if (list_empty(&shrinker_list))
-		return;
+	lockdep_assert_held(&shrinker_lock);
 
 	info = read_meminfo();
 	want_shrink = (info.total >> 2) - info.available;
 
+	WRITE_ONCE(memory_pressure,
+		   want_shrink <= 0			? MEMORY_PRESSURE_NONE :
+		   info.available > (info.total >> 3)	? MEMORY_PRESSURE_SOME :
+							  MEMORY_PRESSURE_CRITICAL);
+
 	if (want_shrink <= 0)
 		return;
 
-	mutex_lock(&shrinker_lock);
 	list_for_each_entry(shrinker, &shrinker_list, list) {
 		struct shrink_control sc = {
-			.nr_to_scan = want_shrink >> PAGE_SHIFT
+			.gfp_mask	= gfp_mask,
+			.nr_to_scan	= want_shrink >> PAGE_SHIFT
 		};
 
 		shrinker->scan_objects(shrinker, &sc);
 	}
+}
+
+static int shrinker_thread(void *arg)
+{
+	struct pollfd fds[2];
+	unsigned nr_fds = 0;
+
+	if (psi_fd >= 0)
+		fds[nr_fds++] = (struct pollfd) { .fd = psi_fd, .events = POLLPRI };
+	if (cg_events_fd >= 0)
+		fds[nr_fds++] = (struct pollfd) { .fd = cg_events_fd, .events = POLLPRI };
+
+	while (1) {
+		mutex_lock(&shrinker_lock);
+		/* rearms the notification: */
+		if (cg_events_fd >= 0)
+			read_fd(cg_events_fd);
+
+		shrink_memory(GFP_KERNEL);
+		mutex_unlock(&shrinker_lock);
+
+		if (poll(fds, nr_fds, READ_ONCE(memory_pressure)
+			 ? SHRINKER_PRESSURE_INTERVAL_MS
+			 : SHRINKER_INTERVAL_MS) < 0 &&
+		    errno != EINTR)
+			die("poll error: %m");
+	}
+
+	return 0;
+}
+
+static void shrinker_thread_start(void)
+{
+	struct task_struct *p;
+
+	lockdep_assert_held(&shrinker_lock);
+
+	meminfo_fd = open("/proc/meminfo", O_RDONLY|O_CLOEXEC);
+	if (meminfo_fd < 0)
+		die("error opening /proc/meminfo: %m");
+
+	open_memory_cgroup();
+	open_psi_trigger();
+
+	p = kthread_run(shrinker_thread, NULL, "shrinkers");
+	BUG_ON(IS_ERR(p));
+	shrinker_task = p;
+}
+
+int register_shrinker(struct shrinker *shrinker)
+{
+	mutex_lock(&shrinker_lock);
+	if (!shrinker_task)
+		shrinker_thread_start();
+	list_add_tail(&shrinker->list, &shrinker_list);
+	mutex_unlock(&shrinker_lock);
+	return 0;
+}
+
+void unregister_shrinker(struct shrinker *shrinker)
+{
+	mutex_lock(&shrinker_lock);
+	list_del(&shrinker->list);
+	mutex_unlock(&shrinker_lock);
+}
+
+/*
+ * Direct reclaim: if the shrinker thread (or another allocation) is already
+ * shrinking, there's no point in piling on.
+ */
+void __run_shrinkers(void)
+{
+	if (!mutex_trylock(&shrinker_lock))
+		return;
+
+	shrink_memory(0);
 	mutex_unlock(&shrinker_lock);
 }
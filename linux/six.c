@@ -1,11 +1,19 @@
 // SPDX-License-Identifier: GPL-2.0
 
+#include <limits.h>
+#include <linux/futex.h>
+
+/* hack for mips: */
+#define CONFIG_RCU_HAVE_FUTEX 1
+#include <urcu/futex.h>
+
+#include <linux/blkdev.h>
 #include <linux/export.h>
 #include <linux/log2.h>
+#include <linux/percpu.h>
 #include <linux/preempt.h>
 #include <linux/rcupdate.h>
 #include <linux/sched.h>
-#include <linux/sched/rt.h>
 #include <linux/six.h>
 
 #ifdef DEBUG
@@ -34,14 +42,17 @@ struct six_lock_vals {
 	enum six_lock_type	unlock_wakeup;
 };
 
+
 #define __SIX_LOCK_HELD_read	__SIX_VAL(read_lock, ~0)
 #define __SIX_LOCK_HELD_intent	__SIX_VAL(intent_lock, ~0)
 #define __SIX_LOCK_HELD_write	__SIX_VAL(seq, 1)
+#define __SIX_WRITE_LOCKING	__SIX_VAL(write_locking, 1)
+#define __SIX_PCPU_READERS	__SIX_VAL(pcpu_readers, 1)
 
 #define LOCK_VALS {							\
 	[SIX_LOCK_read] = {						\
 		.lock_val	= __SIX_VAL(read_lock, 1),		\
-		.lock_fail	= __SIX_LOCK_HELD_write,		\
+		.lock_fail	= __SIX_LOCK_HELD_write|__SIX_WRITE_LOCKING,\
 		.unlock_val	= -__SIX_VAL(read_lock, 1),		\
 		.held_mask	= __SIX_LOCK_HELD_read,			\
 		.unlock_wakeup	= SIX_LOCK_write,			\
@@ -87,14 +98,152 @@ static inline void six_clear_owner(struct six_lock *lock, enum six_lock_type typ
 		lock->owner = NULL;
 }
 
+/* This is probably up there with the more evil things I've done */
+#define waitlist_bitnr(id) ilog2((((union six_lock_state) { .waiters = 1 << (id) }).l))
+
+/* Wakeups: */
+
+static void six_futex_wait(u32 *uaddr, u32 val)
+{
+	/* as in schedule(): don't go to sleep holding plugged IO */
+	blk_flush_plug(current);
+	rcu_quiescent_state();
+
+	futex((int32_t *) uaddr, FUTEX_WAIT|FUTEX_PRIVATE_FLAG,
+	      val, NULL, NULL, 0);
+}
+
+static void six_lock_wakeup(struct six_lock *lock,
+			    union six_lock_state state,
+			    unsigned waitlist_id)
+{
+	if (waitlist_id == SIX_LOCK_write && state.read_lock)
+		return;
+
+	if (!(state.waiters & (1 << waitlist_id)))
+		return;
+
+	clear_bit(waitlist_bitnr(waitlist_id),
+		  (unsigned long *) &lock->state.v);
+
+	/*
+	 * Waiters sample wait_seq before setting their waiting bit, so either
+	 * they see the new seq or we see their bit. Intent lock waiters are
+	 * woken one at a time - see __six_lock_type_slowpath() for how the
+	 * rest get woken:
+	 */
+	__atomic_add_fetch(&lock->wait_seq[waitlist_id], 1, __ATOMIC_SEQ_CST);
+	futex((int32_t *) &lock->wait_seq[waitlist_id],
+	      FUTEX_WAKE|FUTEX_PRIVATE_FLAG,
+	      waitlist_id == SIX_LOCK_intent ? 1 : INT_MAX, NULL, NULL, 0);
+}
+
+/* Per cpu readers: */
+
+static inline unsigned pcpu_read_count(struct six_lock *lock)
+{
+	unsigned read_count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		read_count += READ_ONCE(*per_cpu_ptr(lock->readers, cpu));
+	return read_count;
+}
+
+static void six_pcpu_read_release(struct six_lock *lock)
+{
+	union six_lock_state state;
+
+	this_cpu_dec(*lock->readers);
+
+	/* pairs with the writer setting its waiting bit, then summing: */
+	smp_mb();
+	state.v = READ_ONCE(lock->state.v);
+	six_lock_wakeup(lock, state, SIX_LOCK_write);
+}
+
+/*
+ * Returns true if we got the lock; if the lock wasn't in per cpu reader mode
+ * after all, @old won't have pcpu_readers set:
+ */
+static bool six_pcpu_read_trylock(struct six_lock *lock,
+				  union six_lock_state *old,
+				  bool check_seq, u32 seq)
+{
+	const struct six_lock_vals l[] = LOCK_VALS;
+	bool ret;
+
+	preempt_disable();
+	__this_cpu_inc(*lock->readers);
+	smp_mb();
+	old->v = READ_ONCE(lock->state.v);
+	ret = old->pcpu_readers &&
+		!(old->v & l[SIX_LOCK_read].lock_fail) &&
+		(!check_seq || old->seq == seq);
+	preempt_enable();
+
+	/*
+	 * Our increment may have made a writer think the lock was still read
+	 * locked and go to sleep, so dropping it has to do a wakeup:
+	 */
+	if (!ret)
+		six_pcpu_read_release(lock);
+	return ret;
+}
+
+/*
+ * Write locking a lock with per cpu readers: set write_locking, which blocks
+ * new readers, then check that the existing readers have gone away. If @try,
+ * we don't wait for them - clear write_locking again, and wake up any readers
+ * we blocked in the meantime:
+ */
+static bool six_pcpu_write_trylock(struct six_lock *lock, bool try)
+{
+	union six_lock_state old;
+	bool ret;
+
+	if (!(READ_ONCE(lock->state.v) & __SIX_WRITE_LOCKING)) {
+		atomic64_add(__SIX_WRITE_LOCKING, &lock->state.counter);
+		smp_mb__after_atomic();
+	}
+
+	ret = !pcpu_read_count(lock);
+
+	if (ret) {
+		atomic64_add(__SIX_VAL(seq, 1) - __SIX_WRITE_LOCKING,
+			     &lock->state.counter);
+	} else if (try) {
+		old.v = atomic64_sub_return(__SIX_WRITE_LOCKING,
+					    &lock->state.counter);
+		six_lock_wakeup(lock, old, SIX_LOCK_read);
+	}
+
+	return ret;
+}
+
 static __always_inline bool do_six_trylock_type(struct six_lock *lock,
-						enum six_lock_type type)
+						enum six_lock_type type,
+						bool try)
 {
 	const struct six_lock_vals l[] = LOCK_VALS;
 	union six_lock_state old;
 	u64 v = READ_ONCE(lock->state.v);
 
 	EBUG_ON(type == SIX_LOCK_write && lock->owner != current);
+retry:
+	if (type == SIX_LOCK_read && (v & __SIX_PCPU_READERS)) {
+		if (six_pcpu_read_trylock(lock, &old, false, 0))
+			return true;
+		if (old.pcpu_readers || (old.v & l[type].lock_fail))
+			return false;
+
+		/* lock was switched out of per cpu reader mode: */
+		v = old.v;
+		goto retry;
+	}
+
+	if (type == SIX_LOCK_write && (v & __SIX_PCPU_READERS))
+		return six_pcpu_write_trylock(lock, try);
 
 	do {
 		old.v = v;
@@ -105,6 +254,9 @@ static __always_inline bool do_six_trylock_type(struct six_lock *lock,
 
 		if (old.v & l[type].lock_fail)
 			return false;
+
+		if (type == SIX_LOCK_read && (old.v & __SIX_PCPU_READERS))
+			goto retry;
 	} while ((v = atomic64_cmpxchg_acquire(&lock->state.counter,
 				old.v,
 				old.v + l[type].lock_val)) != old.v);
@@ -116,7 +268,7 @@ static __always_inline bool do_six_trylock_type(struct six_lock *lock,
 __always_inline __flatten
 static bool __six_trylock_type(struct six_lock *lock, enum six_lock_type type)
 {
-	if (!do_six_trylock_type(lock, type))
+	if (!do_six_trylock_type(lock, type, true))
 		return false;
 
 	six_acquire(&lock->dep_map, 1);
@@ -130,157 +282,74 @@ static bool __six_relock_type(struct six_lock *lock, enum six_lock_type type,
 	const struct six_lock_vals l[] = LOCK_VALS;
 	union six_lock_state old;
 	u64 v = READ_ONCE(lock->state.v);
+retry:
+	if (type == SIX_LOCK_read && (v & __SIX_PCPU_READERS)) {
+		if (six_pcpu_read_trylock(lock, &old, true, seq))
+			goto success;
+		if (old.pcpu_readers || old.seq != seq ||
+		    (old.v & l[type].lock_fail))
+			return false;
+
+		v = old.v;
+		goto retry;
+	}
 
 	do {
 		old.v = v;
 
 		if (old.seq != seq || old.v & l[type].lock_fail)
 			return false;
+
+		if (type == SIX_LOCK_read && (old.v & __SIX_PCPU_READERS))
+			goto retry;
 	} while ((v = atomic64_cmpxchg_acquire(&lock->state.counter,
 				old.v,
 				old.v + l[type].lock_val)) != old.v);
 
 	six_set_owner(lock, type, old);
+success:
 	six_acquire(&lock->dep_map, 1);
 	return true;
 }
 
-struct six_lock_waiter {
-	struct list_head	list;
-	struct task_struct	*task;
-};
-
-/* This is probably up there with the more evil things I've done */
-#define waitlist_bitnr(id) ilog2((((union six_lock_state) { .waiters = 1 << (id) }).l))
-
-#ifdef CONFIG_LOCK_SPIN_ON_OWNER
-
-static inline int six_can_spin_on_owner(struct six_lock *lock)
-{
-	struct task_struct *owner;
-	int retval = 1;
-
-	if (need_resched())
-		return 0;
-
-	rcu_read_lock();
-	owner = READ_ONCE(lock->owner);
-	if (owner)
-		retval = owner->on_cpu;
-	rcu_read_unlock();
-	/*
-	 * if lock->owner is not set, the mutex owner may have just acquired
-	 * it and not set the owner yet or the mutex has been released.
-	 */
-	return retval;
-}
-
-static inline bool six_spin_on_owner(struct six_lock *lock,
-				     struct task_struct *owner)
-{
-	bool ret = true;
-
-	rcu_read_lock();
-	while (lock->owner == owner) {
-		/*
-		 * Ensure we emit the owner->on_cpu, dereference _after_
-		 * checking lock->owner still matches owner. If that fails,
-		 * owner might point to freed memory. If it still matches,
-		 * the rcu_read_lock() ensures the memory stays valid.
-		 */
-		barrier();
-
-		if (!owner->on_cpu || need_resched()) {
-			ret = false;
-			break;
-		}
-
-		cpu_relax();
-	}
-	rcu_read_unlock();
-
-	return ret;
-}
+/*
+ * Adaptive spinning, as with glibc's adaptive mutexes: we don't know if the
+ * lock holder is running, so spin for about as long as it's recently taken to
+ * get the lock, and then a bit more.
+ */
+#define SIX_SPIN_MIN		16
+#define SIX_SPIN_MAX		1000
 
 static inline bool six_optimistic_spin(struct six_lock *lock, enum six_lock_type type)
 {
-	struct task_struct *task = current;
+	const struct six_lock_vals l[] = LOCK_VALS;
+	unsigned spin_avg, max, i;
 
-	if (type == SIX_LOCK_write)
+	/* waiting on readers that hold the lock for who knows how long: */
+	if (type == SIX_LOCK_write || num_online_cpus() == 1)
 		return false;
 
-	preempt_disable();
-	if (!six_can_spin_on_owner(lock))
-		goto fail;
-
-	if (!osq_lock(&lock->osq))
-		goto fail;
+	spin_avg = READ_ONCE(lock->spin_avg);
+	max = min_t(unsigned, SIX_SPIN_MAX, spin_avg * 2 + SIX_SPIN_MIN);
 
-	while (1) {
-		struct task_struct *owner;
-
-		/*
-		 * If there's an owner, wait for it to either
-		 * release the lock or go to sleep.
-		 */
-		owner = READ_ONCE(lock->owner);
-		if (owner && !six_spin_on_owner(lock, owner))
-			break;
-
-		if (do_six_trylock_type(lock, type)) {
-			osq_unlock(&lock->osq);
-			preempt_enable();
-			return true;
-		}
+	for (i = 0; i < max; i++) {
+		cpu_relax();
 
-		/*
-		 * When there's no owner, we might have preempted between the
-		 * owner acquiring the lock and setting the owner field. If
-		 * we're an RT task that will live-lock because we won't let
-		 * the owner complete.
-		 */
-		if (!owner && (need_resched() || rt_task(task)))
+		if (!(READ_ONCE(lock->state.v) & l[type].lock_fail) &&
+		    do_six_trylock_type(lock, type, true))
 			break;
-
-		/*
-		 * The cpu_relax() call is a compiler barrier which forces
-		 * everything in this loop to be re-loaded. We don't need
-		 * memory barriers as we'll eventually observe the right
-		 * values at the cost of a few extra spins.
-		 */
-		cpu_relax();
 	}
 
-	osq_unlock(&lock->osq);
-fail:
-	preempt_enable();
-
-	/*
-	 * If we fell out of the spin path because of need_resched(),
-	 * reschedule now, before we try-lock again. This avoids getting
-	 * scheduled out right after we obtained the lock.
-	 */
-	if (need_resched())
-		schedule();
-
-	return false;
+	WRITE_ONCE(lock->spin_avg, spin_avg + ((int) i - (int) spin_avg) / 8);
+	return i < max;
 }
 
-#else /* CONFIG_LOCK_SPIN_ON_OWNER */
-
-static inline bool six_optimistic_spin(struct six_lock *lock, enum six_lock_type type)
-{
-	return false;
-}
-
-#endif
-
 noinline
 static void __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type type)
 {
 	const struct six_lock_vals l[] = LOCK_VALS;
 	union six_lock_state old, new;
-	struct six_lock_waiter wait;
+	u32 wait_seq;
 	u64 v;
 
 	if (six_optimistic_spin(lock, type))
@@ -288,47 +357,53 @@ static void __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type t
 
 	lock_contended(&lock->dep_map, _RET_IP_);
 
-	INIT_LIST_HEAD(&wait.list);
-	wait.task = current;
+	if (type == SIX_LOCK_intent)
+		atomic_inc(&lock->intent_waiters);
 
 	while (1) {
-		set_current_state(TASK_UNINTERRUPTIBLE);
-		if (type == SIX_LOCK_write)
-			EBUG_ON(lock->owner != current);
-		else if (list_empty_careful(&wait.list)) {
-			raw_spin_lock(&lock->wait_lock);
-			list_add_tail(&wait.list, &lock->wait_list[type]);
-			raw_spin_unlock(&lock->wait_lock);
-		}
-
-		v = READ_ONCE(lock->state.v);
-		do {
-			new.v = old.v = v;
-
-			if (!(old.v & l[type].lock_fail))
-				new.v += l[type].lock_val;
-			else if (!(new.waiters & (1 << type)))
-				new.waiters |= 1 << type;
-			else
-				break; /* waiting bit already set */
-		} while ((v = atomic64_cmpxchg_acquire(&lock->state.counter,
-					old.v, new.v)) != old.v);
+		wait_seq = smp_load_acquire(&lock->wait_seq[type]);
 
-		if (!(old.v & l[type].lock_fail))
+		if (do_six_trylock_type(lock, type, false))
 			break;
 
-		schedule();
-	}
+		if (type == SIX_LOCK_write && lock->state.pcpu_readers) {
+			/*
+			 * Readers check for the waiting bit after dropping
+			 * their count:
+			 */
+			set_bit(waitlist_bitnr(type),
+				(unsigned long *) &lock->state.v);
+			smp_mb__after_atomic();
+
+			if (!pcpu_read_count(lock))
+				continue;
+		} else {
+			v = READ_ONCE(lock->state.v);
+			do {
+				new.v = old.v = v;
+
+				if (!(old.v & l[type].lock_fail))
+					break;
 
-	six_set_owner(lock, type, old);
+				new.waiters |= 1 << type;
+			} while ((v = atomic64_cmpxchg(&lock->state.counter,
+						old.v, new.v)) != old.v);
 
-	__set_current_state(TASK_RUNNING);
+			if (!(old.v & l[type].lock_fail))
+				continue;
+		}
 
-	if (!list_empty_careful(&wait.list)) {
-		raw_spin_lock(&lock->wait_lock);
-		list_del_init(&wait.list);
-		raw_spin_unlock(&lock->wait_lock);
+		six_futex_wait(&lock->wait_seq[type], wait_seq);
 	}
+
+	/*
+	 * We only get woken up one at a time for intent locks: if there's
+	 * more waiters, make sure our unlock wakes up the next one:
+	 */
+	if (type == SIX_LOCK_intent &&
+	    atomic_dec_return(&lock->intent_waiters))
+		set_bit(waitlist_bitnr(type),
+			(unsigned long *) &lock->state.v);
 }
 
 __always_inline
@@ -336,59 +411,24 @@ static void __six_lock_type(struct six_lock *lock, enum six_lock_type type)
 {
 	six_acquire(&lock->dep_map, 0);
 
-	if (!do_six_trylock_type(lock, type))
+	if (!do_six_trylock_type(lock, type, true))
 		__six_lock_type_slowpath(lock, type);
 
 	lock_acquired(&lock->dep_map, _RET_IP_);
 }
 
-static inline void six_lock_wakeup(struct six_lock *lock,
-				   union six_lock_state state,
-				   unsigned waitlist_id)
-{
-	struct list_head *wait_list = &lock->wait_list[waitlist_id];
-	struct six_lock_waiter *w, *next;
-
-	if (waitlist_id == SIX_LOCK_write && state.read_lock)
-		return;
-
-	if (!(state.waiters & (1 << waitlist_id)))
-		return;
-
-	clear_bit(waitlist_bitnr(waitlist_id),
-		  (unsigned long *) &lock->state.v);
-
-	if (waitlist_id == SIX_LOCK_write) {
-		struct task_struct *p = READ_ONCE(lock->owner);
-
-		if (p)
-			wake_up_process(p);
-		return;
-	}
-
-	raw_spin_lock(&lock->wait_lock);
-
-	list_for_each_entry_safe(w, next, wait_list, list) {
-		list_del_init(&w->list);
-
-		if (wake_up_process(w->task) &&
-		    waitlist_id != SIX_LOCK_read) {
-			if (!list_empty(wait_list))
-				set_bit(waitlist_bitnr(waitlist_id),
-					(unsigned long *) &lock->state.v);
-			break;
-		}
-	}
-
-	raw_spin_unlock(&lock->wait_lock);
-}
-
 __always_inline __flatten
 static void __six_unlock_type(struct six_lock *lock, enum six_lock_type type)
 {
 	const struct six_lock_vals l[] = LOCK_VALS;
 	union six_lock_state state;
 
+	if (type == SIX_LOCK_read && lock->state.pcpu_readers) {
+		six_release(&lock->dep_map);
+		six_pcpu_read_release(lock);
+		return;
+	}
+
 	EBUG_ON(!(lock->state.v & l[type].held_mask));
 	EBUG_ON(type == SIX_LOCK_write &&
 		!(lock->state.v & __SIX_LOCK_HELD_intent));
@@ -477,13 +517,15 @@ bool six_lock_tryupgrade(struct six_lock *lock)
 	const struct six_lock_vals l[] = LOCK_VALS;
 	union six_lock_state old, new;
 	u64 v = READ_ONCE(lock->state.v);
+	bool pcpu = v & __SIX_PCPU_READERS;
 
 	do {
 		new.v = old.v = v;
 
-		EBUG_ON(!(old.v & l[SIX_LOCK_read].held_mask));
+		EBUG_ON(!pcpu && !(old.v & l[SIX_LOCK_read].held_mask));
 
-		new.v += l[SIX_LOCK_read].unlock_val;
+		if (!pcpu)
+			new.v += l[SIX_LOCK_read].unlock_val;
 
 		if (new.v & l[SIX_LOCK_intent].lock_fail)
 			return false;
@@ -493,7 +535,12 @@ bool six_lock_tryupgrade(struct six_lock *lock)
 				old.v, new.v)) != old.v);
 
 	six_set_owner(lock, SIX_LOCK_intent, old);
-	six_lock_wakeup(lock, new, l[SIX_LOCK_read].unlock_wakeup);
+
+	/* no writer to wake up, we've got the intent lock: */
+	if (pcpu)
+		this_cpu_dec(*lock->readers);
+	else
+		six_lock_wakeup(lock, new, l[SIX_LOCK_read].unlock_wakeup);
 
 	return true;
 }
@@ -530,6 +577,63 @@ void six_lock_increment(struct six_lock *lock, enum six_lock_type type)
 
 	/* XXX: assert already locked, and that we don't overflow: */
 
-	atomic64_add(l[type].lock_val, &lock->state.counter);
+	if (type == SIX_LOCK_read && lock->state.pcpu_readers)
+		this_cpu_inc(*lock->readers);
+	else
+		atomic64_add(l[type].lock_val, &lock->state.counter);
 }
 EXPORT_SYMBOL_GPL(six_lock_increment);
+
+/*
+ * Add to or subtract from the read count, for a caller that knows it holds the
+ * lock for read @nr times and has to get them out of the way of its own write
+ * lock:
+ */
+void six_lock_readers_add(struct six_lock *lock, int nr)
+{
+	if (lock->state.pcpu_readers)
+		this_cpu_add(*lock->readers, nr);
+	else if (nr < 0)
+		atomic64_sub(__SIX_VAL(read_lock, -nr), &lock->state.counter);
+	else
+		atomic64_add(__SIX_VAL(read_lock, nr), &lock->state.counter);
+}
+EXPORT_SYMBOL_GPL(six_lock_readers_add);
+
+/*
+ * Switch between per cpu and shared reader counts: the lock must be held for
+ * write, so there are no readers to move over. If we can't allocate the per
+ * cpu counters, the lock just stays as it was:
+ */
+void six_lock_pcpu_readers(struct six_lock *lock, bool pcpu)
+{
+	EBUG_ON(!(lock->state.v & __SIX_LOCK_HELD_write));
+
+	if (pcpu == lock->state.pcpu_readers)
+		return;
+
+	if (pcpu && !lock->readers) {
+		lock->readers = alloc_percpu(unsigned);
+		if (!lock->readers)
+			return;
+	}
+
+	if (pcpu)
+		atomic64_add(__SIX_PCPU_READERS, &lock->state.counter);
+	else
+		atomic64_sub(__SIX_PCPU_READERS, &lock->state.counter);
+}
+EXPORT_SYMBOL_GPL(six_lock_pcpu_readers);
+
+/* Lock must be unlocked, and no longer reachable: */
+void six_lock_exit(struct six_lock *lock)
+{
+	EBUG_ON(lock->state.v & (__SIX_LOCK_HELD_read|
+				 __SIX_LOCK_HELD_intent|
+				 __SIX_LOCK_HELD_write));
+	EBUG_ON(lock->readers && pcpu_read_count(lock));
+
+	free_percpu(lock->readers);
+	lock->readers = NULL;
+}
+EXPORT_SYMBOL_GPL(six_lock_exit);
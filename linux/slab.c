@@ -0,0 +1,696 @@
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/cache.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/lockdep.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+/*
+ * Slab allocator, for kmem_caches (and mempools, and biosets, which are built
+ * on them):
+ *
+ * Objects are carved out of large slabs, each aligned to its size so that we
+ * can find an object's slab, which counts how many of its objects are in use.
+ * Each thread has its own magazines - small stacks of free objects - for each
+ * cache it uses, so allocating and freeing is normally a push or pop with no
+ * locking; only when a thread's magazines are empty (or full) does it go to the
+ * cache's depot of full and empty magazines, under the cache lock.
+ *
+ * Objects sitting in magazines are still in use as far as their slab is
+ * concerned, so the memory held by magazines is capped per cache: the number
+ * of magazines is limited, and objects too big for a magazine of
+ * KMEM_MAG_BYTES skip them entirely. Past the cap, objects go straight back to
+ * their slab.
+ *
+ * Under memory pressure the shrinker empties the depot and frees slabs with no
+ * objects in use; it can't touch other threads' magazines, so it asks threads
+ * to empty them into their slabs the next time they take the cache lock.
+ *
+ * Objects may be freed by a different thread than the one that allocated them
+ * - e.g. bios, freed by completion threads: they go into the freeing thread's
+ * magazines, and once full, back to the depot for the allocating thread to pick
+ * up.
+ *
+ * Caches are identified by a small integer id, which indexes each thread's
+ * array of magazines; when a cache is destroyed its id may be reused, so
+ * destroying a cache empties its magazines in every thread.
+ */
+
+#define KMEM_SLAB_SIZE		(64U << 10)
+#define KMEM_MAG_BYTES		(32U << 10)
+#define KMEM_MAG_MAX		64U
+/* Memory in magazines, per cache, is capped at this: */
+#define KMEM_CACHE_MAG_BYTES	(4U << 20)
+/* Empty magazines beyond this many aren't kept in the depot: */
+#define KMEM_DEPOT_MAX_EMPTY	16U
+
+struct kmem_magazine {
+	struct kmem_magazine	*next;
+	unsigned		nr;
+	void			*objs[];
+};
+
+/* At the start of each slab, objects follow at kmem_cache->slab_offset: */
+struct kmem_slab {
+	struct list_head	list;
+	void			*freelist;
+	/* objects past here have never been allocated: */
+	void			*next;
+	unsigned		nr_inuse;
+};
+
+struct kmem_cache {
+	char			*name;
+	unsigned		id;
+	size_t			object_size;
+	size_t			size;
+	size_t			align;
+	unsigned		mag_size;
+	void			(*ctor)(void *);
+
+	size_t			slab_size;
+	size_t			slab_offset;
+	unsigned		slab_objs;
+
+	struct mutex		lock;
+	struct kmem_magazine	*full;
+	struct kmem_magazine	*empty;
+	unsigned		nr_empty;
+	/* magazines that exist, in the depot or held by threads: */
+	unsigned		nr_mags;
+	unsigned		max_mags;
+	/* bumped by the shrinker, to have threads empty their magazines: */
+	unsigned		flush_seq;
+
+	struct list_head	slabs_partial;
+	struct list_head	slabs_full;
+	size_t			nr_slab_bytes;
+
+	/* from threads that have exited: */
+	u64			alloc_hits;
+	u64			free_hits;
+	u64			alloc_misses;
+	u64			free_misses;
+};
+
+struct kmem_cpu_cache {
+	struct kmem_magazine	*loaded;
+	struct kmem_magazine	*prev;
+	unsigned		flush_seq;
+	u64			alloc_hits;
+	u64			free_hits;
+};
+
+struct kmem_thread {
+	struct list_head	list;
+	unsigned		nr;
+	struct kmem_cpu_cache	*caches;
+};
+
+static __thread struct kmem_thread *kmem_this_thread;
+static pthread_key_t kmem_thread_key;
+
+/* protects the lists of caches and threads, and threads' magazine arrays: */
+static DEFINE_MUTEX(kmem_lock);
+static LIST_HEAD(kmem_threads);
+static struct kmem_cache **kmem_caches;
+static unsigned kmem_caches_nr;
+static unsigned kmem_caches_size;
+
+static struct shrinker kmem_shrinker;
+static bool kmem_shrinker_registered;
+
+bool kmem_print_stats;
+
+/* Slabs: */
+
+static inline struct kmem_slab *kmem_obj_slab(struct kmem_cache *c, void *p)
+{
+	return (void *) ((unsigned long) p & ~(c->slab_size - 1));
+}
+
+static void *kmem_slab_alloc(struct kmem_cache *c)
+{
+	struct kmem_slab *slab;
+	void *p;
+
+	lockdep_assert_held(&c->lock);
+
+	slab = list_first_entry_or_null(&c->slabs_partial, struct kmem_slab, list);
+	if (!slab) {
+		slab = aligned_alloc(c->slab_size, c->slab_size);
+		if (!slab)
+			return NULL;
+
+		slab->freelist	= NULL;
+		slab->next	= (void *) slab + c->slab_offset;
+		slab->nr_inuse	= 0;
+		list_add(&slab->list, &c->slabs_partial);
+		c->nr_slab_bytes += c->slab_size;
+	}
+
+	if (slab->freelist) {
+		p = slab->freelist;
+		slab->freelist = *((void **) p);
+	} else {
+		p = slab->next;
+		slab->next += c->size;
+
+		if (c->ctor)
+			c->ctor(p);
+	}
+
+	if (++slab->nr_inuse == c->slab_objs)
+		list_move(&slab->list, &c->slabs_full);
+	return p;
+}
+
+static void kmem_slab_free(struct kmem_cache *c, void *p)
+{
+	struct kmem_slab *slab = kmem_obj_slab(c, p);
+
+	lockdep_assert_held(&c->lock);
+
+	if (slab->nr_inuse-- == c->slab_objs)
+		list_move(&slab->list, &c->slabs_partial);
+
+	*((void **) p) = slab->freelist;
+	slab->freelist = p;
+}
+
+/* Returns number of pages freed: */
+static unsigned long kmem_slabs_free_empty(struct kmem_cache *c)
+{
+	struct kmem_slab *slab, *n;
+	unsigned long freed = 0;
+
+	lockdep_assert_held(&c->lock);
+
+	list_for_each_entry_safe(slab, n, &c->slabs_partial, list)
+		if (!slab->nr_inuse) {
+			list_del(&slab->list);
+			free(slab);
+			c->nr_slab_bytes -= c->slab_size;
+			freed += c->slab_size >> PAGE_SHIFT;
+		}
+
+	return freed;
+}
+
+/* Depot: */
+
+static struct kmem_magazine *kmem_magazine_alloc(struct kmem_cache *c)
+{
+	struct kmem_magazine *m = c->empty;
+
+	if (m) {
+		c->empty = m->next;
+		c->nr_empty--;
+		return m;
+	}
+
+	if (c->nr_mags >= c->max_mags)
+		return NULL;
+
+	m = malloc(sizeof(*m) + sizeof(m->objs[0]) * c->mag_size);
+	if (m) {
+		m->nr = 0;
+		c->nr_mags++;
+	}
+	return m;
+}
+
+static void kmem_magazine_free(struct kmem_cache *c, struct kmem_magazine *m)
+{
+	free(m);
+	c->nr_mags--;
+}
+
+/* Return a magazine's objects to their slabs: */
+static void kmem_magazine_empty(struct kmem_cache *c, struct kmem_magazine *m)
+{
+	if (m)
+		while (m->nr)
+			kmem_slab_free(c, m->objs[--m->nr]);
+}
+
+static void kmem_depot_put(struct kmem_cache *c, struct kmem_magazine *m)
+{
+	if (!m)
+		return;
+
+	if (m->nr) {
+		m->next = c->full;
+		c->full = m;
+	} else if (c->nr_empty < KMEM_DEPOT_MAX_EMPTY) {
+		m->next = c->empty;
+		c->empty = m;
+		c->nr_empty++;
+	} else {
+		kmem_magazine_free(c, m);
+	}
+}
+
+static void kmem_cpu_cache_drain(struct kmem_cache *c,
+				 struct kmem_cpu_cache *cc)
+{
+	mutex_lock(&c->lock);
+	kmem_depot_put(c, cc->loaded);
+	kmem_depot_put(c, cc->prev);
+	c->alloc_hits	+= cc->alloc_hits;
+	c->free_hits	+= cc->free_hits;
+	mutex_unlock(&c->lock);
+
+	memset(cc, 0, sizeof(*cc));
+}
+
+/* The shrinker ran: empty our magazines, so their slabs can be freed: */
+static void kmem_cpu_cache_flush(struct kmem_cache *c,
+				 struct kmem_cpu_cache *cc)
+{
+	lockdep_assert_held(&c->lock);
+
+	kmem_magazine_empty(c, cc->loaded);
+	kmem_magazine_empty(c, cc->prev);
+	cc->flush_seq = c->flush_seq;
+}
+
+/* Returns number of pages freed: */
+static unsigned long kmem_cache_shrink_locked(struct kmem_cache *c)
+{
+	struct kmem_magazine *m;
+
+	lockdep_assert_held(&c->lock);
+
+	c->flush_seq++;
+
+	while ((m = c->full)) {
+		c->full = m->next;
+		kmem_magazine_empty(c, m);
+		kmem_magazine_free(c, m);
+	}
+
+	while ((m = c->empty)) {
+		c->empty = m->next;
+		kmem_magazine_free(c, m);
+	}
+	c->nr_empty = 0;
+
+	return kmem_slabs_free_empty(c);
+}
+
+/* Threads: */
+
+static void kmem_thread_exit(void *arg)
+{
+	struct kmem_thread *t = arg;
+	unsigned i;
+
+	mutex_lock(&kmem_lock);
+	for (i = 0; i < t->nr; i++)
+		if (i < kmem_caches_nr && kmem_caches[i])
+			kmem_cpu_cache_drain(kmem_caches[i], &t->caches[i]);
+	list_del(&t->list);
+	mutex_unlock(&kmem_lock);
+
+	kmem_this_thread = NULL;
+	free(t->caches);
+	free(t);
+}
+
+static struct kmem_cpu_cache *kmem_thread_get(struct kmem_cache *c)
+{
+	struct kmem_thread *t = kmem_this_thread;
+	struct kmem_cpu_cache *caches, *ret = NULL;
+	unsigned nr;
+
+	mutex_lock(&kmem_lock);
+	if (!t) {
+		t = calloc(1, sizeof(*t));
+		if (!t)
+			goto out;
+
+		list_add(&t->list, &kmem_threads);
+		pthread_setspecific(kmem_thread_key, t);
+		kmem_this_thread = t;
+	}
+
+	nr = kmem_caches_nr;
+	caches = realloc(t->caches, sizeof(*caches) * nr);
+	if (!caches)
+		goto out;
+
+	memset(caches + t->nr, 0, sizeof(*caches) * (nr - t->nr));
+	t->caches	= caches;
+	t->nr		= nr;
+	ret		= &t->caches[c->id];
+out:
+	mutex_unlock(&kmem_lock);
+	return ret;
+}
+
+static inline struct kmem_cpu_cache *kmem_cpu_cache(struct kmem_cache *c)
+{
+	struct kmem_thread *t = kmem_this_thread;
+
+	return likely(t && c->id < t->nr)
+		? &t->caches[c->id]
+		: kmem_thread_get(c);
+}
+
+/* Allocation: */
+
+static noinline void *kmem_cache_alloc_slowpath(struct kmem_cache *c,
+						struct kmem_cpu_cache *cc)
+{
+	struct kmem_magazine *m;
+	void *p = NULL;
+
+	/* objects too big for magazines: */
+	if (!c->mag_size)
+		cc = NULL;
+
+	if (cc && cc->prev && cc->prev->nr) {
+		swap(cc->loaded, cc->prev);
+		cc->alloc_hits++;
+		return cc->loaded->objs[--cc->loaded->nr];
+	}
+
+	run_shrinkers();
+
+	mutex_lock(&c->lock);
+	c->alloc_misses++;
+
+	if (!cc)
+		goto slab_alloc;
+
+	if (unlikely(cc->flush_seq != c->flush_seq))
+		kmem_cpu_cache_flush(c, cc);
+
+	if (c->full) {
+		m = c->full;
+		c->full = m->next;
+
+		kmem_depot_put(c, cc->loaded);
+		cc->loaded = m;
+	} else {
+		if (!cc->loaded)
+			cc->loaded = kmem_magazine_alloc(c);
+		if (!cc->loaded)
+			goto slab_alloc;
+
+		/* refill in batches, so the next few allocations are hits: */
+		m = cc->loaded;
+		while (m->nr < c->mag_size / 2 &&
+		       (p = kmem_slab_alloc(c)))
+			m->objs[m->nr++] = p;
+		p = NULL;
+	}
+
+	if (cc->loaded->nr)
+		p = cc->loaded->objs[--cc->loaded->nr];
+slab_alloc:
+	if (!p)
+		p = kmem_slab_alloc(c);
+	mutex_unlock(&c->lock);
+	return p;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
+{
+	struct kmem_cpu_cache *cc = kmem_cpu_cache(c);
+	void *p;
+
+	if (likely(cc && cc->loaded && cc->loaded->nr)) {
+		cc->alloc_hits++;
+		p = cc->loaded->objs[--cc->loaded->nr];
+	} else {
+		p = kmem_cache_alloc_slowpath(c, cc);
+	}
+
+	if (p && (gfp & __GFP_ZERO))
+		memset(p, 0, c->object_size);
+	return p;
+}
+
+static noinline void kmem_cache_free_slowpath(struct kmem_cache *c,
+					      struct kmem_cpu_cache *cc,
+					      void *p)
+{
+	struct kmem_magazine *m;
+
+	if (!c->mag_size)
+		cc = NULL;
+
+	if (cc && cc->prev && cc->prev->nr < c->mag_size) {
+		swap(cc->loaded, cc->prev);
+		cc->free_hits++;
+		cc->loaded->objs[cc->loaded->nr++] = p;
+		return;
+	}
+
+	mutex_lock(&c->lock);
+	c->free_misses++;
+
+	if (cc && unlikely(cc->flush_seq != c->flush_seq)) {
+		kmem_cpu_cache_flush(c, cc);
+
+		if (cc->loaded) {
+			cc->loaded->objs[cc->loaded->nr++] = p;
+			goto out;
+		}
+	}
+
+	/* at the cap on magazine memory, or no memory for a magazine: */
+	if (!cc || !(m = kmem_magazine_alloc(c))) {
+		kmem_slab_free(c, p);
+		goto out;
+	}
+
+	/* both magazines full (or not yet allocated): */
+	kmem_depot_put(c, cc->prev);
+	cc->prev	= cc->loaded;
+	cc->loaded	= m;
+	m->objs[m->nr++] = p;
+out:
+	mutex_unlock(&c->lock);
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *p)
+{
+	struct kmem_cpu_cache *cc;
+
+	if (!p)
+		return;
+
+	cc = kmem_cpu_cache(c);
+	if (likely(cc && cc->loaded && cc->loaded->nr < c->mag_size)) {
+		cc->free_hits++;
+		cc->loaded->objs[cc->loaded->nr++] = p;
+	} else {
+		kmem_cache_free_slowpath(c, cc, p);
+	}
+}
+
+/* Shrinker: */
+
+static unsigned long kmem_shrink_scan(struct shrinker *shrink,
+				      struct shrink_control *sc)
+{
+	struct kmem_cache *c;
+	unsigned long freed = 0;
+	unsigned i;
+
+	mutex_lock(&kmem_lock);
+	for (i = 0; i < kmem_caches_nr; i++)
+		if ((c = kmem_caches[i])) {
+			mutex_lock(&c->lock);
+			freed += kmem_cache_shrink_locked(c);
+			mutex_unlock(&c->lock);
+		}
+	mutex_unlock(&kmem_lock);
+
+	return freed;
+}
+
+/* Cache creation/destruction: */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, unsigned long flags,
+				     void (*ctor)(void *))
+{
+	struct kmem_cache *c = calloc(1, sizeof(*c));
+	unsigned id;
+	bool new_shrinker;
+
+	if (!c)
+		return NULL;
+
+	if (flags & SLAB_HWCACHE_ALIGN)
+		align = max_t(size_t, align, L1_CACHE_BYTES);
+	align = roundup_pow_of_two(max_t(size_t, align, ARCH_KMALLOC_MINALIGN));
+
+	c->name		= strdup(name);
+	c->object_size	= size;
+	c->size		= round_up(max_t(size_t, size, sizeof(void *)), align);
+	c->align	= align;
+	c->mag_size	= min_t(size_t, KMEM_MAG_BYTES / c->size, KMEM_MAG_MAX);
+	c->max_mags	= c->mag_size
+		? KMEM_CACHE_MAG_BYTES / (c->mag_size * c->size)
+		: 0;
+	c->ctor		= ctor;
+	c->slab_size	= roundup_pow_of_two(max_t(size_t, KMEM_SLAB_SIZE,
+							c->size * 8));
+	c->slab_offset	= round_up(sizeof(struct kmem_slab), align);
+	c->slab_objs	= (c->slab_size - c->slab_offset) / c->size;
+	mutex_init(&c->lock);
+	INIT_LIST_HEAD(&c->slabs_partial);
+	INIT_LIST_HEAD(&c->slabs_full);
+
+	if (!c->name) {
+		free(c);
+		return NULL;
+	}
+
+	mutex_lock(&kmem_lock);
+	for (id = 0; id < kmem_caches_nr; id++)
+		if (!kmem_caches[id])
+			goto found;
+
+	if (kmem_caches_nr == kmem_caches_size) {
+		unsigned new_size = max(8U, kmem_caches_size * 2);
+		struct kmem_cache **caches =
+			realloc(kmem_caches, sizeof(*caches) * new_size);
+
+		if (!caches) {
+			mutex_unlock(&kmem_lock);
+			free(c->name);
+			free(c);
+			return NULL;
+		}
+		kmem_caches		= caches;
+		kmem_caches_size	= new_size;
+	}
+	kmem_caches_nr++;
+found:
+	c->id = id;
+	kmem_caches[id] = c;
+
+	new_shrinker = !kmem_shrinker_registered;
+	kmem_shrinker_registered = true;
+	mutex_unlock(&kmem_lock);
+
+	/* not under kmem_lock, the shrinker takes it with shrinker_lock held: */
+	if (new_shrinker) {
+		kmem_shrinker.scan_objects = kmem_shrink_scan;
+		register_shrinker(&kmem_shrinker);
+	}
+
+	return c;
+}
+
+static void kmem_cache_stats_print(FILE *f, struct kmem_cache *c)
+{
+	struct kmem_thread *t;
+	u64 alloc_hits, free_hits, alloc_misses, free_misses, total;
+	size_t slab_bytes;
+
+	lockdep_assert_held(&kmem_lock);
+
+	mutex_lock(&c->lock);
+	slab_bytes	= c->nr_slab_bytes;
+	alloc_hits	= c->alloc_hits;
+	free_hits	= c->free_hits;
+	alloc_misses	= c->alloc_misses;
+	free_misses	= c->free_misses;
+	mutex_unlock(&c->lock);
+
+	/* other threads' counters may be a little stale: */
+	list_for_each_entry(t, &kmem_threads, list)
+		if (c->id < t->nr) {
+			alloc_hits	+= READ_ONCE(t->caches[c->id].alloc_hits);
+			free_hits	+= READ_ONCE(t->caches[c->id].free_hits);
+		}
+
+	total = alloc_hits + alloc_misses;
+
+	fprintf(f, "%-24s size %6zu slabs %8zuk alloc hit %llu miss %llu free hit %llu miss %llu (%llu%% hits)\n",
+		c->name, c->object_size, slab_bytes >> 10,
+		alloc_hits, alloc_misses,
+		free_hits, free_misses,
+		total ? alloc_hits * 100 / total : 100);
+}
+
+void kmem_caches_print_stats(FILE *f)
+{
+	unsigned i;
+
+	mutex_lock(&kmem_lock);
+	for (i = 0; i < kmem_caches_nr; i++)
+		if (kmem_caches[i])
+			kmem_cache_stats_print(f, kmem_caches[i]);
+	mutex_unlock(&kmem_lock);
+}
+
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+	struct kmem_thread *t;
+	struct kmem_magazine *m;
+	struct kmem_slab *slab, *n;
+
+	if (!c)
+		return;
+
+	mutex_lock(&kmem_lock);
+	list_for_each_entry(t, &kmem_threads, list)
+		if (c->id < t->nr)
+			kmem_cpu_cache_drain(c, &t->caches[c->id]);
+
+	if (kmem_print_stats)
+		kmem_cache_stats_print(stderr, c);
+
+	kmem_caches[c->id] = NULL;
+	mutex_unlock(&kmem_lock);
+
+	while ((m = c->full)) {
+		c->full = m->next;
+		free(m);
+	}
+
+	while ((m = c->empty)) {
+		c->empty = m->next;
+		free(m);
+	}
+
+	list_splice(&c->slabs_full, &c->slabs_partial);
+	list_for_each_entry_safe(slab, n, &c->slabs_partial, list)
+		free(slab);
+
+	free(c->name);
+	free(c);
+}
+
+static void kmem_exit(void)
+{
+	kmem_caches_print_stats(stderr);
+}
+
+__attribute__((constructor(101)))
+static void kmem_init(void)
+{
+	int ret = pthread_key_create(&kmem_thread_key, kmem_thread_exit);
+
+	BUG_ON(ret);
+
+	if (getenv("BCACHEFS_SLAB_STATS")) {
+		kmem_print_stats = true;
+		atexit(kmem_exit);
+	}
+}
@@ -0,0 +1,516 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoint backend: events are enabled by name, from $BCACHEFS_TRACE or
+ * trace_events_enable().
+ *
+ * Each thread records the events it hits into its own ring buffer: the thread
+ * only ever advances head, and the writer thread only ever advances tail, so
+ * recording an event takes no locks and no atomic read-modify-writes. If a
+ * ring buffer fills up, events are dropped (and counted) rather than waiting
+ * on the writer.
+ *
+ * The writer thread periodically - or when a ring buffer is getting full -
+ * copies out everything new in each ring buffer to the trace file, as a chunk
+ * tagged with the thread's id. Entries are written out as they are in the ring
+ * buffer; the decoder (cmd_trace.c) sorts them back into time order.
+ */
+
+#define TRACE_RING_SIZE		(1U << 20)
+#define TRACE_FLUSH_INTERVAL	(HZ / 10)
+
+struct trace_ring {
+	struct list_head	list;
+	pid_t			tid;
+	bool			dead;
+	bool			flush_requested;
+	u64			lost;
+	/* only written by the owning thread: */
+	u64			head;
+	/* only written by the writer thread: */
+	u64			tail;
+	char			buf[TRACE_RING_SIZE];
+};
+
+static DEFINE_MUTEX(trace_lock);
+static LIST_HEAD(trace_rings);
+static pthread_key_t trace_ring_key;
+static __thread struct trace_ring *trace_ring_this;
+
+static const char *trace_file_path = "bcachefs.trace";
+static FILE *trace_file;
+static struct task_struct *trace_writer;
+static bool trace_shutdown;
+
+u64 trace_print_text_base;
+
+/* Enabling events: */
+
+struct tracepoint *trace_event_find(const char *name)
+{
+	struct tracepoint * const *i, *tp;
+
+	for_each_tracepoint(tp, i)
+		if (!strcmp(tp->name, name))
+			return tp;
+	return NULL;
+}
+
+/*
+ * @list is a comma separated list of event names or shell style patterns;
+ * "all" matches every event, and a leading '-' inverts @enable for that
+ * pattern. Returns the number of events matched:
+ */
+int trace_events_enable(const char *list, bool enable)
+{
+	struct tracepoint * const *i, *tp;
+	char *buf = strdup(list), *p = buf, *pattern;
+	int nr = 0;
+
+	while ((pattern = strsep(&p, ","))) {
+		bool v = enable;
+
+		if (*pattern == '-') {
+			v = !v;
+			pattern++;
+		}
+
+		if (!*pattern)
+			continue;
+
+		if (!strcmp(pattern, "all"))
+			pattern = "*";
+
+		for_each_tracepoint(tp, i)
+			if (!fnmatch(pattern, tp->name, 0)) {
+				WRITE_ONCE(tp->enabled, v);
+				nr++;
+			}
+	}
+
+	free(buf);
+	return nr;
+}
+
+static void trace_events_disable_all(void)
+{
+	struct tracepoint * const *i, *tp;
+
+	for_each_tracepoint(tp, i)
+		WRITE_ONCE(tp->enabled, false);
+}
+
+/* Writing out the trace file: */
+
+static void trace_ring_flush(struct trace_ring *r)
+{
+	u64 head	= smp_load_acquire(&r->head);
+	u64 tail	= r->tail;
+	u64 lost	= xchg(&r->lost, 0);
+	unsigned offset	= tail & (TRACE_RING_SIZE - 1);
+	unsigned bytes	= head - tail;
+	unsigned n	= min(bytes, TRACE_RING_SIZE - offset);
+	struct trace_file_chunk chunk = {
+		.tid	= r->tid,
+		.bytes	= bytes,
+		.lost	= lost,
+	};
+
+	WRITE_ONCE(r->flush_requested, false);
+
+	if (!bytes && !lost)
+		return;
+
+	fwrite(&chunk, sizeof(chunk), 1, trace_file);
+	fwrite(r->buf + offset, n, 1, trace_file);
+	fwrite(r->buf, bytes - n, 1, trace_file);
+
+	smp_store_release(&r->tail, head);
+}
+
+static void __trace_flush(void)
+{
+	struct trace_ring *r, *n;
+
+	if (!trace_file)
+		return;
+
+	list_for_each_entry_safe(r, n, &trace_rings, list) {
+		/* a dead thread won't be adding anything more: */
+		bool dead = smp_load_acquire(&r->dead);
+
+		trace_ring_flush(r);
+
+		if (dead) {
+			list_del(&r->list);
+			free(r);
+		}
+	}
+
+	fflush(trace_file);
+}
+
+static void trace_flush(void)
+{
+	mutex_lock(&trace_lock);
+	__trace_flush();
+	mutex_unlock(&trace_lock);
+}
+
+static int trace_writer_fn(void *arg)
+{
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+
+		trace_flush();
+		schedule_timeout(TRACE_FLUSH_INTERVAL);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/*
+ * The writer thread is left running (it can still be woken by threads that
+ * haven't exited): it'll find the file closed.
+ */
+static void trace_exit(void)
+{
+	mutex_lock(&trace_lock);
+	trace_shutdown = true;
+	__trace_flush();
+
+	if (trace_file) {
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+	mutex_unlock(&trace_lock);
+}
+
+static int trace_file_open(void)
+{
+	extern char __executable_start[];
+	struct tracepoint * const *i, *tp;
+	struct trace_file_header h = {
+		.magic		= TRACE_FILE_MAGIC,
+		.version	= TRACE_FILE_VERSION,
+		.nr_events	= __stop___tracepoints_ptrs -
+				  __start___tracepoints_ptrs,
+		.text_base	= (unsigned long) __executable_start,
+	};
+
+	trace_file = fopen(trace_file_path, "w");
+	if (!trace_file) {
+		fprintf(stderr, "error opening trace file %s: %m, "
+			"tracing disabled\n", trace_file_path);
+		return -errno;
+	}
+
+	fwrite(&h, sizeof(h), 1, trace_file);
+
+	for_each_tracepoint(tp, i) {
+		struct trace_file_event e = {
+			.id		= tp->id,
+			.entry_size	= tp->entry_size,
+		};
+
+		strncpy(e.name, tp->name, sizeof(e.name) - 1);
+		fwrite(&e, sizeof(e), 1, trace_file);
+	}
+
+	trace_writer = kthread_run(trace_writer_fn, NULL, "trace_writer");
+	BUG_ON(IS_ERR(trace_writer));
+
+	atexit(trace_exit);
+	return 0;
+}
+
+/* Recording events: */
+
+static noinline struct trace_ring *trace_ring_alloc(void)
+{
+	struct trace_ring *r = NULL;
+
+	mutex_lock(&trace_lock);
+	if (trace_shutdown ||
+	    (!trace_file && trace_file_open())) {
+		trace_events_disable_all();
+		goto out;
+	}
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		goto out;
+
+	memset(r, 0, offsetof(struct trace_ring, buf));
+	r->tid = syscall(SYS_gettid);
+	list_add_tail(&r->list, &trace_rings);
+
+	trace_ring_this = r;
+	pthread_setspecific(trace_ring_key, r);
+out:
+	mutex_unlock(&trace_lock);
+	return r;
+}
+
+static void trace_ring_exit(void *p)
+{
+	struct trace_ring *r = p;
+
+	/* any events from later thread exit destructors get a new ring: */
+	trace_ring_this = NULL;
+	smp_store_release(&r->dead, true);
+}
+
+static inline void trace_ring_copy(struct trace_ring *r, u64 pos,
+				   const void *src, unsigned len)
+{
+	unsigned offset = pos & (TRACE_RING_SIZE - 1);
+	unsigned n = min(len, TRACE_RING_SIZE - offset);
+
+	memcpy(r->buf + offset, src, n);
+	memcpy(r->buf, src + n, len - n);
+}
+
+static void trace_ring_kick(struct trace_ring *r)
+{
+	if (!READ_ONCE(r->flush_requested)) {
+		WRITE_ONCE(r->flush_requested, true);
+		wake_up_process(trace_writer);
+	}
+}
+
+void trace_event_write(struct tracepoint *tp, const void *data, unsigned size)
+{
+	static const u8 zeroes[8];
+	struct trace_ring *r = trace_ring_this ?: trace_ring_alloc();
+	struct trace_entry e;
+	u64 head, used;
+
+	if (!r)
+		return;
+
+	e.time	= local_clock();
+	e.id	= tp->id;
+	e.cpu	= raw_smp_processor_id();
+	e.bytes	= round_up(sizeof(e) + size, 8);
+
+	head = r->head;
+	used = head - smp_load_acquire(&r->tail);
+
+	if (used + e.bytes > TRACE_RING_SIZE) {
+		__atomic_add_fetch(&r->lost, 1, __ATOMIC_RELAXED);
+		trace_ring_kick(r);
+		return;
+	}
+
+	trace_ring_copy(r, head, &e, sizeof(e));
+	trace_ring_copy(r, head + sizeof(e), data, size);
+	trace_ring_copy(r, head + sizeof(e) + size, zeroes,
+			e.bytes - sizeof(e) - size);
+
+	smp_store_release(&r->head, head + e.bytes);
+
+	if (used + e.bytes > TRACE_RING_SIZE / 2)
+		trace_ring_kick(r);
+}
+
+/* Printing events: */
+
+static void trace_print_uuid(FILE *out, const u8 *u)
+{
+	fprintf(out, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+		"%02x%02x%02x%02x%02x%02x",
+		u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+		u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+}
+
+static void trace_print_symbol(FILE *out, unsigned long ip)
+{
+	/* no symbol table: print as an offset into the binary, for addr2line */
+	if (trace_print_text_base && ip >= trace_print_text_base)
+		fprintf(out, "%s+0x%lx", program_invocation_short_name,
+			ip - (unsigned long) trace_print_text_base);
+	else
+		fprintf(out, "0x%lx", ip);
+}
+
+/*
+ * printf, plus the kernel's %pU (uuid) and %pf/%pF/%ps/%pS (function address)
+ * extensions that event formats use:
+ */
+void trace_event_printf(FILE *out, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+
+	while (*fmt) {
+		/*
+		 * The limits below stop copying flags, width, precision and
+		 * length modifiers at spec + 28, but a '*' width or precision
+		 * is expanded with %d, up to 11 more chars each:
+		 */
+		char spec[28 + 2 * 11 + 2], *s = spec, conv;
+		unsigned long_mods = 0;
+		bool size_t_mod = false;
+
+		if (*fmt != '%') {
+			putc(*fmt++, out);
+			continue;
+		}
+
+		*s++ = *fmt++;
+
+		while (*fmt && strchr("-+ #0", *fmt) && s < spec + 8)
+			*s++ = *fmt++;
+
+		if (*fmt == '*') {
+			s += sprintf(s, "%d", va_arg(args, int));
+			fmt++;
+		}
+		while (isdigit(*fmt) && s < spec + 16)
+			*s++ = *fmt++;
+
+		if (*fmt == '.') {
+			*s++ = *fmt++;
+			if (*fmt == '*') {
+				s += sprintf(s, "%d", va_arg(args, int));
+				fmt++;
+			}
+			while (isdigit(*fmt) && s < spec + 24)
+				*s++ = *fmt++;
+		}
+
+		while (*fmt && strchr("hlLqjzt", *fmt) && s < spec + 28) {
+			if (*fmt == 'l' || *fmt == 'L' || *fmt == 'q' ||
+			    *fmt == 'j')
+				long_mods++;
+			if (*fmt == 'z' || *fmt == 't')
+				size_t_mod = true;
+			*s++ = *fmt++;
+		}
+
+		conv = *fmt;
+		if (!conv)
+			break;
+		fmt++;
+
+		*s++ = conv;
+		*s = '\0';
+
+		switch (conv) {
+		case 'd':
+		case 'i':
+			if (size_t_mod)
+				fprintf(out, spec, va_arg(args, ssize_t));
+			else if (long_mods > 1)
+				fprintf(out, spec, va_arg(args, long long));
+			else if (long_mods)
+				fprintf(out, spec, va_arg(args, long));
+			else
+				fprintf(out, spec, va_arg(args, int));
+			break;
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			if (size_t_mod)
+				fprintf(out, spec, va_arg(args, size_t));
+			else if (long_mods > 1)
+				fprintf(out, spec, va_arg(args, unsigned long long));
+			else if (long_mods)
+				fprintf(out, spec, va_arg(args, unsigned long));
+			else
+				fprintf(out, spec, va_arg(args, unsigned));
+			break;
+		case 'c':
+			fprintf(out, spec, va_arg(args, int));
+			break;
+		case 's':
+			fprintf(out, spec, va_arg(args, const char *));
+			break;
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if (long_mods)
+				fprintf(out, spec, va_arg(args, long double));
+			else
+				fprintf(out, spec, va_arg(args, double));
+			break;
+		case 'p':
+			switch (*fmt) {
+			case 'U':
+				fmt++;
+				trace_print_uuid(out, va_arg(args, const u8 *));
+				break;
+			case 'f':
+			case 'F':
+			case 's':
+			case 'S':
+				fmt++;
+				trace_print_symbol(out, (unsigned long)
+						   va_arg(args, void *));
+				break;
+			default:
+				fprintf(out, spec, va_arg(args, void *));
+			}
+			break;
+		case '%':
+			putc('%', out);
+			break;
+		default:
+			fputs(spec, out);
+		}
+	}
+
+	va_end(args);
+}
+
+__attribute__((constructor(102)))
+static void trace_init(void)
+{
+	struct tracepoint * const *i, *tp;
+	const char *events = getenv("BCACHEFS_TRACE");
+	const char *path = getenv("BCACHEFS_TRACE_FILE");
+	int ret = pthread_key_create(&trace_ring_key, trace_ring_exit);
+
+	BUG_ON(ret);
+
+	for_each_tracepoint(tp, i)
+		tp->id = i - __start___tracepoints_ptrs;
+
+	if (path)
+		trace_file_path = path;
+
+	if (events && events[0] &&
+	    !trace_events_enable(events, true))
+		fprintf(stderr, "BCACHEFS_TRACE: no events matching %s\n",
+			events);
+}
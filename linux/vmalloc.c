@@ -0,0 +1,399 @@
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/huge_mm.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/page.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "tools-util.h"
+
+/*
+ * Page arena:
+ *
+ * To vmap() pages - map them again, contiguously, at a new address - they have
+ * to be backed by something we can mmap() a second time, which anonymous
+ * memory from malloc() is not. So single pages (alloc_page()) come from an
+ * arena backed by a memfd; vmap() maps the memfd pages behind the pages it was
+ * passed.
+ *
+ * Mapping pages is a good deal more expensive than copying them, though - so
+ * the arena hands out free pages in address order, next-fit: pages allocated
+ * one after another, as for a bio, are normally adjacent, and vmap() of
+ * adjacent pages needs no new mapping at all.
+ *
+ * The arena's address space is reserved up front, so that page_arena_contains()
+ * is just a range check, and it's grown in PAGE_ARENA_GROW sized steps.
+ */
+
+#define PAGE_ARENA_MAX		(1UL << 36)
+#define PAGE_ARENA_GROW		(2UL << 20)
+/* Free pages beyond this many are handed back to the kernel: */
+#define PAGE_ARENA_MAX_FREE	4096
+
+void *page_arena_start;
+void *page_arena_end;
+
+static DEFINE_MUTEX(page_arena_lock);
+static bool page_arena_failed;
+static int page_arena_fd = -1;
+static size_t page_arena_nr_pages;
+static size_t page_arena_nr_free;
+static size_t page_arena_next;
+/* set bits are free pages: */
+static unsigned long *page_arena_free_map;
+
+static int page_arena_init(void)
+{
+	void *p;
+
+	page_arena_fd = memfd_create("bcachefs-pages", MFD_CLOEXEC);
+	if (page_arena_fd < 0)
+		return -errno;
+
+	p = mmap(NULL, PAGE_ARENA_MAX, PROT_NONE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		close(page_arena_fd);
+		page_arena_fd = -1;
+		return -errno;
+	}
+
+	page_arena_start	= p;
+	page_arena_end		= p + PAGE_ARENA_MAX;
+	return 0;
+}
+
+static int page_arena_grow(void)
+{
+	size_t old_size = page_arena_nr_pages << PAGE_SHIFT;
+	size_t new_size = old_size + PAGE_ARENA_GROW;
+	size_t i, nr_pages = new_size >> PAGE_SHIFT;
+	unsigned long *map;
+
+	if (new_size > PAGE_ARENA_MAX)
+		return -ENOMEM;
+
+	map = realloc(page_arena_free_map,
+		      BITS_TO_LONGS(nr_pages) * sizeof(unsigned long));
+	if (!map)
+		return -ENOMEM;
+	page_arena_free_map = map;
+
+	if (ftruncate(page_arena_fd, new_size))
+		return -errno;
+
+	if (mmap(page_arena_start + old_size, PAGE_ARENA_GROW,
+		 PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+		 page_arena_fd, old_size) == MAP_FAILED)
+		return -errno;
+
+	/*
+	 * Shared with the memfd - we don't want children writing to it. This
+	 * has to be done per mapping: MAP_FIXED replaces the old VMA, and with
+	 * it any earlier madvise():
+	 */
+	madvise(page_arena_start + old_size, PAGE_ARENA_GROW, MADV_DONTFORK);
+
+	for (i = page_arena_nr_pages; i < nr_pages; i++)
+		__set_bit(i, page_arena_free_map);
+
+	page_arena_next		= page_arena_nr_pages;
+	page_arena_nr_free	+= nr_pages - page_arena_nr_pages;
+	page_arena_nr_pages	= nr_pages;
+	return 0;
+}
+
+void *page_arena_alloc(void)
+{
+	size_t idx;
+	void *p = NULL;
+
+	mutex_lock(&page_arena_lock);
+	if (page_arena_failed)
+		goto out;
+
+	if (!page_arena_start &&
+	    page_arena_init()) {
+		page_arena_failed = true;
+		goto out;
+	}
+
+	if (!page_arena_nr_free &&
+	    page_arena_grow())
+		goto out;
+
+	idx = find_next_bit(page_arena_free_map, page_arena_nr_pages,
+			    page_arena_next);
+	if (idx >= page_arena_nr_pages)
+		idx = find_next_bit(page_arena_free_map, page_arena_nr_pages, 0);
+	BUG_ON(idx >= page_arena_nr_pages);
+
+	__clear_bit(idx, page_arena_free_map);
+	page_arena_nr_free--;
+	page_arena_next = idx + 1;
+
+	p = page_arena_start + (idx << PAGE_SHIFT);
+out:
+	mutex_unlock(&page_arena_lock);
+	return p;
+}
+
+void page_arena_free(void *p)
+{
+	size_t offset = p - page_arena_start;
+
+	mutex_lock(&page_arena_lock);
+	if (page_arena_nr_free >= PAGE_ARENA_MAX_FREE)
+		fallocate(page_arena_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			  offset, PAGE_SIZE);
+
+	__set_bit(offset >> PAGE_SHIFT, page_arena_free_map);
+	page_arena_nr_free++;
+	mutex_unlock(&page_arena_lock);
+}
+
+/*
+ * Huge page arena:
+ *
+ * Compound allocations of HPAGE_PMD_SIZE (the btree node cache allocates these)
+ * are each given their own huge page aligned slot in a reserved range of
+ * address space, so that the kernel can back them with a single huge page - an
+ * explicit (hugetlbfs) page if BCACHEFS_HUGEPAGES=explicit and the system has
+ * them reserved, otherwise a transparent huge page.
+ *
+ * Freeing remaps the slot PROT_NONE, returning the whole huge page to the
+ * kernel; the address space stays reserved.
+ */
+
+#define HUGE_ARENA_MAX		(1UL << 38)
+#define HUGE_ARENA_SLOTS	(HUGE_ARENA_MAX >> HPAGE_PMD_SHIFT)
+
+enum huge_pages_mode {
+	HUGE_PAGES_OFF,
+	HUGE_PAGES_TRANSPARENT,
+	HUGE_PAGES_EXPLICIT,
+};
+
+void *huge_arena_start;
+void *huge_arena_end;
+
+static enum huge_pages_mode huge_pages_mode = HUGE_PAGES_TRANSPARENT;
+static DEFINE_MUTEX(huge_arena_lock);
+static bool huge_arena_failed;
+static size_t huge_arena_next;
+/* set bits are slots in use: */
+static unsigned long *huge_arena_used;
+
+static int huge_arena_init(void)
+{
+	void *p;
+
+	huge_arena_used = calloc(BITS_TO_LONGS(HUGE_ARENA_SLOTS),
+				 sizeof(unsigned long));
+	if (!huge_arena_used)
+		return -ENOMEM;
+
+	p = mmap(NULL, HUGE_ARENA_MAX + HPAGE_PMD_SIZE, PROT_NONE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		free(huge_arena_used);
+		huge_arena_used = NULL;
+		return -errno;
+	}
+
+	huge_arena_start	= PTR_ALIGN(p, HPAGE_PMD_SIZE);
+	huge_arena_end		= huge_arena_start + HUGE_ARENA_MAX;
+	return 0;
+}
+
+static bool huge_page_map(void *p)
+{
+	if (huge_pages_mode == HUGE_PAGES_EXPLICIT &&
+	    mmap(p, HPAGE_PMD_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_HUGETLB,
+		 -1, 0) != MAP_FAILED)
+		return true;
+
+	if (mmap(p, HPAGE_PMD_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED,
+		 -1, 0) == MAP_FAILED)
+		return false;
+
+	madvise(p, HPAGE_PMD_SIZE, MADV_HUGEPAGE);
+	return true;
+}
+
+void *huge_page_alloc(void)
+{
+	size_t idx;
+	void *p = NULL;
+
+	mutex_lock(&huge_arena_lock);
+	if (huge_pages_mode == HUGE_PAGES_OFF ||
+	    huge_arena_failed)
+		goto out;
+
+	if (!huge_arena_start &&
+	    huge_arena_init()) {
+		huge_arena_failed = true;
+		goto out;
+	}
+
+	idx = find_next_zero_bit(huge_arena_used, HUGE_ARENA_SLOTS,
+				 huge_arena_next);
+	if (idx >= HUGE_ARENA_SLOTS)
+		idx = find_next_zero_bit(huge_arena_used, HUGE_ARENA_SLOTS, 0);
+	if (idx >= HUGE_ARENA_SLOTS)
+		goto out;
+
+	if (!huge_page_map(huge_arena_start + (idx << HPAGE_PMD_SHIFT)))
+		goto out;
+
+	__set_bit(idx, huge_arena_used);
+	huge_arena_next = idx + 1;
+
+	p = huge_arena_start + (idx << HPAGE_PMD_SHIFT);
+out:
+	mutex_unlock(&huge_arena_lock);
+	return p;
+}
+
+void huge_page_free(void *p)
+{
+	size_t idx = (p - huge_arena_start) >> HPAGE_PMD_SHIFT;
+
+	BUG_ON(!IS_ALIGNED((unsigned long) p, HPAGE_PMD_SIZE));
+
+	if (mmap(p, HPAGE_PMD_SIZE, PROT_NONE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE,
+		 -1, 0) == MAP_FAILED)
+		die("error unmapping huge page: %m");
+
+	mutex_lock(&huge_arena_lock);
+	BUG_ON(!test_bit(idx, huge_arena_used));
+	__clear_bit(idx, huge_arena_used);
+	mutex_unlock(&huge_arena_lock);
+}
+
+__attribute__((constructor(102)))
+static void huge_pages_init(void)
+{
+	const char *mode = getenv("BCACHEFS_HUGEPAGES");
+
+	if (!mode || !*mode || !strcmp(mode, "transparent"))
+		huge_pages_mode = HUGE_PAGES_TRANSPARENT;
+	else if (!strcmp(mode, "explicit"))
+		huge_pages_mode = HUGE_PAGES_EXPLICIT;
+	else if (!strcmp(mode, "off"))
+		huge_pages_mode = HUGE_PAGES_OFF;
+	else
+		die("BCACHEFS_HUGEPAGES: unknown mode %s", mode);
+}
+
+/* vmap: */
+
+struct vmap_area {
+	struct list_head	list;
+	void			*addr;
+	size_t			size;
+};
+
+static LIST_HEAD(vmap_areas);
+static DEFINE_MUTEX(vmap_lock);
+
+void *vmap(struct page **pages, unsigned int count,
+	   unsigned long flags, unsigned prot)
+{
+	struct vmap_area *area;
+	size_t size = (size_t) count << PAGE_SHIFT;
+	unsigned i, nr;
+	void *addr;
+
+	for (i = 0; i < count; i++)
+		if (!page_arena_contains(pages[i]))
+			return NULL;
+
+	for (i = 1; i < count; i++)
+		if (page_address(pages[i]) !=
+		    page_address(pages[0]) + ((size_t) i << PAGE_SHIFT))
+			break;
+
+	/* already contiguous: */
+	if (i == count)
+		return page_address(pages[0]);
+
+	area = malloc(sizeof(*area));
+	if (!area)
+		return NULL;
+
+	addr = mmap(NULL, size, PROT_NONE,
+		    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED)
+		goto err;
+
+	/* one mapping per run of consecutive arena pages: */
+	for (i = 0; i < count; i += nr) {
+		void *p = page_address(pages[i]);
+
+		for (nr = 1;
+		     i + nr < count &&
+		     page_address(pages[i + nr]) == p + (nr << PAGE_SHIFT);
+		     nr++)
+			;
+
+		if (mmap(addr + ((size_t) i << PAGE_SHIFT),
+			 (size_t) nr << PAGE_SHIFT,
+			 PROT_READ|PROT_WRITE,
+			 MAP_SHARED|MAP_FIXED|MAP_POPULATE,
+			 page_arena_fd, p - page_arena_start) == MAP_FAILED) {
+			munmap(addr, size);
+			goto err;
+		}
+	}
+
+	/* as in page_arena_grow(): */
+	madvise(addr, size, MADV_DONTFORK);
+
+	area->addr	= addr;
+	area->size	= size;
+
+	mutex_lock(&vmap_lock);
+	list_add(&area->list, &vmap_areas);
+	mutex_unlock(&vmap_lock);
+
+	return addr;
+err:
+	free(area);
+	return NULL;
+}
+
+void vunmap(const void *addr)
+{
+	struct vmap_area *area;
+
+	if (page_arena_contains(addr))
+		return;
+
+	mutex_lock(&vmap_lock);
+	list_for_each_entry(area, &vmap_areas, list)
+		if (area->addr == addr) {
+			list_del(&area->list);
+			goto found;
+		}
+	BUG();
+found:
+	mutex_unlock(&vmap_lock);
+
+	munmap(area->addr, area->size);
+	free(area);
+}
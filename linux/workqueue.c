@@ -1,28 +1,73 @@
 #include <pthread.h>
+#include <sched.h>
+#include <sys/sysinfo.h>
 
 #include <linux/kthread.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/workqueue.h>
 
-static pthread_mutex_t	wq_lock = PTHREAD_MUTEX_INITIALIZER;
-static LIST_HEAD(wq_list);
+/*
+ * Work is run by pools of worker threads, one pool per workqueue. Runnable work
+ * goes on the pool's worklist, where any idle worker can take it; workers are
+ * started as needed.
+ *
+ * A workqueue may only have max_active work items on the worklist or running
+ * at a time (per CPU, for bound workqueues); the rest wait on the workqueue's
+ * inactive list. So a pool never needs more than max_active workers - and
+ * since pools aren't shared, work on one workqueue can't be starved of
+ * workers by work on another that's blocked, waiting on it; the kernel gets
+ * the same by creating workers on demand, with rescuers for WQ_MEM_RECLAIM.
+ */
+struct worker_pool {
+	pthread_mutex_t		lock;
+	struct list_head	worklist;
+	struct list_head	workers;
+	struct list_head	idle;
+	unsigned		nr_workers;
+	unsigned		nr_idle;
+	unsigned		max_workers;
+
+	/* signalled when work completes, if anyone's waiting: */
+	pthread_cond_t		work_done;
+	unsigned		nr_waiting;
 
-struct workqueue_struct {
+	char			name[24];
+};
+
+struct worker {
 	struct list_head	list;
+	struct list_head	idle;
+	/* work that was queued again while this worker was running it: */
+	struct list_head	scheduled;
+	struct worker_pool	*pool;
+	struct task_struct	*task;
 
 	struct work_struct	*current_work;
-	struct list_head	pending_work;
+	work_func_t		current_func;
+};
 
-	pthread_cond_t		work_finished;
+struct workqueue_struct {
+	struct worker_pool	*pool;
+	unsigned		flags;
+	unsigned		max_active;
+	unsigned		nr_active;
+	struct list_head	inactive;
 
-	struct task_struct	*worker;
 	char			name[24];
 };
 
+/*
+ * work->data is the workqueue the work was last queued on, and flag bits:
+ */
 enum {
 	WORK_PENDING_BIT,
+	WORK_INACTIVE_BIT,
+	WORK_FLAG_BITS,
 };
 
+#define WORK_FLAGS_MASK		((1UL << WORK_FLAG_BITS) - 1)
+
 static void clear_work_pending(struct work_struct *work)
 {
 	clear_bit(WORK_PENDING_BIT, work_data_bits(work));
@@ -33,24 +78,107 @@ static bool set_work_pending(struct work_struct *work)
 	return !test_and_set_bit(WORK_PENDING_BIT, work_data_bits(work));
 }
 
+/* only called by whoever set WORK_PENDING: */
+static void set_work_wq(struct work_struct *work,
+			struct workqueue_struct *wq)
+{
+	atomic_long_set(&work->data,
+			(unsigned long) wq | (1UL << WORK_PENDING_BIT));
+}
+
+static struct workqueue_struct *get_work_wq(struct work_struct *work)
+{
+	return (void *) (atomic_long_read(&work->data) & ~WORK_FLAGS_MASK);
+}
+
+static int worker_thread(void *);
+
+static void create_worker(struct worker_pool *pool)
+{
+	struct worker *worker = kzalloc(sizeof(*worker), GFP_KERNEL);
+
+	BUG_ON(!worker);
+
+	INIT_LIST_HEAD(&worker->idle);
+	INIT_LIST_HEAD(&worker->scheduled);
+	worker->pool = pool;
+	worker->task = kthread_create(worker_thread, worker, "%s/%u",
+				      pool->name, pool->nr_workers);
+	BUG_ON(IS_ERR(worker->task));
+	get_task_struct(worker->task);
+
+	list_add_tail(&worker->list, &pool->workers);
+	pool->nr_workers++;
+
+	wake_up_process(worker->task);
+}
+
+/* Get a worker going on the pool's worklist: */
+static void wake_worker(struct worker_pool *pool)
+{
+	struct worker *worker =
+		list_first_entry_or_null(&pool->idle, struct worker, idle);
+
+	if (worker) {
+		list_del_init(&worker->idle);
+		pool->nr_idle--;
+		wake_up_process(worker->task);
+	} else if (pool->nr_workers < pool->max_workers) {
+		create_worker(pool);
+	}
+}
+
+static void activate_work(struct workqueue_struct *wq,
+			  struct work_struct *work)
+{
+	wq->nr_active++;
+	clear_bit(WORK_INACTIVE_BIT, work_data_bits(work));
+	list_add_tail(&work->entry, &wq->pool->worklist);
+	wake_worker(wq->pool);
+}
+
+/* A work item is done running, or was cancelled before it ran: */
+static void work_done(struct workqueue_struct *wq)
+{
+	struct work_struct *work =
+		list_first_entry_or_null(&wq->inactive, struct work_struct, entry);
+
+	wq->nr_active--;
+
+	if (work) {
+		list_del_init(&work->entry);
+		activate_work(wq, work);
+	}
+
+	if (wq->pool->nr_waiting)
+		pthread_cond_broadcast(&wq->pool->work_done);
+}
+
 static void __queue_work(struct workqueue_struct *wq,
 			 struct work_struct *work)
 {
 	BUG_ON(!test_bit(WORK_PENDING_BIT, work_data_bits(work)));
 	BUG_ON(!list_empty(&work->entry));
 
-	list_add_tail(&work->entry, &wq->pending_work);
-	wake_up_process(wq->worker);
+	set_work_wq(work, wq);
+
+	if (wq->nr_active < wq->max_active) {
+		activate_work(wq, work);
+	} else {
+		set_bit(WORK_INACTIVE_BIT, work_data_bits(work));
+		list_add_tail(&work->entry, &wq->inactive);
+	}
 }
 
 bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
 {
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	if ((ret = set_work_pending(work)))
+	if ((ret = set_work_pending(work))) {
+		pthread_mutex_lock(&wq->pool->lock);
 		__queue_work(wq, work);
-	pthread_mutex_unlock(&wq_lock);
+		pthread_mutex_unlock(&wq->pool->lock);
+	}
 
 	return ret;
 }
@@ -59,10 +187,11 @@ void delayed_work_timer_fn(struct timer_list *timer)
 {
 	struct delayed_work *dwork =
 		container_of(timer, struct delayed_work, timer);
+	struct workqueue_struct *wq = dwork->wq;
 
-	pthread_mutex_lock(&wq_lock);
-	__queue_work(dwork->wq, &dwork->work);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_lock(&wq->pool->lock);
+	__queue_work(wq, &dwork->work);
+	pthread_mutex_unlock(&wq->pool->lock);
 }
 
 static void __queue_delayed_work(struct workqueue_struct *wq,
@@ -77,7 +206,9 @@ static void __queue_delayed_work(struct workqueue_struct *wq,
 	BUG_ON(!list_empty(&work->entry));
 
 	if (!delay) {
+		pthread_mutex_lock(&wq->pool->lock);
 		__queue_work(wq, &dwork->work);
+		pthread_mutex_unlock(&wq->pool->lock);
 	} else {
 		dwork->wq = wq;
 		timer->expires = jiffies + delay;
@@ -92,16 +223,19 @@ bool queue_delayed_work(struct workqueue_struct *wq,
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	if ((ret = set_work_pending(work)))
 		__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
 
+/*
+ * Take ownership of WORK_PENDING: returns true if the work was queued (and
+ * now isn't), false if it wasn't
+ */
 static bool grab_pending(struct work_struct *work, bool is_dwork)
 {
+	struct workqueue_struct *wq;
 retry:
 	if (set_work_pending(work)) {
 		BUG_ON(!list_empty(&work->entry));
@@ -117,30 +251,62 @@ retry:
 		}
 	}
 
-	if (!list_empty(&work->entry)) {
-		list_del_init(&work->entry);
-		return true;
-	}
+	wq = get_work_wq(work);
+	if (wq) {
+		pthread_mutex_lock(&wq->pool->lock);
+		if (get_work_wq(work) == wq &&
+		    !list_empty(&work->entry)) {
+			list_del_init(&work->entry);
+
+			if (!test_and_clear_bit(WORK_INACTIVE_BIT,
+						work_data_bits(work)))
+				work_done(wq);
 
-	BUG_ON(!is_dwork);
+			pthread_mutex_unlock(&wq->pool->lock);
+			return true;
+		}
+		pthread_mutex_unlock(&wq->pool->lock);
+	}
 
-	pthread_mutex_unlock(&wq_lock);
-	flush_timers();
-	pthread_mutex_lock(&wq_lock);
+	/* the timer is firing, or queue_work() hasn't taken the lock yet: */
+	if (is_dwork)
+		flush_timers();
+	else
+		sched_yield();
 	goto retry;
 }
 
+static struct worker *find_worker_running(struct worker_pool *pool,
+					  struct work_struct *work)
+{
+	struct worker *worker;
+
+	list_for_each_entry(worker, &pool->workers, list)
+		if (worker->current_work == work)
+			return worker;
+
+	return NULL;
+}
+
 static bool __flush_work(struct work_struct *work)
 {
-	struct workqueue_struct *wq;
+	struct workqueue_struct *wq = get_work_wq(work);
+	struct worker_pool *pool;
 	bool ret = false;
-retry:
-	list_for_each_entry(wq, &wq_list, list)
-		if (wq->current_work == work) {
-			pthread_cond_wait(&wq->work_finished, &wq_lock);
-			ret = true;
-			goto retry;
-		}
+
+	if (!wq)
+		return false;
+
+	pool = wq->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->nr_waiting++;
+	while (find_worker_running(pool, work)) {
+		pthread_cond_wait(&pool->work_done, &pool->lock);
+		ret = true;
+	}
+	pool->nr_waiting--;
+	pthread_mutex_unlock(&pool->lock);
 
 	return ret;
 }
@@ -149,12 +315,10 @@ bool cancel_work_sync(struct work_struct *work)
 {
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, false);
 
 	__flush_work(work);
 	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -163,14 +327,11 @@ bool mod_delayed_work(struct workqueue_struct *wq,
 		      struct delayed_work *dwork,
 		      unsigned long delay)
 {
-	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
+	ret = grab_pending(&dwork->work, true);
 
 	__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -180,11 +341,9 @@ bool cancel_delayed_work(struct delayed_work *dwork)
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, true);
 
 	clear_work_pending(&dwork->work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -194,63 +353,132 @@ bool cancel_delayed_work_sync(struct delayed_work *dwork)
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, true);
 
 	__flush_work(work);
 	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
 
 static int worker_thread(void *arg)
 {
-	struct workqueue_struct *wq = arg;
+	struct worker *worker = arg;
+	struct worker_pool *pool = worker->pool;
+	struct workqueue_struct *wq;
 	struct work_struct *work;
+	struct worker *running;
 
-	pthread_mutex_lock(&wq_lock);
+	pthread_mutex_lock(&pool->lock);
 	while (1) {
 		__set_current_state(TASK_INTERRUPTIBLE);
-		work = list_first_entry_or_null(&wq->pending_work,
-				struct work_struct, entry);
-		wq->current_work = work;
 
-		if (kthread_should_stop()) {
-			BUG_ON(wq->current_work);
+		if (kthread_should_stop())
 			break;
-		}
+
+		work = list_first_entry_or_null(&worker->scheduled,
+				struct work_struct, entry) ?:
+			list_first_entry_or_null(&pool->worklist,
+				struct work_struct, entry);
 
 		if (!work) {
-			pthread_mutex_unlock(&wq_lock);
+			if (list_empty(&worker->idle)) {
+				list_add(&worker->idle, &pool->idle);
+				pool->nr_idle++;
+			}
+
+			pthread_mutex_unlock(&pool->lock);
 			schedule();
-			pthread_mutex_lock(&wq_lock);
+			pthread_mutex_lock(&pool->lock);
 			continue;
 		}
 
-		BUG_ON(!test_bit(WORK_PENDING_BIT, work_data_bits(work)));
+		__set_current_state(TASK_RUNNING);
 		list_del_init(&work->entry);
+
+		if (!list_empty(&worker->idle)) {
+			list_del_init(&worker->idle);
+			pool->nr_idle--;
+		}
+
+		/*
+		 * Work items aren't reentrant: if another worker is still
+		 * running this one, it gets to run it again
+		 */
+		running = find_worker_running(pool, work);
+		if (running && running != worker) {
+			list_add_tail(&work->entry, &running->scheduled);
+			continue;
+		}
+
+		BUG_ON(!test_bit(WORK_PENDING_BIT, work_data_bits(work)));
+		wq = get_work_wq(work);
+
+		worker->current_work = work;
+		worker->current_func = work->func;
 		clear_work_pending(work);
 
-		pthread_mutex_unlock(&wq_lock);
-		work->func(work);
-		pthread_mutex_lock(&wq_lock);
+		pthread_mutex_unlock(&pool->lock);
+		worker->current_func(work);
+		pthread_mutex_lock(&pool->lock);
+
+		worker->current_work = NULL;
+		work_done(wq);
+	}
 
-		pthread_cond_broadcast(&wq->work_finished);
+	if (!list_empty(&worker->idle)) {
+		list_del_init(&worker->idle);
+		pool->nr_idle--;
 	}
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&pool->lock);
 
 	return 0;
 }
 
+static struct worker_pool *alloc_pool(const char *name, unsigned max_workers)
+{
+	struct worker_pool *pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_done, NULL);
+	INIT_LIST_HEAD(&pool->worklist);
+	INIT_LIST_HEAD(&pool->workers);
+	INIT_LIST_HEAD(&pool->idle);
+	pool->max_workers = max(max_workers, 1U);
+	strlcpy(pool->name, name, sizeof(pool->name));
+
+	return pool;
+}
+
+static void free_pool(struct worker_pool *pool)
+{
+	struct worker *worker, *n;
+
+	/* no new workers can be created, so we can stop them unlocked: */
+	list_for_each_entry_safe(worker, n, &pool->workers, list) {
+		kthread_stop(worker->task);
+		put_task_struct(worker->task);
+		kfree(worker);
+	}
+
+	kfree(pool);
+}
+
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-	kthread_stop(wq->worker);
+	struct worker_pool *pool = wq->pool;
 
-	pthread_mutex_lock(&wq_lock);
-	list_del(&wq->list);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_lock(&pool->lock);
+	pool->nr_waiting++;
+	while (wq->nr_active || !list_empty(&wq->inactive))
+		pthread_cond_wait(&pool->work_done, &pool->lock);
+	pool->nr_waiting--;
+	pthread_mutex_unlock(&pool->lock);
 
+	free_pool(pool);
 	kfree(wq);
 }
 
@@ -261,30 +489,33 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 {
 	va_list args;
 	struct workqueue_struct *wq;
+	unsigned nr_cpus = get_nprocs();
 
 	wq = kzalloc(sizeof(*wq), GFP_KERNEL);
 	if (!wq)
 		return NULL;
 
-	INIT_LIST_HEAD(&wq->list);
-	INIT_LIST_HEAD(&wq->pending_work);
-
-	pthread_cond_init(&wq->work_finished, NULL);
+	INIT_LIST_HEAD(&wq->inactive);
 
 	va_start(args, max_active);
 	vsnprintf(wq->name, sizeof(wq->name), fmt, args);
 	va_end(args);
 
-	wq->worker = kthread_run(worker_thread, wq, "%s", wq->name);
-	if (IS_ERR(wq->worker)) {
+	wq->flags	= flags;
+	wq->max_active	= clamp_t(int, max_active ?: WQ_DFL_ACTIVE,
+				  1, WQ_MAX_ACTIVE);
+
+	/* max_active is per cpu, for bound workqueues: */
+	if (!(flags & WQ_UNBOUND))
+		wq->max_active = min(wq->max_active * nr_cpus,
+				     (unsigned) WQ_MAX_ACTIVE);
+
+	wq->pool = alloc_pool(wq->name, wq->max_active);
+	if (!wq->pool) {
 		kfree(wq);
 		return NULL;
 	}
 
-	pthread_mutex_lock(&wq_lock);
-	list_add(&wq->list, &wq_list);
-	pthread_mutex_unlock(&wq_lock);
-
 	return wq;
 }
 
@@ -84,11 +84,16 @@ void qcow2_write_image(int infd, int outfd, ranges *data,
 		.offset		= round_up(sizeof(hdr), block_size),
 	};
 	struct range *r;
-	char *buf = xmalloc(block_size);
+	char *buf;
 	u64 src_offset, dst_offset;
 
 	assert(is_power_of_2(block_size));
 
+	/* infd may have been opened O_DIRECT: */
+	buf = aligned_alloc(PAGE_SIZE, max_t(unsigned, block_size, PAGE_SIZE));
+	if (!buf)
+		die("insufficient memory");
+
 	ranges_roundup(data, block_size);
 	ranges_sort_merge(data);
 